@@ -0,0 +1,94 @@
+#!/usr/bin/env bash
+#
+# Stack versus register backend: runs each program with --vm=stack and
+# --vm=register, checking they print the same thing.
+# Usage: bench/backends.sh [runs]
+
+set -euo pipefail
+
+ASBTL="${ASBTL:-$(dirname "$0")/../build/asbtl}"
+RUNS="${1:-3}"
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+cat >"$WORK_DIR/fib.lox" <<'LOX'
+func fib(n) {
+  if (n < 2) return n;
+  return fib(n - 2) + fib(n - 1);
+}
+print fib(30);
+LOX
+
+cat >"$WORK_DIR/loop.lox" <<'LOX'
+func sum(n) {
+  var total = 0;
+  for (var i = 0; i < n; i = i + 1) {
+    var square = i * i;
+    total = total + square - i;
+  }
+  return total;
+}
+print sum(10000000);
+LOX
+
+cat >"$WORK_DIR/closure.lox" <<'LOX'
+func counter() {
+  var count = 0;
+  func increment() {
+    count = count + 1;
+    return count;
+  }
+  return increment;
+}
+var next = counter();
+var last = 0;
+for (var i = 0; i < 3000000; i = i + 1) {
+  last = next();
+}
+print last;
+LOX
+
+cat >"$WORK_DIR/globals.lox" <<'LOX'
+var a = 0;
+var b = 1;
+var i = 0;
+while (i < 3000000) {
+  var t = a + b;
+  a = b;
+  b = t - a + 1;
+  i = i + 1;
+}
+print b;
+LOX
+
+# Prints the fastest of the runs in seconds
+best() {
+  local backend="$1" program="$2" best=""
+
+  for ((run = 0; run < RUNS; run++)); do
+    local start end
+    start=$(date +%s.%N)
+    "$ASBTL" --vm="$backend" "$program" >"$WORK_DIR/$backend.out"
+    end=$(date +%s.%N)
+    best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+      'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+  done
+
+  echo "$best"
+}
+
+printf "%-10s %10s %10s %8s\n" program stack register speedup
+
+for program in fib loop closure globals; do
+  stack=$(best stack "$WORK_DIR/$program.lox")
+  register=$(best register "$WORK_DIR/$program.lox")
+
+  if ! cmp -s "$WORK_DIR/stack.out" "$WORK_DIR/register.out"; then
+    echo "$program: backends print different results" >&2
+    exit 1
+  fi
+
+  awk -v p="$program" -v s="$stack" -v r="$register" \
+    'BEGIN { printf "%-10s %9.3fs %9.3fs %7.2fx\n", p, s, r, s / r }'
+done
@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+#
+# Compile time for functions with many locals: compiles a generated script to
+# an image without running it. Every reference resolves an early local, or one
+# of an enclosing function's, from behind a couple of hundred later ones.
+# Usage: bench/compile.sh [functions] [runs]
+
+set -euo pipefail
+
+ASBTL="${ASBTL:-$(dirname "$0")/../build/asbtl}"
+FUNCS="${1:-100}"
+RUNS="${2:-3}"
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+awk -v n="$FUNCS" 'BEGIN {
+  for (f = 0; f < n; f++) {
+    printf "func f%d(a) {\n  var l0 = a;\n  var l1 = a;\n  var l2 = a;\n", f
+    for (i = 3; i < 240; i++)
+      printf "  var l%d = l0 + l1 + l2 + l%d + l%d + a;\n", i, int(i / 2), i - 1
+    printf "  func inner() {\n"
+    for (i = 0; i < 10; i++)
+      printf "    var m%d = l0 + l1 + l2 + a;\n", i
+    printf "    return m0;\n  }\n  return inner;\n}\n"
+  }
+}' >"$WORK_DIR/locals.lox"
+
+best=""
+for ((run = 0; run < RUNS; run++)); do
+  start=$(date +%s.%N)
+  "$ASBTL" --compile="$WORK_DIR/locals.img" "$WORK_DIR/locals.lox"
+  end=$(date +%s.%N)
+  best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+    'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+done
+
+lines=$(wc -l <"$WORK_DIR/locals.lox")
+awk -v lines="$lines" -v secs="$best" 'BEGIN {
+  printf "lines: %d in %.3fs, %.0f lines/sec\n", lines, secs, lines / secs
+}'
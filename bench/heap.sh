@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+#
+# Object heap: builds lists out of closures over strings, so most of the run is
+# allocating and collecting, then reports what --stats saw of the collector.
+# Usage: bench/heap.sh [length] [rounds]
+
+set -euo pipefail
+
+ASBTL="${ASBTL:-$(dirname "$0")/../build/asbtl}"
+LENGTH="${1:-20000}"
+ROUNDS="${2:-20}"
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+cat >"$WORK_DIR/heap.lox" <<LOX
+func cons(head, tail) {
+  func get(first) {
+    if (first) return head;
+    return tail;
+  }
+  return get;
+}
+
+var list = nil;
+for (var round = 0; round < $ROUNDS; round = round + 1) {
+  list = nil;
+  for (var i = 0; i < $LENGTH; i = i + 1) {
+    list = cons("item " + str(i), list);
+  }
+}
+
+var n = 0;
+while (list != nil) {
+  n = n + 1;
+  list = list(false);
+}
+print n;
+LOX
+
+"$ASBTL" --stats "$WORK_DIR/heap.lox" 2>&1 | grep -E "^(run|collections|heap)"
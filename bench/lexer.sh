@@ -0,0 +1,130 @@
+#!/usr/bin/env bash
+#
+# Lexing throughput: scans generated sources of a few megabytes each, pulling a
+# token at a time with scanNext() and all at once with scanTokens(), and prints
+# the best of the runs in MB/s. Builds its own driver against src/scanner.c.
+# Usage: bench/lexer.sh [runs] [megabytes]
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+RUNS="${1:-5}"
+MEGABYTES="${2:-8}"
+CC="${CC:-cc}"
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+cat >"$WORK_DIR/lexer.c" <<'C'
+#include "scanner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  FILE *file = fopen(argv[1], "rb");
+  int runs   = atoi(argv[2]);
+
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  rewind(file);
+
+  char *source = malloc(len + 1);
+  fread(source, 1, len, file);
+  source[len] = '\0';
+  fclose(file);
+
+  double pull = 0, batch = 0;
+  int tokens  = 0;
+  TokenList list;
+  initTokenList(&list);
+
+  for (int run = 0; run < runs; run++) {
+    double start = now();
+    Scanner scanner;
+    initScanner(&scanner, source);
+
+    tokens = 0;
+    while (scanNext(&scanner).type != TOK_EOF) {
+      tokens++;
+    }
+
+    double mid = now();
+    scanTokens(source, &list);
+    double end = now();
+
+    if (run == 0 || mid - start < pull)
+      pull = mid - start;
+    if (run == 0 || end - mid < batch)
+      batch = end - mid;
+  }
+
+  printf("%d %.1f %.1f\n", tokens, len / pull / 1e6, len / batch / 1e6);
+  freeTokenList(&list);
+  free(source);
+  return 0;
+}
+C
+
+"$CC" -O2 -I"$ROOT/include" "$WORK_DIR/lexer.c" "$ROOT/src/scanner.c" \
+  -o "$WORK_DIR/lexer"
+
+# Repeats the text until the file is at least the given size
+generate() {
+  local name="$1" text="$2" file="$WORK_DIR/$1.lox"
+  local target=$((MEGABYTES * 1024 * 1024))
+
+  printf '%s' "$text" >"$file"
+  while (($(wc -c <"$file") < target)); do
+    cat "$file" "$file" >"$file.tmp"
+    mv "$file.tmp" "$file"
+  done
+}
+
+generate code '
+func fibonacci(n) {
+  if (n < 2) return n;
+  return fibonacci(n - 2) + fibonacci(n - 1);
+}
+
+var total = 0;
+for (var i = 0; i < 100; i = i + 1) {
+  total = total + fibonacci(i) * 3.25;
+  print total >= 1000 ? "big" : "small";
+}
+'
+
+generate comments '
+// Comments and blank lines, like a heavily documented file, with only the
+// occasional line of code between them.
+//
+//   var example = "not really code";
+
+var documented = true; // trailing comment
+'
+
+generate indented '
+                if (depth > maximumDepth) {
+                        maximumDepth = depth;
+                }
+'
+
+generate identifiers '
+var aVeryLongDescriptiveIdentifier = anotherVeryLongDescriptiveIdentifier;
+var shorter_snake_case_name_2 = yet_another_snake_case_name_123456;
+'
+
+printf "%-12s %10s %12s %12s\n" source tokens "pull MB/s" "batch MB/s"
+
+for source in code comments indented identifiers; do
+  read -r tokens pull batch < <("$WORK_DIR/lexer" "$WORK_DIR/$source.lox" "$RUNS")
+  printf "%-12s %10s %12s %12s\n" "$source" "$tokens" "$pull" "$batch"
+done
@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+#
+# Line reading throughput: streams a generated log file through readLine().
+# Usage: bench/lines.sh [lines]
+
+set -euo pipefail
+
+ASBTL="${ASBTL:-$(dirname "$0")/../build/asbtl}"
+LINES="${1:-5000000}"
+
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+  for (i = 0; i < n; i++)
+    printf "2024-01-01T00:00:%02d level=info req=%d path=/api/items/%d\n", i % 60, i, i % 977
+}' >"$WORK_DIR/input.log"
+
+cat >"$WORK_DIR/lines.lox" <<LOX
+var file = open("$WORK_DIR/input.log");
+var count = 0;
+var line = readLine(file);
+
+while (line != nil) {
+  count = count + 1;
+  line = readLine(file);
+}
+
+close(file);
+print count;
+LOX
+
+start=$(date +%s.%N)
+count=$("$ASBTL" "$WORK_DIR/lines.lox")
+end=$(date +%s.%N)
+
+bytes=$(stat -c %s "$WORK_DIR/input.log")
+
+awk -v count="$count" -v bytes="$bytes" -v start="$start" -v end="$end" 'BEGIN {
+  secs = end - start
+  printf "lines: %d (%.1f MB) in %.3fs\n", count, bytes / 1e6, secs
+  printf "%.0f lines/sec, %.1f MB/s\n", count / secs, bytes / 1e6 / secs
+}'
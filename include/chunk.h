@@ -39,25 +39,65 @@ typedef enum op_code {
   OP_CLOSURE,
   OP_PRINT,
   OP_RETURN,
+  OP_IS_FUNC,
+  OP_SLIDE,
+  OP_GET_CAPTURED,
+  OP_LOCAL_CLOSURE,
+  OP_GET_PARENT,
+  OP_SET_PARENT,
+  OP_GET_HOISTED,
+  OP_CALL_NATIVE,
+  OP_DEF_CONST,
 } OpCode;
 
+#define OP_CODE_COUNT (OP_DEF_CONST + 1)
+
 const char *opCodeStr(OpCode opCode);
 
+// The bytecode from the offset up to the next run's was all compiled from the
+// same line.
+typedef struct line_run {
+  unsigned int offset;
+  int line;
+} LineRun;
+
 // A chunk is the abstraction that represents a bytecode array and its
 // associated information such as the constants it refers to.
 typedef struct chunk {
   unsigned int capacity;
   unsigned int count;
-  uint8_t *code;       // Bytecode array
-  int *lines;          // Corresponding line numbers of the bytecode
-  ValueList constants; // Constants pool (values list)
+  uint8_t *code;             // Bytecode array
+  int *lines;                // Line of each byte, until the chunk is finalized
+  LineRun *lineRuns;         // Then the lines as runs, see chunkLine()
+  unsigned int lineRunCount;
+  ValueList constants;       // Constants pool (values list)
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void appendChunk(Chunk *chunk, uint8_t byte, int line);
 void freeChunk(Chunk *chunk);
 
+// Once nothing more is appended to a chunk, shrinks its code and constants to
+// fit and replaces the line of each byte with far fewer runs of lines.
+void finalizeChunk(Chunk *chunk);
+
+// Returns the line the byte at the offset was compiled from.
+int chunkLine(Chunk *chunk, unsigned int offset);
+
 // Appends to the constant pool, returning the array index it was written to.
 unsigned int appendConstant(Chunk *chunk, Value constant);
 
+// Returns the size in bytes of the instruction at the offset, with operands.
+unsigned int instructionLen(Chunk *chunk, unsigned int offset);
+
+// Returns the offset the jump or loop instruction at the offset lands on.
+unsigned int jumpTarget(Chunk *chunk, unsigned int offset);
+
+// Returns how many values the instruction pushes, or pops when negative.
+int stackEffect(Chunk *chunk, unsigned int offset);
+
+// Finds the stack depth at each reachable instruction of a function with the
+// arity, setting the rest to -1. depths has an entry per byte of code.
+void findStackDepths(Chunk *chunk, int arity, int *depths);
+
 #endif
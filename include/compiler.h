@@ -2,14 +2,45 @@
 #define ASBTL_COMPILER_H
 
 #include "object.h"
+#include "optimizer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
 
 #define UPVALUE_CAPTURES_UPVALUE (0)
 #define UPVALUE_CAPTURES_LOCAL   (1)
+#define UPVALUE_CAPTURES_VALUE   (2) // A local that is never assigned, copied
+
+#define INLINE_LIMIT_DEFAULT     32
+#define INLINE_LIMIT_MAX         UINT8_MAX
 
 // Returns the object function contianing the chunk with bytecode if compilation
 // succeeded, otherwise a failure will return NULL.
 ObjFunc *compile(const char *source);
 
+// Sets how much the compiler optimizes the functions it compiles from now on.
+void setOptLevel(OptLevel level);
+
+// Sets the largest function, in bytes of bytecode, that -O2 inlines at its call
+// sites. Zero turns inlining off.
+void setInlineLimit(int limit);
+
+// Sets whether compile() leaves the bodies of top level functions until their
+// first call, when compileLazyFunc() compiles them from the same source.
+void setLazyCompile(bool lazy);
+
+// Sets whether the source given to compile() outlives everything compiled from
+// it, so string literals and names can point into it instead of being copied.
+void setRetainedSource(bool retained);
+
+// Compiles the body of a function compile() left for later. Returns false on a
+// compile error.
+bool compileLazyFunc(ObjFunc *func);
+
+// Forgets the constants and inline candidates kept between calls to compile(),
+// before the VM frees the objects they refer to.
+void freeCompiler();
+
 void markCompilerRoots();
 
 #endif
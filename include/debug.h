@@ -7,7 +7,11 @@
 #endif
 
 #include "chunk.h"
+#include "regcode.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 
+// Register code refers to the constants of the chunk it was translated from.
+void disassembleRegCode(RegCode *regCode, Chunk *chunk, const char *name);
+
 #endif
@@ -0,0 +1,13 @@
+#ifndef ASBTL_DTOA_H
+#define ASBTL_DTOA_H
+
+// Large enough for the longest formatted double, "-2.2250738585072014e-308",
+// plus the null byte.
+#define NUMBER_FMT_MAX 32
+
+// Writes the shortest decimal representation of the number that reads back as
+// the same double, returning the number of chars written (excluding the null
+// byte). Integers print without a fraction or exponent.
+int formatNumber(double value, char *buf);
+
+#endif
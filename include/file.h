@@ -0,0 +1,18 @@
+#ifndef ASBTL_FILE_H
+#define ASBTL_FILE_H
+
+#include "object.h"
+
+// Size of a file's read buffer. It only grows past this for longer lines.
+#define FILE_BUFFER_SIZE (256 * 1024)
+
+// Opens the file for sequential reading, returning NULL if it can't be opened.
+ObjFile *openFile(const char *path);
+
+// Returns the next line without its line terminator, or NULL once there are
+// no lines left or on a read error.
+ObjString *readLine(ObjFile *file);
+
+void closeFile(ObjFile *file);
+
+#endif
@@ -29,6 +29,9 @@ void freeHashTable(HashTable *ht);
 // Adds the given key/value pair, returning true if it is a new entry.
 bool hashTableSet(HashTable *ht, ObjString *key, Value value);
 
+// Returns true if the next new entry will make the table rehash.
+bool hashTableIsFull(HashTable *ht);
+
 // Finds the entry with the given key, setting the value out pointer and
 // returning true if found.
 bool hashTableGet(HashTable *ht, ObjString *key, Value *value);
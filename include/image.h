@@ -0,0 +1,46 @@
+#ifndef ASBTL_IMAGE_H
+#define ASBTL_IMAGE_H
+
+#include "object.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A compiled image starts with a byte that can never begin a source file.
+#define IMAGE_MAGIC   "\x7f" "ASB"
+
+// Bump whenever the layout of the image or the bytecode it holds changes.
+// Images (including cached ones) built by any other version are rejected.
+#define IMAGE_VERSION 8
+
+// Identifies what an image was built from. Cached images are only reused when
+// the whole key matches.
+typedef struct image_key {
+  uint64_t sourceHash;
+  uint32_t flags; // Compiler options that change the bytecode (the -O level)
+} ImageKey;
+
+// Hash of the source text, used as the key into the image cache.
+uint64_t hashSource(const char *chars, size_t len);
+
+// Returns whether the bytes look like a compiled image rather than source.
+bool isImage(const char *bytes, size_t len);
+
+// Serializes the function and every function nested in it to the file at the
+// given path, replacing it atomically. Returns false if it can't be written.
+bool writeImage(ObjFunc *func, const ImageKey *key, const char *path);
+
+// Rebuilds the top level function from an image, checking its bytecode only
+// refers to what the functions hold. Returns NULL if the image is malformed,
+// from another version or, when key isn't NULL, was built from different source
+// or with different compiler options.
+ObjFunc *loadImage(const char *bytes, size_t len, const ImageKey *key);
+
+// Writes the path of the cached image for the key into path, creating the
+// cache directory if needed. Returns false if there is no usable cache.
+bool imageCachePath(const ImageKey *key, char *path, size_t n);
+
+void markImageRoots();
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef ASBTL_IR_H
+#define ASBTL_IR_H
+
+#include "chunk.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IR_NO_BLOCK (-1)
+
+// A decoded instruction. Operands refer to constants, local slots and upvalues
+// directly rather than by their position in the bytecode.
+typedef struct ir_instr {
+  OpCode op;
+  int operand; // Constant index, local/upvalue/parent slot or value count
+  int line;
+  const uint8_t *captures; // OP_CLOSURE upvalue operand pairs, in the source
+  int captureCount;
+} IrInstr;
+
+// How control leaves a basic block. Jumps refer to blocks, so code can be added,
+// removed and reordered without patching offsets.
+typedef enum ir_exit {
+  EXIT_NEXT,   // Falls through to the next block
+  EXIT_JUMP,   // Unconditionally jumps to the target block
+  EXIT_BRANCH, // Jumps to the target block, or falls through to the next
+  EXIT_RETURN, // Ends with OP_RETURN
+} IrExit;
+
+typedef struct ir_block {
+  IrInstr *instrs;
+  int count;
+  int capacity;
+  IrExit exit;
+  OpCode branchOp; // OP_JUMP_IF_FALSE or OP_JUMP_IF_TRUE for EXIT_BRANCH
+  int target;      // For EXIT_JUMP and EXIT_BRANCH
+  int next;        // For EXIT_NEXT and EXIT_BRANCH, IR_NO_BLOCK at the end
+  int exitLine;
+  bool isLive; // False once removed, e.g. when unreachable or merged
+} IrBlock;
+
+// The basic blocks of one function, in their original order. Constants stay in
+// the chunk the function was built from.
+typedef struct ir_func {
+  Chunk *chunk;
+  IrBlock *blocks;
+  int blockCount;
+} IrFunc;
+
+// Splits the chunk's bytecode into basic blocks. The chunk must outlive the IR.
+void buildIr(IrFunc *ir, Chunk *chunk);
+
+// Emits the live blocks in order into the empty chunk, which shares nothing
+// with the IR's chunk. Returns false if a jump is too far to encode.
+bool lowerIr(IrFunc *ir, Chunk *out);
+
+void freeIr(IrFunc *ir);
+
+void appendIrInstr(IrBlock *block, IrInstr instr);
+
+#endif
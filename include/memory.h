@@ -1,12 +1,13 @@
 #ifndef ASBTL_MEMORY_H
 #define ASBTL_MEMORY_H
 
+#include "object.h"
 #include "value.h"
 
 #include <stddef.h>
 
 // malloc
-#define ALLOCATE(type, count) (type *)reallocate(NULL, sizeof(type) * count, 0)
+#define ALLOCATE(type, count) (type *)reallocate(NULL, sizeof(type) * (count), 0)
 
 #define GROW_CAPACITY(cap)    ((cap) < 8 ? 8 : (cap) * 2)
 
@@ -19,10 +20,35 @@
 // free
 #define FREE(type, ptr) reallocate(ptr, 0, sizeof(type))
 
+#define OBJ_PAGE_SIZE 4096
+#define OBJ_FREE      0xFF // The type of an unused slot
+
+typedef struct obj_page {
+  struct obj_page *next; // Followed by the page's slots
+} ObjPage;
+
+// Objects of one type, allocated in fixed size slots carved from pages. The
+// collector finds every object by walking the pages, and the unused slots are
+// kept on a free list threaded through them.
+typedef struct obj_pool {
+  ObjPage *pages;
+  Obj *freeSlots;
+  size_t pageCount;
+  size_t live; // Slots in use
+} ObjPool;
+
 void *reallocate(void *ptr, size_t newSize, size_t oldSize);
+
+// Takes an unused slot for an object of the type, collecting first when due.
+// The caller fills in the header.
+Obj *takeSlot(ObjType type);
+
 void markValue(Value value);
 void markObj(Obj *obj);
 void collectGarbage();
 void freeObjs();
 
+// Counts the objects in the heap and the bytes of the pages holding them.
+void heapUsage(size_t *objs, size_t *bytes);
+
 #endif
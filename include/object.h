@@ -2,22 +2,28 @@
 #define ASBTL_OBJECT_H
 
 #include "chunk.h"
+#include "regcode.h"
+#include "token.h"
 #include "value.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
-#define OBJ_TYPE(value)   AS_OBJ(value)->type
+#define OBJ_TYPE(value)   ((ObjType)AS_OBJ(value)->type)
 
 #define IS_STRING(value)  isObjType(value, OBJ_STRING)
 #define IS_FUNC(value)    isObjType(value, OBJ_FUNC)
 #define IS_NATIVE(value)  isObjType(value, OBJ_NATIVE)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FILE(value)    isObjType(value, OBJ_FILE)
 
 #define AS_STRING(value)  ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define AS_FUNC(value)    ((ObjFunc *)AS_OBJ(value))
-#define AS_NATIVE(value)  (((ObjNative *)AS_OBJ(value))->func)
+#define AS_NATIVE(value)  ((ObjNative *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_FILE(value)    ((ObjFile *)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
 
 typedef enum obj_type {
   OBJ_STRING,
@@ -25,19 +31,44 @@ typedef enum obj_type {
   OBJ_NATIVE,
   OBJ_CLOSURE,
   OBJ_UPVALUE,
+  OBJ_FILE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_FILE + 1)
+
+// Objects live in their type's pool rather than on a list of their own (see
+// ObjPool), so the header is two bytes and the fields after it fill the rest
+// of the first word.
 struct obj {
-  ObjType type;
-  struct obj *next;
+  uint8_t type; // An ObjType, or OBJ_FREE for a pool's unused slot
   bool isMarked;
 };
 
+#ifdef COMPRESSED_REFS
+// References between objects are 32-bit offsets into the region every object
+// is allocated in (see memory.c), 0 standing for NULL.
+typedef uint32_t ObjRef;
+
+extern char *heapRegion;
+
+#define ENCODE_REF(obj) \
+  ((obj) == NULL ? 0 : (ObjRef)((char *)(obj) - heapRegion))
+#define DECODE_REF(type, ref) \
+  ((ref) == 0 ? NULL : (type *)(heapRegion + (ref)))
+#else
+typedef Obj *ObjRef;
+
+#define ENCODE_REF(obj)       ((Obj *)(obj))
+#define DECODE_REF(type, ref) ((type *)(ref))
+#endif
+
+// Owned chars are zero terminated. Borrowed ones needn't be, so use len.
 typedef struct obj_string {
   Obj obj;
-  const char *chars;
+  bool ownsChars; // False when chars point into memory that outlives the VM
   int len;
   uint32_t hash;
+  const char *chars;
 } ObjString;
 
 typedef struct obj_func {
@@ -46,33 +77,56 @@ typedef struct obj_func {
   Chunk chunk; // Each function has its own chunk
   ObjString *name;
   int upvalueCount;
+  RegCode regCode; // Register backend code, translated on the first call
+  struct obj_closure *localClosure; // Shared by OP_LOCAL_CLOSURE, made lazily
+  // The '(' of the parameters while the body is left to the first call, whose
+  // start is NULL once compiled. See compileLazyFunc().
+  Token lazyStart;
 } ObjFunc;
 
 // Runtime representation of upvalues, the closed-over vars no longer on stack
 typedef struct obj_upvalue {
   Obj obj;
-  Value *location;          // Reference to the closed-over variable
-  Value closed;             // Variable value is here when upvalue is closed.
-  struct obj_upvalue *next; // Next open upvalue farther down the stack
+  ObjRef next;     // Next open upvalue farther down the stack
+  Value *location; // Reference to the closed-over variable
+  Value closed;    // Variable value is here when upvalue is closed.
 } ObjUpvalue;
 
+#define UPVALUE_NEXT(upvalue) DECODE_REF(ObjUpvalue, (upvalue)->next)
+
 // The closure around a function
 typedef struct obj_closure {
   Obj obj;
-  ObjFunc *func;
-  ObjUpvalue **upvalues; // Dynamically allocated array of upvalue pointers
-  int upvalueCount;
+  uint16_t upvalueCount;
+  ObjRef func;
+  Value *upvalues; // Each an upvalue object, or the value captured by value
 } ObjClosure;
 
+#define CLOSURE_FUNC(closure) DECODE_REF(ObjFunc, (closure)->func)
+
 // A native function takes an argument count and pointer to the first argument
-// on the value stack. Once done, returns the result value.
+// on the value stack. Once done, returns the result value. It is only called
+// with as many arguments as it declares.
 typedef Value (*NativeFn)(int argCount, Value *args);
 
 typedef struct obj_native {
   Obj obj;
+  uint8_t arity;
   NativeFn func;
 } ObjNative;
 
+// A file opened for reading line by line. Lines are found in a large buffer
+// that is only refilled once exhausted, so reading costs no syscall per line.
+typedef struct obj_file {
+  Obj obj;
+  int fd; // -1 once closed
+  char *buf;
+  size_t capacity;
+  size_t start; // First unread char in buf
+  size_t end;   // One past the last char read into buf
+  bool eof;
+} ObjFile;
+
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -80,18 +134,29 @@ static inline bool isObjType(Value value, ObjType type) {
 uint32_t hashString(const char *key, int n);
 
 ObjFunc *newFunc();
-ObjNative *newNative(NativeFn func);
+ObjNative *newNative(NativeFn func, int arity);
 ObjClosure *newClosure(ObjFunc *func);
 ObjUpvalue *newUpvalue(Value *slot);
+ObjFile *newFile(int fd);
 
 ObjString makeObjString(const char *chars, int n);
 
-// Conservatively makes a new heap-allocation of the passed chars
+// Pre-interns the empty, one byte and small integer strings into the VM. These
+// are rooted by markStringCache() so they are never collected.
+void initStringCache();
+void markStringCache();
+
+// Conservatively makes a new heap-allocation of the passed chars. Empty and one
+// byte strings come from the string cache without hashing or allocating.
 ObjString *copyString(const char *chars, int n);
 
 // Claims ownership of the heap-allocated passed chars
 ObjString *takeString(char *chars, int n);
 
+// Interns the chars in place instead of copying them, so they must outlive the
+// string. Freeing it leaves them alone.
+ObjString *borrowString(const char *chars, int n);
+
 ObjString *concatenate(ObjString *a, ObjString *b);
 
 void printObj(Value value);
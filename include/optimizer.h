@@ -0,0 +1,28 @@
+#ifndef ASBTL_OPTIMIZER_H
+#define ASBTL_OPTIMIZER_H
+
+#include "chunk.h"
+#include "value.h"
+
+#include <stdbool.h>
+
+// How much work the compiler puts into each function's bytecode (-O0 to -O2).
+typedef enum opt_level {
+  OPT_NONE,  // Bytecode as the parser emits it
+  OPT_LOCAL, // Constant folding and peepholes within each basic block
+  OPT_FULL,  // Also folds branches, drops unreachable blocks, merges blocks and
+             // compacts the constant pool. The compiler inlines calls and
+             // hoists loop-invariant global reads.
+} OptLevel;
+
+#define OPT_LEVEL_MAX OPT_FULL
+
+// Runs the passes for the level over a function's finished chunk, by lifting
+// it into the IR and lowering it back. Does nothing at OPT_NONE.
+void optimizeChunk(Chunk *chunk, OptLevel level);
+
+// Evaluates the operator on two literals the same way the VM would. Returns
+// false if it can't be done at compile time, e.g. it would be a runtime error.
+bool foldBinary(OpCode op, Value a, Value b, Value *result);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ASBTL_PEEPHOLE_H
+#define ASBTL_PEEPHOLE_H
+
+#include "chunk.h"
+
+// Retargets jumps that land on other jumps to their final destination, then
+// removes jumps to the next instruction. Run over a finished chunk.
+void threadJumps(Chunk *chunk);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef ASBTL_REGCODE_H
+#define ASBTL_REGCODE_H
+
+#include "chunk.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The register backend's instruction set, in the style of Lua 5. Every stack
+ * slot of a frame is a register: locals live in theirs for the whole call and
+ * temporaries take the slots above them. Instructions are 32-bit words:
+ *
+ *   | C (9 bits) | B (9 bits) | A (8 bits) | op (6 bits) |
+ *
+ * A is a register. B and C are "RK" operands: a register, or a constant when
+ * the REG_CONST bit is set. Bx spans B and C for unsigned operands, sBx is the
+ * same biased to hold signed jump offsets.
+ */
+typedef uint32_t RegInstr;
+
+typedef enum reg_op_code {
+  ROP_MOVE,          // R[A] = RK(B)
+  ROP_NIL,           // R[A] = nil
+  ROP_TRUE,          // R[A] = true
+  ROP_FALSE,         // R[A] = false
+  ROP_ADD,           // R[A] = RK(B) + RK(C)
+  ROP_SUBTRACT,      // R[A] = RK(B) - RK(C)
+  ROP_MULTIPLY,      // R[A] = RK(B) * RK(C)
+  ROP_DIVIDE,        // R[A] = RK(B) / RK(C)
+  ROP_EQ,            // R[A] = RK(B) == RK(C)
+  ROP_NOT_EQ,        // R[A] = RK(B) != RK(C)
+  ROP_LESS,          // R[A] = RK(B) < RK(C)
+  ROP_LESS_EQ,       // R[A] = RK(B) <= RK(C)
+  ROP_GREATER,       // R[A] = RK(B) > RK(C)
+  ROP_GREATER_EQ,    // R[A] = RK(B) >= RK(C)
+  ROP_NOT,           // R[A] = !RK(B)
+  ROP_NEGATE,        // R[A] = -RK(B)
+  ROP_DEF_GLOBAL,    // Globals[K[A]] = RK(B), defining it
+  ROP_GET_GLOBAL,    // R[A] = Globals[K[Bx]]
+  ROP_SET_GLOBAL,    // Globals[K[A]] = RK(B)
+  ROP_GET_UPVALUE,   // R[A] = Upvalues[B]
+  ROP_SET_UPVALUE,   // Upvalues[A] = RK(B)
+  ROP_CLOSE,         // Closes the upvalues of R[A] and the registers above it
+  ROP_JUMP,          // pc += sBx
+  ROP_JUMP_IF_FALSE, // if R[A] is falsy: pc += sBx
+  ROP_JUMP_IF_TRUE,  // if R[A] is truthy: pc += sBx
+  ROP_CALL,          // R[A] = R[A](R[A + 1], ... R[A + B])
+  ROP_CLOSURE,       // R[A] = closure of K[Bx], then a word per upvalue it
+                     // captures (A = capture kind, B = index)
+  ROP_PRINT,         // print RK(B)
+  ROP_RETURN,        // return RK(B)
+  ROP_IS_FUNC,       // R[A] = RK(B) is a closure of the function RK(C)
+  ROP_GET_CAPTURED,  // R[A] = the value captured as Upvalues[B]
+  ROP_LOCAL_CLOSURE, // R[A] = the shared closure of K[Bx], which never escapes
+  ROP_GET_PARENT,    // R[A] = the calling frame's R[B]
+  ROP_SET_PARENT,    // The calling frame's R[A] = RK(B)
+  ROP_GET_HOISTED,   // R[A] = R[B], first loading it from Globals[R[B - 1]]
+                     // when nil
+  ROP_CALL_NATIVE,   // R[A] = Natives[C](R[A + 1], ... R[A + B]), or as
+                     // ROP_CALL once R[A] isn't that native
+  ROP_DEF_CONST,     // Globals[K[A]] = RK(B), defining it as a constant
+} RegOpCode;
+
+#define REG_CONST    0x100 // Set in an RK operand that refers to a constant
+#define REG_MAX      UINT8_MAX
+#define REG_SBX_BIAS (1 << 17)
+#define REG_SBX_MAX  (REG_SBX_BIAS - 1)
+
+#define REG_OP(instr)  ((RegOpCode)((instr) & 0x3F))
+#define REG_A(instr)   (((instr) >> 6) & 0xFF)
+#define REG_B(instr)   (((instr) >> 14) & 0x1FF)
+#define REG_C(instr)   ((instr) >> 23)
+#define REG_BX(instr)  ((instr) >> 14)
+#define REG_SBX(instr) ((int)REG_BX(instr) - REG_SBX_BIAS)
+
+#define REG_ABC(op, a, b, c) \
+  ((RegInstr)(op) | ((RegInstr)(a) << 6) | ((RegInstr)(b) << 14) | \
+   ((RegInstr)(c) << 23))
+#define REG_ABX(op, a, bx)  ((RegInstr)(op) | ((RegInstr)(a) << 6) | \
+                             ((RegInstr)(bx) << 14))
+#define REG_ASBX(op, a, sbx) REG_ABX(op, a, (sbx) + REG_SBX_BIAS)
+
+// A function's code for the register backend. Constants are shared with the
+// function's chunk.
+typedef struct reg_code {
+  int capacity;
+  int count;
+  RegInstr *code;
+  int *lines;    // Line of each instruction
+  int frameSize; // Registers the function uses, including slot 0
+} RegCode;
+
+void initRegCode(RegCode *regCode);
+void freeRegCode(RegCode *regCode);
+
+// Translates a function's stack bytecode into register code, folding the moves
+// of locals and constants into the instructions that use them. Returns false if
+// the function needs more registers or longer jumps than can be encoded.
+bool translateChunk(Chunk *chunk, int arity, RegCode *out);
+
+const char *regOpCodeStr(RegOpCode opCode);
+
+#endif
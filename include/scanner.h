@@ -6,6 +6,7 @@
 typedef struct scanner {
   const char *start; // Start of the lexeme being scanned
   const char *cur;   // Current character in source
+  const char *end;   // The source's terminating zero byte
   unsigned int line; // Current line scanner is in source
   unsigned int col;  // Current col scanner is in the line/source
 } Scanner;
@@ -14,4 +15,18 @@ void initScanner(Scanner *scanner, const char *source);
 
 Token scanNext(Scanner *scanner);
 
+// Every token of a source, scanned up front and ending with TOK_EOF.
+typedef struct token_list {
+  int count;
+  int capacity;
+  Token *tokens;
+} TokenList;
+
+void initTokenList(TokenList *list);
+void freeTokenList(TokenList *list);
+
+// Scans the whole source into the list, replacing what it held. Errors are kept
+// in order as TOK_ERR tokens.
+void scanTokens(const char *source, TokenList *list);
+
 #endif
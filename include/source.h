@@ -0,0 +1,23 @@
+#ifndef ASBTL_SOURCE_H
+#define ASBTL_SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The null terminated source text of a script. Regular files are mapped into
+// memory read-only so the scanner runs directly over the page cache, anything
+// else (pipes, special files) is read into a heap buffer.
+typedef struct source {
+  const char *chars;
+  size_t len;       // Number of chars, excluding the null sentinel
+  size_t mappedLen; // Length of the mapping, 0 if chars is heap allocated
+} Source;
+
+// Loads the script at the given path, exiting with EX_IOERR on failure.
+void readSource(Source *source, const char *path);
+
+// Like readSource(), but returns false on failure instead of exiting.
+bool tryReadSource(Source *source, const char *path);
+void freeSource(Source *source);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef ASBTL_STATS_H
+#define ASBTL_STATS_H
+
+#include "object.h"
+
+#include <stdio.h>
+
+typedef enum stats_format {
+  STATS_TEXT,
+  STATS_JSON,
+} StatsFormat;
+
+typedef enum phase {
+  PHASE_READ,    // Reading the script or image
+  PHASE_SCAN,    // Scanning the source on its own, before compiling it
+  PHASE_COMPILE, // Compiling the source, or loading an image
+  PHASE_RUN,
+} Phase;
+
+#define PHASE_COUNT (PHASE_RUN + 1)
+
+// Seconds spent, as wall clock and process CPU time.
+typedef struct phase_time {
+  double wall;
+  double cpu;
+} PhaseTime;
+
+// The size of a compiled function's code.
+typedef struct func_stats {
+  char *name; // NULL for the top level script
+  int bytes;
+  int constants;
+  int upvalues;
+} FuncStats;
+
+typedef struct stats {
+  const char *path;
+  PhaseTime phases[PHASE_COUNT];
+  PhaseTime started; // When the phase being timed began
+  int tokens;
+  size_t compileObjs; // Objects allocated while compiling
+  size_t collections;
+  double traceTime; // Seconds the collector spent marking and tracing
+  double sweepTime;
+  size_t lazyCompiles; // Bodies compiled on their first call, with --lazy
+  double lazyTime;     // Seconds spent compiling them, part of the run phase
+  size_t heapObjs;     // Live once the script finished
+  size_t heapBytes;
+  int funcCount;
+  int funcCapacity;
+  FuncStats *funcs;
+} Stats;
+
+void initStats(Stats *stats, const char *path);
+void freeStats(Stats *stats);
+
+void startPhase(Stats *stats);
+
+// Adds the time since startPhase() to the phase.
+void endPhase(Stats *stats, Phase phase);
+
+// Scans the whole source up front without compiling it, returning the number
+// of tokens.
+int countTokens(const char *source);
+
+// Records the collector's work, the bodies compiled lazily and what the heap
+// holds at this point.
+void collectRunStats(Stats *stats);
+
+// Records the code size of the script and every function nested in it.
+void collectFuncStats(Stats *stats, ObjFunc *script);
+
+void printStats(Stats *stats, StatsFormat format, FILE *out);
+
+#endif
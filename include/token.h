@@ -33,6 +33,7 @@ typedef enum tok_type {
   TOK_FALSE,
   TOK_NIL,
   TOK_VAR,
+  TOK_CONST,
   TOK_IF,
   TOK_ELSE,
   TOK_WHILE,
@@ -2,18 +2,57 @@
 #define ASBTL_VM_H
 
 #include "hashtable.h"
+#include "memory.h"
+#include "regcode.h"
 #include "value.h"
 
 #include <stddef.h>
 #include <stdint.h>
 
-#define FRAMES_MAX 64
-#define STACK_MAX  (FRAMES_MAX * 256)
+#define FRAMES_MAX        64
+#define STACK_MAX         (FRAMES_MAX * 256)
+#define BYTE_STRINGS_MAX  (UINT8_MAX + 1)
+#define SMALL_INT_STRINGS 256
+#define OUTPUT_BUFFER_MAX (64 * 1024)
+#define NATIVE_COUNT      6
+
+typedef enum output_mode {
+  OUTPUT_FULL,      // Flush when the buffer fills or at an explicit flush point
+  OUTPUT_LINE,      // Also flush after every printed line
+  OUTPUT_UNBUFFERED // Flush after every write
+} OutputMode;
+
+// Which instruction set functions are run as
+typedef enum backend {
+  BACKEND_STACK,    // The compiler's stack bytecode
+  BACKEND_REGISTER, // Register code translated from it, see regcode.h
+} Backend;
+
+// What a native promises not to do
+typedef enum native_flags {
+  NATIVE_PURE     = 1 << 0, // No side effects, the result depends on the args
+  NATIVE_NO_ALLOC = 1 << 1, // Never allocates, so never collects garbage
+} NativeFlags;
+
+typedef struct native_def {
+  const char *name;
+  NativeFn func;
+  int arity;
+  int flags;
+} NativeDef;
+
+// Every native, each defined as a global of its name. OP_CALL_NATIVE refers to
+// them by their index.
+extern const NativeDef nativeDefs[NATIVE_COUNT];
+
+// Returns the index of the native with the name, or -1 if there is none.
+int findNative(const char *name, int len);
 
 // Represents a function invocation
 typedef struct call_frame {
   ObjClosure *closure; // The closure surrounding the ObjFunc being executed
   uint8_t *ip;  // Each frame has its own IP for next instruction to execute
+  const RegInstr *pc; // The IP when running register code
   Value *slots; // Points into the VM's value stack at the first slot it uses
 } CallFrame;
 
@@ -22,15 +61,40 @@ typedef struct vm {
   int frameCount;               // Height of the call frame stack
   Value stack[STACK_MAX];
   Value *stackTop;
-  Obj *objs;       // Intrusive list of runtime allocated objects
+  ObjPool pools[OBJ_TYPE_COUNT]; // Every runtime allocated object, by type
   Obj **grayStack; // The worklist of gray values for GC
   int grayCount;
   int grayCapacity;
   size_t bytesAllocated;
   size_t nextGC;
+  size_t objsAllocated; // Objects ever allocated, for --stats
+  size_t collections;   // Collections run, for --stats
+  double traceTime;     // Seconds spent marking and tracing, for --stats
+  double sweepTime;     // Seconds spent sweeping, for --stats
+  size_t lazyCompiles;  // Bodies compiled on their first call, for --stats
+  double lazyTime;      // Seconds spent compiling them, for --stats
   HashTable strings;        // String interning pool (hash set)
   HashTable globals;        // Global variables
+  HashTable constGlobals;   // Names of the globals defined by a const (set)
   ObjUpvalue *openUpvalues; // Intrusive list of open upvalues
+
+  // Each native's object, which OP_CALL_NATIVE checks its callee is before
+  // calling the native directly. Rooted even once their globals are reassigned.
+  ObjNative *natives[NATIVE_COUNT];
+
+  // Pre-interned short strings, created at startup and rooted for the VM's
+  // lifetime so the hot string paths can return them without hashing.
+  ObjString *emptyString;
+  ObjString *byteStrings[BYTE_STRINGS_MAX];      // Every one byte string
+  ObjString *smallIntStrings[SMALL_INT_STRINGS]; // "0" ... "255"
+
+  // Program output is gathered here and written to stdout in large blocks
+  // rather than going through stdio for every printed value.
+  char output[OUTPUT_BUFFER_MAX];
+  size_t outputLen;
+  OutputMode outputMode;
+
+  Backend backend;
 } VM;
 
 extern VM vm;
@@ -41,6 +105,15 @@ void push(Value value);
 void initVM();
 void freeVM();
 
+// Appends to the VM's output buffer, flushing it to stdout when full.
+void writeOutput(const char *chars, size_t n);
+void printOutput(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+// Ends a printed line, flushing it unless the output is fully buffered.
+void endOutputLine();
+void flushOutput();
+
 typedef enum interpret_result {
   INTERPRET_OK,
   INTERPRET_COMPILER_ERR,
@@ -49,4 +122,7 @@ typedef enum interpret_result {
 
 InterpretResult interpret(const char *source);
 
+// Runs already compiled top level code, such as a function loaded from an image
+InterpretResult interpretFunc(ObjFunc *func);
+
 #endif
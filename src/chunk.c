@@ -1,9 +1,11 @@
 #include "chunk.h"
 
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -42,16 +44,27 @@ const char *opCodeStr(OpCode opCode) {
     case OP_CLOSURE:       return "OP_CLOSURE";
     case OP_PRINT:         return "OP_PRINT";
     case OP_RETURN:        return "OP_RETURN";
+    case OP_IS_FUNC:       return "OP_IS_FUNC";
+    case OP_SLIDE:         return "OP_SLIDE";
+    case OP_GET_CAPTURED:  return "OP_GET_CAPTURED";
+    case OP_LOCAL_CLOSURE: return "OP_LOCAL_CLOSURE";
+    case OP_GET_PARENT:    return "OP_GET_PARENT";
+    case OP_SET_PARENT:    return "OP_SET_PARENT";
+    case OP_GET_HOISTED:   return "OP_GET_HOISTED";
+    case OP_CALL_NATIVE:   return "OP_CALL_NATIVE";
+    case OP_DEF_CONST:     return "OP_DEF_CONST";
   }
 
   return "unknown opcode";
 }
 
 void initChunk(Chunk *chunk) {
-  chunk->capacity = 0;
-  chunk->count    = 0;
-  chunk->code     = NULL;
-  chunk->lines    = NULL;
+  chunk->capacity     = 0;
+  chunk->count        = 0;
+  chunk->code         = NULL;
+  chunk->lines        = NULL;
+  chunk->lineRuns     = NULL;
+  chunk->lineRunCount = 0;
   initValueList(&chunk->constants);
 }
 
@@ -70,14 +83,192 @@ void appendChunk(Chunk *chunk, uint8_t byte, int line) {
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+
+  if (chunk->lines != NULL) {
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  }
+
+  FREE_ARRAY(LineRun, chunk->lineRuns, chunk->lineRunCount);
   freeValueList(&chunk->constants);
   initChunk(chunk);
 }
 
+void finalizeChunk(Chunk *chunk) {
+  unsigned int runCount = 0;
+  for (unsigned int i = 0; i < chunk->count; i++) {
+    runCount += i == 0 || chunk->lines[i] != chunk->lines[i - 1];
+  }
+
+  LineRun *runs    = ALLOCATE(LineRun, runCount);
+  unsigned int run = 0;
+
+  for (unsigned int i = 0; i < chunk->count; i++) {
+    if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) {
+      runs[run].offset = i;
+      runs[run].line   = chunk->lines[i];
+      run++;
+    }
+  }
+
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  chunk->lines        = NULL;
+  chunk->lineRuns     = runs;
+  chunk->lineRunCount = runCount;
+
+  chunk->code     = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity,
+                               chunk->count);
+  chunk->capacity = chunk->count;
+
+  ValueList *constants = &chunk->constants;
+  constants->values    = GROW_ARRAY(Value, constants->values,
+                                    constants->capacity, constants->count);
+  constants->capacity  = constants->count;
+}
+
+int chunkLine(Chunk *chunk, unsigned int offset) {
+  if (chunk->lines != NULL)
+    return chunk->lines[offset];
+
+  // The last run starting at or before the offset
+  unsigned int low = 0, high = chunk->lineRunCount - 1;
+
+  while (low < high) {
+    unsigned int mid = low + (high - low + 1) / 2;
+
+    if (chunk->lineRuns[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  return chunk->lineRuns[low].line;
+}
+
 unsigned int appendConstant(Chunk *chunk, Value constant) {
   push(constant);
   appendValueList(&chunk->constants, constant);
   pop();
   return chunk->constants.count - 1;
 }
+
+unsigned int instructionLen(Chunk *chunk, unsigned int offset) {
+  switch ((OpCode)chunk->code[offset]) {
+    case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CONSTANT:
+    case OP_CALL:
+    case OP_IS_FUNC:
+    case OP_SLIDE:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_SET_UPVALUE:
+    case OP_GET_PARENT:
+    case OP_SET_PARENT:
+    case OP_GET_HOISTED:
+    case OP_CALL_NATIVE:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:     return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:          return 3;
+    case OP_CLOSURE:
+    case OP_LOCAL_CLOSURE: {
+      // Followed by a pair of bytes for each upvalue the closure captures
+      Value func = chunk->constants.values[chunk->code[offset + 1]];
+      return 2 + 2 * AS_FUNC(func)->upvalueCount;
+    }
+    default: return 1;
+  }
+}
+
+unsigned int jumpTarget(Chunk *chunk, unsigned int offset) {
+  uint16_t toJump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+
+  if (chunk->code[offset] == OP_LOOP)
+    return offset + 3 - toJump;
+
+  return offset + 3 + toJump;
+}
+
+int stackEffect(Chunk *chunk, unsigned int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_GET_PARENT:
+    case OP_GET_GLOBAL:
+    case OP_GET_HOISTED:
+    case OP_IS_FUNC:
+    case OP_CLOSURE:
+    case OP_LOCAL_CLOSURE: return 1;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQ:
+    case OP_NOT_EQ:
+    case OP_LESS:
+    case OP_LESS_EQ:
+    case OP_GREATER:
+    case OP_GREATER_EQ:
+    case OP_POP:
+    case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:
+    case OP_CLOSE_UPVALUE:
+    case OP_PRINT:
+    case OP_RETURN:        return -1;
+    case OP_CALL:
+    case OP_SLIDE:         return -chunk->code[offset + 1];
+    case OP_CALL_NATIVE:   return -nativeDefs[chunk->code[offset + 1]].arity;
+    default:               return 0;
+  }
+}
+
+static void reach(Chunk *chunk, int *depths, unsigned int offset, int depth,
+                  bool *changed) {
+  if (offset < chunk->count && depths[offset] < 0) {
+    depths[offset] = depth;
+    *changed       = true;
+  }
+}
+
+// Loop bodies can be placed after the code jumping back to them, as with a for
+// loop's increment, so this repeats until nothing new is reached.
+void findStackDepths(Chunk *chunk, int arity, int *depths) {
+  bool changed = true;
+
+  for (unsigned int i = 0; i < chunk->count; i++) {
+    depths[i] = -1;
+  }
+
+  depths[0] = arity + 1; // The callee and its parameters
+
+  while (changed) {
+    changed = false;
+
+    for (unsigned int offset = 0; offset < chunk->count;
+         offset += instructionLen(chunk, offset)) {
+      int depth = depths[offset];
+      OpCode op = chunk->code[offset];
+
+      if (depth < 0 || op == OP_RETURN)
+        continue;
+
+      if (op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE ||
+          op == OP_JUMP_IF_TRUE)
+        reach(chunk, depths, jumpTarget(chunk, offset), depth, &changed);
+
+      if (op != OP_JUMP && op != OP_LOOP)
+        reach(chunk, depths, offset + instructionLen(chunk, offset),
+              depth + stackEffect(chunk, offset), &changed);
+    }
+  }
+}
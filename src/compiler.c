@@ -3,8 +3,11 @@
 #include "chunk.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "token.h"
+#include "vm.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -19,11 +22,21 @@ typedef struct parser {
   bool panicMode;
 } Parser;
 
+// Locals are found by the hash of their name, in this many (a power of two)
+// buckets per function.
+#define LOCAL_BUCKETS 256
+
 // Represents a local variable
 typedef struct local {
   Token name;
+  uint32_t hash; // Of the name, picking the bucket the local is found in
+  int next;      // Previous local in the same bucket, or LOCAL_NOT_FOUND
   int depth;
   bool isCaptured; // True if captured by a later nested function declaration.
+  bool isAssigned; // True if assigned anywhere after its declaration
+  bool escapes;    // True if read other than to call it, or captured
+  // Chunk offset of the code that initializes it
+  unsigned int declaredAt;
 } Local;
 
 typedef enum func_type {
@@ -37,17 +50,66 @@ typedef struct upvalue {
                  // surrounding function
 } Upvalue;
 
+// A global a loop reads through a pair of hidden locals: the global's name, and
+// its value, cached by the first OP_GET_HOISTED to read it.
+typedef struct hoisted_global {
+  Token name;
+  int slot; // Of the cached value, with the name in the slot below
+} HoistedGlobal;
+
+#define MAX_HOISTED      16 // Per function, across the loops nested in it
+#define MAX_LOOP_ASSIGNS 64
+
 typedef struct compiler {
   struct compiler *enclosing; // The compiler/function that surrounds this one
   ObjFunc *func;              // Current function being compiled
   FuncType type;              // Type of function currently being compiled
   Local locals[UINT8_MAX + 1];
   int localCount;
+  int localBuckets[LOCAL_BUCKETS]; // Newest local whose name hashes to each
   int scopeDepth; // Number of surrounding blocks (global = 0, etc...)
   Upvalue upvalues[UINT8_MAX + 1]; // Closure variables
+  // The upvalue already capturing each upvalue [0] or local [1] slot, if any
+  int upvalueSlots[2][UINT8_MAX + 1];
+  bool unreachable; // Control can't reach the next statement (e.g. a return)
+  int temps;        // Values above the locals while compiling an expression
+  HoistedGlobal hoisted[MAX_HOISTED]; // Of the loops being compiled
+  int hoistedCount;
 } Compiler;
 
+// A name bound by a const declaration to a value known at compile time.
+typedef struct const_decl {
+  Token name;
+  uint32_t hash; // Of the name
+  Value value;
+  Compiler *compiler; // Function declaring it, or NULL at the top level
+  int depth;          // Scope depth it is declared at
+  int localCount;     // Locals of the function declared before it
+} ConstDecl;
+
+// A position in the current chunk, which later code can be discarded back to.
+typedef struct code_mark {
+  unsigned int count;
+  unsigned int constCount;
+} CodeMark;
+
+// A top level function which -O2 can inline the calls to.
+typedef struct inline_candidate {
+  ObjString *name;
+  ObjFunc *func;
+} InlineCandidate;
+
+// Truthiness of a condition that is known at compile time.
+typedef enum const_cond {
+  COND_DYNAMIC,
+  COND_TRUE,
+  COND_FALSE,
+} ConstCond;
+
 #define MAX_FUNC_PARAMS            255
+#define MAX_INLINE_CANDIDATES      64
+#define MAX_CONST_DECLS            256
+#define CONST_EVAL_STACK           64
 
 #define IN_A_LOCAL_SCOPE(compiler) ((compiler)->scopeDepth > 0)
 #define IN_GLOBAL_SCOPE(compiler)  ((compiler)->scopeDepth == 0)
@@ -71,6 +133,22 @@ typedef enum expr_type {
 
 Parser parser;
 Compiler *currentCompiler;
+static OptLevel optLevel   = OPT_NONE;
+static int inlineLimit     = INLINE_LIMIT_DEFAULT;
+static bool lazyCompile    = false;
+static bool retainedSource = false;
+
+// The last source compiled, which lazily compiled bodies usually come from
+static const char *sourceStart;
+static const char *sourceEnd;
+
+static InlineCandidate inlineCandidates[MAX_INLINE_CANDIDATES];
+static int inlineCandidateCount;
+
+// The consts in scope, innermost last. Top level consts stay after compile()
+// returns for the function bodies it leaves to be compiled lazily.
+static ConstDecl constDecls[MAX_CONST_DECLS];
+static int constDeclCount;
 
 static void expression();
 static void declaration();
@@ -112,43 +190,241 @@ static void errorCur(const char *message) {
   errorAt(&parser.cur, message);
 }
 
-static void initCompiler(Compiler *compiler, FuncType type) {
-  compiler->enclosing  = currentCompiler;
-  compiler->func       = NULL;
-  compiler->type       = type;
-  compiler->localCount = 0;
-  compiler->scopeDepth = 0;
-  compiler->func       = newFunc(); // Re-assigned immediately for GC reasons.
+static int localBucket(uint32_t hash) {
+  return hash & (LOCAL_BUCKETS - 1);
+}
+
+// Adds a local to the end of the compiler's locals, and to its bucket
+static Local *pushLocal(Compiler *compiler, Token name) {
+  int index     = compiler->localCount++;
+  Local *local  = &compiler->locals[index];
+  uint32_t hash = hashString(name.start, name.len);
+  int *bucket   = &compiler->localBuckets[localBucket(hash)];
+
+  local->name       = name;
+  local->hash       = hash;
+  local->next       = *bucket;
+  local->depth      = LOCAL_UNINITIALIZED;
+  local->isCaptured = false;
+  local->isAssigned = false;
+  local->escapes    = false;
+  local->declaredAt = compiler->func->chunk.count;
+  *bucket           = index;
+
+  return local;
+}
+
+// Removes the last local, which is always the newest in its bucket
+static void popLocal(Compiler *compiler) {
+  Local *local = &compiler->locals[--compiler->localCount];
+  compiler->localBuckets[localBucket(local->hash)] = local->next;
+}
+
+// A string of source text, pointing into the source when it's retained.
+static ObjString *sourceString(const char *chars, int n) {
+  return retainedSource ? borrowString(chars, n) : copyString(chars, n);
+}
+
+// Compiles into a new function named by the previous token, or into the already
+// declared lazyFunc if it isn't NULL.
+static void initCompiler(Compiler *compiler, FuncType type, ObjFunc *lazyFunc) {
+  compiler->enclosing    = currentCompiler;
+  compiler->func         = NULL;
+  compiler->type         = type;
+  compiler->localCount   = 0;
+  compiler->scopeDepth   = 0;
+  compiler->unreachable  = false;
+  compiler->temps        = 0;
+  compiler->hoistedCount = 0;
+  // Re-assigned immediately for GC reasons.
+  compiler->func = lazyFunc != NULL ? lazyFunc : newFunc();
 
   currentCompiler = compiler;
 
-  if (type != TYPE_SCRIPT) {
+  if (type != TYPE_SCRIPT && lazyFunc == NULL) {
     Token name                  = parser.prev;
-    currentCompiler->func->name = copyString(name.start, name.len);
+    currentCompiler->func->name = sourceString(name.start, name.len);
+  }
+
+  for (int i = 0; i < LOCAL_BUCKETS; i++) {
+    compiler->localBuckets[i] = LOCAL_NOT_FOUND;
+  }
+
+  for (int i = 0; i <= UINT8_MAX; i++) {
+    compiler->upvalueSlots[false][i] = UPVALUE_NOT_FOUND;
+    compiler->upvalueSlots[true][i]  = UPVALUE_NOT_FOUND;
   }
 
   // The compiler implicitly claims stack slot 0 for the VM's own internal use
-  Local *local      = &currentCompiler->locals[currentCompiler->localCount++];
-  local->depth      = 0;
-  local->name.start = "";
-  local->name.len   = 0;
-  local->isCaptured = false;
+  Token name   = {.start = "", .len = 0};
+  Local *local = pushLocal(compiler, name);
+  local->depth = 0;
 }
 
 static void beginScope() {
   currentCompiler->scopeDepth++;
 }
 
+// Makes a function read its upvalue as a captured value, along with the
+// functions nested in it that capture the upvalue in turn.
+static void patchCapturedReads(ObjFunc *func, uint8_t upvalue) {
+  Chunk *chunk        = &func->chunk;
+  unsigned int offset = 0;
+
+  while (offset < chunk->count) {
+    uint8_t *code = &chunk->code[offset];
+
+    if (code[0] == OP_GET_UPVALUE && code[1] == upvalue) {
+      code[0] = OP_GET_CAPTURED;
+    } else if (code[0] == OP_CLOSURE) {
+      ObjFunc *inner = AS_FUNC(chunk->constants.values[code[1]]);
+
+      for (int i = 0; i < inner->upvalueCount; i++) {
+        uint8_t *capture = &code[2 + i * 2];
+        if (capture[0] == UPVALUE_CAPTURES_UPVALUE && capture[1] == upvalue)
+          patchCapturedReads(inner, i);
+      }
+    }
+
+    offset += instructionLen(chunk, offset);
+  }
+}
+
+/*
+ * A captured local that is never assigned holds the same value for as long as
+ * any closure can see it, so the closures can copy it rather than share it
+ * through an upvalue. Once its scope is compiled, this switches every closure
+ * capturing the local to a copy and returns true, or returns false if the local
+ * still needs an upvalue.
+ */
+static bool captureByValue(int slot) {
+  Local *local        = &currentCompiler->locals[slot];
+  Chunk *chunk        = currentChunk();
+  unsigned int offset = local->declaredAt;
+
+  while (offset < chunk->count) {
+    uint8_t *code = &chunk->code[offset];
+
+    if (code[0] == OP_CLOSURE) {
+      ObjFunc *func = AS_FUNC(chunk->constants.values[code[1]]);
+
+      for (int i = 0; i < func->upvalueCount; i++) {
+        uint8_t *capture = &code[2 + i * 2];
+        if (capture[0] != UPVALUE_CAPTURES_LOCAL || capture[1] != slot)
+          continue;
+
+        // An assigned local needs an upvalue, as does a local function's own
+        // closure, created before the local is. Either is the first closure
+        // found, so nothing has changed yet. Parameters have no code, so the
+        // closure at their offset is some other local's.
+        bool isOwnClosure = offset == local->declaredAt &&
+                            slot > currentCompiler->func->arity;
+        if (local->isAssigned || isOwnClosure)
+          return false;
+
+        capture[0] = UPVALUE_CAPTURES_VALUE;
+        patchCapturedReads(func, i);
+      }
+    }
+
+    offset += instructionLen(chunk, offset);
+  }
+
+  return true;
+}
+
+// Whether any closure in the chunk captures an upvalue of the function it is in
+static bool capturesUpvalues(Chunk *chunk) {
+  for (unsigned int offset = 0; offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    uint8_t *code = &chunk->code[offset];
+
+    if (code[0] != OP_CLOSURE && code[0] != OP_LOCAL_CLOSURE)
+      continue;
+
+    ObjFunc *func = AS_FUNC(chunk->constants.values[code[1]]);
+    for (int i = 0; i < func->upvalueCount; i++) {
+      if (code[2 + i * 2] == UPVALUE_CAPTURES_UPVALUE)
+        return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * A local function that is only ever called, and only by the function
+ * declaring it, always runs with the frame that created its closure as its
+ * caller. It can then use that frame's locals in place of upvalues, and with
+ * nothing of its own to hold, its closures are all alike and can share one.
+ * Once the local's scope is compiled, this makes its closure such a one if it
+ * can be.
+ */
+static void makeLocalClosure(int slot) {
+  Local *local        = &currentCompiler->locals[slot];
+  Chunk *chunk        = currentChunk();
+  unsigned int offset = local->declaredAt;
+
+  // Only a local function has its closure at the start of its declaration
+  if (local->escapes || slot <= currentCompiler->func->arity ||
+      offset >= chunk->count || chunk->code[offset] != OP_CLOSURE)
+    return;
+
+  uint8_t *code = &chunk->code[offset];
+  ObjFunc *func = AS_FUNC(chunk->constants.values[code[1]]);
+
+  // An upvalue of an upvalue belongs to a frame further down the stack, and
+  // closures nested inside the function can't capture what it doesn't have.
+  for (int i = 0; i < func->upvalueCount; i++) {
+    if (code[2 + i * 2] == UPVALUE_CAPTURES_UPVALUE)
+      return;
+  }
+
+  if (capturesUpvalues(&func->chunk))
+    return;
+
+  code[0] = OP_LOCAL_CLOSURE;
+
+  Chunk *body = &func->chunk;
+  for (unsigned int i = 0; i < body->count; i += instructionLen(body, i)) {
+    uint8_t *instr = &body->code[i];
+
+    switch (instr[0]) {
+      case OP_GET_UPVALUE:
+      case OP_GET_CAPTURED: instr[0] = OP_GET_PARENT; break;
+      case OP_SET_UPVALUE:  instr[0] = OP_SET_PARENT; break;
+      default:              continue;
+    }
+
+    instr[1] = code[2 + instr[1] * 2 + 1]; // The captured slot
+  }
+}
+
+// Removes the function's consts declared deeper than the depth
+static void popConsts(Compiler *compiler, int depth) {
+  while (constDeclCount > 0 &&
+         constDecls[constDeclCount - 1].compiler == compiler &&
+         constDecls[constDeclCount - 1].depth > depth) {
+    constDeclCount--;
+  }
+}
+
 static void endScope() {
   currentCompiler->scopeDepth--;
+  popConsts(currentCompiler, currentCompiler->scopeDepth);
 
   // When exiting the scope, we need to remove the variable declarations from
   // the exiting scope, as well as cleanup the initializer values on the stack.
   while (currentCompiler->localCount > 0 &&
          LAST_LOCAL(currentCompiler).depth > currentCompiler->scopeDepth) {
-    emitByte(LAST_LOCAL(currentCompiler).isCaptured ? OP_CLOSE_UPVALUE
-                                                    : OP_POP);
-    currentCompiler->localCount--;
+    int slot = currentCompiler->localCount - 1;
+    makeLocalClosure(slot);
+
+    bool needsClosing = LAST_LOCAL(currentCompiler).isCaptured &&
+                        !captureByValue(slot);
+
+    emitByte(needsClosing ? OP_CLOSE_UPVALUE : OP_POP);
+    popLocal(currentCompiler);
   }
 }
 
@@ -254,6 +530,57 @@ static void patchJump(int offset) {
   chunk->code[offset + 1] = bytesToJump & 0xFF;        // Low byte
 }
 
+static CodeMark markCode() {
+  Chunk *chunk  = currentChunk();
+  CodeMark mark = {chunk->count, chunk->constants.count};
+  return mark;
+}
+
+// Drops everything emitted since the mark. Constants added after it can only be
+// referenced by the discarded code, so they go too.
+static void discardCode(CodeMark mark) {
+  Chunk *chunk           = currentChunk();
+  chunk->count           = mark.count;
+  chunk->constants.count = mark.constCount;
+
+  // Locals declared in the discarded code now start where it did
+  for (int i = currentCompiler->localCount - 1; i >= 0; i--) {
+    Local *local = &currentCompiler->locals[i];
+    if (local->declaredAt <= mark.count)
+      break;
+    local->declaredAt = mark.count;
+  }
+}
+
+/*
+ * Checks if the expression compiled since the mark is a literal with a known
+ * truthiness. If so, the literal is discarded as the caller no longer needs to
+ * test it at runtime.
+ */
+static ConstCond constantCondition(CodeMark start) {
+  Chunk *chunk      = currentChunk();
+  unsigned int size = chunk->count - start.count;
+  ConstCond cond    = COND_DYNAMIC;
+
+  if (size == 0) // Nothing compiled, e.g. after a syntax error
+    return cond;
+
+  uint8_t op = chunk->code[start.count];
+
+  if (size == 1 && op == OP_TRUE) {
+    cond = COND_TRUE;
+  } else if (size == 1 && (op == OP_FALSE || op == OP_NIL)) {
+    cond = COND_FALSE;
+  } else if (size == 2 && op == OP_CONSTANT) {
+    cond = COND_TRUE; // Numbers and strings are always truthy
+  }
+
+  if (cond != COND_DYNAMIC)
+    discardCode(start);
+
+  return cond;
+}
+
 static unsigned int makeConstant(Value constant) {
   unsigned int constantIndex = appendConstant(currentChunk(), constant);
 
@@ -270,8 +597,19 @@ static void emitConstant(Value constant) {
   emitBytes(OP_CONSTANT, makeConstant(constant));
 }
 
+// Emits the code that pushes a value known at compile time.
+static void emitValue(Value value) {
+  if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else {
+    emitConstant(value);
+  }
+}
+
 static uint8_t identifierConstant(Token *name) {
-  ObjString *identifier = copyString(name->start, name->len);
+  ObjString *identifier = sourceString(name->start, name->len);
   return makeConstant(OBJ_VAL(identifier));
 }
 
@@ -280,26 +618,50 @@ static bool identifiersEqual(Token *a, Token *b) {
 }
 
 /*
- * Walk backwards of the compilers locals array to find the LAST declared
- * variable with the given name - then variable shadowing behaves correctly.
+ * Walks the chain of the name's bucket, newest first, to find the LAST
+ * declared local with the given name - then variable shadowing behaves
+ * correctly. Returns its index in the compiler's locals array, otherwise
+ * `LOCAL_NOT_FOUND`.
+ */
+static int findLocal(Compiler *compiler, Token *name) {
+  uint32_t hash = hashString(name->start, name->len);
+  int i         = compiler->localBuckets[localBucket(hash)];
+
+  while (i != LOCAL_NOT_FOUND) {
+    Local *local = &compiler->locals[i];
+    if (local->hash == hash && identifiersEqual(name, &local->name))
+      return i;
+    i = local->next;
+  }
+
+  return LOCAL_NOT_FOUND;
+}
+
+/*
  * Returns the index of the resolved local from the compilers locals array,
  * otherwise -1 (macro `LOCAL_NOT_FOUND`). The resolved index corresponds with
  * the VM's stack slot index layout.
  */
 static int resolveLocalVar(Compiler *compiler, Token *name) {
-  for (int i = compiler->localCount - 1; i >= 0; i--) {
-    Local *local = &compiler->locals[i];
-
-    if (identifiersEqual(name, &local->name)) {
-      if (local->depth == LOCAL_UNINITIALIZED) {
-        errorPrev("can't read local variable in its own initializer");
-      }
+  int i = findLocal(compiler, name);
 
-      return i;
-    }
+  if (i != LOCAL_NOT_FOUND &&
+      compiler->locals[i].depth == LOCAL_UNINITIALIZED) {
+    errorPrev("can't read local variable in its own initializer");
   }
 
-  return LOCAL_NOT_FOUND;
+  return i;
+}
+
+// Records that the variable an upvalue refers to is assigned through it.
+static void markUpvalueAssigned(Compiler *compiler, int index) {
+  Upvalue *upvalue = &compiler->upvalues[index];
+
+  if (upvalue->isLocal) {
+    compiler->enclosing->locals[upvalue->index].isAssigned = true;
+  } else {
+    markUpvalueAssigned(compiler->enclosing, upvalue->index);
+  }
 }
 
 static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
@@ -307,11 +669,9 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
 
   // Before adding a new upvalue, see if the function already has an upvalue
   // that closes over that variable to save duplication of upvalue creations.
-  for (int i = 0; i < upvalueCount; i++) {
-    Upvalue *upvalue = &compiler->upvalues[i];
-    if (upvalue->index == index && upvalue->isLocal == isLocal)
-      return i;
-  }
+  int *slot = &compiler->upvalueSlots[isLocal][index];
+  if (*slot != UPVALUE_NOT_FOUND)
+    return *slot;
 
   if (upvalueCount >= UINT8_MAX + 1) {
     errorPrev("exceeded max of 255 closure variables in function");
@@ -320,6 +680,7 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
 
   compiler->upvalues[upvalueCount].index   = index;
   compiler->upvalues[upvalueCount].isLocal = isLocal;
+  *slot                                    = upvalueCount;
 
   return compiler->func->upvalueCount++;
 }
@@ -340,6 +701,7 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
   int localIndex = resolveLocalVar(compiler->enclosing, name);
   if (localIndex != LOCAL_NOT_FOUND) {
     compiler->enclosing->locals[localIndex].isCaptured = true;
+    compiler->enclosing->locals[localIndex].escapes    = true;
     return addUpvalue(compiler, localIndex, true);
   }
 
@@ -347,45 +709,124 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
   // This works it way up the chain of functions until a base case is hit.
   int upvalueIndex = resolveUpvalue(compiler->enclosing, name);
   if (upvalueIndex != UPVALUE_NOT_FOUND)
-    return addUpvalue(compiler, localIndex, false);
+    return addUpvalue(compiler, upvalueIndex, false);
 
   return UPVALUE_NOT_FOUND;
 }
 
+// Finds the innermost const with the name, wherever it is declared.
+static ConstDecl *findConst(Token *name) {
+  if (constDeclCount == 0)
+    return NULL;
+
+  uint32_t hash = hashString(name->start, name->len);
+
+  for (int i = constDeclCount - 1; i >= 0; i--) {
+    ConstDecl *decl = &constDecls[i];
+    if (decl->hash == hash && identifiersEqual(name, &decl->name))
+      return decl;
+  }
+
+  return NULL;
+}
+
+/*
+ * Returns the const the name refers to, or NULL if it is a variable. Locals
+ * declared after the const shadow it, and a top level const is not seen by a
+ * function body before it, even when that body is compiled lazily after it.
+ */
+static ConstDecl *resolveConst(Token *name) {
+  ConstDecl *decl = findConst(name);
+
+  if (decl == NULL ||
+      (decl->compiler == NULL && name->start < decl->name.start))
+    return NULL;
+
+  Compiler *compiler = currentCompiler;
+  for (; compiler != decl->compiler; compiler = compiler->enclosing) {
+    if (findLocal(compiler, name) != LOCAL_NOT_FOUND)
+      return NULL;
+  }
+
+  if (compiler != NULL && findLocal(compiler, name) >= decl->localCount)
+    return NULL;
+
+  return decl;
+}
+
+// Returns whether a const with the name is declared in the current scope.
+static bool constInScope(Token *name) {
+  ConstDecl *decl = findConst(name);
+
+  if (decl == NULL)
+    return false;
+
+  if (IN_GLOBAL_SCOPE(currentCompiler))
+    return decl->compiler == NULL;
+
+  return decl->compiler == currentCompiler &&
+         decl->depth == currentCompiler->scopeDepth;
+}
+
+// Returns whether a local with the name is declared in the current scope. Only
+// the newest local with the name can be in it, as a redeclaration is an error.
+static bool localInScope(Token *name) {
+  int i = findLocal(currentCompiler, name);
+
+  if (i == LOCAL_NOT_FOUND)
+    return false;
+
+  Local *local = &currentCompiler->locals[i];
+  return local->depth == LOCAL_UNINITIALIZED ||
+         local->depth >= currentCompiler->scopeDepth;
+}
+
+// Finds the hidden local a loop being compiled holds the global in, if any.
+static HoistedGlobal *findHoisted(Compiler *compiler, Token *name) {
+  for (int i = compiler->hoistedCount - 1; i >= 0; i--) {
+    if (identifiersEqual(name, &compiler->hoisted[i].name))
+      return &compiler->hoisted[i];
+  }
+
+  return NULL;
+}
+
+// Returns whether the name is read as a global, and isn't yet hoisted.
+static bool isUnhoistedGlobal(Token *name) {
+  if (resolveConst(name) != NULL || findHoisted(currentCompiler, name) != NULL)
+    return false;
+
+  for (Compiler *compiler = currentCompiler; compiler != NULL;
+       compiler = compiler->enclosing) {
+    if (findLocal(compiler, name) != LOCAL_NOT_FOUND)
+      return false;
+  }
+
+  return true;
+}
+
 static void addLocalVar(Token name) {
   if (currentCompiler->localCount >= UINT8_MAX + 1) {
     errorPrev("exceeded max of 256 local variables in function");
     return;
   }
 
-  Local *local      = &currentCompiler->locals[currentCompiler->localCount++];
-  local->name       = name;
-  local->depth      = LOCAL_UNINITIALIZED;
-  local->isCaptured = false;
+  pushLocal(currentCompiler, name);
 }
 
 static void declareVariable() {
+  Token *name = &parser.prev;
+
+  if (constInScope(name))
+    errorPrev("constant with this name already declared in this scope");
+
   // Global vars are late bound, so the compiler doesn't keep track of them.
   if (IN_GLOBAL_SCOPE(currentCompiler))
     return;
 
-  Token *name = &parser.prev;
-
-  // Check variable name is not redeclared in the same scope
-  // Work backwards from the compilers locals to work from inner scope outwards
-  for (int i = currentCompiler->localCount - 1; i >= 0; i--) {
-    Local *local = &currentCompiler->locals[i];
-
-    // Exit the loop early if we have checked all the locals in the compiler's
-    // current scope depth.
-    if (local->depth != LOCAL_UNINITIALIZED &&
-        local->depth < currentCompiler->scopeDepth)
-      break;
-
-    if (identifiersEqual(name, &local->name)) {
-      errorPrev("variable with this name already declared in this scope");
-    }
-  }
+  // Check variable name is not redeclared in the same scope.
+  if (localInScope(name))
+    errorPrev("variable with this name already declared in this scope");
 
   addLocalVar(*name);
 }
@@ -416,7 +857,22 @@ static void emitReturn() {
 }
 
 static ObjFunc *endCompiler() {
-  emitReturn();
+  // No implicit return needed if every path has already returned
+  if (!currentCompiler->unreachable)
+    emitReturn();
+
+  // The parameters are left to OP_RETURN rather than ended by a scope
+  for (int slot = 1; slot < currentCompiler->localCount; slot++) {
+    if (currentCompiler->locals[slot].isCaptured)
+      captureByValue(slot);
+  }
+
+  popConsts(currentCompiler, -1);
+
+  threadJumps(currentChunk());
+  optimizeChunk(currentChunk(), optLevel);
+  finalizeChunk(currentChunk());
+
   ObjFunc *compiledFunc = currentCompiler->func; // Contains the bytecode
   currentCompiler       = currentCompiler->enclosing;
   return compiledFunc;
@@ -433,6 +889,7 @@ static void synchronize() {
     switch (parser.cur.type) {
       case TOK_IF:
       case TOK_VAR:
+      case TOK_CONST:
       case TOK_PRINT: return;
       default:        advance();
     }
@@ -449,7 +906,7 @@ static void string() {
   const char *chars = parser.prev.start + 1;
   int n             = parser.prev.len - 2;
 
-  ObjString *str = copyString(chars, n);
+  ObjString *str = sourceString(chars, n);
   emitConstant(OBJ_VAL(str));
 }
 
@@ -465,9 +922,19 @@ static void variable() {
 
   Token *name = &parser.prev;
 
+  ConstDecl *decl = resolveConst(name);
+  if (decl != NULL) {
+    emitValue(decl->value);
+    return;
+  }
+
   int localIndex = resolveLocalVar(currentCompiler, name);
 
   if (localIndex != LOCAL_NOT_FOUND) {
+    // Calling a local's value can't let it outlive the frame, reading it can
+    if (!check(TOK_LEFT_PAREN))
+      currentCompiler->locals[localIndex].escapes = true;
+
     emitBytes(OP_GET_LOCAL, localIndex);
     return;
   }
@@ -479,6 +946,13 @@ static void variable() {
     return;
   }
 
+  HoistedGlobal *hoisted = findHoisted(currentCompiler, name);
+
+  if (hoisted != NULL) {
+    emitBytes(OP_GET_HOISTED, hoisted->slot);
+    return;
+  }
+
   emitBytes(OP_GET_GLOBAL, identifierConstant(name));
 }
 
@@ -537,6 +1011,7 @@ static uint8_t args() {
     expression(); // Each arg leaves value on the stack in prep for OP_CALL
 
     argCount++;
+    currentCompiler->temps++;
   } while (match(TOK_COMMA));
 
   consume(TOK_RIGHT_PAREN, "expect ')' after arguments");
@@ -544,12 +1019,138 @@ static uint8_t args() {
   return argCount;
 }
 
+// Returns the stack slot that the expression being compiled is pushed to.
+static int expressionSlot() {
+  int slot = currentCompiler->localCount + currentCompiler->temps;
+
+  // A local's initializer is compiled into the slot of the local itself
+  if (LAST_LOCAL(currentCompiler).depth == LOCAL_UNINITIALIZED)
+    slot--;
+
+  return slot;
+}
+
+// Returns the inline candidate the callee that was just compiled is read from,
+// or NULL if it isn't read straight from a candidate's global.
+static InlineCandidate *calleeCandidate(ExprType calleeType) {
+  Chunk *chunk = currentChunk();
+
+  if (optLevel < OPT_FULL || calleeType != EXPR_VAR || chunk->count < 2 ||
+      chunk->code[chunk->count - 2] != OP_GET_GLOBAL)
+    return NULL;
+
+  Value name = chunk->constants.values[chunk->code[chunk->count - 1]];
+
+  for (int i = 0; i < inlineCandidateCount; i++) {
+    if (inlineCandidates[i].name == AS_STRING(name))
+      return &inlineCandidates[i];
+  }
+
+  return NULL;
+}
+
+// Returns the index of the native the callee that was just compiled is read
+// from the global of, or -1.
+static int calleeNative(ExprType calleeType, Token *callee) {
+  Chunk *chunk = currentChunk();
+
+  if (calleeType != EXPR_VAR || chunk->count < 2)
+    return -1;
+
+  OpCode op = chunk->code[chunk->count - 2];
+  if (op != OP_GET_GLOBAL && op != OP_GET_HOISTED)
+    return -1;
+
+  return findNative(callee->start, callee->len);
+}
+
+// A call to a native with as many arguments as it takes is made directly while
+// the callee is still the native, see OP_CALL_NATIVE.
+static void emitCall(int native, uint8_t argCount) {
+  if (native != -1 && nativeDefs[native].arity == argCount) {
+    emitBytes(OP_CALL_NATIVE, native);
+  } else {
+    emitBytes(OP_CALL, argCount);
+  }
+}
+
+/*
+ * Emits the body of the candidate in place of a call to it, with the callee and
+ * arguments on the stack from the callee slot up. The callee is checked to
+ * still be the candidate's function, otherwise the call is made as usual:
+ *
+ *   IS_FUNC func, JUMP_IF_TRUE body, POP, CALL n, JUMP end,
+ *   body: <body>, SLIDE n + 2,
+ *   end:
+ *
+ * Returns false without emitting anything if the call can't be inlined.
+ */
+static bool inlineCall(InlineCandidate *candidate, int calleeSlot,
+                       uint8_t argCount) {
+  ObjFunc *func = candidate->func;
+  Chunk *body   = &func->chunk;
+
+  // The body's constants are copied into this chunk's pool, plus the function
+  unsigned int constCount = currentChunk()->constants.count +
+                            body->constants.count + 1;
+
+  if (argCount != func->arity || argCount + 2 > UINT8_MAX ||
+      calleeSlot + argCount > UINT8_MAX || constCount > UINT8_MAX + 1)
+    return false;
+
+  emitBytes(OP_IS_FUNC, makeConstant(OBJ_VAL(func)));
+  int bodyOperandOffset = emitJump(OP_JUMP_IF_TRUE);
+
+  emitByte(OP_POP);
+  emitBytes(OP_CALL, argCount);
+  int endOperandOffset = emitJump(OP_JUMP);
+
+  patchJump(bodyOperandOffset);
+
+  // The body ends with its only return, which leaves the result on top
+  unsigned int offset = 0;
+  while (offset < body->count - 1) {
+    OpCode op       = body->code[offset];
+    uint8_t operand = body->code[offset + 1];
+
+    switch (op) {
+      case OP_GET_LOCAL: emitBytes(op, calleeSlot + operand); break;
+      case OP_CONSTANT:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        emitBytes(op, makeConstant(body->constants.values[operand]));
+        break;
+      case OP_CALL:
+      case OP_CALL_NATIVE: emitBytes(op, operand); break;
+      default:             emitByte(op); break;
+    }
+
+    offset += instructionLen(body, offset);
+  }
+
+  // Like a return, the result replaces the callee and the arguments, along with
+  // the guard's condition
+  emitBytes(OP_SLIDE, argCount + 2);
+
+  patchJump(endOperandOffset);
+  return true;
+}
+
 static ExprType call() {
   ExprType exprType = primary();
+  Token callee      = parser.prev;
 
   if (match(TOK_LEFT_PAREN)) {
+    InlineCandidate *candidate = calleeCandidate(exprType);
+    int native                 = calleeNative(exprType, &callee);
+    int calleeSlot             = expressionSlot();
+
+    currentCompiler->temps++; // The callee
     uint8_t argCount = args();
-    emitBytes(OP_CALL, argCount);
+    currentCompiler->temps -= argCount + 1;
+
+    if (candidate == NULL || !inlineCall(candidate, calleeSlot, argCount))
+      emitCall(native, argCount);
   }
 
   return exprType;
@@ -578,7 +1179,9 @@ static ExprType factor() {
   while (match(TOK_STAR) || match(TOK_SLASH)) {
     TokType type = parser.prev.type;
 
+    currentCompiler->temps++; // The left operand
     unary();
+    currentCompiler->temps--;
 
     switch (type) {
       case TOK_STAR:  emitByte(OP_MULTIPLY); break;
@@ -598,7 +1201,9 @@ static ExprType term() {
   while (match(TOK_PLUS) || match(TOK_MINUS)) {
     TokType type = parser.prev.type;
 
+    currentCompiler->temps++; // The left operand
     factor();
+    currentCompiler->temps--;
 
     switch (type) {
       case TOK_PLUS:  emitByte(OP_ADD); break;
@@ -619,7 +1224,9 @@ static ExprType comparison() {
          match(TOK_GREATER_EQ)) {
     TokType type = parser.prev.type;
 
+    currentCompiler->temps++; // The left operand
     term();
+    currentCompiler->temps--;
 
     switch (type) {
       case TOK_LESS:       emitByte(OP_LESS); break;
@@ -641,7 +1248,9 @@ static ExprType equality() {
   while (match(TOK_EQ_EQ) || match(TOK_BANG_EQ)) {
     TokType type = parser.prev.type;
 
+    currentCompiler->temps++; // The left operand
     comparison();
+    currentCompiler->temps--;
 
     switch (type) {
       case TOK_EQ_EQ:   emitByte(OP_EQ); break;
@@ -683,13 +1292,40 @@ static ExprType logicalOr() {
   return exprType;
 }
 
+static ExprType conditional();
+
+// Compiles the branches of a conditional with a literal condition, only keeping
+// the code for the branch that is taken.
+static void constantConditional(ConstCond cond) {
+  CodeMark thenStart = markCode();
+  expression();
+
+  if (cond == COND_FALSE)
+    discardCode(thenStart);
+
+  consume(TOK_COLON, "expect ':' after then branch of conditional");
+
+  CodeMark elseStart = markCode();
+  conditional();
+
+  if (cond == COND_TRUE)
+    discardCode(elseStart);
+}
+
 static ExprType conditional() {
   // This statement will compile the condition already if parsing conditional.
-  ExprType exprType = logicalOr();
+  CodeMark condStart = markCode();
+  ExprType exprType  = logicalOr();
 
   if (match(TOK_QUESTION)) {
     exprType = EXPR_TERNARY;
 
+    ConstCond cond = constantCondition(condStart);
+    if (cond != COND_DYNAMIC) {
+      constantConditional(cond);
+      return exprType;
+    }
+
     // Then branch - jump over condition if false. Also emit a jump at the end
     // of the then branch to jump over the else branch if condition is true.
     int jumpToElseOperandOffset = emitJump(OP_JUMP_IF_FALSE);
@@ -719,14 +1355,19 @@ static void assignment() {
 
     switch (exprType) {
       case EXPR_VAR: {
+        if (resolveConst(&name) != NULL)
+          errorAt(&name, "can't assign to a constant");
+
         assignment();
 
         int arg = resolveLocalVar(currentCompiler, &name);
 
         if (arg != LOCAL_NOT_FOUND) {
+          currentCompiler->locals[arg].isAssigned = true;
           emitBytes(OP_SET_LOCAL, arg);
         } else if ((arg = resolveUpvalue(currentCompiler, &name)) !=
                    UPVALUE_NOT_FOUND) {
+          markUpvalueAssigned(currentCompiler, arg);
           emitBytes(OP_SET_UPVALUE, arg);
         } else {
           emitBytes(OP_SET_GLOBAL, identifierConstant(&name));
@@ -752,7 +1393,12 @@ static void blockStmt() {
 
   consume(TOK_RIGHT_BRACE, "expect '}' at end of block");
 
+  // Returning already discards the locals, so popping them is dead code
+  CodeMark scopeEnd = markCode();
   endScope();
+
+  if (currentCompiler->unreachable)
+    discardCode(scopeEnd);
 }
 
 static void exprStmt() {
@@ -761,12 +1407,50 @@ static void exprStmt() {
   emitByte(OP_POP);
 }
 
+// Compiles a statement that can never run, so it is only checked for errors.
+static void deadStatement() {
+  CodeMark start   = markCode();
+  bool unreachable = currentCompiler->unreachable;
+
+  statement();
+
+  discardCode(start);
+  currentCompiler->unreachable = unreachable;
+}
+
+// With a literal condition only the branch that is taken is kept, and there is
+// no condition to test or pop.
+static void constantIfStmt(ConstCond cond) {
+  if (cond == COND_TRUE) {
+    statement();
+  } else {
+    deadStatement();
+  }
+
+  if (match(TOK_ELSE)) {
+    if (cond == COND_FALSE) {
+      statement();
+    } else {
+      deadStatement();
+    }
+  }
+}
+
 static void ifStmt() {
   // Compile the condition and leave it on the stack
   consume(TOK_LEFT_PAREN, "expect '(' after 'if'");
+  CodeMark condStart = markCode();
   expression();
   consume(TOK_RIGHT_PAREN, "expect ')' after 'if'");
 
+  ConstCond cond = constantCondition(condStart);
+  if (cond != COND_DYNAMIC) {
+    constantIfStmt(cond);
+    return;
+  }
+
+  bool unreachable = currentCompiler->unreachable;
+
   // Emit a OP_JUMP_IF_FALSE to jump past the true condition branch
   int ifFalseOperandOffset = emitJump(OP_JUMP_IF_FALSE);
 
@@ -776,19 +1460,27 @@ static void ifStmt() {
   statement();
 
   // At the end of the 'then' statement, emit a OP_JUMP to jump over the 'else'.
-  int endThenOperandOffset = emitJump(OP_JUMP);
+  // Not needed if the 'then' statement always returns.
+  bool thenReturns         = currentCompiler->unreachable;
+  int endThenOperandOffset = thenReturns ? -1 : emitJump(OP_JUMP);
 
   // Else branch - OP_JUMP_IF_FALSE jumps here.
   // Pop the condition and compile the 'else' statement (if any).
   patchJump(ifFalseOperandOffset);
   emitByte(OP_POP);
 
+  currentCompiler->unreachable = unreachable;
+
   if (match(TOK_ELSE)) {
     statement();
   }
 
+  // Only unreachable after the 'if' when both branches return
+  currentCompiler->unreachable = currentCompiler->unreachable && thenReturns;
+
   // Patch the end of the 'then' statement OP_JUMP to skip the 'else' branch.
-  patchJump(endThenOperandOffset);
+  if (!thenReturns)
+    patchJump(endThenOperandOffset);
 }
 
 static void printStmt() {
@@ -797,25 +1489,176 @@ static void printStmt() {
   emitByte(OP_PRINT);
 }
 
+static bool containsName(Token *names, int count, Token *name) {
+  for (int i = 0; i < count; i++) {
+    if (identifiersEqual(&names[i], name))
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Scans ahead over the header and block body of the loop about to be compiled
+ * for the globals it reads, and never assigns. A call could assign any global,
+ * so a loop with one (or a function declaration, which looks the same) has
+ * none. Returns how many were found, up to max.
+ */
+static int loopInvariantGlobals(Token *names, int max) {
+  Scanner scanner = *parser.scanner;
+  Token prev      = parser.prev;
+  Token tok       = parser.cur;
+  Token assigned[MAX_LOOP_ASSIGNS];
+  int assignedCount = 0;
+  int count         = 0;
+  int depth         = 0;
+  bool inBody       = false;
+
+  if (tok.type != TOK_LEFT_PAREN)
+    return 0;
+
+  while (true) {
+    Token next = scanNext(&scanner);
+
+    switch (tok.type) {
+      case TOK_EOF:
+      case TOK_ERR:        return 0;
+      case TOK_LEFT_PAREN: {
+        if (prev.type == TOK_IDENTIFIER || prev.type == TOK_RIGHT_PAREN)
+          return 0;
+        depth++;
+        break;
+      }
+      case TOK_LEFT_BRACE:  depth++; break;
+      case TOK_RIGHT_PAREN:
+      case TOK_RIGHT_BRACE: depth--; break;
+      case TOK_IDENTIFIER:  {
+        if (next.type == TOK_EQ) {
+          if (assignedCount == MAX_LOOP_ASSIGNS)
+            return 0;
+          assigned[assignedCount++] = tok;
+        } else if (count < max && !containsName(names, count, &tok) &&
+                   isUnhoistedGlobal(&tok)) {
+          names[count++] = tok;
+        }
+        break;
+      }
+      default: break;
+    }
+
+    // The header ends at its closing ')', and the body at its closing '}'
+    if (depth == 0) {
+      if (inBody)
+        break;
+      if (next.type != TOK_LEFT_BRACE)
+        return 0;
+      inBody = true;
+    }
+
+    prev = tok;
+    tok  = next;
+  }
+
+  int kept = 0;
+  for (int i = 0; i < count; i++) {
+    if (!containsName(assigned, assignedCount, &names[i]))
+      names[kept++] = names[i];
+  }
+
+  return kept;
+}
+
+/*
+ * At -O2, declares the hidden locals for the globals the loop about to be
+ * compiled can read once rather than on every iteration. They go in a scope of
+ * their own around the loop. Returns how many globals were hoisted, which the
+ * caller passes on to endHoist() after the loop.
+ */
+static int hoistLoopGlobals() {
+  Compiler *compiler = currentCompiler;
+
+  if (optLevel < OPT_FULL)
+    return 0;
+
+  int room  = MAX_HOISTED - compiler->hoistedCount;
+  int slots = (UINT8_MAX + 1 - compiler->localCount) / 2;
+  Token names[MAX_HOISTED];
+  int count = loopInvariantGlobals(names, room < slots ? room : slots);
+
+  if (count == 0)
+    return 0;
+
+  beginScope();
+
+  Token hidden = {.start = "", .len = 0};
+
+  for (int i = 0; i < count; i++) {
+    pushLocal(compiler, hidden)->depth = compiler->scopeDepth;
+    emitBytes(OP_CONSTANT, identifierConstant(&names[i]));
+    pushLocal(compiler, hidden)->depth = compiler->scopeDepth;
+    emitByte(OP_NIL);
+
+    HoistedGlobal *hoisted = &compiler->hoisted[compiler->hoistedCount++];
+    hoisted->name          = names[i];
+    hoisted->slot          = compiler->localCount - 1;
+  }
+
+  return count;
+}
+
+static void endHoist(int count) {
+  if (count == 0)
+    return;
+
+  currentCompiler->hoistedCount -= count;
+
+  // Returning already discards the locals, so popping them is dead code
+  CodeMark scopeEnd = markCode();
+  endScope();
+
+  if (currentCompiler->unreachable)
+    discardCode(scopeEnd);
+}
+
 static void whileStmt() {
   unsigned int conditionOffset = currentChunk()->count;
 
   // Condition
   consume(TOK_LEFT_PAREN, "expect '(' after 'while'");
+  CodeMark condStart = markCode();
   expression();
   consume(TOK_RIGHT_PAREN, "expect ')' after condition");
 
-  int exitLoopOperandOffset = emitJump(OP_JUMP_IF_FALSE);
+  ConstCond cond = constantCondition(condStart);
+  if (cond == COND_FALSE) {
+    deadStatement();
+    return;
+  }
+
+  bool unreachable = currentCompiler->unreachable;
+
+  // A loop that is always entered has no exit to test for
+  int exitLoopOperandOffset =
+      cond == COND_TRUE ? -1 : emitJump(OP_JUMP_IF_FALSE);
 
   // While statement body - pop the condition, compile body and emit the loop
   // bytecode to jump back to before the condition expression.
-  emitByte(OP_POP);
+  if (cond == COND_DYNAMIC)
+    emitByte(OP_POP);
+
   statement();
-  emitLoop(conditionOffset);
+
+  // A body that always returns never loops back around
+  if (!currentCompiler->unreachable)
+    emitLoop(conditionOffset);
+
+  currentCompiler->unreachable = unreachable;
 
   // Backpatch the exit loop jump, and pop the condition a final time
-  patchJump(exitLoopOperandOffset);
-  emitByte(OP_POP);
+  if (cond == COND_DYNAMIC) {
+    patchJump(exitLoopOperandOffset);
+    emitByte(OP_POP);
+  }
 }
 
 static void forStmt() {
@@ -837,14 +1680,25 @@ static void forStmt() {
   unsigned int loopStartOffset = currentChunk()->count;
   int exitLoopOperandOffset    = NO_EXIT_LOOP_OFFSET;
 
+  ConstCond cond = COND_TRUE; // No condition loops forever
+
   if (!match(TOK_SEMICOLON)) {
+    CodeMark condStart = markCode();
     expression();
     consume(TOK_SEMICOLON, "expect ';' after 'for' loop condition");
 
+    cond = constantCondition(condStart);
+  }
+
+  if (cond == COND_DYNAMIC) {
     exitLoopOperandOffset = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP); // pop loop condition off stack when it is true
   }
 
+  // When the loop is never entered, only the initializer is kept
+  CodeMark loopStart = markCode();
+  bool unreachable   = currentCompiler->unreachable;
+
   // Increment
   if (!match(TOK_RIGHT_PAREN)) {
     int incrementOperandOffset        = emitJump(OP_JUMP);
@@ -865,7 +1719,15 @@ static void forStmt() {
   // Body - after compilation, jumps to start of increment. If there is no
   // increment jump goes back to the start of the loop at the condition.
   statement();
-  emitLoop(loopStartOffset);
+
+  // A body that always returns never loops back around
+  if (!currentCompiler->unreachable)
+    emitLoop(loopStartOffset);
+
+  currentCompiler->unreachable = unreachable;
+
+  if (cond == COND_FALSE)
+    discardCode(loopStart);
 
   // Patch the condition jump (if there was a condition)
   if (exitLoopOperandOffset != NO_EXIT_LOOP_OFFSET) {
@@ -885,12 +1747,13 @@ static void returnStmt() {
 
   if (match(TOK_SEMICOLON)) {
     emitReturn();
-    return;
+  } else {
+    expression();
+    consume(TOK_SEMICOLON, "expect ';' after return value");
+    emitByte(OP_RETURN);
   }
 
-  expression();
-  consume(TOK_SEMICOLON, "expect ';' after return value");
-  emitByte(OP_RETURN);
+  currentCompiler->unreachable = true;
 }
 
 static void statement() {
@@ -910,12 +1773,16 @@ static void statement() {
   }
 
   if (match(TOK_WHILE)) {
+    int hoisted = hoistLoopGlobals();
     whileStmt();
+    endHoist(hoisted);
     return;
   }
 
   if (match(TOK_FOR)) {
+    int hoisted = hoistLoopGlobals();
     forStmt();
+    endHoist(hoisted);
     return;
   }
 
@@ -927,18 +1794,11 @@ static void statement() {
   exprStmt();
 }
 
-static void func(FuncType type) {
-  // Create a separate `Compiler` for each function compiled. Then, as the body
-  // is compiled all the emitted bytecode goes to the Compiler owned function.
-  Compiler compiler;
-  initCompiler(&compiler, type);
-
-  beginScope();
-
+// Parses the parameter list - semantically these are local variables declared
+// in the outermost lexical scope of the function body.
+static void params() {
   consume(TOK_LEFT_PAREN, "expect '(' after function name");
 
-  // Parameters - semantically these are local variables declared in the
-  // outermost lexical scope of the function body.
   if (!check(TOK_RIGHT_PAREN)) {
     do {
       if (currentCompiler->func->arity >= MAX_FUNC_PARAMS) {
@@ -954,9 +1814,61 @@ static void func(FuncType type) {
 
   consume(TOK_RIGHT_PAREN, "expect ')' after function parameters");
   consume(TOK_LEFT_BRACE, "expect '{' at start of function body");
-  blockStmt();
+}
+
+/*
+ * Top level functions can only refer to globals and their own variables, so
+ * their bodies can be left until they are first called. Not at -O2 though,
+ * where calls to them may be inlined. The source must outlive them.
+ */
+static bool compilesLazily(Compiler *compiler) {
+  Compiler *enclosing = compiler->enclosing;
+
+  return lazyCompile && !(optLevel == OPT_FULL && inlineLimit > 0) &&
+         enclosing->type == TYPE_SCRIPT && IN_GLOBAL_SCOPE(enclosing);
+}
+
+// Skips over the rest of a block by matching braces. Errors other than the
+// scanner's are only found once it is compiled.
+static void skipBlock() {
+  int depth = 1;
+
+  while (!check(TOK_EOF)) {
+    if (check(TOK_LEFT_BRACE)) {
+      depth++;
+    } else if (check(TOK_RIGHT_BRACE) && --depth == 0) {
+      break;
+    }
+
+    advance();
+  }
+
+  consume(TOK_RIGHT_BRACE, "expect '}' at end of block");
+}
+
+static ObjFunc *func(FuncType type) {
+  // Create a separate `Compiler` for each function compiled. Then, as the body
+  // is compiled all the emitted bytecode goes to the Compiler owned function.
+  Compiler compiler;
+  initCompiler(&compiler, type, NULL);
+
+  Token start = parser.cur;
+
+  beginScope();
+  params();
+
+  ObjFunc *func;
+
+  if (compilesLazily(&compiler)) {
+    skipBlock();
+    func            = compiler.func;
+    func->lazyStart = start;
+    currentCompiler = compiler.enclosing;
+  } else {
+    blockStmt();
+    func = endCompiler();
+  }
 
-  ObjFunc *func = endCompiler();
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(func)));
 
   // For each upvalue the closure captures, there are two single byte operands.
@@ -973,13 +1885,105 @@ static void func(FuncType type) {
 
   // There is no need for a corresponding endScope call to the beginScope call
   // as the compiler is ended when reaching the function body end.
+  return func;
+}
+
+/*
+ * Whether calls to the function can be replaced with its body: it is small,
+ * closes over nothing, and is straight-line code ending in its only return with
+ * nothing but its arguments below the result. It mustn't use its own global
+ * either, so it is never recursive.
+ */
+static bool isInlinable(ObjFunc *func, ObjString *name) {
+  Chunk *chunk = &func->chunk;
+
+  if (func->upvalueCount > 0 || chunk->count > (unsigned int)inlineLimit)
+    return false;
+
+  int depth           = func->arity + 1; // Values on the stack
+  unsigned int offset = 0;
+
+  while (offset < chunk->count) {
+    unsigned int len = instructionLen(chunk, offset);
+    OpCode op        = chunk->code[offset];
+    uint8_t operand  = len > 1 ? chunk->code[offset + 1] : 0;
+    offset += len;
+
+    switch (op) {
+      case OP_RETURN:
+        return offset == chunk->count && depth == func->arity + 2;
+      case OP_GET_LOCAL:
+        if (operand == 0 || operand > func->arity)
+          return false;
+        depth++;
+        break;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        if (AS_STRING(chunk->constants.values[operand]) == name)
+          return false;
+        depth += op == OP_GET_GLOBAL;
+        break;
+      case OP_FALSE:
+      case OP_TRUE:
+      case OP_NIL:
+      case OP_CONSTANT:    depth++; break;
+      case OP_NOT:
+      case OP_NEGATE:      break;
+      case OP_CALL:        depth -= operand; break;
+      case OP_CALL_NATIVE: depth -= nativeDefs[operand].arity; break;
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_EQ:
+      case OP_NOT_EQ:
+      case OP_LESS:
+      case OP_LESS_EQ:
+      case OP_GREATER_EQ:
+      case OP_GREATER:
+      case OP_POP:
+      case OP_PRINT: depth--; break;
+      default:       return false;
+    }
+  }
+
+  return false;
+}
+
+// Records a top level function declaration for inlining. A redeclaration of the
+// name replaces an earlier candidate, or removes it if it can't be inlined.
+static void recordInlineCandidate(uint8_t nameIndex, ObjFunc *func) {
+  ObjString *name = AS_STRING(currentChunk()->constants.values[nameIndex]);
+  bool inlinable  = isInlinable(func, name);
+
+  for (int i = 0; i < inlineCandidateCount; i++) {
+    if (inlineCandidates[i].name != name)
+      continue;
+
+    if (inlinable) {
+      inlineCandidates[i].func = func;
+    } else {
+      inlineCandidates[i] = inlineCandidates[--inlineCandidateCount];
+    }
+
+    return;
+  }
+
+  if (inlinable && inlineCandidateCount < MAX_INLINE_CANDIDATES) {
+    InlineCandidate candidate                = {name, func};
+    inlineCandidates[inlineCandidateCount++] = candidate;
+  }
 }
 
 // Functions are first-class values, so a declaration stores it as a variable.
 static void funcDecl() {
   uint8_t identifierIndex = parseVariable("expect function name");
   markInitialized();
-  func(TYPE_FUNC);
+  ObjFunc *declared = func(TYPE_FUNC);
+
+  if (currentCompiler->type == TYPE_SCRIPT && IN_GLOBAL_SCOPE(currentCompiler))
+    recordInlineCandidate(identifierIndex, declared);
+
   defineVariable(identifierIndex);
 }
 
@@ -996,31 +2000,181 @@ static void varDecl() {
   defineVariable(identifierIndex);
 }
 
+static bool isFalsyConst(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/*
+ * Evaluates the expression compiled since the mark, if it only combines
+ * literals (and so other consts) with operators that can be folded. The jumps
+ * of logical operators and conditionals are followed. Returns false if it has
+ * to be left to runtime.
+ */
+static bool constantValue(CodeMark start, Value *value) {
+  Chunk *chunk        = currentChunk();
+  unsigned int offset = start.count;
+  Value stack[CONST_EVAL_STACK];
+  int top = 0;
+
+  while (offset < chunk->count) {
+    uint8_t *code = &chunk->code[offset];
+    bool pushes   = code[0] == OP_CONSTANT || code[0] == OP_TRUE ||
+                  code[0] == OP_FALSE || code[0] == OP_NIL;
+
+    // Code left unfinished by a syntax error can be missing operands
+    if (pushes ? top == CONST_EVAL_STACK : top == 0)
+      return false;
+
+    Value *last = pushes ? NULL : &stack[top - 1];
+    offset += instructionLen(chunk, offset);
+
+    switch (code[0]) {
+      case OP_CONSTANT: stack[top++] = chunk->constants.values[code[1]]; break;
+      case OP_TRUE:     stack[top++] = BOOL_VAL(true); break;
+      case OP_FALSE:    stack[top++] = BOOL_VAL(false); break;
+      case OP_NIL:      stack[top++] = NIL_VAL; break;
+      case OP_POP:      top--; break;
+      case OP_NOT:      *last = BOOL_VAL(isFalsyConst(*last)); break;
+      case OP_NEGATE: {
+        if (!IS_NUM(*last))
+          return false;
+
+        *last = NUM_VAL(-AS_NUM(*last));
+        break;
+      }
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_TRUE: {
+        bool jumps = code[0] == OP_JUMP ||
+                     isFalsyConst(*last) == (code[0] == OP_JUMP_IF_FALSE);
+        if (jumps)
+          offset += (uint16_t)(code[1] << 8 | code[2]);
+        break;
+      }
+      default: {
+        if (top < 2 || !foldBinary(code[0], last[-1], *last, &last[-1]))
+          return false;
+
+        top--;
+      }
+    }
+  }
+
+  if (top != 1)
+    return false;
+
+  *value = stack[0];
+  return true;
+}
+
+static void addConst(Token name, Value value) {
+  if (constDeclCount >= MAX_CONST_DECLS) {
+    errorPrev("exceeded max of 256 constants in scope");
+    return;
+  }
+
+  ConstDecl *decl  = &constDecls[constDeclCount++];
+  decl->name       = name;
+  decl->hash       = hashString(name.start, name.len);
+  decl->value      = value;
+  decl->compiler   = IN_GLOBAL_SCOPE(currentCompiler) ? NULL : currentCompiler;
+  decl->depth      = currentCompiler->scopeDepth;
+  decl->localCount = currentCompiler->localCount;
+}
+
+// A const's value is folded into the code reading it. At the top level it also
+// defines a global, read by functions declared before it and later REPL lines.
+static void constDecl() {
+  consume(TOK_IDENTIFIER, "expect constant name");
+  Token name = parser.prev;
+
+  if (constInScope(&name))
+    errorPrev("constant with this name already declared in this scope");
+  else if (IN_A_LOCAL_SCOPE(currentCompiler) && localInScope(&name))
+    errorPrev("variable with this name already declared in this scope");
+
+  consume(TOK_EQ, "expect '=' after constant name");
+
+  CodeMark start = markCode();
+  expression();
+  consume(TOK_SEMICOLON, "expect ';' after constant declaration");
+
+  Value value = NIL_VAL;
+  if (!constantValue(start, &value))
+    errorAt(&name, "constant initializer must be known at compile time");
+
+  discardCode(start);
+  addConst(name, value);
+
+  if (IN_GLOBAL_SCOPE(currentCompiler)) {
+    emitValue(value);
+    emitBytes(OP_DEF_CONST, identifierConstant(&name));
+  }
+}
+
 static void declaration() {
+  CodeMark start   = markCode();
+  bool unreachable = currentCompiler->unreachable;
+  const char *from = parser.cur.start;
+
+  currentCompiler->temps = 0; // In case an error left an expression unfinished
+
   if (match(TOK_FUNC)) {
     funcDecl();
   } else if (match(TOK_VAR)) {
     varDecl();
+  } else if (match(TOK_CONST)) {
+    constDecl();
   } else {
     statement();
   }
 
+  // Nothing after a return can run, so it is only compiled for its errors
+  if (unreachable)
+    discardCode(start);
+
   if (parser.panicMode) {
+    // An error on the first token leaves it unconsumed, and synchronize()
+    // stops before it if it follows a ';', so skip it to make progress.
+    if (parser.cur.start == from)
+      advance();
     synchronize();
   }
 }
 
+void setOptLevel(OptLevel level) {
+  optLevel = level;
+}
+
+void setInlineLimit(int limit) {
+  inlineLimit = limit;
+}
+
+void setLazyCompile(bool lazy) {
+  lazyCompile = lazy;
+}
+
+void setRetainedSource(bool retained) {
+  retainedSource = retained;
+}
+
 ObjFunc *compile(const char *source) {
   Scanner scanner;
   initScanner(&scanner, source);
 
   Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+  initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
   parser.scanner   = &scanner;
   parser.hadError  = false;
   parser.panicMode = false;
 
+  sourceStart = scanner.start;
+  sourceEnd   = scanner.end;
+
+  inlineCandidateCount = 0;
+  constDeclCount       = 0;
+
   advance();
 
   while (!match(TOK_EOF)) {
@@ -1028,9 +2182,50 @@ ObjFunc *compile(const char *source) {
   }
 
   ObjFunc *func = endCompiler();
+
+  // Lazy bodies are never compiled with inlining on, so nothing else can use
+  // the candidates and they needn't keep their functions alive.
+  inlineCandidateCount = 0;
   return parser.hadError ? NULL : func;
 }
 
+bool compileLazyFunc(ObjFunc *func) {
+  // Resume scanning just after the '(' of the parameters
+  Token start     = func->lazyStart;
+  Scanner scanner = {.start = start.start,
+                     .cur   = start.start + start.len,
+                     .line  = start.line,
+                     .col   = start.col};
+
+  bool inSource = start.start >= sourceStart && start.start < sourceEnd;
+  scanner.end   = inSource ? sourceEnd : scanner.cur + strlen(scanner.cur);
+
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_FUNC, func);
+
+  parser.scanner   = &scanner;
+  parser.cur       = start;
+  parser.hadError  = false;
+  parser.panicMode = false;
+
+  func->arity = 0; // Counted again as the parameters are declared
+  beginScope();
+  params();
+  blockStmt();
+  endCompiler();
+
+  if (parser.hadError)
+    return false;
+
+  func->lazyStart.start = NULL;
+  return true;
+}
+
+void freeCompiler() {
+  inlineCandidateCount = 0;
+  constDeclCount       = 0;
+}
+
 // Walk the chain of compilers and mark each one's ObjFunc
 void markCompilerRoots() {
   Compiler *compiler = currentCompiler;
@@ -1039,4 +2234,13 @@ void markCompilerRoots() {
     markObj((Obj *)compiler->func);
     compiler = compiler->enclosing;
   }
+
+  for (int i = 0; i < constDeclCount; i++) {
+    markValue(constDecls[i].value);
+  }
+
+  for (int i = 0; i < inlineCandidateCount; i++) {
+    markObj((Obj *)inlineCandidates[i].name);
+    markObj((Obj *)inlineCandidates[i].func);
+  }
 }
@@ -1,16 +1,16 @@
 #include "debug.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "object.h"
-
-#include <stdio.h>
+#include "vm.h"
 
 static unsigned int constant(Chunk *chunk, unsigned int offset) {
   const char *name      = opCodeStr(chunk->code[offset]);
   uint8_t constantIndex = chunk->code[offset + 1];
 
-  printf("%-16s %4d '", name, constantIndex);
+  printOutput("%-16s %4d '", name, constantIndex);
   printValue(chunk->constants.values[constantIndex]);
-  printf("'\n");
+  printOutput("'\n");
 
   return offset + 2;
 }
@@ -21,7 +21,15 @@ static unsigned int byte(Chunk *chunk, unsigned int offset) {
 
   // Unlike global variables, we don't have the variable name but we can at
   // least show it's slot number in the VM if that counts for anything.
-  printf("%-16s %4d\n", name, slot);
+  printOutput("%-16s %4d\n", name, slot);
+  return offset + 2;
+}
+
+static unsigned int native(Chunk *chunk, unsigned int offset) {
+  const char *name = opCodeStr(chunk->code[offset]);
+  uint8_t index    = chunk->code[offset + 1];
+
+  printOutput("%-16s %4d '%s'\n", name, index, nativeDefs[index].name);
   return offset + 2;
 }
 
@@ -30,31 +38,54 @@ static unsigned int jump(Chunk *chunk, int sign, int offset) {
   uint16_t toJump  = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
 
   int dest = offset + 3 + sign * toJump;
-  printf("%-16s %4d -> %d\n", name, offset, dest);
+  printOutput("%-16s %4d -> %d\n", name, offset, dest);
 
   return offset + 3;
 }
 
 static unsigned int single(Chunk *chunk, unsigned int offset) {
-  printf("%s\n", opCodeStr(chunk->code[offset]));
+  printOutput("%s\n", opCodeStr(chunk->code[offset]));
   return offset + 1;
 }
 
+static const char *captureKindStr(int kind) {
+  switch (kind) {
+    case UPVALUE_CAPTURES_LOCAL: return "local";
+    case UPVALUE_CAPTURES_VALUE: return "value";
+    default:                     return "upvalue";
+  }
+}
+
 // Returns the offset of the next instruction in the chunk to disassemble
 static unsigned int disassembleInstruction(Chunk *chunk, unsigned int offset) {
-  printf("%04d ", offset);
+  printOutput("%04d ", offset);
+
+  int line = chunkLine(chunk, offset);
+  if (offset > 0 && line == chunkLine(chunk, offset - 1)) {
+    printOutput("   | ");
+  } else {
+    printOutput("%4d ", line);
+  }
 
   OpCode opCode = chunk->code[offset];
   switch (opCode) {
     case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:
     case OP_GET_GLOBAL:
     case OP_SET_GLOBAL:
+    case OP_IS_FUNC:
     case OP_CONSTANT:      return constant(chunk, offset);
     case OP_CALL:
+    case OP_SLIDE:
     case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
     case OP_SET_UPVALUE:
+    case OP_GET_PARENT:
+    case OP_SET_PARENT:
+    case OP_GET_HOISTED:
     case OP_GET_LOCAL:
     case OP_SET_LOCAL:     return byte(chunk, offset);
+    case OP_CALL_NATIVE:   return native(chunk, offset);
     case OP_JUMP:
     case OP_JUMP_IF_TRUE:
     case OP_JUMP_IF_FALSE: return jump(chunk, 1, offset);
@@ -78,22 +109,21 @@ static unsigned int disassembleInstruction(Chunk *chunk, unsigned int offset) {
     case OP_PRINT:
     case OP_CLOSE_UPVALUE:
     case OP_RETURN:        return single(chunk, offset);
-    case OP_CLOSURE:       {
+    case OP_CLOSURE:
+    case OP_LOCAL_CLOSURE: {
       offset++;
       uint8_t constantIndex = chunk->code[offset++];
-      printf("%-16s %4d ", opCodeStr(OP_CLOSURE), constantIndex);
+      printOutput("%-16s %4d ", opCodeStr(opCode), constantIndex);
       printValue(chunk->constants.values[constantIndex]);
-      printf("\n");
+      printOutput("\n");
 
       ObjFunc *func = AS_FUNC(chunk->constants.values[constantIndex]);
       for (int i = 0; i < func->upvalueCount; i++) {
-        int isLocal      = chunk->code[offset];
-        char *isLocalOut = isLocal ? "local" : "upvalue";
-
+        int kind  = chunk->code[offset];
         int index = chunk->code[offset + 1];
 
-        printf("%04d      |                     %s %d\n", offset, isLocalOut,
-               index);
+        printOutput("%04d    |      |                     %s %d\n", offset,
+                    captureKindStr(kind), index);
 
         offset += 2;
       }
@@ -102,15 +132,125 @@ static unsigned int disassembleInstruction(Chunk *chunk, unsigned int offset) {
     }
   }
 
-  printf("Unknown opcode %d\n", opCode);
+  printOutput("Unknown opcode %d\n", opCode);
   return offset + 1;
 }
 
 void disassembleChunk(Chunk *chunk, const char *name) {
-  printf("== %s == \n", name);
+  printOutput("== %s == \n", name);
 
   unsigned int offset = 0;
   while (offset < chunk->count) {
     offset = disassembleInstruction(chunk, offset);
   }
 }
+
+// Prints an RK operand as a register (r1) or a constant (k1 'value').
+static void rkOperand(Chunk *chunk, unsigned int operand) {
+  if (!(operand & REG_CONST)) {
+    printOutput(" r%u", operand);
+    return;
+  }
+
+  printOutput(" k%u '", operand & ~REG_CONST);
+  printValue(chunk->constants.values[operand & ~REG_CONST]);
+  printOutput("'");
+}
+
+// Returns the index of the next instruction to disassemble
+static int disassembleRegInstr(RegCode *regCode, Chunk *chunk, int index) {
+  RegInstr instr = regCode->code[index];
+  RegOpCode op   = REG_OP(instr);
+
+  printOutput("%04d %-17s", index, regOpCodeStr(op));
+
+  switch (op) {
+    case ROP_NIL:
+    case ROP_TRUE:
+    case ROP_FALSE:
+    case ROP_CLOSE:         printOutput(" r%u", REG_A(instr)); break;
+    case ROP_GET_UPVALUE:
+    case ROP_GET_CAPTURED:
+    case ROP_GET_PARENT:
+    case ROP_GET_HOISTED:
+    case ROP_CALL:          {
+      const char *format = op == ROP_CALL           ? " r%u %u"
+                           : op == ROP_GET_PARENT   ? " r%u p%u"
+                           : op == ROP_GET_HOISTED  ? " r%u r%u"
+                                                    : " r%u u%u";
+      printOutput(format, REG_A(instr), REG_B(instr));
+      break;
+    }
+    case ROP_CALL_NATIVE: {
+      printOutput(" r%u %u '%s'", REG_A(instr), REG_B(instr),
+                  nativeDefs[REG_C(instr)].name);
+      break;
+    }
+    case ROP_SET_UPVALUE:
+    case ROP_SET_PARENT:  {
+      printOutput(op == ROP_SET_PARENT ? " p%u" : " u%u", REG_A(instr));
+      rkOperand(chunk, REG_B(instr));
+      break;
+    }
+    case ROP_JUMP: printOutput(" -> %d", index + 1 + REG_SBX(instr)); break;
+    case ROP_JUMP_IF_FALSE:
+    case ROP_JUMP_IF_TRUE:  {
+      printOutput(" r%u -> %d", REG_A(instr), index + 1 + REG_SBX(instr));
+      break;
+    }
+    case ROP_PRINT:
+    case ROP_RETURN:        rkOperand(chunk, REG_B(instr)); break;
+    case ROP_DEF_GLOBAL:
+    case ROP_DEF_CONST:
+    case ROP_SET_GLOBAL:    {
+      rkOperand(chunk, REG_A(instr) | REG_CONST);
+      rkOperand(chunk, REG_B(instr));
+      break;
+    }
+    case ROP_GET_GLOBAL:
+    case ROP_LOCAL_CLOSURE: {
+      printOutput(" r%u", REG_A(instr));
+      rkOperand(chunk, REG_BX(instr) | REG_CONST);
+      break;
+    }
+    case ROP_CLOSURE: {
+      printOutput(" r%u", REG_A(instr));
+      rkOperand(chunk, REG_BX(instr) | REG_CONST);
+      printOutput("\n");
+
+      ObjFunc *func = AS_FUNC(chunk->constants.values[REG_BX(instr)]);
+      for (int i = 0; i < func->upvalueCount; i++) {
+        RegInstr capture = regCode->code[++index];
+        printOutput("%04d      |            %s %u\n", index,
+                    captureKindStr(REG_A(capture)), REG_B(capture));
+      }
+
+      return index + 1;
+    }
+    case ROP_MOVE:
+    case ROP_NOT:
+    case ROP_NEGATE: {
+      printOutput(" r%u", REG_A(instr));
+      rkOperand(chunk, REG_B(instr));
+      break;
+    }
+    default: {
+      printOutput(" r%u", REG_A(instr));
+      rkOperand(chunk, REG_B(instr));
+      rkOperand(chunk, REG_C(instr));
+      break;
+    }
+  }
+
+  printOutput("\n");
+  return index + 1;
+}
+
+void disassembleRegCode(RegCode *regCode, Chunk *chunk, const char *name) {
+  printOutput("== %s (%d registers) == \n", name, regCode->frameSize);
+
+  int index = 0;
+  while (index < regCode->count) {
+    index = disassembleRegInstr(regCode, chunk, index);
+  }
+}
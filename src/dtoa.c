@@ -0,0 +1,406 @@
+#include "dtoa.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Shortest round-trip double to string conversion using the Grisu2 algorithm
+ * from Florian Loitsch's "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers". The digits always read back as the same double,
+ * and are the shortest such digits for all but a tiny fraction of inputs.
+ */
+
+#define DP_SIGNIFICAND_SIZE  52
+#define DP_EXPONENT_BIAS     (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT      (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK     0x7FF0000000000000ull
+#define DP_SIGNIFICAND_MASK  0x000FFFFFFFFFFFFFull
+#define DP_HIDDEN_BIT        0x0010000000000000ull
+#define DIY_SIGNIFICAND_SIZE 64
+
+// Doubles below 2^53 that are whole numbers convert exactly to an integer.
+#define MAX_EXACT_INT 9007199254740992.0
+
+// A "do it yourself" floating point number: f * 2^e
+typedef struct diy_fp {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+// Normalized significands and binary exponents of 10^k for k = -348, -340,
+// ..., 340, spaced so every double has a cached power within 8 decimals.
+static const uint64_t cachedPowersF[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+    0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+    0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+    0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull
+};
+
+static const int16_t cachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t powersOf10[] = {
+    1ull,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+static const char digitPairs[] = "00010203040506070809"
+                                 "10111213141516171819"
+                                 "20212223242526272829"
+                                 "30313233343536373839"
+                                 "40414243444546474849"
+                                 "50515253545556575859"
+                                 "60616263646566676869"
+                                 "70717273747576777879"
+                                 "80818283848586878889"
+                                 "90919293949596979899";
+
+static DiyFp diyFp(uint64_t f, int e) {
+  DiyFp fp = {f, e};
+  return fp;
+}
+
+static DiyFp diyFpFromDouble(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  int biasedExp        = (bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE;
+  uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+
+  // Subnormals have no hidden bit and a fixed exponent
+  if (biasedExp == 0)
+    return diyFp(significand, DP_MIN_EXPONENT + 1);
+
+  return diyFp(significand + DP_HIDDEN_BIT, biasedExp - DP_EXPONENT_BIAS);
+}
+
+// The upper 64 bits of the 128-bit product, rounded.
+static DiyFp multiply(DiyFp x, DiyFp y) {
+  const uint64_t M32 = 0xFFFFFFFF;
+
+  uint64_t a = x.f >> 32, b = x.f & M32;
+  uint64_t c = y.f >> 32, d = y.f & M32;
+
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+
+  uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+  tmp += 1u << 31; // Round
+
+  return diyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+static DiyFp normalize(DiyFp x) {
+  while (!(x.f & DP_HIDDEN_BIT)) {
+    x.f <<= 1;
+    x.e--;
+  }
+
+  x.f <<= DIY_SIGNIFICAND_SIZE - DP_SIGNIFICAND_SIZE - 1;
+  x.e -= DIY_SIGNIFICAND_SIZE - DP_SIGNIFICAND_SIZE - 1;
+  return x;
+}
+
+static DiyFp normalizeBoundary(DiyFp x) {
+  while (!(x.f & (DP_HIDDEN_BIT << 1))) {
+    x.f <<= 1;
+    x.e--;
+  }
+
+  x.f <<= DIY_SIGNIFICAND_SIZE - DP_SIGNIFICAND_SIZE - 2;
+  x.e -= DIY_SIGNIFICAND_SIZE - DP_SIGNIFICAND_SIZE - 2;
+  return x;
+}
+
+// The boundaries m- and m+ halfway to the neighbouring doubles, any number
+// between them reads back as v. Both share the exponent of the normalized m+.
+static void normalizedBoundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+  DiyFp pl = normalizeBoundary(diyFp((v.f << 1) + 1, v.e - 1));
+
+  // The lower boundary is closer when v is a power of two
+  DiyFp mi = v.f == DP_HIDDEN_BIT ? diyFp((v.f << 2) - 1, v.e - 2)
+                                  : diyFp((v.f << 1) - 1, v.e - 1);
+
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+
+  *plus  = pl;
+  *minus = mi;
+}
+
+// Finds the cached power c = 10^-K such that the product of c with a number of
+// binary exponent e has its exponent in the range [-60, -32].
+static DiyFp cachedPower(int e, int *K) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347; // log10(2)
+  int k     = (int)dk;
+  if (dk - k > 0.0)
+    k++;
+
+  unsigned int index = (k >> 3) + 1;
+  *K                 = -(-348 + (int)(index << 3));
+
+  return diyFp(cachedPowersF[index], cachedPowersE[index]);
+}
+
+static int countDigits(uint32_t n) {
+  int count = 1;
+  while (n >= 10) {
+    n /= 10;
+    count++;
+  }
+  return count;
+}
+
+// Nudges the last digit towards the real value while still in the safe range.
+static void grisuRound(char *buf, int len, uint64_t delta, uint64_t rest,
+                       uint64_t tenKappa, uint64_t wpw) {
+  while (rest < wpw && delta - rest >= tenKappa &&
+         (rest + tenKappa < wpw || wpw - rest > rest + tenKappa - wpw)) {
+    buf[len - 1]--;
+    rest += tenKappa;
+  }
+}
+
+// Generates digits of Mp until they fall within delta of the real value.
+static void digitGen(DiyFp W, DiyFp Mp, uint64_t delta, char *buf, int *len,
+                     int *K) {
+  DiyFp one = diyFp(1ull << -Mp.e, Mp.e);
+  DiyFp wpw = diyFp(Mp.f - W.f, Mp.e);
+
+  uint32_t p1 = (uint32_t)(Mp.f >> -one.e); // Integral part
+  uint64_t p2 = Mp.f & (one.f - 1);         // Fractional part
+  int kappa   = countDigits(p1);
+
+  *len = 0;
+
+  while (kappa > 0) {
+    uint32_t divisor = (uint32_t)powersOf10[kappa - 1];
+    uint32_t d       = p1 / divisor;
+    p1 %= divisor;
+
+    if (d || *len)
+      buf[(*len)++] = '0' + (char)d;
+
+    kappa--;
+
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *K += kappa;
+      grisuRound(buf, *len, delta, rest, powersOf10[kappa] << -one.e, wpw.f);
+      return;
+    }
+  }
+
+  while (true) {
+    p2 *= 10;
+    delta *= 10;
+
+    char d = (char)(p2 >> -one.e);
+    if (d || *len)
+      buf[(*len)++] = '0' + d;
+
+    p2 &= one.f - 1;
+    kappa--;
+
+    if (p2 < delta) {
+      *K += kappa;
+      int index = -kappa;
+      grisuRound(buf, *len, delta, p2, one.f,
+                 wpw.f * (index < 20 ? powersOf10[index] : 0));
+      return;
+    }
+  }
+}
+
+// Writes the digits of a positive, finite, non-zero value to buf such that
+// value = digits * 10^K, returning the number of digits.
+static int grisu2(double value, char *buf, int *K) {
+  DiyFp v = diyFpFromDouble(value);
+
+  DiyFp wm, wp;
+  normalizedBoundaries(v, &wm, &wp);
+
+  DiyFp cmk = cachedPower(wp.e, K);
+  DiyFp W   = multiply(normalize(v), cmk);
+  DiyFp Wp  = multiply(wp, cmk);
+  DiyFp Wm  = multiply(wm, cmk);
+
+  // Shrink the boundaries by one unit to account for the multiply's error
+  Wm.f++;
+  Wp.f--;
+
+  int len;
+  digitGen(W, Wp, Wp.f - Wm.f, buf, &len, K);
+  return len;
+}
+
+static int writeExponent(int exp, char *buf) {
+  char *start = buf;
+
+  *buf++ = 'e';
+  *buf++ = exp < 0 ? '-' : '+';
+  if (exp < 0)
+    exp = -exp;
+
+  if (exp >= 100) {
+    *buf++ = '0' + exp / 100;
+    exp %= 100;
+    memcpy(buf, &digitPairs[exp * 2], 2);
+    buf += 2;
+  } else if (exp >= 10) {
+    memcpy(buf, &digitPairs[exp * 2], 2);
+    buf += 2;
+  } else {
+    *buf++ = '0' + exp;
+  }
+
+  return buf - start;
+}
+
+/*
+ * Lays out the len digits (value = digits * 10^K) in buf. Plain decimal
+ * notation is used when the decimal point falls within 21 digits of the first
+ * digit, otherwise scientific notation e.g. 1.5e+300.
+ */
+static int prettify(char *buf, int len, int K) {
+  int kk = len + K; // 10^(kk - 1) <= value < 10^kk
+
+  if (K >= 0 && kk <= 21) {
+    // 1234e7 -> 12340000000
+    memset(buf + len, '0', K);
+    return kk;
+  }
+
+  if (kk > 0 && kk <= 21) {
+    // 1234e-2 -> 12.34
+    memmove(buf + kk + 1, buf + kk, len - kk);
+    buf[kk] = '.';
+    return len + 1;
+  }
+
+  if (kk > -6 && kk <= 0) {
+    // 1234e-6 -> 0.001234
+    int offset = 2 - kk;
+    memmove(buf + offset, buf, len);
+    buf[0] = '0';
+    buf[1] = '.';
+    memset(buf + 2, '0', -kk);
+    return len + offset;
+  }
+
+  if (len == 1) {
+    // 1e30
+    return 1 + writeExponent(kk - 1, buf + 1);
+  }
+
+  // 1234e30 -> 1.234e+33
+  memmove(buf + 2, buf + 1, len - 1);
+  buf[1] = '.';
+  return len + 1 + writeExponent(kk - 1, buf + len + 1);
+}
+
+// Writes the whole number n without leading zeros, two digits at a time.
+static int formatInteger(uint64_t n, char *buf) {
+  char digits[20];
+  char *p = digits + sizeof(digits);
+
+  while (n >= 100) {
+    p -= 2;
+    memcpy(p, &digitPairs[(n % 100) * 2], 2);
+    n /= 100;
+  }
+
+  if (n >= 10) {
+    p -= 2;
+    memcpy(p, &digitPairs[n * 2], 2);
+  } else {
+    *--p = '0' + (char)n;
+  }
+
+  int len = digits + sizeof(digits) - p;
+  memcpy(buf, p, len);
+  return len;
+}
+
+int formatNumber(double value, char *buf) {
+  char *start = buf;
+
+  if (isnan(value)) {
+    memcpy(buf, "nan", 4);
+    return 3;
+  }
+
+  if (signbit(value)) {
+    *buf++ = '-';
+    value  = -value;
+  }
+
+  int len;
+
+  if (isinf(value)) {
+    memcpy(buf, "inf", 3);
+    len = 3;
+  } else if (value < MAX_EXACT_INT && value == (double)(uint64_t)value) {
+    len = formatInteger((uint64_t)value, buf);
+  } else {
+    int K;
+    len = grisu2(value, buf, &K);
+    len = prettify(buf, len, K);
+  }
+
+  buf[len] = '\0';
+  return buf - start + len;
+}
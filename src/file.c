@@ -0,0 +1,114 @@
+#include "file.h"
+
+#include "memory.h"
+#include "object.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+ObjFile *openFile(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  // Lines are consumed front to back, so ask for aggressive read-ahead.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  return newFile(fd);
+}
+
+/*
+ * Moves the unread tail of the buffer to its front and reads as much as fits
+ * after it. The buffer doubles when the tail already fills it, i.e. a single
+ * line is longer than the buffer. Returns false on a read error.
+ */
+static bool refill(ObjFile *file) {
+  size_t unread = file->end - file->start;
+
+  if (file->buf == NULL) {
+    file->buf      = ALLOCATE(char, FILE_BUFFER_SIZE);
+    file->capacity = FILE_BUFFER_SIZE;
+  } else if (unread == file->capacity) {
+    size_t oldCap  = file->capacity;
+    file->capacity = GROW_CAPACITY(oldCap);
+    file->buf      = GROW_ARRAY(char, file->buf, oldCap, file->capacity);
+  } else if (file->start > 0) {
+    memmove(file->buf, file->buf + file->start, unread);
+  }
+
+  file->start = 0;
+  file->end   = unread;
+
+  while (true) {
+    ssize_t bytesRead =
+        read(file->fd, file->buf + file->end, file->capacity - file->end);
+
+    if (bytesRead == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    if (bytesRead == 0)
+      file->eof = true;
+
+    file->end += bytesRead;
+    return true;
+  }
+}
+
+ObjString *readLine(ObjFile *file) {
+  if (file->fd == -1)
+    return NULL;
+
+  size_t scanned = 0; // Chars of the current line already searched for '\n'
+
+  while (true) {
+    char *line    = file->buf + file->start;
+    size_t unread = file->end - file->start;
+
+    char *newline = file->buf == NULL
+                        ? NULL
+                        : memchr(line + scanned, '\n', unread - scanned);
+
+    if (newline != NULL) {
+      size_t len = newline - line;
+      file->start += len + 1;
+
+      if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+      return copyString(line, len);
+    }
+
+    // The last line may not end with a newline
+    if (file->eof) {
+      if (unread == 0)
+        return NULL;
+
+      file->start = file->end;
+      return copyString(line, unread);
+    }
+
+    scanned = unread;
+
+    if (!refill(file))
+      return NULL;
+  }
+}
+
+void closeFile(ObjFile *file) {
+  if (file->fd == -1)
+    return;
+
+  close(file->fd);
+  FREE_ARRAY(char, file->buf, file->capacity);
+
+  file->fd       = -1;
+  file->buf      = NULL;
+  file->capacity = 0;
+  file->start    = 0;
+  file->end      = 0;
+}
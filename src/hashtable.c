@@ -78,9 +78,28 @@ static void adjustCapacity(HashTable *ht, unsigned int newCap) {
   ht->capacity = newCap;
 }
 
+static unsigned int liveEntries(HashTable *ht) {
+  unsigned int live = 0;
+
+  for (unsigned int i = 0; i < ht->capacity; i++) {
+    if (ht->entries[i].key != NULL)
+      live++;
+  }
+
+  return live;
+}
+
+bool hashTableIsFull(HashTable *ht) {
+  return ht->count >= ht->capacity * MAX_LOAD_FACTOR;
+}
+
 bool hashTableSet(HashTable *ht, ObjString *key, Value value) {
-  if (ht->count >= ht->capacity * MAX_LOAD_FACTOR) {
-    adjustCapacity(ht, GROW_CAPACITY(ht->capacity));
+  if (hashTableIsFull(ht)) {
+    // Tombstones count towards the load, so a table that is mostly tombstones
+    // (e.g. interned strings swept by the GC) is rebuilt at the same size
+    // instead of growing without bound.
+    bool mostlyDead = liveEntries(ht) < ht->capacity * MAX_LOAD_FACTOR / 2;
+    adjustCapacity(ht, mostlyDead ? ht->capacity : GROW_CAPACITY(ht->capacity));
   }
 
   HashTableEntry *entry = findEntry(ht->entries, key, ht->capacity);
@@ -160,7 +179,7 @@ void hashTableRemoveWhite(HashTable *ht) {
   for (unsigned int i = 0; i < ht->capacity; i++) {
     HashTableEntry *entry = &ht->entries[i];
 
-    if (entry->key != NULL && entry->key->obj.isMarked) {
+    if (entry->key != NULL && !entry->key->obj.isMarked) {
       hashTableRemove(ht, entry->key);
     }
   }
@@ -0,0 +1,664 @@
+#include "image.h"
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_64_OFFSET_BASIS 14695981039346656037ull
+#define FNV_64_PRIME        1099511628211ull
+
+// Every record and variable length section starts on an 8 byte boundary, so a
+// mapped image can be read in place without unaligned accesses.
+#define IMAGE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * Image layout, in native byte order:
+ *
+ *   ImageHeader
+ *   ImageFunc x funcCount, children before the functions that enclose them
+ *     name chars (nameLen)
+ *     code bytes (codeLen)
+ *     ImageLineRun x lineRunCount
+ *     ImageConst x constCount, each string followed by its chars
+ *
+ * The only fix-ups needed when loading are interning strings and resolving
+ * nested function constants, which refer to earlier functions by index.
+ */
+typedef struct image_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceHash;
+  uint32_t funcCount;
+  uint32_t flags; // Compiler options that change the bytecode
+} ImageHeader;
+
+typedef struct image_func {
+  int32_t arity;
+  int32_t upvalueCount;
+  uint32_t codeLen;
+  uint32_t lineRunCount;
+  uint32_t constCount;
+  uint32_t hasName; // The top level script has no name
+  uint32_t nameLen;
+} ImageFunc;
+
+typedef struct image_line_run {
+  uint32_t offset;
+  int32_t line;
+} ImageLineRun;
+
+typedef enum image_const_type {
+  IMAGE_CONST_NIL,
+  IMAGE_CONST_BOOL,
+  IMAGE_CONST_NUM,
+  IMAGE_CONST_STRING,
+  IMAGE_CONST_FUNC,
+} ImageConstType;
+
+typedef struct image_const {
+  uint32_t type;
+  uint32_t len; // String length
+  union {
+    double number;
+    uint64_t boolean;
+    uint64_t funcIndex;
+  } as;
+} ImageConst;
+
+typedef struct image_buffer {
+  char *bytes;
+  size_t len;
+  size_t capacity;
+} ImageBuffer;
+
+// How the code loaded so far uses a function.
+typedef struct func_use {
+  int parentSlots; // Of its caller, which its code reads or writes
+  bool local;      // Created by an OP_LOCAL_CLOSURE
+  bool closure;    // Created by an OP_CLOSURE
+} FuncUse;
+
+// Functions created so far by loadImage(), rooted until the load completes.
+static ObjFunc **loadedFuncs;
+static FuncUse *loadedUses;
+static uint32_t loadedCount;
+
+uint64_t hashSource(const char *chars, size_t len) {
+  uint64_t hash = FNV_64_OFFSET_BASIS;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)chars[i];
+    hash *= FNV_64_PRIME;
+  }
+
+  return hash;
+}
+
+bool isImage(const char *bytes, size_t len) {
+  return len >= sizeof(ImageHeader) &&
+         memcmp(bytes, IMAGE_MAGIC, sizeof(((ImageHeader *)0)->magic)) == 0;
+}
+
+// Appends the bytes, padded with zeros to the next 8 byte boundary.
+static void bufferWrite(ImageBuffer *buf, const void *bytes, size_t n) {
+  size_t padded = IMAGE_ALIGN(n);
+
+  if (buf->len + padded > buf->capacity) {
+    while (buf->len + padded > buf->capacity) {
+      buf->capacity = GROW_CAPACITY(buf->capacity);
+    }
+
+    buf->bytes = realloc(buf->bytes, buf->capacity);
+    if (buf->bytes == NULL)
+      exit(EXIT_FAILURE);
+  }
+
+  memcpy(buf->bytes + buf->len, bytes, n);
+  memset(buf->bytes + buf->len + n, 0, padded - n);
+  buf->len += padded;
+}
+
+// Writes the function's nested functions then itself, returning its index.
+static uint32_t writeFunc(ImageBuffer *buf, ObjFunc *func, uint32_t *count) {
+  Chunk *chunk = &func->chunk;
+
+  // Children first, so loading only ever refers back to created functions.
+  uint64_t *funcIndexes = calloc(chunk->constants.count, sizeof(uint64_t));
+  if (funcIndexes == NULL && chunk->constants.count > 0)
+    exit(EXIT_FAILURE);
+
+  for (unsigned int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNC(constant)) {
+      funcIndexes[i] = writeFunc(buf, AS_FUNC(constant), count);
+    }
+  }
+
+  ImageFunc record = {
+      .arity        = func->arity,
+      .upvalueCount = func->upvalueCount,
+      .codeLen      = chunk->count,
+      .lineRunCount = chunk->lineRunCount,
+      .constCount   = chunk->constants.count,
+      .hasName      = func->name != NULL,
+      .nameLen      = func->name != NULL ? func->name->len : 0,
+  };
+
+  bufferWrite(buf, &record, sizeof(record));
+  bufferWrite(buf, record.hasName ? func->name->chars : "", record.nameLen);
+  bufferWrite(buf, chunk->code, chunk->count);
+
+  ImageLineRun *runs = malloc(sizeof(ImageLineRun) * chunk->lineRunCount);
+  if (runs == NULL && chunk->lineRunCount > 0)
+    exit(EXIT_FAILURE);
+
+  for (unsigned int i = 0; i < chunk->lineRunCount; i++) {
+    runs[i].offset = chunk->lineRuns[i].offset;
+    runs[i].line   = chunk->lineRuns[i].line;
+  }
+
+  bufferWrite(buf, runs, sizeof(ImageLineRun) * chunk->lineRunCount);
+  free(runs);
+
+  for (unsigned int i = 0; i < chunk->constants.count; i++) {
+    Value constant     = chunk->constants.values[i];
+    ImageConst encoded = {0};
+
+    switch (constant.type) {
+      case VAL_NIL: encoded.type = IMAGE_CONST_NIL; break;
+      case VAL_BOOL:
+        encoded.type       = IMAGE_CONST_BOOL;
+        encoded.as.boolean = AS_BOOL(constant);
+        break;
+      case VAL_NUM:
+        encoded.type      = IMAGE_CONST_NUM;
+        encoded.as.number = AS_NUM(constant);
+        break;
+      case VAL_OBJ:
+        if (IS_STRING(constant)) {
+          encoded.type = IMAGE_CONST_STRING;
+          encoded.len  = AS_STRING(constant)->len;
+        } else {
+          encoded.type         = IMAGE_CONST_FUNC;
+          encoded.as.funcIndex = funcIndexes[i];
+        }
+        break;
+    }
+
+    bufferWrite(buf, &encoded, sizeof(encoded));
+
+    if (encoded.type == IMAGE_CONST_STRING) {
+      bufferWrite(buf, AS_CSTRING(constant), encoded.len);
+    }
+  }
+
+  free(funcIndexes);
+  return (*count)++;
+}
+
+bool writeImage(ObjFunc *func, const ImageKey *key, const char *path) {
+  ImageBuffer buf = {NULL, 0, 0};
+
+  ImageHeader header = {.version    = IMAGE_VERSION,
+                        .sourceHash = key->sourceHash,
+                        .flags      = key->flags};
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  bufferWrite(&buf, &header, sizeof(header));
+
+  uint32_t funcCount = 0;
+  writeFunc(&buf, func, &funcCount);
+  ((ImageHeader *)buf.bytes)->funcCount = funcCount;
+
+  // Write to a temporary file and rename it over the destination so readers,
+  // such as a concurrent run sharing the cache, never see a partial image.
+  char tmpPath[4096];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+
+  int fd  = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd != -1;
+
+  for (size_t written = 0; ok && written < buf.len;) {
+    ssize_t n = write(fd, buf.bytes + written, buf.len - written);
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    ok = n > 0;
+    written += ok ? n : 0;
+  }
+
+  if (fd != -1 && close(fd) == -1)
+    ok = false;
+
+  if (ok && rename(tmpPath, path) == -1)
+    ok = false;
+
+  if (!ok)
+    unlink(tmpPath);
+
+  free(buf.bytes);
+  return ok;
+}
+
+// Returns a pointer to the next n bytes of the image, or NULL if truncated.
+static const char *take(const char **cur, const char *end, size_t n) {
+  if ((size_t)(end - *cur) < IMAGE_ALIGN(n))
+    return NULL;
+
+  const char *start = *cur;
+  *cur += IMAGE_ALIGN(n);
+  return start;
+}
+
+static bool isConst(Chunk *chunk, uint8_t index, ObjType type) {
+  return index < chunk->constants.count &&
+         isObjType(chunk->constants.values[index], type);
+}
+
+// Checks the operands of the instruction at the offset refer to what the
+// function has, and that the instruction doesn't run past the end of the code.
+static bool validOperands(ObjFunc *func, unsigned int offset) {
+  Chunk *chunk      = &func->chunk;
+  uint8_t *code     = chunk->code + offset;
+  unsigned int left = chunk->count - offset; // Bytes from the opcode on
+
+  // A closure's length depends on its function, checked first below
+  bool isClosure = code[0] == OP_CLOSURE || code[0] == OP_LOCAL_CLOSURE;
+  if (!isClosure && left < instructionLen(chunk, offset))
+    return false;
+
+  switch ((OpCode)code[0]) {
+    case OP_CONSTANT: return code[1] < chunk->constants.count;
+    case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:  return isConst(chunk, code[1], OBJ_STRING);
+    case OP_IS_FUNC:     return isConst(chunk, code[1], OBJ_FUNC);
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURED: return code[1] < func->upvalueCount;
+    case OP_CALL_NATIVE:  return code[1] < NATIVE_COUNT;
+    case OP_CLOSURE:
+    case OP_LOCAL_CLOSURE: {
+      if (left < 2 || !isConst(chunk, code[1], OBJ_FUNC))
+        return false;
+
+      // Then the capture kind and index of each of its upvalues
+      ObjFunc *closed = AS_FUNC(chunk->constants.values[code[1]]);
+      if (left < instructionLen(chunk, offset))
+        return false;
+
+      for (int i = 0; i < closed->upvalueCount; i++) {
+        uint8_t kind  = code[2 + 2 * i];
+        uint8_t index = code[3 + 2 * i];
+
+        if (kind > UPVALUE_CAPTURES_VALUE ||
+            (kind == UPVALUE_CAPTURES_UPVALUE && index >= func->upvalueCount))
+          return false;
+      }
+
+      return true;
+    }
+    default: return true;
+  }
+}
+
+// Returns how many values at the top of the stack the instruction reads,
+// whether or not it pops them.
+static int stackReads(Chunk *chunk, unsigned int offset) {
+  uint8_t *code = &chunk->code[offset];
+
+  switch ((OpCode)code[0]) {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQ:
+    case OP_NOT_EQ:
+    case OP_LESS:
+    case OP_LESS_EQ:
+    case OP_GREATER:
+    case OP_GREATER_EQ:    return 2;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_POP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_PARENT:
+    case OP_CLOSE_UPVALUE:
+    case OP_PRINT:
+    case OP_RETURN:        return 1;
+    case OP_CALL:
+    case OP_SLIDE:         return code[1] + 1;
+    case OP_CALL_NATIVE:   return nativeDefs[code[1]].arity + 1;
+    case OP_IS_FUNC:
+      return AS_FUNC(chunk->constants.values[code[1]])->arity + 1;
+    default: return 0;
+  }
+}
+
+static FuncUse *funcUse(Value func) {
+  uint32_t i = 0;
+  while (loadedFuncs[i] != AS_FUNC(func)) {
+    i++;
+  }
+
+  return &loadedUses[i];
+}
+
+/*
+ * Checks the reachable instruction at the offset stays within the function's
+ * frame: it only reads values pushed in the frame, the local slots it refers to
+ * are in use, and the stack has the same depth however the code after it is
+ * reached. Notes how it uses the nested function it creates, if any.
+ */
+static bool validStack(ObjFunc *func, unsigned int offset, const int *depths) {
+  Chunk *chunk      = &func->chunk;
+  uint8_t *code     = &chunk->code[offset];
+  int depth         = depths[offset];
+  int after         = depth + stackEffect(chunk, offset);
+  unsigned int next = offset + instructionLen(chunk, offset);
+
+  // Slot 0 holds the callee, which is never popped
+  if (depth - 1 < stackReads(chunk, offset))
+    return false;
+
+  switch ((OpCode)code[0]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      if (code[1] >= depth)
+        return false;
+      break;
+    case OP_GET_HOISTED: // The global's name is in the slot below
+      if (code[1] == 0 || code[1] >= depth)
+        return false;
+      break;
+    case OP_GET_PARENT:
+    case OP_SET_PARENT: {
+      FuncUse *use = &loadedUses[loadedCount - 1];
+      if (code[1] >= use->parentSlots)
+        use->parentSlots = code[1] + 1;
+      break;
+    }
+    case OP_CLOSURE:
+      funcUse(chunk->constants.values[code[1]])->closure = true;
+      break;
+    case OP_LOCAL_CLOSURE: {
+      // Its closure uses the slots in use once it is pushed
+      FuncUse *use = funcUse(chunk->constants.values[code[1]]);
+      use->local   = true;
+
+      if (use->parentSlots > after)
+        return false;
+      break;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+      if (depths[jumpTarget(chunk, offset)] != depth)
+        return false;
+      break;
+    default: break;
+  }
+
+  if (code[0] == OP_RETURN || code[0] == OP_JUMP || code[0] == OP_LOOP)
+    return true;
+
+  return next < chunk->count && depths[next] == after;
+}
+
+/*
+ * Rejects code a corrupt image could hold rather than run it: unknown opcodes,
+ * operands out of range, jumps that don't land on an instruction, code that can
+ * run off its end, and stack slots outside the function's frame.
+ */
+static bool validCode(ObjFunc *func) {
+  Chunk *chunk = &func->chunk;
+  if (chunk->count == 0)
+    return false;
+
+  bool *starts = calloc(chunk->count, sizeof(bool));
+  if (starts == NULL)
+    exit(EXIT_FAILURE);
+
+  unsigned int offset = 0, last = 0;
+  bool ok             = true;
+
+  while (ok && offset < chunk->count) {
+    starts[offset] = true;
+    last           = offset;
+
+    ok = chunk->code[offset] < OP_CODE_COUNT && validOperands(func, offset);
+    if (ok)
+      offset += instructionLen(chunk, offset);
+  }
+
+  for (offset = 0; ok && offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    switch (chunk->code[offset]) {
+      case OP_JUMP:
+      case OP_JUMP_IF_TRUE:
+      case OP_JUMP_IF_FALSE:
+      case OP_LOOP:          {
+        unsigned int target = jumpTarget(chunk, offset);
+        ok                  = target < chunk->count && starts[target];
+        break;
+      }
+    }
+  }
+
+  free(starts);
+
+  // Only a return or an unconditional jump can end the code
+  uint8_t lastOp = chunk->code[last];
+  if (!ok ||
+      (lastOp != OP_RETURN && lastOp != OP_JUMP && lastOp != OP_LOOP))
+    return false;
+
+  int *depths = malloc(sizeof(int) * chunk->count);
+  if (depths == NULL)
+    exit(EXIT_FAILURE);
+
+  findStackDepths(chunk, func->arity, depths);
+
+  for (offset = 0; ok && offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    ok = depths[offset] < 0 || validStack(func, offset, depths);
+  }
+
+  free(depths);
+  return ok;
+}
+
+static bool loadFunc(const char **cur, const char *end, ObjFunc *func) {
+  const ImageFunc *record =
+      (const ImageFunc *)take(cur, end, sizeof(ImageFunc));
+  if (record == NULL || record->arity < 0 || record->arity > UINT8_MAX ||
+      record->upvalueCount < 0 || record->upvalueCount > UINT8_MAX + 1)
+    return false;
+
+  func->arity        = record->arity;
+  func->upvalueCount = record->upvalueCount;
+
+  size_t linesLen   = sizeof(ImageLineRun) * record->lineRunCount;
+  const char *name  = take(cur, end, record->nameLen);
+  const char *code  = take(cur, end, record->codeLen);
+  const char *lines = take(cur, end, linesLen);
+  if (name == NULL || code == NULL || lines == NULL)
+    return false;
+
+  // chunkLine() relies on the first run covering the first byte
+  const ImageLineRun *runs = (const ImageLineRun *)lines;
+  if (record->codeLen > 0 &&
+      (record->lineRunCount == 0 || runs[0].offset != 0))
+    return false;
+
+  if (record->hasName) {
+    func->name = copyString(name, record->nameLen);
+  }
+
+  uint8_t *chunkCode = ALLOCATE(uint8_t, record->codeLen);
+  LineRun *lineRuns  = ALLOCATE(LineRun, record->lineRunCount);
+
+  memcpy(chunkCode, code, record->codeLen);
+  for (uint32_t i = 0; i < record->lineRunCount; i++) {
+    lineRuns[i].offset = runs[i].offset;
+    lineRuns[i].line   = runs[i].line;
+  }
+
+  // Sized exactly and already finalized, there's nothing more to append to a
+  // loaded chunk.
+  Chunk *chunk        = &func->chunk;
+  chunk->code         = chunkCode;
+  chunk->lineRuns     = lineRuns;
+  chunk->lineRunCount = record->lineRunCount;
+  chunk->capacity     = record->codeLen;
+  chunk->count        = record->codeLen;
+
+  for (uint32_t i = 0; i < record->constCount; i++) {
+    const ImageConst *encoded =
+        (const ImageConst *)take(cur, end, sizeof(ImageConst));
+    if (encoded == NULL)
+      return false;
+
+    Value constant;
+
+    switch (encoded->type) {
+      case IMAGE_CONST_NIL:  constant = NIL_VAL; break;
+      case IMAGE_CONST_BOOL: constant = BOOL_VAL(encoded->as.boolean); break;
+      case IMAGE_CONST_NUM:  constant = NUM_VAL(encoded->as.number); break;
+      case IMAGE_CONST_STRING: {
+        const char *chars = take(cur, end, encoded->len);
+        if (chars == NULL)
+          return false;
+
+        constant = OBJ_VAL(copyString(chars, encoded->len));
+        break;
+      }
+      case IMAGE_CONST_FUNC:
+        if (encoded->as.funcIndex >= loadedCount - 1)
+          return false; // Must refer to an earlier function
+
+        constant = OBJ_VAL(loadedFuncs[encoded->as.funcIndex]);
+        break;
+      default: return false;
+    }
+
+    appendConstant(chunk, constant);
+  }
+
+  return validCode(func);
+}
+
+ObjFunc *loadImage(const char *bytes, size_t len, const ImageKey *key) {
+  if (!isImage(bytes, len))
+    return NULL;
+
+  const char *cur = bytes, *end = bytes + len;
+
+  const ImageHeader *header =
+      (const ImageHeader *)take(&cur, end, sizeof(ImageHeader));
+
+  if (header->version != IMAGE_VERSION || header->funcCount == 0)
+    return NULL;
+
+  if (key != NULL &&
+      (header->sourceHash != key->sourceHash || header->flags != key->flags))
+    return NULL;
+
+  loadedFuncs = malloc(sizeof(ObjFunc *) * header->funcCount);
+  loadedUses  = calloc(header->funcCount, sizeof(FuncUse));
+  if (loadedFuncs == NULL || loadedUses == NULL)
+    exit(EXIT_FAILURE);
+
+  bool ok = true;
+
+  for (uint32_t i = 0; ok && i < header->funcCount; i++) {
+    ObjFunc *func              = newFunc();
+    loadedFuncs[loadedCount++] = func;
+    ok                         = loadFunc(&cur, end, func);
+  }
+
+  // Only a closure created by OP_LOCAL_CLOSURE is sure to be called from the
+  // frame that created it, so only it can use that frame's slots. That rules
+  // out the top level script, which has no caller.
+  for (uint32_t i = 0; ok && i < loadedCount; i++) {
+    FuncUse *use = &loadedUses[i];
+    ok           = use->parentSlots == 0 || (use->local && !use->closure);
+  }
+
+  // The top level script closes over nothing
+  ObjFunc *script = ok ? loadedFuncs[header->funcCount - 1] : NULL;
+  if (script != NULL && script->upvalueCount != 0)
+    script = NULL;
+
+  free(loadedFuncs);
+  free(loadedUses);
+  loadedFuncs = NULL;
+  loadedUses  = NULL;
+  loadedCount = 0;
+
+  return script;
+}
+
+// Creates the directory and any missing parents.
+static bool makeDirs(char *path) {
+  for (char *p = path + 1; *p != '\0'; p++) {
+    if (*p != '/')
+      continue;
+
+    *p      = '\0';
+    bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+    *p      = '/';
+
+    if (!ok)
+      return false;
+  }
+
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+bool imageCachePath(const ImageKey *key, char *path, size_t n) {
+  char dir[4096];
+  const char *env;
+
+  if ((env = getenv("ASBTL_CACHE_DIR")) != NULL && *env != '\0') {
+    snprintf(dir, sizeof(dir), "%s", env);
+  } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0') {
+    snprintf(dir, sizeof(dir), "%s/asbtl", env);
+  } else if ((env = getenv("HOME")) != NULL && *env != '\0') {
+    snprintf(dir, sizeof(dir), "%s/.cache/asbtl", env);
+  } else {
+    return false;
+  }
+
+  if (!makeDirs(dir))
+    return false;
+
+  // Each set of compiler options gets its own image of the same source
+  int written = snprintf(path, n, "%s/%016llx-%u.asbc", dir,
+                         (unsigned long long)key->sourceHash, key->flags);
+  return written > 0 && (size_t)written < n;
+}
+
+void markImageRoots() {
+  for (uint32_t i = 0; i < loadedCount; i++) {
+    markObj((Obj *)loadedFuncs[i]);
+  }
+}
@@ -0,0 +1,299 @@
+#include "ir.h"
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JUMP_LEN 3 // Opcode and a 2-byte operand
+
+// A forward jump whose operand is patched once its target block is placed
+typedef struct fixup {
+  unsigned int operandOffset;
+  int target;
+} Fixup;
+
+typedef struct lowering {
+  Chunk *out;
+  unsigned int *starts; // Offset each placed block starts at
+  Fixup *fixups;
+  int fixupCount;
+} Lowering;
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE ||
+         op == OP_JUMP_IF_TRUE;
+}
+
+void appendIrInstr(IrBlock *block, IrInstr instr) {
+  if (block->count >= block->capacity) {
+    int oldCap      = block->capacity;
+    block->capacity = GROW_CAPACITY(oldCap);
+    block->instrs =
+        GROW_ARRAY(IrInstr, block->instrs, oldCap, block->capacity);
+  }
+
+  block->instrs[block->count++] = instr;
+}
+
+static void initBlock(IrBlock *block, int index, int blockCount) {
+  block->instrs   = NULL;
+  block->count    = 0;
+  block->capacity = 0;
+  block->exit     = EXIT_NEXT;
+  block->branchOp = OP_JUMP_IF_FALSE;
+  block->target   = IR_NO_BLOCK;
+  block->next     = index + 1 < blockCount ? index + 1 : IR_NO_BLOCK;
+  block->exitLine = 0;
+  block->isLive   = true;
+}
+
+static IrInstr decodeInstr(Chunk *chunk, unsigned int offset) {
+  IrInstr instr = {chunk->code[offset], 0, chunk->lines[offset], NULL, 0};
+
+  if (instructionLen(chunk, offset) > 1)
+    instr.operand = chunk->code[offset + 1];
+
+  if (instr.op == OP_CLOSURE || instr.op == OP_LOCAL_CLOSURE) {
+    ObjFunc *func      = AS_FUNC(chunk->constants.values[instr.operand]);
+    instr.captures     = &chunk->code[offset + 2];
+    instr.captureCount = func->upvalueCount;
+  }
+
+  return instr;
+}
+
+void buildIr(IrFunc *ir, Chunk *chunk) {
+  ir->chunk      = chunk;
+  ir->blocks     = NULL;
+  ir->blockCount = 0;
+
+  // Find the leaders (first instruction of each block): the start, every jump
+  // target and whatever follows a jump or return. The end of the chunk only
+  // gets a block of its own when something jumps there.
+  bool *isLeader = ALLOCATE(bool, chunk->count + 1);
+  for (unsigned int i = 0; i <= chunk->count; i++) {
+    isLeader[i] = false;
+  }
+
+  isLeader[0]        = true;
+  bool isEndTargeted = false;
+
+  for (unsigned int offset = 0; offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    uint8_t op       = chunk->code[offset];
+    unsigned int len = instructionLen(chunk, offset);
+
+    if (isJump(op)) {
+      unsigned int target = jumpTarget(chunk, offset);
+      isLeader[target]    = true;
+      isEndTargeted       = isEndTargeted || target == chunk->count;
+    }
+
+    if (isJump(op) || op == OP_RETURN)
+      isLeader[offset + len] = true;
+  }
+
+  // Number the blocks in order of where they start
+  int *blockAt   = ALLOCATE(int, chunk->count + 1);
+  int blockCount = 0;
+
+  for (unsigned int i = 0; i < chunk->count; i++) {
+    blockAt[i] = isLeader[i] ? blockCount++ : IR_NO_BLOCK;
+  }
+
+  blockAt[chunk->count] = isEndTargeted ? blockCount++ : IR_NO_BLOCK;
+
+  ir->blocks     = ALLOCATE(IrBlock, blockCount);
+  ir->blockCount = blockCount;
+
+  for (int i = 0; i < blockCount; i++) {
+    initBlock(&ir->blocks[i], i, blockCount);
+  }
+
+  // Jumps and returns end a block, everything else is an instruction in it
+  IrBlock *block = NULL;
+
+  for (unsigned int offset = 0; offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    if (blockAt[offset] != IR_NO_BLOCK)
+      block = &ir->blocks[blockAt[offset]];
+
+    uint8_t op = chunk->code[offset];
+
+    if (isJump(op)) {
+      block->exit     = op == OP_JUMP || op == OP_LOOP ? EXIT_JUMP : EXIT_BRANCH;
+      block->branchOp = op == OP_JUMP_IF_TRUE ? OP_JUMP_IF_TRUE
+                                              : OP_JUMP_IF_FALSE;
+      block->target   = blockAt[jumpTarget(chunk, offset)];
+      block->exitLine = chunk->lines[offset];
+      continue;
+    }
+
+    appendIrInstr(block, decodeInstr(chunk, offset));
+
+    if (op == OP_RETURN)
+      block->exit = EXIT_RETURN;
+  }
+
+  FREE_ARRAY(int, blockAt, chunk->count + 1);
+  FREE_ARRAY(bool, isLeader, chunk->count + 1);
+}
+
+static bool hasOperand(OpCode op) {
+  switch (op) {
+    case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CONSTANT:
+    case OP_CALL:
+    case OP_IS_FUNC:
+    case OP_SLIDE:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_SET_UPVALUE:
+    case OP_GET_PARENT:
+    case OP_SET_PARENT:
+    case OP_GET_HOISTED:
+    case OP_CALL_NATIVE:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CLOSURE:
+    case OP_LOCAL_CLOSURE: return true;
+    default:               return false;
+  }
+}
+
+static void emitInstr(Chunk *out, IrInstr *instr) {
+  appendChunk(out, instr->op, instr->line);
+
+  if (hasOperand(instr->op))
+    appendChunk(out, instr->operand, instr->line);
+
+  for (int i = 0; i < instr->captureCount * 2; i++) {
+    appendChunk(out, instr->captures[i], instr->line);
+  }
+}
+
+static void emitShort(Chunk *out, unsigned int value, int line) {
+  appendChunk(out, (value >> 8) & 0xFF, line); // High byte
+  appendChunk(out, value & 0xFF, line);        // Low byte
+}
+
+/*
+ * Emits a jump to the target block. Blocks are placed in order, so a target at
+ * or before the current block has already been placed and is jumped back to.
+ * There is no backwards conditional jump, so one is emitted as the opposite
+ * jump over an OP_LOOP. Forward jumps are recorded to be patched later.
+ * Returns false if a backwards jump is too far.
+ */
+static bool emitJumpTo(Lowering *lowering, OpCode op, int current, int target,
+                       int line) {
+  Chunk *out = lowering->out;
+
+  if (target > current) {
+    appendChunk(out, op, line);
+
+    Fixup fixup                              = {out->count, target};
+    lowering->fixups[lowering->fixupCount++] = fixup;
+
+    emitShort(out, 0xFFFF, line);
+    return true;
+  }
+
+  if (op != OP_JUMP) {
+    appendChunk(out, op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE
+                                            : OP_JUMP_IF_FALSE,
+                line);
+    emitShort(out, JUMP_LEN, line);
+  }
+
+  unsigned int toJump = out->count + JUMP_LEN - lowering->starts[target];
+  if (toJump > UINT16_MAX)
+    return false;
+
+  appendChunk(out, OP_LOOP, line);
+  emitShort(out, toJump, line);
+  return true;
+}
+
+// Returns the live block placed after the given one, if any.
+static int followingBlock(IrFunc *ir, int index) {
+  for (int i = index + 1; i < ir->blockCount; i++) {
+    if (ir->blocks[i].isLive)
+      return i;
+  }
+
+  return IR_NO_BLOCK;
+}
+
+bool lowerIr(IrFunc *ir, Chunk *out) {
+  // Each block ends with at most two forward jumps
+  Lowering lowering = {out, ALLOCATE(unsigned int, ir->blockCount),
+                       ALLOCATE(Fixup, ir->blockCount * 2), 0};
+  bool ok           = true;
+
+  for (int i = 0; ok && i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+
+    if (!block->isLive)
+      continue;
+
+    lowering.starts[i] = out->count;
+    int following      = followingBlock(ir, i);
+
+    for (int j = 0; j < block->count; j++) {
+      emitInstr(out, &block->instrs[j]);
+    }
+
+    // Falling through to a block that isn't placed next needs a jump
+    int fallsTo = IR_NO_BLOCK;
+
+    switch (block->exit) {
+      case EXIT_RETURN: break;
+      case EXIT_NEXT:   fallsTo = block->next; break;
+      case EXIT_JUMP:   fallsTo = block->target; break;
+      case EXIT_BRANCH: {
+        ok      = emitJumpTo(&lowering, block->branchOp, i, block->target,
+                             block->exitLine);
+        fallsTo = block->next;
+        break;
+      }
+    }
+
+    if (ok && fallsTo != IR_NO_BLOCK && fallsTo != following)
+      ok = emitJumpTo(&lowering, OP_JUMP, i, fallsTo, block->exitLine);
+  }
+
+  for (int i = 0; ok && i < lowering.fixupCount; i++) {
+    Fixup *fixup = &lowering.fixups[i];
+    unsigned int toJump =
+        lowering.starts[fixup->target] - fixup->operandOffset - 2;
+
+    if (toJump > UINT16_MAX) {
+      ok = false;
+      break;
+    }
+
+    out->code[fixup->operandOffset]     = (toJump >> 8) & 0xFF; // High byte
+    out->code[fixup->operandOffset + 1] = toJump & 0xFF;        // Low byte
+  }
+
+  FREE_ARRAY(Fixup, lowering.fixups, ir->blockCount * 2);
+  FREE_ARRAY(unsigned int, lowering.starts, ir->blockCount);
+  return ok;
+}
+
+void freeIr(IrFunc *ir) {
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+    FREE_ARRAY(IrInstr, block->instrs, block->capacity);
+  }
+
+  FREE_ARRAY(IrBlock, ir->blocks, ir->blockCount);
+  ir->blocks     = NULL;
+  ir->blockCount = 0;
+}
@@ -1,21 +1,58 @@
+#include "compiler.h"
+#include "image.h"
+#include "source.h"
+#include "stats.h"
 #include "vm.h"
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
 #include <sysexits.h>
+#include <unistd.h>
+
+#define JOBS_MAX 256
+
+// Command line options, applied once the VM has been initialized.
+static bool hasOutputMode = false;
+static OutputMode outputMode;
+static bool useImageCache    = false;
+static const char *imagePath = NULL; // Compile to this image instead of running
+static OptLevel optLevel     = OPT_NONE;
+static int inlineLimit       = INLINE_LIMIT_DEFAULT;
+static Backend backend       = BACKEND_STACK;
+static int jobs              = 0; // Scripts compiled at once, 0 for one per CPU
+static bool lazyCompile      = false;
+
+// Reported on stderr for each script with --stats
+static bool showStats          = false;
+static StatsFormat statsFormat = STATS_TEXT;
+
+static void applyOptions() {
+  if (hasOutputMode)
+    vm.outputMode = outputMode;
+
+  vm.backend = backend;
+
+  setOptLevel(optLevel);
+  setInlineLimit(inlineLimit);
+}
 
 static void repl() {
   initVM();
+  applyOptions();
 
   char *line  = NULL;
   size_t size = 0;
   ssize_t nread;
 
-  printf("Welcome to ASBTL - A Stack Based Toy Language\n");
+  printOutput("Welcome to ASBTL - A Stack Based Toy Language\n");
 
   while (true) {
-    printf("> ");
+    printOutput("> ");
+    flushOutput(); // Show everything printed so far before blocking on input
 
     if ((nread = getline(&line, &size, stdin)) == -1) {
       break;
@@ -32,68 +69,520 @@ static void repl() {
   freeVM();
 }
 
-char *readFile(const char *path) {
-  FILE *file = fopen(path, "r");
-  if (file == NULL) {
-    fprintf(stderr, "could not open file '%s'\n", path);
-    exit(EX_IOERR);
+// Images are only reused when compiled with the same options.
+static ImageKey imageKey(Source *source) {
+  ImageKey key = {hashSource(source->chars, source->len),
+                  optLevel | (uint32_t)inlineLimit << 8};
+  return key;
+}
+
+// Looks for an image of the source in the cache, otherwise compiles it and
+// stores the image for next time. Returns NULL on a compile error.
+static ObjFunc *compileCached(Source *source) {
+  ImageKey key = imageKey(source);
+
+  char cachePath[4096];
+  if (!imageCachePath(&key, cachePath, sizeof(cachePath)))
+    return compile(source->chars);
+
+  Source cached;
+  if (tryReadSource(&cached, cachePath)) {
+    ObjFunc *func = loadImage(cached.chars, cached.len, &key);
+    freeSource(&cached);
+
+    if (func != NULL)
+      return func;
   }
 
-  if (fseek(file, 0, SEEK_END) == -1) {
-    perror("fseek");
-    exit(EX_IOERR);
+  // Missing, stale or from another version, so (re)build it.
+  ObjFunc *func = compile(source->chars);
+  if (func != NULL) {
+    writeImage(func, &key, cachePath);
   }
 
-  long bytes = ftell(file);
-  if (bytes == -1) {
-    perror("ftell");
-    exit(EX_IOERR);
+  return func;
+}
+
+// Prints the stats to stderr when asked for with --stats.
+static void reportStats(Stats *stats) {
+  if (showStats)
+    printStats(stats, statsFormat, stderr);
+
+  freeStats(stats);
+}
+
+// Times compiling the source, or loading the image, and what it allocates.
+static ObjFunc *timeCompile(Source *source, Stats *stats,
+                            ObjFunc *(*compileSource)(Source *source)) {
+  size_t objs = vm.objsAllocated;
+
+  startPhase(stats);
+  ObjFunc *func = compileSource(source);
+  endPhase(stats, PHASE_COMPILE);
+
+  stats->compileObjs = vm.objsAllocated - objs;
+  return func;
+}
+
+// Records what compiling and running the script did, once it has finished. As
+// nothing is allocated after it returns, its functions are still in the heap,
+// including the bodies compiled on their first call.
+static void collectStats(Stats *stats, ObjFunc *func) {
+  if (!showStats)
+    return;
+
+  collectRunStats(stats);
+  if (func != NULL)
+    collectFuncStats(stats, func);
+}
+
+static ObjFunc *compileText(Source *source) {
+  return compile(source->chars);
+}
+
+static ObjFunc *loadSourceImage(Source *source) {
+  return loadImage(source->chars, source->len, NULL);
+}
+
+// Writes the compiled script to the image path instead of running it.
+static void compileFile(Source *source, Stats *stats) {
+  ImageKey key  = imageKey(source);
+  ObjFunc *func = timeCompile(source, stats, compileText);
+
+  bool ok = func != NULL && writeImage(func, &key, imagePath);
+  if (func != NULL && !ok) {
+    fprintf(stderr, "could not write image '%s'\n", imagePath);
   }
 
-  if (fseek(file, 0, SEEK_SET) == -1) {
-    perror("fseek");
-    exit(EX_IOERR);
+  collectStats(stats, func);
+
+  reportStats(stats);
+  freeSource(source);
+  freeVM();
+
+  if (!ok)
+    exit(EXIT_FAILURE);
+}
+
+void runFile(const char *path) {
+  initVM();
+  applyOptions();
+
+  Stats stats;
+  initStats(&stats, path);
+
+  Source source;
+  startPhase(&stats);
+  readSource(&source, path);
+  endPhase(&stats, PHASE_READ);
+
+  bool image = isImage(source.chars, source.len);
+  if (showStats && !image) {
+    startPhase(&stats);
+    stats.tokens = countTokens(source.chars);
+    endPhase(&stats, PHASE_SCAN);
   }
 
-  char *source = malloc(bytes + 1); // Extra byte for '\0'
-  if (source == NULL) {
-    perror("malloc");
-    exit(EX_IOERR);
+  // The source is freed only once nothing compiled from it is used, so strings
+  // compiled from it can point into it.
+  setRetainedSource(true);
+
+  ObjFunc *func;
+
+  if (image) {
+    func = timeCompile(&source, &stats, loadSourceImage);
+
+    if (func == NULL) {
+      fprintf(stderr, "invalid or incompatible image '%s'\n", path);
+      reportStats(&stats);
+      freeSource(&source);
+      freeVM();
+      exit(EX_DATAERR);
+    }
+  } else if (imagePath != NULL) {
+    compileFile(&source, &stats);
+    return;
+  } else if (useImageCache) {
+    func = timeCompile(&source, &stats, compileCached);
+  } else {
+    // The source is kept until the script finishes, so with --lazy bodies can
+    // be compiled on their first call.
+    setLazyCompile(lazyCompile);
+    func = timeCompile(&source, &stats, compileText);
   }
 
-  long bytesRead = fread(source, sizeof(char), bytes, file);
-  if (bytesRead < bytes) {
-    fprintf(stderr, "failed to read file '%s'\n", path);
-    exit(EX_IOERR);
+  InterpretResult result = INTERPRET_COMPILER_ERR;
+  if (func != NULL) {
+    startPhase(&stats);
+    result = interpretFunc(func);
+    endPhase(&stats, PHASE_RUN);
   }
 
-  fclose(file);
+  collectStats(&stats, func);
+  flushOutput(); // Keep the program's output ahead of its stats
+  reportStats(&stats);
+  freeSource(&source);
+  freeVM();
 
-  source[bytes] = '\0';
-  return source;
+  if (result != INTERPRET_OK)
+    exit(EXIT_FAILURE);
 }
 
-void runFile(const char *path) {
+/*
+ * Compiles a script, or loads an image, and writes it as an image. Used by each
+ * worker process when compiling several scripts, where it's all the work the
+ * process does. Returns false if the script can't be compiled or written.
+ */
+static bool writeScriptImage(const char *path, const char *image) {
   initVM();
+  applyOptions();
+
+  Source source;
+  if (!tryReadSource(&source, path)) {
+    fprintf(stderr, "could not open file '%s'\n", path);
+    freeVM();
+    return false;
+  }
 
-  char *source = readFile(path);
+  ImageKey key = imageKey(&source);
+  ObjFunc *func;
 
-  InterpretResult result = interpret(source);
+  if (isImage(source.chars, source.len)) {
+    func = loadImage(source.chars, source.len, NULL);
 
-  free(source);
+    if (func == NULL)
+      fprintf(stderr, "invalid or incompatible image '%s'\n", path);
+  } else if (useImageCache) {
+    func = compileCached(&source);
+  } else {
+    func = compile(source.chars);
+  }
+
+  bool ok = func != NULL && writeImage(func, &key, image);
+  if (func != NULL && !ok) {
+    fprintf(stderr, "could not write image '%s'\n", image);
+  }
+
+  freeSource(&source);
   freeVM();
+  return ok;
+}
 
-  if (result != INTERPRET_OK)
+/*
+ * Compiles each script to its image, running up to `jobs` worker processes at
+ * once. Each has its own VM, so they share neither the compiler's state nor a
+ * heap. Sets whether each one succeeded.
+ */
+static void writeScriptImages(char **paths, char **images, int count,
+                              bool *compiled) {
+  int workers = jobs > 0 ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  pid_t *pids = malloc(sizeof(pid_t) * count);
+  int running = 0;
+
+  if (pids == NULL)
     exit(EXIT_FAILURE);
+
+  for (int next = 0; next < count || running > 0;) {
+    if (next < count && running < workers) {
+      pid_t pid = fork();
+
+      if (pid == 0)
+        _exit(writeScriptImage(paths[next], images[next]) ? EXIT_SUCCESS
+                                                          : EXIT_FAILURE);
+
+      // Without another process, compile it in this one instead
+      if (pid == -1) {
+        compiled[next] = writeScriptImage(paths[next], images[next]);
+      } else {
+        running++;
+      }
+
+      pids[next++] = pid;
+      continue;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+
+    if (pid == -1 && errno == EINTR)
+      continue;
+
+    // The scripts still compiling can't be waited for, so count them failed
+    if (pid == -1) {
+      fprintf(stderr, "could not wait for scripts to compile\n");
+      break;
+    }
+
+    running--;
+
+    for (int i = 0; i < next; i++) {
+      if (pids[i] == pid)
+        compiled[i] = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    }
+  }
+
+  free(pids);
+}
+
+// Where the image of each script is written when compiling several. Into the
+// --compile directory named after the script, otherwise numbered in order.
+static char *scriptImagePath(const char *dir, const char *path, int index) {
+  char image[4096];
+
+  if (imagePath != NULL) {
+    const char *name = strrchr(path, '/');
+    name             = name != NULL ? name + 1 : path;
+
+    const char *ext = strrchr(name, '.');
+    int nameLen     = ext != NULL && ext != name ? (int)(ext - name)
+                                                  : (int)strlen(name);
+
+    snprintf(image, sizeof(image), "%s/%.*s.asbc", dir, nameLen, name);
+  } else {
+    snprintf(image, sizeof(image), "%s/%d.asbc", dir, index);
+  }
+
+  return strdup(image);
+}
+
+/*
+ * Compiles several scripts in parallel, then runs them one after another in the
+ * order given, each in a fresh VM. A script that fails to compile or run
+ * doesn't stop the rest, but makes the exit status a failure. With --compile,
+ * only writes their images into that directory.
+ */
+static void runFiles(char **paths, int count) {
+  char tmpDir[4096];
+  const char *dir = imagePath;
+
+  if (dir == NULL) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf(tmpDir, sizeof(tmpDir), "%s/asbtl.XXXXXX",
+             tmp != NULL && tmp[0] != '\0' ? tmp : "/tmp");
+
+    if (mkdtemp(tmpDir) == NULL) {
+      fprintf(stderr, "could not create a directory for images\n");
+      exit(EX_CANTCREAT);
+    }
+
+    dir = tmpDir;
+  }
+
+  char **images  = malloc(sizeof(char *) * count);
+  bool *compiled = calloc(count, sizeof(bool));
+
+  if (images == NULL || compiled == NULL)
+    exit(EXIT_FAILURE);
+
+  for (int i = 0; i < count; i++) {
+    images[i] = scriptImagePath(dir, paths[i], i);
+  }
+
+  // Scripts with the same name in different directories would overwrite each
+  // other's image in the --compile directory.
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < i; j++) {
+      if (strcmp(images[i], images[j]) == 0) {
+        fprintf(stderr, "'%s' and '%s' would both compile to '%s'\n",
+                paths[j], paths[i], images[i]);
+        exit(EX_USAGE);
+      }
+    }
+  }
+
+  writeScriptImages(paths, images, count, compiled);
+
+  bool ok = true;
+
+  for (int i = 0; i < count; i++) {
+    if (!compiled[i]) {
+      ok = false;
+    } else if (imagePath == NULL) {
+      initVM();
+      applyOptions();
+
+      Stats stats;
+      initStats(&stats, paths[i]);
+
+      Source image;
+      startPhase(&stats);
+      readSource(&image, images[i]);
+      endPhase(&stats, PHASE_READ);
+
+      ObjFunc *func = timeCompile(&image, &stats, loadSourceImage);
+      if (func != NULL) {
+        startPhase(&stats);
+        ok &= interpretFunc(func) == INTERPRET_OK;
+        endPhase(&stats, PHASE_RUN);
+      } else {
+        ok = false;
+      }
+
+      collectStats(&stats, func);
+
+      flushOutput();
+      reportStats(&stats);
+      freeSource(&image);
+      freeVM();
+      unlink(images[i]);
+    }
+
+    free(images[i]);
+  }
+
+  if (imagePath == NULL)
+    rmdir(tmpDir);
+
+  free(images);
+  free(compiled);
+
+  if (!ok)
+    exit(EXIT_FAILURE);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [--buffer=full|line|none] [--cache] [--compile=image] "
+          "[-O0|-O1|-O2] [--inline-limit=bytes] [--jobs=n] [--lazy] "
+          "[--stats[=text|json]] [--vm=stack|register] [script...]\n",
+          program);
+  exit(EX_USAGE);
+}
+
+static bool parseOutputMode(const char *mode) {
+  if (strcmp(mode, "full") == 0) {
+    outputMode = OUTPUT_FULL;
+  } else if (strcmp(mode, "line") == 0) {
+    outputMode = OUTPUT_LINE;
+  } else if (strcmp(mode, "none") == 0) {
+    outputMode = OUTPUT_UNBUFFERED;
+  } else {
+    return false;
+  }
+
+  hasOutputMode = true;
+  return true;
+}
+
+static bool parseBackend(const char *name) {
+  if (strcmp(name, "stack") == 0) {
+    backend = BACKEND_STACK;
+  } else if (strcmp(name, "register") == 0) {
+    backend = BACKEND_REGISTER;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+// Parses the level in -O<level>, which is a single digit.
+static bool parseOptLevel(const char *level) {
+  if (level[0] < '0' || level[0] > '0' + OPT_LEVEL_MAX || level[1] != '\0')
+    return false;
+
+  optLevel = (OptLevel)(level[0] - '0');
+  return true;
+}
+
+static bool parseStatsFormat(const char *format) {
+  if (strcmp(format, "text") == 0) {
+    statsFormat = STATS_TEXT;
+  } else if (strcmp(format, "json") == 0) {
+    statsFormat = STATS_JSON;
+  } else {
+    return false;
+  }
+
+  showStats = true;
+  return true;
+}
+
+static bool parseJobs(const char *count) {
+  char *end;
+  long value = strtol(count, &end, 10);
+
+  if (end == count || *end != '\0' || value < 1 || value > JOBS_MAX)
+    return false;
+
+  jobs = (int)value;
+  return true;
+}
+
+static bool parseInlineLimit(const char *limit) {
+  char *end;
+  long value = strtol(limit, &end, 10);
+
+  if (end == limit || *end != '\0' || value < 0 || value > INLINE_LIMIT_MAX)
+    return false;
+
+  inlineLimit = (int)value;
+  return true;
 }
 
 int main(int argc, char *argv[]) {
-  if (argc == 1) {
+#define BUFFER_OPTION  "--buffer="
+#define COMPILE_OPTION "--compile="
+#define INLINE_OPTION  "--inline-limit="
+#define JOBS_OPTION    "--jobs="
+#define STATS_OPTION   "--stats="
+#define VM_OPTION      "--vm="
+  // The scripts are gathered at the front of argv, after the program name
+  char **paths  = argv + 1;
+  int pathCount = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+
+    if (strncmp(arg, BUFFER_OPTION, strlen(BUFFER_OPTION)) == 0) {
+      if (!parseOutputMode(arg + strlen(BUFFER_OPTION)))
+        usage(argv[0]);
+    } else if (strncmp(arg, COMPILE_OPTION, strlen(COMPILE_OPTION)) == 0) {
+      imagePath = arg + strlen(COMPILE_OPTION);
+    } else if (strncmp(arg, INLINE_OPTION, strlen(INLINE_OPTION)) == 0) {
+      if (!parseInlineLimit(arg + strlen(INLINE_OPTION)))
+        usage(argv[0]);
+    } else if (strncmp(arg, JOBS_OPTION, strlen(JOBS_OPTION)) == 0) {
+      if (!parseJobs(arg + strlen(JOBS_OPTION)))
+        usage(argv[0]);
+    } else if (strncmp(arg, STATS_OPTION, strlen(STATS_OPTION)) == 0) {
+      if (!parseStatsFormat(arg + strlen(STATS_OPTION)))
+        usage(argv[0]);
+    } else if (strncmp(arg, VM_OPTION, strlen(VM_OPTION)) == 0) {
+      if (!parseBackend(arg + strlen(VM_OPTION)))
+        usage(argv[0]);
+    } else if (strncmp(arg, "-O", 2) == 0) {
+      if (!parseOptLevel(arg + 2))
+        usage(argv[0]);
+    } else if (strcmp(arg, "--cache") == 0) {
+      useImageCache = true;
+    } else if (strcmp(arg, "--lazy") == 0) {
+      lazyCompile = true;
+    } else if (strcmp(arg, "--stats") == 0) {
+      showStats = true;
+    } else if (arg[0] != '-') {
+      paths[pathCount++] = argv[i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  // There is nothing to compile into an image or report on from the REPL
+  if (pathCount == 0 && (imagePath != NULL || showStats))
+    usage(argv[0]);
+
+  if (pathCount == 0) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  } else if (pathCount == 1) {
+    runFile(paths[0]);
   } else {
-    fprintf(stderr, "usage: %s [script]\n", argv[0]);
-    exit(EX_USAGE);
+    runFiles(paths, pathCount);
   }
+
+#undef VM_OPTION
+#undef STATS_OPTION
+#undef JOBS_OPTION
+#undef INLINE_OPTION
+#undef COMPILE_OPTION
+#undef BUFFER_OPTION
 }
@@ -1,32 +1,62 @@
 #include "memory.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "file.h"
+#include "image.h"
 #include "object.h"
 #include "vm.h"
 
 #include "debug.h"
 
-#ifdef DEBUG_MODE
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef COMPRESSED_REFS
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #endif
 
-#include <stdlib.h>
-
 #define GC_HEAP_GROW_FACTOR 2
 
-void *reallocate(void *ptr, size_t newSize, size_t oldSize) {
-  vm.bytesAllocated += newSize - oldSize;
-
-  if (newSize > oldSize) {
+// An unused slot in a pool, linked to the next one on the free list
+typedef struct free_slot {
+  Obj obj;
+  Obj *next;
+} FreeSlot;
+
+static const size_t slotSizes[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING]  = sizeof(ObjString),
+    [OBJ_FUNC]    = sizeof(ObjFunc),
+    [OBJ_NATIVE]  = sizeof(ObjNative),
+    [OBJ_CLOSURE] = sizeof(ObjClosure),
+    [OBJ_UPVALUE] = sizeof(ObjUpvalue),
+    [OBJ_FILE]    = sizeof(ObjFile),
+};
+
+#define SLOTS_PER_PAGE(type) \
+  ((OBJ_PAGE_SIZE - sizeof(ObjPage)) / slotSizes[type])
+
+#define PAGE_SLOT(page, type, i) \
+  ((Obj *)((char *)((page) + 1) + (i) * slotSizes[type]))
+
+// Called as the heap grows
+static void collectIfDue() {
 #ifdef DEBUG_STRESS_GC
-    // Trigger the GC everytime we allocate memory (when debugging)
-    collectGarbage();
+  // Trigger the GC everytime we allocate memory (when debugging)
+  collectGarbage();
 #endif
 
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
-    }
+  if (vm.bytesAllocated > vm.nextGC) {
+    collectGarbage();
   }
+}
+
+void *reallocate(void *ptr, size_t newSize, size_t oldSize) {
+  vm.bytesAllocated += newSize - oldSize;
+
+  if (newSize > oldSize)
+    collectIfDue();
 
   if (newSize == 0) {
     free(ptr);
@@ -41,14 +71,109 @@ void *reallocate(void *ptr, size_t newSize, size_t oldSize) {
   return result;
 }
 
+#ifdef COMPRESSED_REFS
+// Reserved once for the whole process. Pages are handed out in order and the
+// ones given back are reused before the region grows, so it is never unmapped.
+#define HEAP_REGION_SIZE ((size_t)UINT32_MAX + 1)
+
+char *heapRegion = NULL;
+static size_t regionUsed;
+static ObjPage *regionFreePages;
+
+static ObjPage *newPage() {
+  if (regionFreePages != NULL) {
+    ObjPage *page   = regionFreePages;
+    regionFreePages = page->next;
+    return page;
+  }
+
+  if (heapRegion == NULL) {
+    // Only address space is reserved, the kernel backs pages as they are used.
+    void *region = mmap(NULL, HEAP_REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (region == MAP_FAILED) {
+      perror("could not reserve the object heap");
+      exit(EXIT_FAILURE);
+    }
+
+    heapRegion = region;
+    regionUsed = OBJ_PAGE_SIZE; // So no object is at offset 0, the NULL ref
+  }
+
+  if (regionUsed + OBJ_PAGE_SIZE > HEAP_REGION_SIZE) {
+    fprintf(stderr, "object heap exhausted\n");
+    exit(EXIT_FAILURE);
+  }
+
+  ObjPage *page = (ObjPage *)(heapRegion + regionUsed);
+  regionUsed += OBJ_PAGE_SIZE;
+  return page;
+}
+
+static void releasePage(ObjPage *page) {
+  page->next      = regionFreePages;
+  regionFreePages = page;
+}
+#else
+static ObjPage *newPage() {
+  ObjPage *page = malloc(OBJ_PAGE_SIZE);
+
+  if (page == NULL)
+    exit(EXIT_FAILURE);
+
+  return page;
+}
+
+static void releasePage(ObjPage *page) {
+  free(page);
+}
+#endif
+
+static Obj *pushFreeSlot(Obj *freeSlots, Obj *slot) {
+  slot->type               = OBJ_FREE;
+  slot->isMarked           = false;
+  ((FreeSlot *)slot)->next = freeSlots;
+  return slot;
+}
+
+static void addPage(ObjPool *pool, ObjType type) {
+  ObjPage *page = newPage();
+  page->next    = pool->pages;
+  pool->pages   = page;
+  pool->pageCount++;
+
+  // Pushed last to first so the slots are taken in address order
+  for (size_t i = SLOTS_PER_PAGE(type); i > 0; i--) {
+    Obj *slot       = PAGE_SLOT(page, type, i - 1);
+    pool->freeSlots = pushFreeSlot(pool->freeSlots, slot);
+  }
+}
+
+Obj *takeSlot(ObjType type) {
+  // Objects are accounted for like any other allocation, so the collector runs
+  // as often as it did before they were pooled.
+  vm.bytesAllocated += slotSizes[type];
+  collectIfDue();
+
+  ObjPool *pool = &vm.pools[type];
+  if (pool->freeSlots == NULL)
+    addPage(pool, type);
+
+  Obj *slot       = pool->freeSlots;
+  pool->freeSlots = ((FreeSlot *)slot)->next;
+  pool->live++;
+  return slot;
+}
+
 void markObj(Obj *obj) {
   if (obj == NULL || obj->isMarked)
     return;
 
 #ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void *)obj);
+  printOutput("%p mark ", (void *)obj);
   printObj(OBJ_VAL(obj));
-  printf("\n");
+  printOutput("\n");
 #endif
 
   obj->isMarked = true;
@@ -56,7 +181,8 @@ void markObj(Obj *obj) {
   // When an object turns gray, add to the worklist (seen but not processed yet)
   if (vm.grayCount >= vm.grayCapacity) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCount);
+    vm.grayStack =
+        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
 
     if (vm.grayStack == NULL)
       exit(EXIT_FAILURE);
@@ -80,27 +206,29 @@ static void markList(ValueList *list) {
 // Traverse the single object's references (marks )
 static void blackenObj(Obj *obj) {
 #ifdef DEBUG_LOG_GC
-  printf("%p blacken", (void *)obj);
+  printOutput("%p blacken", (void *)obj);
   printValue(OBJ_VAL(obj));
-  printf("\n");
+  printOutput("\n");
 #endif
 
-  switch (obj->type) {
+  switch ((ObjType)obj->type) {
     case OBJ_NATIVE:
+    case OBJ_FILE:
     case OBJ_STRING:  break;
     case OBJ_UPVALUE: markValue(((ObjUpvalue *)obj)->closed); break;
     case OBJ_FUNC:    {
       ObjFunc *func = (ObjFunc *)obj;
       markObj((Obj *)func->name);
+      markObj((Obj *)func->localClosure);
       markList(&func->chunk.constants);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure *closure = (ObjClosure *)obj;
-      markObj((Obj *)closure->func);
+      markObj((Obj *)CLOSURE_FUNC(closure));
 
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObj((Obj *)closure->upvalues[i]);
+        markValue(closure->upvalues[i]);
       }
 
       break;
@@ -109,40 +237,38 @@ static void blackenObj(Obj *obj) {
 }
 
 static void freeObj(Obj *obj) {
-#ifdef DEBUG_STRESS_GC
-  printf("%p free type %d\n", (void *)obj, obj->type);
+#ifdef DEBUG_LOG_GC
+  printOutput("%p free type %d\n", (void *)obj, obj->type);
 #endif
 
-  switch (obj->type) {
+  // The slot itself goes back to its pool, only what the object owns is freed
+  switch ((ObjType)obj->type) {
     case OBJ_STRING: {
       ObjString *str = (ObjString *)obj;
-      FREE_ARRAY(char, (char *)str->chars, str->len + 1); // + 1 for null byte
-      FREE(ObjString, str);
+      if (str->ownsChars)
+        FREE_ARRAY(char, (char *)str->chars, str->len + 1); // + 1 for null byte
       break;
     }
     case OBJ_FUNC: {
       ObjFunc *func = (ObjFunc *)obj;
       freeChunk(&func->chunk);
-      FREE(ObjFunc, func);
-      break;
-    }
-    case OBJ_NATIVE: {
-      ObjNative *native = (ObjNative *)obj;
-      FREE(ObjNative, native);
+      freeRegCode(&func->regCode);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure *closure = (ObjClosure *)obj;
-      FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, closure);
+      FREE_ARRAY(Value, closure->upvalues, closure->upvalueCount);
       break;
     }
-    case OBJ_UPVALUE: {
-      ObjUpvalue *upvalue = (ObjUpvalue *)obj;
-      FREE(ObjUpvalue, upvalue);
+    case OBJ_FILE:
+      // Unreachable files are closed by the collector
+      closeFile((ObjFile *)obj);
       break;
-    }
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE: break;
   }
+
+  vm.bytesAllocated -= slotSizes[obj->type];
 }
 
 static void markRoots() {
@@ -157,11 +283,18 @@ static void markRoots() {
   ObjUpvalue *upvalue = vm.openUpvalues;
   while (upvalue != NULL) {
     markObj((Obj *)upvalue);
-    upvalue = upvalue->next;
+    upvalue = UPVALUE_NEXT(upvalue);
   }
 
   markHashTable(&vm.globals);
+  markHashTable(&vm.constGlobals);
+  markStringCache();
+
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    markObj((Obj *)vm.natives[i]);
+  }
   markCompilerRoots();
+  markImageRoots();
 }
 
 static void traceReferences() {
@@ -173,66 +306,123 @@ static void traceReferences() {
   }
 }
 
-static void sweep() {
-  Obj *prev = NULL, *cur = NULL;
+// Frees the pool's unmarked objects and rebuilds its free list, giving back
+// the pages left empty.
+static void sweepPool(ObjPool *pool, ObjType type) {
+  ObjPage **page = &pool->pages;
+  Obj *freeSlots = NULL;
+  size_t perPage = SLOTS_PER_PAGE(type);
+  pool->live     = 0;
+
+  while (*page != NULL) {
+    Obj *pageStart = freeSlots; // The free list before this page's slots
+    size_t live    = 0;
+
+    for (size_t i = perPage; i > 0; i--) {
+      Obj *obj = PAGE_SLOT(*page, type, i - 1);
+
+      // If an object is marked (black), pass it.
+      if (obj->isMarked) {
+        obj->isMarked = false; // Turn white for next GC cycle
+        live++;
+        continue;
+      }
 
-  // Walk the linked list of the VM's tracked objects on the heap
-  while (cur != NULL) {
+      // If it is unmarked (white - not grey, as worklist is now empty), free
+      // it, and either way the slot is now unused.
+      if (obj->type != OBJ_FREE)
+        freeObj(obj);
 
-    // If an object is marked (black), pass it.
-    if (cur->isMarked) {
-      cur->isMarked = false; // Turn white for next GC cycle
-      prev          = cur;
-      cur           = cur->next;
-      return;
+      freeSlots = pushFreeSlot(freeSlots, obj);
     }
 
-    // If it is unmarked (white - not grey, as worklist is now empty), unlink
-    // it from the list and free it.
+    if (live == 0) {
+      ObjPage *empty = *page;
+      *page          = empty->next;
+      freeSlots      = pageStart;
+      pool->pageCount--;
+      releasePage(empty);
+      continue;
+    }
 
-    Obj *unreached = cur;
-    cur            = cur->next;
+    pool->live += live;
+    page        = &(*page)->next;
+  }
 
-    if (prev != NULL) {
-      prev->next = cur;
-    } else {
-      vm.objs = cur;
-    }
+  pool->freeSlots = freeSlots;
+}
 
-    freeObj(unreached);
+static void sweep() {
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    sweepPool(&vm.pools[type], type);
   }
 }
 
 // Mark and sweep
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
-  printf("-- GC Begin\n");
+  printOutput("-- GC Begin\n");
   size_t before = vm.bytesAllocated;
 #endif
 
+  struct timespec start, traced, swept;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   markRoots();
   traceReferences();
   hashTableRemoveWhite(&vm.strings);
+  clock_gettime(CLOCK_MONOTONIC, &traced);
+
   sweep();
+  clock_gettime(CLOCK_MONOTONIC, &swept);
+
+  vm.collections++;
+  vm.traceTime += (traced.tv_sec - start.tv_sec) +
+                  (traced.tv_nsec - start.tv_nsec) / 1e9;
+  vm.sweepTime += (swept.tv_sec - traced.tv_sec) +
+                  (swept.tv_nsec - traced.tv_nsec) / 1e9;
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
-  printf("-- GC End\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+  printOutput("-- GC End\n");
+  printOutput("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+              before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
 #endif
 }
 
 void freeObjs() {
-  Obj *cur = vm.objs;
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    ObjPool *pool = &vm.pools[type];
+
+    while (pool->pages != NULL) {
+      ObjPage *page = pool->pages;
+      pool->pages   = page->next;
 
-  while (cur != NULL) {
-    Obj *next = cur->next;
-    freeObj(cur);
-    cur = next;
+      for (size_t i = 0; i < SLOTS_PER_PAGE(type); i++) {
+        Obj *obj = PAGE_SLOT(page, type, i);
+        if (obj->type != OBJ_FREE)
+          freeObj(obj);
+      }
+
+      releasePage(page);
+    }
+
+    pool->freeSlots = NULL;
+    pool->pageCount = 0;
+    pool->live      = 0;
   }
 
-  vm.objs = NULL;
   free(vm.grayStack);
 }
+
+void heapUsage(size_t *objs, size_t *bytes) {
+  *objs  = 0;
+  *bytes = 0;
+
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    *objs += vm.pools[type].live;
+    *bytes += vm.pools[type].pageCount * OBJ_PAGE_SIZE;
+  }
+}
+
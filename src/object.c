@@ -10,49 +10,53 @@
 #define FNV_32_OFFSET_BASIS         2166136261u
 #define FNV_32_PRIME                16777619
 
-#define ALLOCATE_OBJ(type, objType) (type *)allocateObj(sizeof(type), objType)
+// Below this size the intern table simply grows when full
+#define STRINGS_COLLECT_MIN         1024
 
-static Obj *allocateObj(size_t size, ObjType type) {
-  Obj *obj      = reallocate(NULL, size, 0);
+#define ALLOCATE_OBJ(type, objType) (type *)allocateObj(objType)
+
+static Obj *allocateObj(ObjType type) {
+  Obj *obj      = takeSlot(type);
   obj->type     = type;
   obj->isMarked = false;
-
-  // Prepend allocated object to VM's intrusive linked list
-  obj->next = vm.objs;
-  vm.objs   = obj;
+  vm.objsAllocated++;
 
 #ifdef DEBUG_LOG_GC
-  printf("%p allocate %zu for %d\n", (void *)obj, size, type);
+  printOutput("%p allocate for %d\n", (void *)obj, type);
 #endif
 
   return obj;
 }
 
 ObjFunc *newFunc() {
-  ObjFunc *func      = ALLOCATE_OBJ(ObjFunc, OBJ_FUNC);
-  func->arity        = 0;
-  func->name         = NULL;
-  func->upvalueCount = 0;
+  ObjFunc *func         = ALLOCATE_OBJ(ObjFunc, OBJ_FUNC);
+  func->arity           = 0;
+  func->name            = NULL;
+  func->upvalueCount    = 0;
+  func->localClosure    = NULL;
+  func->lazyStart.start = NULL;
 
   initChunk(&func->chunk);
+  initRegCode(&func->regCode);
 
   return func;
 }
 
-ObjNative *newNative(NativeFn func) {
+ObjNative *newNative(NativeFn func, int arity) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->func      = func;
+  native->arity     = arity;
   return native;
 }
 
 ObjClosure *newClosure(ObjFunc *func) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, func->upvalueCount);
+  Value *upvalues = ALLOCATE(Value, func->upvalueCount);
   for (int i = 0; i < func->upvalueCount; i++) {
-    upvalues[i] = NULL;
+    upvalues[i] = NIL_VAL;
   }
 
   ObjClosure *closure   = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-  closure->func         = func;
+  closure->func         = ENCODE_REF(func);
   closure->upvalues     = upvalues;
   closure->upvalueCount = func->upvalueCount;
   return closure;
@@ -61,18 +65,39 @@ ObjClosure *newClosure(ObjFunc *func) {
 ObjUpvalue *newUpvalue(Value *slot) {
   ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location   = slot;
-  upvalue->next       = NULL;
+  upvalue->next       = ENCODE_REF(NULL);
   upvalue->closed     = NIL_VAL;
   return upvalue;
 }
 
-static ObjString *allocateObjString(char *chars, int n, uint32_t hash) {
+ObjFile *newFile(int fd) {
+  ObjFile *file  = ALLOCATE_OBJ(ObjFile, OBJ_FILE);
+  file->fd       = fd;
+  file->buf      = NULL;
+  file->capacity = 0;
+  file->start    = 0;
+  file->end      = 0;
+  file->eof      = false;
+  return file;
+}
+
+static ObjString *allocateObjString(const char *chars, int n, uint32_t hash,
+                                    bool ownsChars) {
   ObjString *str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   str->chars     = chars;
   str->len       = n;
   str->hash      = hash;
+  str->ownsChars = ownsChars;
 
   push(OBJ_VAL(str));
+
+  // Collect before growing a large intern table, so slots held by strings that
+  // are already garbage (e.g. lines read from a file) are reused instead.
+  if (vm.strings.capacity >= STRINGS_COLLECT_MIN &&
+      hashTableIsFull(&vm.strings)) {
+    collectGarbage();
+  }
+
   hashTableSet(&vm.strings, str, NIL_VAL);
   pop();
 
@@ -80,8 +105,8 @@ static ObjString *allocateObjString(char *chars, int n, uint32_t hash) {
 }
 
 ObjString makeObjString(const char *chars, int n) {
-  Obj obj       = {OBJ_STRING, NULL, false};
-  ObjString str = {obj, chars, n, hashString(chars, n)};
+  Obj obj       = {OBJ_STRING, false};
+  ObjString str = {obj, false, n, hashString(chars, n), chars};
   return str;
 }
 
@@ -97,7 +122,8 @@ uint32_t hashString(const char *key, int n) {
   return hash;
 }
 
-ObjString *copyString(const char *chars, int n) {
+// Interns the chars through the string pool, allocating if not already there.
+static ObjString *internString(const char *chars, int n) {
   uint32_t hash = hashString(chars, n);
 
   ObjString *interned = tableFindString(&vm.strings, chars, n, hash);
@@ -109,10 +135,68 @@ ObjString *copyString(const char *chars, int n) {
   strncpy(heapChars, chars, n);
   heapChars[n] = '\0';
 
-  return allocateObjString(heapChars, n, hash);
+  return allocateObjString(heapChars, n, hash, true);
+}
+
+// Returns the pre-interned string for empty and one byte strings, else NULL.
+static inline ObjString *cachedString(const char *chars, int n) {
+  if (n == 0)
+    return vm.emptyString;
+
+  if (n == 1)
+    return vm.byteStrings[(uint8_t)chars[0]];
+
+  return NULL;
+}
+
+void initStringCache() {
+  // Clear first so a GC triggered part way through only sees complete entries.
+  vm.emptyString = NULL;
+  memset(vm.byteStrings, 0, sizeof(vm.byteStrings));
+  memset(vm.smallIntStrings, 0, sizeof(vm.smallIntStrings));
+
+  vm.emptyString = internString("", 0);
+
+  for (int i = 0; i < BYTE_STRINGS_MAX; i++) {
+    char c            = (char)i;
+    vm.byteStrings[i] = internString(&c, 1);
+  }
+
+  for (int i = 0; i < SMALL_INT_STRINGS; i++) {
+    char digits[4];
+    int n                 = snprintf(digits, sizeof(digits), "%d", i);
+    vm.smallIntStrings[i] = internString(digits, n);
+  }
+}
+
+void markStringCache() {
+  markObj((Obj *)vm.emptyString);
+
+  for (int i = 0; i < BYTE_STRINGS_MAX; i++) {
+    markObj((Obj *)vm.byteStrings[i]);
+  }
+
+  for (int i = 0; i < SMALL_INT_STRINGS; i++) {
+    markObj((Obj *)vm.smallIntStrings[i]);
+  }
+}
+
+ObjString *copyString(const char *chars, int n) {
+  ObjString *cached = cachedString(chars, n);
+  if (cached != NULL) {
+    return cached;
+  }
+
+  return internString(chars, n);
 }
 
 ObjString *takeString(char *chars, int n) {
+  ObjString *cached = cachedString(chars, n);
+  if (cached != NULL) {
+    FREE_ARRAY(char, chars, n + 1); // + 1 for null byte
+    return cached;
+  }
+
   uint32_t hash = hashString(chars, n);
 
   ObjString *interned = tableFindString(&vm.strings, chars, n, hash);
@@ -121,10 +205,33 @@ ObjString *takeString(char *chars, int n) {
     return interned;
   }
 
-  return allocateObjString(chars, n, hash);
+  return allocateObjString(chars, n, hash, true);
+}
+
+ObjString *borrowString(const char *chars, int n) {
+  ObjString *cached = cachedString(chars, n);
+  if (cached != NULL) {
+    return cached;
+  }
+
+  uint32_t hash = hashString(chars, n);
+
+  ObjString *interned = tableFindString(&vm.strings, chars, n, hash);
+  if (interned != NULL) {
+    return interned;
+  }
+
+  return allocateObjString(chars, n, hash, false);
 }
 
 ObjString *concatenate(ObjString *a, ObjString *b) {
+  // Strings are immutable and interned, so an empty operand is a no-op.
+  if (a->len == 0)
+    return b;
+
+  if (b->len == 0)
+    return a;
+
   int n       = a->len + b->len;
   char *chars = ALLOCATE(char, n + 1);
 
@@ -135,21 +242,30 @@ ObjString *concatenate(ObjString *a, ObjString *b) {
   return takeString(chars, n);
 }
 
+#define WRITE_LITERAL(literal) writeOutput(literal, sizeof(literal) - 1)
+
 static void printFunc(ObjFunc *func) {
   if (func->name == NULL) {
-    printf("<script>");
+    WRITE_LITERAL("<script>");
     return;
   }
 
-  printf("<fn %s>", func->name->chars);
+  WRITE_LITERAL("<fn ");
+  writeOutput(func->name->chars, func->name->len);
+  WRITE_LITERAL(">");
 }
 
 void printObj(Value value) {
   switch (OBJ_TYPE(value)) {
-    case OBJ_STRING:  printf("%s", AS_CSTRING(value)); break;
+    case OBJ_STRING:
+      writeOutput(AS_CSTRING(value), AS_STRING(value)->len);
+      break;
     case OBJ_FUNC:    printFunc(AS_FUNC(value)); break;
-    case OBJ_NATIVE:  printf("<native fn>"); break;
-    case OBJ_CLOSURE: printFunc(AS_CLOSURE(value)->func); break;
-    case OBJ_UPVALUE: printf("upvalue"); break;
+    case OBJ_NATIVE:  WRITE_LITERAL("<native fn>"); break;
+    case OBJ_CLOSURE: printFunc(CLOSURE_FUNC(AS_CLOSURE(value))); break;
+    case OBJ_UPVALUE: WRITE_LITERAL("upvalue"); break;
+    case OBJ_FILE:    WRITE_LITERAL("<file>"); break;
   }
 }
+
+#undef WRITE_LITERAL
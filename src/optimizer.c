@@ -0,0 +1,431 @@
+#include "optimizer.h"
+
+#include "chunk.h"
+#include "ir.h"
+#include "memory.h"
+#include "peephole.h"
+#include "value.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_CONSTANTS (UINT8_MAX + 1) // Constant operands are a single byte
+
+static bool isFalsy(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Pushes a value without any side effects, so popping it straight after is the
+// same as never pushing it.
+static bool isPurePush(OpCode op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NIL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_GET_PARENT:   return true;
+    default:              return false;
+  }
+}
+
+static bool usesConstant(OpCode op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_IS_FUNC:
+    case OP_CLOSURE:
+    case OP_LOCAL_CLOSURE: return true;
+    default:               return false;
+  }
+}
+
+// Returns true if the instruction pushes a value known at compile time.
+static bool literalValue(IrFunc *ir, IrInstr *instr, Value *value) {
+  switch (instr->op) {
+    case OP_TRUE:     *value = BOOL_VAL(true); return true;
+    case OP_FALSE:    *value = BOOL_VAL(false); return true;
+    case OP_NIL:      *value = NIL_VAL; return true;
+    case OP_CONSTANT: {
+      *value = ir->chunk->constants.values[instr->operand];
+      return true;
+    }
+    default: return false;
+  }
+}
+
+// Returns the constant index of the number, adding it to the pool if needed, or
+// -1 if the pool is full.
+static int numberConstant(IrFunc *ir, double number) {
+  ValueList *constants = &ir->chunk->constants;
+
+  // Compare the bits so 0 and -0 (or NaNs) are kept apart
+  for (unsigned int i = 0; i < constants->count; i++) {
+    Value constant = constants->values[i];
+
+    if (IS_NUM(constant) &&
+        memcmp(&AS_NUM(constant), &number, sizeof(double)) == 0)
+      return i;
+  }
+
+  if (constants->count >= MAX_CONSTANTS)
+    return -1;
+
+  return appendConstant(ir->chunk, NUM_VAL(number));
+}
+
+// Sets the instruction to push the value. Returns false if it can't.
+static bool makeLiteral(IrFunc *ir, Value value, int line, IrInstr *instr) {
+  IrInstr literal = {OP_NIL, 0, line, NULL, 0};
+
+  if (IS_BOOL(value)) {
+    literal.op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+  } else if (IS_NUM(value)) {
+    literal.op      = OP_CONSTANT;
+    literal.operand = numberConstant(ir, AS_NUM(value));
+
+    if (literal.operand < 0)
+      return false;
+  } else if (!IS_NIL(value)) {
+    return false;
+  }
+
+  *instr = literal;
+  return true;
+}
+
+bool foldBinary(OpCode op, Value a, Value b, Value *result) {
+  if (op == OP_EQ || op == OP_NOT_EQ) {
+    bool isEqual = valuesEq(a, b);
+    *result      = BOOL_VAL(op == OP_EQ ? isEqual : !isEqual);
+    return true;
+  }
+
+  if (!IS_NUM(a) || !IS_NUM(b))
+    return false;
+
+  double x = AS_NUM(a), y = AS_NUM(b);
+
+  switch (op) {
+    case OP_ADD:        *result = NUM_VAL(x + y); return true;
+    case OP_SUBTRACT:   *result = NUM_VAL(x - y); return true;
+    case OP_MULTIPLY:   *result = NUM_VAL(x * y); return true;
+    case OP_DIVIDE:     *result = NUM_VAL(x / y); return true;
+    case OP_LESS:       *result = BOOL_VAL(x < y); return true;
+    case OP_LESS_EQ:    *result = BOOL_VAL(x <= y); return true;
+    case OP_GREATER:    *result = BOOL_VAL(x > y); return true;
+    case OP_GREATER_EQ: *result = BOOL_VAL(x >= y); return true;
+    default:            return false;
+  }
+}
+
+// Returns true if the get reads back the variable the set just assigned.
+static bool isReload(IrFunc *ir, IrInstr *set, IrInstr *get) {
+  switch (set->op) {
+    case OP_SET_LOCAL:
+      return get->op == OP_GET_LOCAL && get->operand == set->operand;
+    case OP_SET_UPVALUE:
+      return get->op == OP_GET_UPVALUE && get->operand == set->operand;
+    case OP_SET_PARENT:
+      return get->op == OP_GET_PARENT && get->operand == set->operand;
+    case OP_SET_GLOBAL: {
+      // Each use of a global has its own constant for the (interned) name
+      ValueList *constants = &ir->chunk->constants;
+      return get->op == OP_GET_GLOBAL &&
+             valuesEq(constants->values[get->operand],
+                      constants->values[set->operand]);
+    }
+    default: return false;
+  }
+}
+
+/*
+ * Simplifies the last few instructions of the block (of n so far). Returns true
+ * if it did, so the caller can try again on the new tail. Simplifications:
+ *   - literal, literal, binary operator => literal
+ *   - literal, OP_NOT / number, OP_NEGATE => literal
+ *   - pure push, OP_POP => nothing
+ *   - OP_SET_X a, OP_POP, OP_GET_X a => OP_SET_X a
+ */
+static bool simplifyTail(IrFunc *ir, IrInstr *instrs, int *n) {
+  IrInstr *last = &instrs[*n - 1];
+  Value a, b, result;
+
+  if (*n >= 2 && last->op == OP_POP && isPurePush(last[-1].op)) {
+    *n -= 2;
+    return true;
+  }
+
+  if (*n >= 3 && last[-1].op == OP_POP && isReload(ir, &last[-2], last)) {
+    *n -= 2;
+    return true;
+  }
+
+  if (*n >= 2 && last->op == OP_NOT && literalValue(ir, &last[-1], &a)) {
+    if (!makeLiteral(ir, BOOL_VAL(isFalsy(a)), last->line, &last[-1]))
+      return false;
+
+    *n -= 1;
+    return true;
+  }
+
+  if (*n >= 2 && last->op == OP_NEGATE && literalValue(ir, &last[-1], &a) &&
+      IS_NUM(a)) {
+    if (!makeLiteral(ir, NUM_VAL(-AS_NUM(a)), last->line, &last[-1]))
+      return false;
+
+    *n -= 1;
+    return true;
+  }
+
+  if (*n >= 3 && literalValue(ir, &last[-2], &a) &&
+      literalValue(ir, &last[-1], &b) && foldBinary(last->op, a, b, &result)) {
+    if (!makeLiteral(ir, result, last->line, &last[-2]))
+      return false;
+
+    *n -= 2;
+    return true;
+  }
+
+  return false;
+}
+
+// Constant folding and peepholes within the block. Returns true if it changed.
+static bool foldBlock(IrFunc *ir, IrBlock *block) {
+  bool changed = false;
+  int n        = 0;
+
+  for (int i = 0; i < block->count; i++) {
+    block->instrs[n++] = block->instrs[i];
+
+    while (n > 0 && simplifyTail(ir, block->instrs, &n)) {
+      changed = true;
+    }
+  }
+
+  block->count = n;
+  return changed;
+}
+
+// A branch on a literal always goes the same way. The literal stays, as the
+// jumps only peek at their condition.
+static bool foldBranches(IrFunc *ir) {
+  bool changed = false;
+
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+    Value condition;
+
+    if (!block->isLive || block->exit != EXIT_BRANCH || block->count == 0 ||
+        !literalValue(ir, &block->instrs[block->count - 1], &condition))
+      continue;
+
+    bool jumps  = isFalsy(condition) == (block->branchOp == OP_JUMP_IF_FALSE);
+    block->exit = jumps ? EXIT_JUMP : EXIT_NEXT;
+    changed     = true;
+  }
+
+  return changed;
+}
+
+static void markReachable(IrFunc *ir, int index, bool *isReached) {
+  while (index != IR_NO_BLOCK && !isReached[index]) {
+    IrBlock *block   = &ir->blocks[index];
+    isReached[index] = true;
+
+    switch (block->exit) {
+      case EXIT_RETURN: return;
+      case EXIT_NEXT:   index = block->next; break;
+      case EXIT_JUMP:   index = block->target; break;
+      case EXIT_BRANCH: {
+        markReachable(ir, block->target, isReached);
+        index = block->next;
+        break;
+      }
+    }
+  }
+}
+
+static bool removeUnreachable(IrFunc *ir) {
+  bool *isReached = ALLOCATE(bool, ir->blockCount);
+  for (int i = 0; i < ir->blockCount; i++) {
+    isReached[i] = false;
+  }
+
+  markReachable(ir, 0, isReached);
+
+  bool changed = false;
+
+  for (int i = 0; i < ir->blockCount; i++) {
+    if (ir->blocks[i].isLive && !isReached[i]) {
+      ir->blocks[i].isLive = false;
+      changed              = true;
+    }
+  }
+
+  FREE_ARRAY(bool, isReached, ir->blockCount);
+  return changed;
+}
+
+static void countPredecessor(int *predCounts, int index) {
+  if (index != IR_NO_BLOCK)
+    predCounts[index]++;
+}
+
+/*
+ * Appends a block to the one before it when that is the only way into it, so
+ * the passes within a block see both. Only later blocks are merged, so jumps
+ * out of the merged block stay forwards.
+ */
+static bool mergeBlocks(IrFunc *ir) {
+  int *predCounts = ALLOCATE(int, ir->blockCount);
+  for (int i = 0; i < ir->blockCount; i++) {
+    predCounts[i] = 0;
+  }
+
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+
+    if (!block->isLive || block->exit == EXIT_RETURN)
+      continue;
+
+    countPredecessor(predCounts, block->exit == EXIT_JUMP ? block->target
+                                                          : block->next);
+    if (block->exit == EXIT_BRANCH)
+      countPredecessor(predCounts, block->target);
+  }
+
+  bool changed = false;
+
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+
+    while (block->isLive &&
+           (block->exit == EXIT_NEXT || block->exit == EXIT_JUMP)) {
+      int successor = block->exit == EXIT_JUMP ? block->target : block->next;
+
+      if (successor == IR_NO_BLOCK || successor <= i ||
+          predCounts[successor] != 1)
+        break;
+
+      IrBlock *merged = &ir->blocks[successor];
+
+      for (int j = 0; j < merged->count; j++) {
+        appendIrInstr(block, merged->instrs[j]);
+      }
+
+      block->exit     = merged->exit;
+      block->branchOp = merged->branchOp;
+      block->target   = merged->target;
+      block->next     = merged->next;
+      block->exitLine = merged->exitLine;
+      merged->isLive  = false;
+      changed         = true;
+    }
+  }
+
+  FREE_ARRAY(int, predCounts, ir->blockCount);
+  return changed;
+}
+
+/*
+ * Rebuilds the constant pool with only the constants the live code still uses,
+ * remapping the instructions to it. Folding and removing code leaves constants
+ * behind, which count towards the limit of 256.
+ */
+static void compactConstants(IrFunc *ir, ValueList *compacted) {
+  ValueList *constants = &ir->chunk->constants;
+  int *remap           = ALLOCATE(int, constants->count);
+
+  for (unsigned int i = 0; i < constants->count; i++) {
+    remap[i] = -1;
+  }
+
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+
+    for (int j = 0; block->isLive && j < block->count; j++) {
+      IrInstr *instr = &block->instrs[j];
+
+      if (!usesConstant(instr->op))
+        continue;
+
+      if (remap[instr->operand] == -1) {
+        // The old pool is still rooted through the function, so appending here
+        // can't lose the value to the collector.
+        remap[instr->operand] = compacted->count;
+        appendValueList(compacted, constants->values[instr->operand]);
+      }
+
+      instr->operand = remap[instr->operand];
+    }
+  }
+
+  FREE_ARRAY(int, remap, constants->count);
+}
+
+void optimizeChunk(Chunk *chunk, OptLevel level) {
+  if (level == OPT_NONE)
+    return;
+
+  IrFunc ir;
+  buildIr(&ir, chunk);
+
+  // Repeat as the passes feed each other, e.g. a folded branch leaves a block
+  // to merge, and merging exposes more to fold.
+  bool changed = true;
+
+  while (changed) {
+    changed = false;
+
+    for (int i = 0; i < ir.blockCount; i++) {
+      if (ir.blocks[i].isLive)
+        changed = foldBlock(&ir, &ir.blocks[i]) || changed;
+    }
+
+    if (level >= OPT_FULL) {
+      changed = foldBranches(&ir) || changed;
+      changed = removeUnreachable(&ir) || changed;
+      changed = mergeBlocks(&ir) || changed;
+    }
+  }
+
+  ValueList compacted;
+  initValueList(&compacted);
+
+  if (level >= OPT_FULL)
+    compactConstants(&ir, &compacted);
+
+  Chunk lowered;
+  initChunk(&lowered);
+
+  // Keep the original bytecode if the optimized code can't be encoded
+  if (lowerIr(&ir, &lowered)) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+
+    chunk->code     = lowered.code;
+    chunk->lines    = lowered.lines;
+    chunk->count    = lowered.count;
+    chunk->capacity = lowered.capacity;
+
+    if (level >= OPT_FULL) {
+      freeValueList(&chunk->constants);
+      chunk->constants = compacted;
+      initValueList(&compacted);
+    }
+  } else {
+    freeChunk(&lowered);
+  }
+
+  freeValueList(&compacted);
+  freeIr(&ir);
+
+  threadJumps(chunk);
+}
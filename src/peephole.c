@@ -0,0 +1,144 @@
+#include "peephole.h"
+
+#include "chunk.h"
+#include "memory.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define JUMP_LEN 3 // Opcode and a 2-byte operand
+
+static bool isConditionalJump(uint8_t op) {
+  return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP || isConditionalJump(op);
+}
+
+/*
+ * Rewrites the operand of the jump at the offset so it lands on the target.
+ * Unconditional jumps switch between OP_JUMP and OP_LOOP with the direction.
+ * Returns false, leaving the jump as it is, if the target can't be reached.
+ */
+static bool setJumpTarget(Chunk *chunk, unsigned int offset,
+                          unsigned int target) {
+  uint8_t op        = chunk->code[offset];
+  unsigned int next = offset + JUMP_LEN;
+  bool isForward    = target >= next;
+
+  // There is no backwards conditional jump
+  if (isConditionalJump(op) && !isForward)
+    return false;
+
+  unsigned int toJump = isForward ? target - next : next - target;
+  if (toJump > UINT16_MAX)
+    return false;
+
+  if (!isConditionalJump(op))
+    op = isForward ? OP_JUMP : OP_LOOP;
+
+  chunk->code[offset]     = op;
+  chunk->code[offset + 1] = (toJump >> 8) & 0xFF; // High byte
+  chunk->code[offset + 2] = toJump & 0xFF;        // Low byte
+  return true;
+}
+
+/*
+ * Follows the chain of jumps from the jump at the offset to where it finally
+ * ends up. Conditional jumps only peek at the condition, so one landing on a
+ * conditional jump of the same kind would take that jump too, and one landing
+ * on the opposite kind would fall through it.
+ */
+static unsigned int finalTarget(Chunk *chunk, unsigned int offset) {
+  uint8_t op          = chunk->code[offset];
+  unsigned int target = jumpTarget(chunk, offset);
+
+  // Bounded, as an empty infinite loop is a jump chain that never ends
+  for (unsigned int hops = 0; hops < chunk->count && target < chunk->count;
+       hops++) {
+    uint8_t landing = chunk->code[target];
+
+    if (landing == OP_JUMP || landing == OP_LOOP || landing == op) {
+      target = jumpTarget(chunk, target);
+    } else if (isConditionalJump(op) && isConditionalJump(landing)) {
+      target += JUMP_LEN;
+    } else {
+      break;
+    }
+  }
+
+  return target;
+}
+
+/*
+ * Removes the jumps that land on the next instruction, shifting the code and
+ * line info that follows them down and fixing up every jump across them.
+ * Returns true if any were removed.
+ */
+static bool removeJumpsToNext(Chunk *chunk) {
+  // Where each byte moves to once the jumps are removed. A removed jump maps to
+  // the instruction that now takes its place, which is also where it went to.
+  unsigned int *newOffsets = ALLOCATE(unsigned int, chunk->count + 1);
+  unsigned int removed     = 0;
+
+  for (unsigned int offset = 0; offset < chunk->count;) {
+    unsigned int len = instructionLen(chunk, offset);
+
+    for (unsigned int i = offset; i < offset + len; i++) {
+      newOffsets[i] = offset - removed;
+    }
+
+    if (isJump(chunk->code[offset]) &&
+        jumpTarget(chunk, offset) == offset + len) {
+      removed += len;
+    }
+
+    offset += len;
+  }
+
+  newOffsets[chunk->count] = chunk->count - removed;
+
+  if (removed == 0) {
+    FREE_ARRAY(unsigned int, newOffsets, chunk->count + 1);
+    return false;
+  }
+
+  // Code only moves down, so it is compacted in place without overwriting any
+  // instruction that is still to be moved.
+  for (unsigned int offset = 0; offset < chunk->count;) {
+    unsigned int len  = instructionLen(chunk, offset);
+    unsigned int dest = newOffsets[offset];
+    uint8_t op        = chunk->code[offset];
+
+    unsigned int target = isJump(op) ? jumpTarget(chunk, offset) : 0;
+
+    if (!isJump(op) || target != offset + len) {
+      memmove(&chunk->code[dest], &chunk->code[offset], len);
+      memmove(&chunk->lines[dest], &chunk->lines[offset], len * sizeof(int));
+
+      if (isJump(op))
+        setJumpTarget(chunk, dest, newOffsets[target]);
+    }
+
+    offset += len;
+  }
+
+  FREE_ARRAY(unsigned int, newOffsets, chunk->count + 1);
+  chunk->count -= removed;
+  return true;
+}
+
+void threadJumps(Chunk *chunk) {
+  for (unsigned int offset = 0; offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    if (isJump(chunk->code[offset]))
+      setJumpTarget(chunk, offset, finalTarget(chunk, offset));
+  }
+
+  // Removing jumps can leave a jump that only jumped over them landing on the
+  // next instruction, so repeat until there are none left.
+  while (removeJumpsToNext(chunk))
+    ;
+}
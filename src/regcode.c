@@ -0,0 +1,527 @@
+#include "regcode.h"
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// What a stack slot holds. Values are only moved into their slot's register
+// when something needs them there, so most reads of locals and constants become
+// operands of the instruction that uses them instead.
+typedef enum operand_kind {
+  OPERAND_HOME,  // In the slot's own register
+  OPERAND_LOCAL, // Still in the register of the local it was read from
+  OPERAND_CONST, // Still in the constant pool
+} OperandKind;
+
+typedef struct operand {
+  OperandKind kind;
+  int index;
+} Operand;
+
+// A forward jump whose offset is patched once its target is translated
+typedef struct reg_fixup {
+  int instr;
+  unsigned int target;
+} RegFixup;
+
+typedef struct translator {
+  Chunk *chunk;
+  RegCode *out;
+  Operand slots[REG_MAX + 1];
+  int depth;        // Slots in use, -1 in unreachable code
+  int *depths;      // Depth at each offset, -1 if it is never reached
+  int *starts;      // Instruction each offset was translated to
+  bool *isLeader;   // Offsets reached other than by falling through
+  RegFixup *fixups; // At most one per jump, so sized to the chunk
+  int fixupCount;
+  int lastWrite; // The last instruction, if all it did was write R[A], else -1
+  int line;
+  bool ok;
+} Translator;
+
+void initRegCode(RegCode *regCode) {
+  regCode->capacity  = 0;
+  regCode->count     = 0;
+  regCode->code      = NULL;
+  regCode->lines     = NULL;
+  regCode->frameSize = 0;
+}
+
+void freeRegCode(RegCode *regCode) {
+  FREE_ARRAY(RegInstr, regCode->code, regCode->capacity);
+  FREE_ARRAY(int, regCode->lines, regCode->capacity);
+  initRegCode(regCode);
+}
+
+static void emit(Translator *t, RegInstr instr, bool isPlainWrite) {
+  RegCode *out = t->out;
+
+  if (out->count >= out->capacity) {
+    int oldCap    = out->capacity;
+    out->capacity = GROW_CAPACITY(oldCap);
+    out->code     = GROW_ARRAY(RegInstr, out->code, oldCap, out->capacity);
+    out->lines    = GROW_ARRAY(int, out->lines, oldCap, out->capacity);
+  }
+
+  out->code[out->count]  = instr;
+  out->lines[out->count] = t->line;
+  t->lastWrite           = isPlainWrite ? out->count : -1;
+  out->count++;
+}
+
+static int rk(Translator *t, int slot) {
+  Operand operand = t->slots[slot];
+
+  switch (operand.kind) {
+    case OPERAND_HOME:  return slot;
+    case OPERAND_LOCAL: return operand.index;
+    case OPERAND_CONST: return operand.index | REG_CONST;
+  }
+
+  return slot;
+}
+
+// Moves the slot's value into its own register
+static void materialize(Translator *t, int slot) {
+  if (t->slots[slot].kind == OPERAND_HOME)
+    return;
+
+  emit(t, REG_ABC(ROP_MOVE, slot, rk(t, slot), 0), true);
+  t->slots[slot].kind = OPERAND_HOME;
+}
+
+static void materializeAll(Translator *t) {
+  for (int i = 0; i < t->depth; i++) {
+    materialize(t, i);
+  }
+}
+
+// Returns the slot a new value is pushed to, failing if it has no register.
+static int pushSlot(Translator *t, OperandKind kind, int index) {
+  if (t->depth > REG_MAX) {
+    t->ok = false;
+    return 0;
+  }
+
+  Operand operand    = {kind, index};
+  t->slots[t->depth] = operand;
+
+  if (t->depth + 1 > t->out->frameSize)
+    t->out->frameSize = t->depth + 1;
+
+  return t->depth++;
+}
+
+// Everything is in its register by the time a block is left, so all the ways
+// into a block agree on where values are.
+static void emitJump(Translator *t, RegOpCode op, int reg,
+                     unsigned int target) {
+  materializeAll(t);
+
+  if (target >= t->chunk->count || t->depths[target] != t->depth) {
+    t->ok = false;
+    return;
+  }
+
+  // Backwards targets are already translated, forward ones are patched later
+  int offset = 0;
+
+  if (t->starts[target] >= 0) {
+    offset = t->starts[target] - (t->out->count + 1);
+
+    if (offset < -REG_SBX_BIAS) {
+      t->ok = false;
+      return;
+    }
+  } else {
+    RegFixup fixup             = {t->out->count, target};
+    t->fixups[t->fixupCount++] = fixup;
+  }
+
+  emit(t, REG_ASBX(op, reg, offset), false);
+}
+
+// Assigning the value at the top of the stack to a local. When the value was
+// just computed into its temporary, the instruction computing it writes to the
+// local instead, so `a = a + b` is a single ROP_ADD.
+static void setLocal(Translator *t, int local) {
+  int top = t->depth - 1;
+
+  // Earlier reads of the local must keep the value it had then
+  for (int i = 0; i < top; i++) {
+    if (t->slots[i].kind == OPERAND_LOCAL && t->slots[i].index == local)
+      materialize(t, i);
+  }
+
+  Operand value = t->slots[top];
+
+  if (value.kind == OPERAND_LOCAL && value.index == local)
+    return;
+
+  if (value.kind == OPERAND_HOME && t->lastWrite >= 0 &&
+      (int)REG_A(t->out->code[t->lastWrite]) == top) {
+    RegInstr *instr = &t->out->code[t->lastWrite];
+    *instr          = (*instr & ~((RegInstr)0xFF << 6)) | (RegInstr)local << 6;
+
+    Operand moved = {OPERAND_LOCAL, local};
+    t->slots[top] = moved;
+    t->lastWrite  = -1;
+  } else {
+    emit(t, REG_ABC(ROP_MOVE, local, rk(t, top), 0), false);
+  }
+
+  t->slots[local].kind = OPERAND_HOME;
+}
+
+static RegOpCode binaryOp(OpCode op) {
+  switch (op) {
+    case OP_ADD:        return ROP_ADD;
+    case OP_SUBTRACT:   return ROP_SUBTRACT;
+    case OP_MULTIPLY:   return ROP_MULTIPLY;
+    case OP_DIVIDE:     return ROP_DIVIDE;
+    case OP_EQ:         return ROP_EQ;
+    case OP_NOT_EQ:     return ROP_NOT_EQ;
+    case OP_LESS:       return ROP_LESS;
+    case OP_LESS_EQ:    return ROP_LESS_EQ;
+    case OP_GREATER:    return ROP_GREATER;
+    default:            return ROP_GREATER_EQ;
+  }
+}
+
+static void binary(Translator *t, OpCode op) {
+  int a = t->depth - 2, b = t->depth - 1;
+
+  emit(t, REG_ABC(binaryOp(op), a, rk(t, a), rk(t, b)), true);
+  t->slots[a].kind = OPERAND_HOME;
+  t->depth--;
+}
+
+static void unary(Translator *t, RegOpCode op) {
+  int a = t->depth - 1;
+
+  emit(t, REG_ABC(op, a, rk(t, a), 0), true);
+  t->slots[a].kind = OPERAND_HOME;
+}
+
+static void closure(Translator *t, unsigned int offset) {
+  Chunk *chunk  = t->chunk;
+  uint8_t index = chunk->code[offset + 1];
+  ObjFunc *func = AS_FUNC(chunk->constants.values[index]);
+
+  // Captured locals must be in their registers, the upvalue points there
+  const uint8_t *captures = &chunk->code[offset + 2];
+  for (int i = 0; i < func->upvalueCount; i++) {
+    if (captures[i * 2])
+      materialize(t, captures[i * 2 + 1]);
+  }
+
+  int slot = pushSlot(t, OPERAND_HOME, 0);
+  emit(t, REG_ABX(ROP_CLOSURE, slot, index), false);
+
+  for (int i = 0; i < func->upvalueCount; i++) {
+    emit(t, REG_ABC(ROP_MOVE, captures[i * 2], captures[i * 2 + 1], 0), false);
+  }
+}
+
+static void translateInstr(Translator *t, unsigned int offset) {
+  Chunk *chunk    = t->chunk;
+  OpCode op       = chunk->code[offset];
+  uint8_t operand = instructionLen(chunk, offset) > 1 ? chunk->code[offset + 1]
+                                                      : 0;
+  int top         = t->depth - 1;
+
+  switch (op) {
+    case OP_CONSTANT: pushSlot(t, OPERAND_CONST, operand); break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:    {
+      RegOpCode load = op == OP_NIL ? ROP_NIL : op == OP_TRUE ? ROP_TRUE
+                                                              : ROP_FALSE;
+      emit(t, REG_ABC(load, pushSlot(t, OPERAND_HOME, 0), 0, 0), true);
+      break;
+    }
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQ:
+    case OP_NOT_EQ:
+    case OP_LESS:
+    case OP_LESS_EQ:
+    case OP_GREATER:
+    case OP_GREATER_EQ: binary(t, op); break;
+    case OP_NOT:        unary(t, ROP_NOT); break;
+    case OP_NEGATE:     unary(t, ROP_NEGATE); break;
+    case OP_IS_FUNC:    {
+      Value func = chunk->constants.values[operand];
+      int callee = top - AS_FUNC(func)->arity;
+      int slot   = pushSlot(t, OPERAND_HOME, 0);
+      emit(t, REG_ABC(ROP_IS_FUNC, slot, rk(t, callee), operand | REG_CONST),
+           true);
+      break;
+    }
+    case OP_POP:        t->depth--; break;
+    case OP_GET_LOCAL:  {
+      materialize(t, operand);
+      pushSlot(t, OPERAND_LOCAL, operand);
+      break;
+    }
+    case OP_SET_LOCAL:   setLocal(t, operand); break;
+    case OP_GET_HOISTED: {
+      // Reads the global's name and writes the cached value back
+      materialize(t, operand - 1);
+      materialize(t, operand);
+
+      int slot = pushSlot(t, OPERAND_HOME, 0);
+      emit(t, REG_ABC(ROP_GET_HOISTED, slot, operand, 0), true);
+      break;
+    }
+    case OP_SLIDE:       {
+      setLocal(t, top - operand);
+      t->depth -= operand;
+      break;
+    }
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_GET_PARENT:   {
+      RegOpCode get = op == OP_GET_UPVALUE    ? ROP_GET_UPVALUE
+                      : op == OP_GET_CAPTURED ? ROP_GET_CAPTURED
+                                              : ROP_GET_PARENT;
+      int slot      = pushSlot(t, OPERAND_HOME, 0);
+      emit(t, REG_ABC(get, slot, operand, 0), true);
+      break;
+    }
+    case OP_SET_UPVALUE:
+    case OP_SET_PARENT:  {
+      RegOpCode set = op == OP_SET_UPVALUE ? ROP_SET_UPVALUE : ROP_SET_PARENT;
+      emit(t, REG_ABC(set, operand, rk(t, top), 0), false);
+      break;
+    }
+    case OP_DEF_GLOBAL:
+    case OP_DEF_CONST:  {
+      RegOpCode def = op == OP_DEF_GLOBAL ? ROP_DEF_GLOBAL : ROP_DEF_CONST;
+      emit(t, REG_ABC(def, operand, rk(t, top), 0), false);
+      t->depth--;
+      break;
+    }
+    case OP_GET_GLOBAL: {
+      int slot = pushSlot(t, OPERAND_HOME, 0);
+      emit(t, REG_ABX(ROP_GET_GLOBAL, slot, operand), true);
+      break;
+    }
+    case OP_SET_GLOBAL: {
+      emit(t, REG_ABC(ROP_SET_GLOBAL, operand, rk(t, top), 0), false);
+      break;
+    }
+    case OP_CLOSE_UPVALUE: {
+      materialize(t, top);
+      emit(t, REG_ABC(ROP_CLOSE, top, 0, 0), false);
+      t->depth--;
+      break;
+    }
+    case OP_CALL:
+    case OP_CALL_NATIVE: {
+      // The callee may change any local through an upvalue, and needs itself
+      // and its arguments in consecutive registers.
+      materializeAll(t);
+
+      int argCount = op == OP_CALL ? operand : nativeDefs[operand].arity;
+      int callee   = t->depth - argCount - 1;
+
+      if (op == OP_CALL) {
+        emit(t, REG_ABC(ROP_CALL, callee, argCount, 0), false);
+      } else {
+        emit(t, REG_ABC(ROP_CALL_NATIVE, callee, argCount, operand), false);
+      }
+
+      t->depth = callee + 1;
+      break;
+    }
+    case OP_CLOSURE:       closure(t, offset); break;
+    case OP_LOCAL_CLOSURE: {
+      // Its function reads the locals straight from this frame, so they need
+      // nothing more than being in their registers for the calls to it
+      int slot = pushSlot(t, OPERAND_HOME, 0);
+      emit(t, REG_ABX(ROP_LOCAL_CLOSURE, slot, operand), false);
+      break;
+    }
+    case OP_PRINT:   {
+      emit(t, REG_ABC(ROP_PRINT, 0, rk(t, top), 0), false);
+      t->depth--;
+      break;
+    }
+    case OP_RETURN: {
+      emit(t, REG_ABC(ROP_RETURN, 0, rk(t, top), 0), false);
+      t->depth = -1;
+      break;
+    }
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:  {
+      RegOpCode jump = op == OP_JUMP_IF_FALSE ? ROP_JUMP_IF_FALSE
+                                              : ROP_JUMP_IF_TRUE;
+      emitJump(t, jump, top, jumpTarget(chunk, offset));
+      break;
+    }
+    case OP_JUMP:
+    case OP_LOOP: {
+      emitJump(t, ROP_JUMP, 0, jumpTarget(chunk, offset));
+      t->depth = -1;
+      break;
+    }
+  }
+}
+
+static void findLeaders(Translator *t) {
+  Chunk *chunk = t->chunk;
+
+  for (unsigned int offset = 0; offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    OpCode op        = chunk->code[offset];
+    unsigned int len = instructionLen(chunk, offset);
+
+    if (op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE ||
+        op == OP_JUMP_IF_TRUE) {
+      unsigned int target = jumpTarget(chunk, offset);
+      if (target < chunk->count)
+        t->isLeader[target] = true;
+    }
+
+    if ((op == OP_JUMP || op == OP_LOOP || op == OP_RETURN) &&
+        offset + len < chunk->count)
+      t->isLeader[offset + len] = true;
+  }
+}
+
+// Translates the reachable instructions in order. Backwards jumps always land
+// on code translated before them, so only forward jumps need patching.
+static void translateCode(Translator *t) {
+  Chunk *chunk = t->chunk;
+
+  for (unsigned int offset = 0; t->ok && offset < chunk->count;
+       offset += instructionLen(chunk, offset)) {
+    if (t->isLeader[offset]) {
+      if (t->depth >= 0)
+        materializeAll(t);
+
+      t->depth     = t->depths[offset];
+      t->lastWrite = -1;
+
+      for (int i = 0; i < t->depth; i++) {
+        t->slots[i].kind = OPERAND_HOME;
+      }
+    }
+
+    if (t->depths[offset] < 0)
+      continue;
+
+    t->starts[offset] = t->out->count;
+    t->line           = chunkLine(chunk, offset);
+    translateInstr(t, offset);
+  }
+}
+
+static void patchFixups(Translator *t) {
+  for (int i = 0; t->ok && i < t->fixupCount; i++) {
+    RegFixup *fixup = &t->fixups[i];
+    int offset      = t->starts[fixup->target] - (fixup->instr + 1);
+
+    if (t->starts[fixup->target] < 0 || offset > REG_SBX_MAX) {
+      t->ok = false;
+      break;
+    }
+
+    RegInstr *instr = &t->out->code[fixup->instr];
+    *instr          = REG_ASBX(REG_OP(*instr), REG_A(*instr), offset);
+  }
+}
+
+bool translateChunk(Chunk *chunk, int arity, RegCode *out) {
+  unsigned int n = chunk->count;
+
+  Translator t = {.chunk      = chunk,
+                  .out        = out,
+                  .depth      = 0,
+                  .depths     = ALLOCATE(int, n),
+                  .starts     = ALLOCATE(int, n),
+                  .isLeader   = ALLOCATE(bool, n),
+                  .fixups     = ALLOCATE(RegFixup, n),
+                  .fixupCount = 0,
+                  .lastWrite  = -1,
+                  .line       = 0,
+                  .ok         = true};
+
+  for (unsigned int i = 0; i < n; i++) {
+    t.starts[i]   = -1;
+    t.isLeader[i] = false;
+  }
+
+  initRegCode(out);
+  findLeaders(&t);
+  findStackDepths(chunk, arity, t.depths);
+
+  // The callee and its parameters are in the first slots
+  for (int i = 0; i <= arity; i++) {
+    pushSlot(&t, OPERAND_HOME, 0);
+  }
+
+  translateCode(&t);
+  patchFixups(&t);
+
+  FREE_ARRAY(RegFixup, t.fixups, n);
+  FREE_ARRAY(bool, t.isLeader, n);
+  FREE_ARRAY(int, t.starts, n);
+  FREE_ARRAY(int, t.depths, n);
+
+  if (!t.ok)
+    freeRegCode(out);
+
+  return t.ok;
+}
+
+const char *regOpCodeStr(RegOpCode opCode) {
+  switch (opCode) {
+    case ROP_MOVE:          return "ROP_MOVE";
+    case ROP_NIL:           return "ROP_NIL";
+    case ROP_TRUE:          return "ROP_TRUE";
+    case ROP_FALSE:         return "ROP_FALSE";
+    case ROP_ADD:           return "ROP_ADD";
+    case ROP_SUBTRACT:      return "ROP_SUBTRACT";
+    case ROP_MULTIPLY:      return "ROP_MULTIPLY";
+    case ROP_DIVIDE:        return "ROP_DIVIDE";
+    case ROP_EQ:            return "ROP_EQ";
+    case ROP_NOT_EQ:        return "ROP_NOT_EQ";
+    case ROP_LESS:          return "ROP_LESS";
+    case ROP_LESS_EQ:       return "ROP_LESS_EQ";
+    case ROP_GREATER:       return "ROP_GREATER";
+    case ROP_GREATER_EQ:    return "ROP_GREATER_EQ";
+    case ROP_NOT:           return "ROP_NOT";
+    case ROP_NEGATE:        return "ROP_NEGATE";
+    case ROP_DEF_GLOBAL:    return "ROP_DEF_GLOBAL";
+    case ROP_GET_GLOBAL:    return "ROP_GET_GLOBAL";
+    case ROP_SET_GLOBAL:    return "ROP_SET_GLOBAL";
+    case ROP_GET_UPVALUE:   return "ROP_GET_UPVALUE";
+    case ROP_SET_UPVALUE:   return "ROP_SET_UPVALUE";
+    case ROP_CLOSE:         return "ROP_CLOSE";
+    case ROP_JUMP:          return "ROP_JUMP";
+    case ROP_JUMP_IF_FALSE: return "ROP_JUMP_IF_FALSE";
+    case ROP_JUMP_IF_TRUE:  return "ROP_JUMP_IF_TRUE";
+    case ROP_CALL:          return "ROP_CALL";
+    case ROP_CLOSURE:       return "ROP_CLOSURE";
+    case ROP_PRINT:         return "ROP_PRINT";
+    case ROP_RETURN:        return "ROP_RETURN";
+    case ROP_IS_FUNC:       return "ROP_IS_FUNC";
+    case ROP_GET_CAPTURED:  return "ROP_GET_CAPTURED";
+    case ROP_LOCAL_CLOSURE: return "ROP_LOCAL_CLOSURE";
+    case ROP_GET_PARENT:    return "ROP_GET_PARENT";
+    case ROP_SET_PARENT:    return "ROP_SET_PARENT";
+    case ROP_GET_HOISTED:   return "ROP_GET_HOISTED";
+    case ROP_CALL_NATIVE:   return "ROP_CALL_NATIVE";
+    case ROP_DEF_CONST:     return "ROP_DEF_CONST";
+  }
+
+  return "unknown opcode";
+}
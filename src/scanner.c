@@ -1,10 +1,49 @@
 #include "scanner.h"
 #include "token.h"
 
-#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#define CHAR_ALPHA 0x01 // Letters and '_', which can start an identifier
+#define CHAR_DIGIT 0x02
+
+static const uint8_t charClasses[256] = {
+    ['a' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_']         = CHAR_ALPHA,
+    ['0' ... '9'] = CHAR_DIGIT,
+};
+
+#define IS_ALPHA(c) (charClasses[(uint8_t)(c)] & CHAR_ALPHA)
+#define IS_DIGIT(c) (charClasses[(uint8_t)(c)] & CHAR_DIGIT)
+
+// SWAR (SIMD within a register) helpers, which look at 8 source bytes at once.
+// Identifiers and numbers are mostly too short for them to pay off.
+#define SWAR_ONES  0x0101010101010101ull
+#define SWAR_HIGHS 0x8080808080808080ull
+
+static uint64_t load8(const char *chars) {
+  uint64_t word;
+  memcpy(&word, chars, sizeof(word));
+  return word;
+}
+
+// Whether any byte of the word is zero.
+static bool hasZeroByte(uint64_t word) {
+  return ((word - SWAR_ONES) & ~word & SWAR_HIGHS) != 0;
+}
+
+// Skips the run of chars in the class, returning the first char after it.
+static const char *skipRun(const char *cur, uint8_t class) {
+  while (charClasses[(uint8_t)*cur] & class) {
+    cur++;
+  }
+
+  return cur;
+}
+
 // Moves the scanner current position one forward, returning the recent char
 static char advance(Scanner *scanner) {
   scanner->cur++;
@@ -34,10 +73,6 @@ static bool match(Scanner *scanner, char c) {
   return false;
 }
 
-static bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
-}
-
 static Token token(Scanner *scanner, TokType type) {
   Token tok;
   tok.type  = type;
@@ -58,37 +93,69 @@ static Token error(Scanner *scanner, const char *msg) {
   return tok;
 }
 
-static Token number(Scanner *scanner) {
-#define CONSUME_DIGITS()         \
-  while (isdigit(peek(scanner))) \
-  advance(scanner)
+// Moves the scanner to the char, which is on the same line.
+static void advanceTo(Scanner *scanner, const char *cur) {
+  scanner->col += cur - scanner->cur;
+  scanner->cur = cur;
+}
 
-  CONSUME_DIGITS();
+static Token number(Scanner *scanner) {
+  advanceTo(scanner, skipRun(scanner->cur, CHAR_DIGIT));
 
   // Look for fractional part of number
   if (peek(scanner) == '.') {
-    if (!isdigit(peekNext(scanner)))
+    if (!IS_DIGIT(peekNext(scanner)))
       return error(scanner, "expect digits after '.'");
 
     advance(scanner); // Consume '.'
-    CONSUME_DIGITS();
+    advanceTo(scanner, skipRun(scanner->cur, CHAR_DIGIT));
   }
 
   return token(scanner, TOK_NUMBER);
+}
+
+// Skips to the end of the line, stopping early at a zero byte like the rest of
+// the scanner does.
+static void skipComment(Scanner *scanner) {
+  const char *cur = scanner->cur;
+
+  while (scanner->end - cur >= 8) {
+    uint64_t word = load8(cur);
+
+    if (hasZeroByte(word) || hasZeroByte(word ^ SWAR_ONES * '\n'))
+      break;
+
+    cur += 8;
+  }
 
-#undef CONSUME_DIGITS
+  while (*cur != '\n' && *cur != '\0') {
+    cur++;
+  }
+
+  advanceTo(scanner, cur);
 }
 
-static void skipWhitespace(Scanner *scanner) {
-#define CONSUME_INLINE_COMMENT()                     \
-  while (peek(scanner) != '\n' && !isAtEnd(scanner)) \
-  advance(scanner)
+// Indentation is mostly runs of spaces.
+static void skipSpaces(Scanner *scanner) {
+  const char *cur = scanner->cur;
+
+  while (scanner->end - cur >= 8 && load8(cur) == SWAR_ONES * ' ') {
+    cur += 8;
+  }
+
+  while (*cur == ' ') {
+    cur++;
+  }
+
+  advanceTo(scanner, cur);
+}
 
+static void skipWhitespace(Scanner *scanner) {
   while (true) {
     switch (peek(scanner)) {
       case '/':
         if (peekNext(scanner) == '/') {
-          CONSUME_INLINE_COMMENT();
+          skipComment(scanner);
           continue;
         }
         return;
@@ -98,54 +165,88 @@ static void skipWhitespace(Scanner *scanner) {
         scanner->col = 1;
         continue;
       case ' ':
+        // Most spaces come alone, between tokens
+        advance(scanner);
+        if (peek(scanner) == ' ')
+          skipSpaces(scanner);
+        continue;
       case '\t':
       case '\r': advance(scanner); continue;
       default:   return;
     }
   }
-
-#undef CONSUME_INLINE_COMMENT
 }
 
-static TokType checkKeyword(Scanner *scanner, int start, int len,
-                            const char *rest, TokType type) {
-  bool sameLen      = scanner->cur - scanner->start == start + len;
-  bool sameContents = strncmp(scanner->start + start, rest, len) == 0;
-  return sameLen && sameContents ? type : TOK_IDENTIFIER;
-}
+typedef struct keyword {
+  union {
+    char chars[8]; // Zero padded
+    uint64_t word;
+  };
+  int len;
+  TokType type;
+} Keyword;
+
+/*
+ * A perfect hash of the keywords: each has its own slot, so an identifier is
+ * only compared with the one keyword it could be. Every keyword is at least two
+ * chars long.
+ */
+#define KEYWORD_SLOTS   32
+#define KEYWORD_MIN_LEN 2
+#define KEYWORD_MAX_LEN 6
+#define KEYWORD_HASH(a, b, len) (((a) + 2 * (b) + (len)) & (KEYWORD_SLOTS - 1))
+
+// The first len bytes of a word loaded from memory
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define KEYWORD_MASK(len) ((1ull << ((len) * 8)) - 1)
+#else
+#define KEYWORD_MASK(len) (~0ull << (64 - (len) * 8))
+#endif
+#define KEYWORD(a, b, str, tokType) \
+  [KEYWORD_HASH(a, b, sizeof(str) - 1)] = {{str}, sizeof(str) - 1, tokType}
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    KEYWORD('c', 'o', "const", TOK_CONST),
+    KEYWORD('e', 'l', "else", TOK_ELSE),
+    KEYWORD('f', 'a', "false", TOK_FALSE),
+    KEYWORD('f', 'o', "for", TOK_FOR),
+    KEYWORD('f', 'u', "func", TOK_FUNC),
+    KEYWORD('i', 'f', "if", TOK_IF),
+    KEYWORD('n', 'i', "nil", TOK_NIL),
+    KEYWORD('p', 'r', "print", TOK_PRINT),
+    KEYWORD('r', 'e', "return", TOK_RETURN),
+    KEYWORD('t', 'r', "true", TOK_TRUE),
+    KEYWORD('v', 'a', "var", TOK_VAR),
+    KEYWORD('w', 'h', "while", TOK_WHILE),
+};
+
+#undef KEYWORD
 
 static TokType identifierType(Scanner *scanner) {
-  // Use a trie to find if it is a language keyword or identifier
-  switch (scanner->start[0]) {
-    case 'e': return checkKeyword(scanner, 1, 3, "lse", TOK_ELSE);
-    case 'f':
-      if (scanner->cur - scanner->start > 1) {
-        switch (scanner->start[1]) {
-          case 'a': return checkKeyword(scanner, 2, 3, "lse", TOK_FALSE);
-          case 'o': return checkKeyword(scanner, 2, 1, "r", TOK_FOR);
-          case 'u': return checkKeyword(scanner, 2, 2, "nc", TOK_FUNC);
-        }
-      }
-      break;
-    case 'i': return checkKeyword(scanner, 1, 1, "f", TOK_IF);
-    case 'n': return checkKeyword(scanner, 1, 2, "il", TOK_NIL);
-    case 'p': return checkKeyword(scanner, 1, 4, "rint", TOK_PRINT);
-    case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOK_RETURN);
-    case 't': return checkKeyword(scanner, 1, 3, "rue", TOK_TRUE);
-    case 'v': return checkKeyword(scanner, 1, 2, "ar", TOK_VAR);
-    case 'w': return checkKeyword(scanner, 1, 4, "hile", TOK_WHILE);
+  int len = scanner->cur - scanner->start;
+
+  if (len < KEYWORD_MIN_LEN || len > KEYWORD_MAX_LEN)
+    return TOK_IDENTIFIER;
+
+  const char *start = scanner->start;
+  const Keyword *keyword =
+      &keywords[KEYWORD_HASH((uint8_t)start[0], (uint8_t)start[1], len)];
+
+  if (keyword->len != len)
+    return TOK_IDENTIFIER;
+
+  // Compares the whole keyword at once when a word can be read
+  if (scanner->end - start >= 8) {
+    uint64_t word = load8(start) & KEYWORD_MASK(len);
+    return word == keyword->word ? keyword->type : TOK_IDENTIFIER;
   }
 
-  return TOK_IDENTIFIER;
+  return memcmp(start, keyword->chars, len) == 0 ? keyword->type
+                                                 : TOK_IDENTIFIER;
 }
 
 static Token identifier(Scanner *scanner) {
-  char c = peek(scanner);
-  while (isAlpha(c) || isdigit(c)) {
-    advance(scanner);
-    c = peek(scanner);
-  }
-
+  advanceTo(scanner, skipRun(scanner->cur, CHAR_ALPHA | CHAR_DIGIT));
   return token(scanner, identifierType(scanner));
 }
 
@@ -169,6 +270,7 @@ static Token string(Scanner *scanner) {
 void initScanner(Scanner *scanner, const char *source) {
   scanner->start = source;
   scanner->cur   = source;
+  scanner->end   = source + strlen(source);
   scanner->line  = 1;
   scanner->col   = 1;
 }
@@ -182,10 +284,10 @@ Token scanNext(Scanner *scanner) {
 
   char c = advance(scanner);
 
-  if (isdigit(c))
+  if (IS_DIGIT(c))
     return number(scanner);
 
-  if (isAlpha(c)) {
+  if (IS_ALPHA(c)) {
     return identifier(scanner);
   }
 
@@ -222,3 +324,47 @@ Token scanNext(Scanner *scanner) {
 
   return error(scanner, "unexpected character");
 }
+
+void initTokenList(TokenList *list) {
+  list->count    = 0;
+  list->capacity = 0;
+  list->tokens   = NULL;
+}
+
+void freeTokenList(TokenList *list) {
+  free(list->tokens);
+  initTokenList(list);
+}
+
+void scanTokens(const char *source, TokenList *list) {
+  Scanner scanner;
+  initScanner(&scanner, source);
+
+  // Most tokens take at least a few chars, including the space around them
+  int capacity = (int)((scanner.end - source) / 4) + 8;
+  if (list->capacity < capacity) {
+    list->capacity = capacity;
+    list->tokens   = realloc(list->tokens, sizeof(Token) * capacity);
+
+    if (list->tokens == NULL)
+      exit(EXIT_FAILURE);
+  }
+
+  list->count = 0;
+
+  while (true) {
+    if (list->count == list->capacity) {
+      list->capacity *= 2;
+      list->tokens = realloc(list->tokens, sizeof(Token) * list->capacity);
+
+      if (list->tokens == NULL)
+        exit(EXIT_FAILURE);
+    }
+
+    Token tok                   = scanNext(&scanner);
+    list->tokens[list->count++] = tok;
+
+    if (tok.type == TOK_EOF)
+      return;
+  }
+}
@@ -0,0 +1,121 @@
+#include "source.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#define READ_CHUNK_SIZE 4096
+
+/*
+ * Maps the file so that at least one zero byte follows its contents. Bytes past
+ * the end of the file within its last page read as zero, and when the file
+ * ends exactly on a page boundary the zero page of the anonymous reservation
+ * underneath the file mapping provides the sentinel.
+ */
+static bool mapFile(Source *source, int fd, size_t size) {
+  size_t pageSize  = sysconf(_SC_PAGESIZE);
+  size_t mappedLen = (size / pageSize + 1) * pageSize;
+
+  char *region = mmap(NULL, mappedLen, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+  if (region == MAP_FAILED)
+    return false;
+
+  if (mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+      MAP_FAILED) {
+    munmap(region, mappedLen);
+    return false;
+  }
+
+  // The scanner makes a single pass from start to end
+  madvise(region, size, MADV_SEQUENTIAL);
+
+  source->chars     = region;
+  source->len       = size;
+  source->mappedLen = mappedLen;
+  return true;
+}
+
+// Reads until end of file, for when the size isn't known up front.
+static bool readStream(Source *source, int fd) {
+  size_t capacity = READ_CHUNK_SIZE, len = 0;
+  char *chars     = malloc(capacity);
+
+  while (true) {
+    if (chars == NULL)
+      return false;
+
+    // Always leave room for the '\0' sentinel
+    if (len + 1 >= capacity) {
+      capacity *= 2;
+      chars = realloc(chars, capacity);
+      continue;
+    }
+
+    ssize_t bytesRead = read(fd, chars + len, capacity - len - 1);
+    if (bytesRead == -1) {
+      if (errno == EINTR)
+        continue;
+
+      free(chars);
+      return false;
+    }
+
+    if (bytesRead == 0)
+      break;
+
+    len += bytesRead;
+  }
+
+  chars[len] = '\0';
+
+  source->chars     = chars;
+  source->len       = len;
+  source->mappedLen = 0;
+  return true;
+}
+
+bool tryReadSource(Source *source, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+
+  if (ok) {
+    bool mapped = S_ISREG(st.st_mode) && st.st_size > 0 &&
+                  mapFile(source, fd, (size_t)st.st_size);
+
+    ok = mapped || readStream(source, fd);
+  }
+
+  // The mapping stays valid once the descriptor is closed
+  close(fd);
+  return ok;
+}
+
+void readSource(Source *source, const char *path) {
+  if (!tryReadSource(source, path)) {
+    fprintf(stderr, "could not open file '%s'\n", path);
+    exit(EX_IOERR);
+  }
+}
+
+void freeSource(Source *source) {
+  if (source->mappedLen > 0) {
+    munmap((void *)source->chars, source->mappedLen);
+  } else {
+    free((void *)source->chars);
+  }
+
+  source->chars     = NULL;
+  source->len       = 0;
+  source->mappedLen = 0;
+}
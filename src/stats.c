@@ -0,0 +1,222 @@
+#include "stats.h"
+
+#include "memory.h"
+#include "scanner.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *phaseNames[PHASE_COUNT] = {
+    [PHASE_READ]    = "read",
+    [PHASE_SCAN]    = "scan",
+    [PHASE_COMPILE] = "compile",
+    [PHASE_RUN]     = "run",
+};
+
+static double seconds(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+void initStats(Stats *stats, const char *path) {
+  memset(stats, 0, sizeof(Stats));
+  stats->path = path;
+}
+
+void freeStats(Stats *stats) {
+  for (int i = 0; i < stats->funcCount; i++) {
+    free(stats->funcs[i].name);
+  }
+
+  free(stats->funcs);
+  initStats(stats, stats->path);
+}
+
+void startPhase(Stats *stats) {
+  stats->started.wall = seconds(CLOCK_MONOTONIC);
+  stats->started.cpu  = seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void endPhase(Stats *stats, Phase phase) {
+  stats->phases[phase].wall += seconds(CLOCK_MONOTONIC) - stats->started.wall;
+  stats->phases[phase].cpu +=
+      seconds(CLOCK_PROCESS_CPUTIME_ID) - stats->started.cpu;
+}
+
+int countTokens(const char *source) {
+  TokenList list;
+  initTokenList(&list);
+  scanTokens(source, &list);
+
+  int count = list.count - 1; // Not counting the TOK_EOF
+  freeTokenList(&list);
+  return count;
+}
+
+void collectRunStats(Stats *stats) {
+  stats->collections  = vm.collections;
+  stats->traceTime    = vm.traceTime;
+  stats->sweepTime    = vm.sweepTime;
+  stats->lazyCompiles = vm.lazyCompiles;
+  stats->lazyTime     = vm.lazyTime;
+  heapUsage(&stats->heapObjs, &stats->heapBytes);
+}
+
+// Functions already recorded. Inlining copies a function constant into the
+// callers' pools, so the same function can be reached more than once.
+typedef struct seen_funcs {
+  int count;
+  int capacity;
+  ObjFunc **funcs;
+} SeenFuncs;
+
+static bool markSeen(SeenFuncs *seen, ObjFunc *func) {
+  for (int i = 0; i < seen->count; i++) {
+    if (seen->funcs[i] == func)
+      return false;
+  }
+
+  if (seen->count == seen->capacity) {
+    seen->capacity = seen->capacity < 8 ? 8 : seen->capacity * 2;
+    seen->funcs    = realloc(seen->funcs, sizeof(ObjFunc *) * seen->capacity);
+
+    if (seen->funcs == NULL)
+      exit(EXIT_FAILURE);
+  }
+
+  seen->funcs[seen->count++] = func;
+  return true;
+}
+
+static void addFunc(Stats *stats, ObjFunc *func) {
+  if (stats->funcCount == stats->funcCapacity) {
+    stats->funcCapacity = stats->funcCapacity < 8 ? 8 : stats->funcCapacity * 2;
+    stats->funcs =
+        realloc(stats->funcs, sizeof(FuncStats) * stats->funcCapacity);
+
+    if (stats->funcs == NULL)
+      exit(EXIT_FAILURE);
+  }
+
+  FuncStats *funcStats = &stats->funcs[stats->funcCount++];
+  funcStats->name      = func->name == NULL ? NULL : strndup(func->name->chars,
+                                                             func->name->len);
+  funcStats->bytes     = (int)func->chunk.count;
+  funcStats->constants = (int)func->chunk.constants.count;
+  funcStats->upvalues  = func->upvalueCount;
+}
+
+static void collectFunc(Stats *stats, SeenFuncs *seen, ObjFunc *func) {
+  if (!markSeen(seen, func))
+    return;
+
+  addFunc(stats, func);
+
+  ValueList *constants = &func->chunk.constants;
+  for (unsigned int i = 0; i < constants->count; i++) {
+    if (IS_FUNC(constants->values[i]))
+      collectFunc(stats, seen, AS_FUNC(constants->values[i]));
+  }
+}
+
+void collectFuncStats(Stats *stats, ObjFunc *script) {
+  SeenFuncs seen = {0, 0, NULL};
+  collectFunc(stats, &seen, script);
+  free(seen.funcs);
+}
+
+// Writes the string as a JSON string literal.
+static void printJsonString(const char *str, FILE *out) {
+  fputc('"', out);
+
+  for (const char *c = str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+
+  fputc('"', out);
+}
+
+static void printText(Stats *stats, FILE *out) {
+  fprintf(out, "stats for %s\n", stats->path);
+  fprintf(out, "%-10s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    fprintf(out, "%-10s %12.6f %12.6f\n", phaseNames[i], stats->phases[i].wall,
+            stats->phases[i].cpu);
+  }
+
+  fprintf(out, "tokens: %d\n", stats->tokens);
+  fprintf(out, "objects allocated while compiling: %zu\n", stats->compileObjs);
+  fprintf(out, "collections: %zu, tracing %.6fs, sweeping %.6fs\n",
+          stats->collections, stats->traceTime, stats->sweepTime);
+  fprintf(out, "compiled on first call: %zu, taking %.6fs\n",
+          stats->lazyCompiles, stats->lazyTime);
+  fprintf(out, "heap: %zu objects in %zu bytes, %.1f bytes each\n",
+          stats->heapObjs, stats->heapBytes,
+          stats->heapObjs == 0 ? 0.0
+                               : (double)stats->heapBytes / stats->heapObjs);
+  fprintf(out, "%-20s %8s %10s %9s\n", "function", "bytes", "constants",
+          "upvalues");
+
+  for (int i = 0; i < stats->funcCount; i++) {
+    FuncStats *func = &stats->funcs[i];
+    fprintf(out, "%-20s %8d %10d %9d\n",
+            func->name == NULL ? "<script>" : func->name, func->bytes,
+            func->constants, func->upvalues);
+  }
+}
+
+// A single line object, so each script's stats are one line of JSON.
+static void printJson(Stats *stats, FILE *out) {
+  fputs("{\"path\":", out);
+  printJsonString(stats->path, out);
+  fputs(",\"phases\":{", out);
+
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    fprintf(out, "%s\"%s\":{\"wall\":%.9f,\"cpu\":%.9f}", i > 0 ? "," : "",
+            phaseNames[i], stats->phases[i].wall, stats->phases[i].cpu);
+  }
+
+  fprintf(out, "},\"tokens\":%d,\"compileObjects\":%zu,", stats->tokens,
+          stats->compileObjs);
+  fprintf(out,
+          "\"gc\":{\"collections\":%zu,\"trace\":%.9f,\"sweep\":%.9f},"
+          "\"lazy\":{\"compiles\":%zu,\"time\":%.9f},"
+          "\"heap\":{\"objects\":%zu,\"bytes\":%zu},\"functions\":[",
+          stats->collections, stats->traceTime, stats->sweepTime,
+          stats->lazyCompiles, stats->lazyTime, stats->heapObjs,
+          stats->heapBytes);
+
+  for (int i = 0; i < stats->funcCount; i++) {
+    FuncStats *func = &stats->funcs[i];
+
+    fputs(i > 0 ? ",{\"name\":" : "{\"name\":", out);
+    if (func->name == NULL) {
+      fputs("null", out);
+    } else {
+      printJsonString(func->name, out);
+    }
+
+    fprintf(out, ",\"bytes\":%d,\"constants\":%d,\"upvalues\":%d}", func->bytes,
+            func->constants, func->upvalues);
+  }
+
+  fputs("]}\n", out);
+}
+
+void printStats(Stats *stats, StatsFormat format, FILE *out) {
+  if (format == STATS_JSON) {
+    printJson(stats, out);
+  } else {
+    printText(stats, out);
+  }
+}
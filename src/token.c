@@ -31,6 +31,7 @@ char *tokTypeStr(TokType type) {
     case TOK_FALSE:       return "TOK_FALSE";
     case TOK_NIL:         return "TOK_NIL";
     case TOK_VAR:         return "TOK_VAR";
+    case TOK_CONST:       return "TOK_CONST";
     case TOK_IF:          return "TOK_IF";
     case TOK_ELSE:        return "TOK_ELSE";
     case TOK_WHILE:       return "TOK_WHILE";
@@ -1,8 +1,9 @@
 #include "value.h"
+#include "dtoa.h"
 #include "memory.h"
 #include "object.h"
+#include "vm.h"
 
-#include <stdio.h>
 #include <string.h>
 
 void initValueList(ValueList *list) {
@@ -27,11 +28,24 @@ void freeValueList(ValueList *list) {
   initValueList(list);
 }
 
+static void printNumber(double number) {
+  char buf[NUMBER_FMT_MAX];
+  int n = formatNumber(number, buf);
+  writeOutput(buf, n);
+}
+
 void printValue(Value value) {
   switch (value.type) {
-    case VAL_NIL:  printf("nil"); break;
-    case VAL_BOOL: printf("%s", AS_BOOL(value) ? "true" : "false"); break;
-    case VAL_NUM:  printf("%g", AS_NUM(value)); break;
+    case VAL_NIL:  writeOutput("nil", 3); break;
+    case VAL_BOOL: {
+      if (AS_BOOL(value)) {
+        writeOutput("true", 4);
+      } else {
+        writeOutput("false", 5);
+      }
+      break;
+    }
+    case VAL_NUM:  printNumber(AS_NUM(value)); break;
     case VAL_OBJ:  printObj(value); break;
   }
 }
@@ -41,7 +55,7 @@ bool valuesEq(Value a, Value b) {
     return false;
 
   switch (a.type) {
-    case VAL_NIL:  return false;
+    case VAL_NIL:  return true;
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NUM:  return AS_NUM(a) == AS_NUM(b);
     case VAL_OBJ:  return AS_OBJ(a) == AS_OBJ(b); // string interning
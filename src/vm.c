@@ -2,14 +2,21 @@
 
 #include "chunk.h"
 #include "compiler.h"
+#include "dtoa.h"
+#include "file.h"
 #include "hashtable.h"
 #include "memory.h"
 #include "object.h"
+#include "regcode.h"
 
+#include <errno.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 VM vm;
 
@@ -40,7 +47,84 @@ static bool isFalsy(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Whether the value is a closure of the function, which an inlined call checks
+// before running the function's body in place of calling it.
+static bool isClosureOf(Value value, Value func) {
+  return IS_CLOSURE(value) && CLOSURE_FUNC(AS_CLOSURE(value)) == AS_FUNC(func);
+}
+
+// Whether the global was defined by a top level const. Functions declared
+// before the const compile assignments to it without knowing it is one.
+static bool isConstGlobal(ObjString *name) {
+  Value unused;
+  return hashTableGet(&vm.constGlobals, name, &unused);
+}
+
+void flushOutput() {
+  const char *chars = vm.output;
+  size_t remaining  = vm.outputLen;
+
+  while (remaining > 0) {
+    ssize_t written = write(STDOUT_FILENO, chars, remaining);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      break; // Nowhere left to report it, drop the output.
+    }
+
+    chars += written;
+    remaining -= written;
+  }
+
+  vm.outputLen = 0;
+}
+
+void writeOutput(const char *chars, size_t n) {
+  if (vm.outputLen + n > OUTPUT_BUFFER_MAX) {
+    flushOutput();
+
+    // Too big to ever fit, so write it through the (now empty) buffer in parts
+    while (n > OUTPUT_BUFFER_MAX) {
+      memcpy(vm.output, chars, OUTPUT_BUFFER_MAX);
+      vm.outputLen = OUTPUT_BUFFER_MAX;
+      flushOutput();
+      chars += OUTPUT_BUFFER_MAX;
+      n -= OUTPUT_BUFFER_MAX;
+    }
+  }
+
+  memcpy(vm.output + vm.outputLen, chars, n);
+  vm.outputLen += n;
+
+  if (vm.outputMode == OUTPUT_UNBUFFERED)
+    flushOutput();
+}
+
+void printOutput(const char *format, ...) {
+  char buf[256];
+
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+
+  if (n < 0)
+    return;
+
+  writeOutput(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+void endOutputLine() {
+  writeOutput("\n", 1);
+
+  if (vm.outputMode == OUTPUT_LINE)
+    flushOutput();
+}
+
 static void runtimeError(const char *format, ...) {
+  // Anything printed before the error should appear before it.
+  flushOutput();
+
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -49,33 +133,41 @@ static void runtimeError(const char *format, ...) {
 
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame *frame = &vm.frames[i];
-    ObjFunc *func    = frame->closure->func;
-    size_t offset    = frame->ip - func->chunk.code - 1;
+    ObjFunc *func    = CLOSURE_FUNC(frame->closure);
+    int line;
 
-    fprintf(stderr, "[line %d] in ", func->chunk.lines[offset]);
+    if (vm.backend == BACKEND_REGISTER) {
+      line = func->regCode.lines[frame->pc - func->regCode.code - 1];
+    } else {
+      line = chunkLine(&func->chunk, frame->ip - func->chunk.code - 1);
+    }
+
+    fprintf(stderr, "[line %d] in ", line);
 
     if (func->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", func->name->chars);
+      fprintf(stderr, "%.*s()\n", func->name->len, func->name->chars);
     }
   }
 
   resetStack();
 }
 
-static void defineNative(const char *name, NativeFn native) {
+static ObjNative *defineNative(const NativeDef *def) {
   // Push/pop off the name and function onto the stack to let the GC know that
   // we aren't done with these so the GC doesn't free them when a recollection
-  // occurs dues to copyString and newNative dynamically allocating memory.
-
-  push(OBJ_VAL(copyString(name, strlen(name))));
-  push(OBJ_VAL(newNative(native)));
+  // occurs dues to borrowString and newNative dynamically allocating memory.
+  // Native names are string literals, so they needn't be copied.
+  push(OBJ_VAL(borrowString(def->name, strlen(def->name))));
+  push(OBJ_VAL(newNative(def->func, def->arity)));
 
   hashTableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  ObjNative *native = AS_NATIVE(vm.stack[1]);
 
   pop();
   pop();
+  return native;
 }
 
 static Value clockNative(__attribute__((unused)) int argCount,
@@ -83,12 +175,113 @@ static Value clockNative(__attribute__((unused)) int argCount,
   return NUM_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// Converts a number to its shortest round-trip string, strings pass through.
+static Value strNative(__attribute__((unused)) int argCount, Value *args) {
+  if (IS_STRING(args[0]))
+    return args[0];
+
+  if (!IS_NUM(args[0]))
+    return NIL_VAL;
+
+  double number = AS_NUM(args[0]);
+
+  if (number >= 0 && number < SMALL_INT_STRINGS && !signbit(number) &&
+      number == (int)number)
+    return OBJ_VAL(vm.smallIntStrings[(int)number]);
+
+  char buf[NUMBER_FMT_MAX];
+  int n = formatNumber(number, buf);
+  return OBJ_VAL(copyString(buf, n));
+}
+
+static Value flushNative(__attribute__((unused)) int argCount,
+                         __attribute__((unused)) Value *args) {
+  flushOutput();
+  return NIL_VAL;
+}
+
+// Opens a file for reading lines, returns nil if it can't be opened.
+static Value openNative(__attribute__((unused)) int argCount, Value *args) {
+  if (!IS_STRING(args[0]))
+    return NIL_VAL;
+
+  // The path may be borrowed from the source, without a zero terminator
+  ObjString *path  = AS_STRING(args[0]);
+  char *terminated = strndup(path->chars, path->len);
+  if (terminated == NULL)
+    return NIL_VAL;
+
+  ObjFile *file = openFile(terminated);
+  free(terminated);
+  return file == NULL ? NIL_VAL : OBJ_VAL(file);
+}
+
+// Returns the file's next line, or nil once all lines have been read.
+static Value readLineNative(__attribute__((unused)) int argCount,
+                            Value *args) {
+  if (!IS_FILE(args[0]))
+    return NIL_VAL;
+
+  ObjString *line = readLine(AS_FILE(args[0]));
+  return line == NULL ? NIL_VAL : OBJ_VAL(line);
+}
+
+static Value closeNative(__attribute__((unused)) int argCount, Value *args) {
+  if (IS_FILE(args[0])) {
+    closeFile(AS_FILE(args[0]));
+  }
+
+  return NIL_VAL;
+}
+
+const NativeDef nativeDefs[NATIVE_COUNT] = {
+    {"clock", clockNative, 0, NATIVE_NO_ALLOC},
+    {"flush", flushNative, 0, NATIVE_NO_ALLOC},
+    {"str", strNative, 1, NATIVE_PURE},
+    {"open", openNative, 1, 0},
+    {"readLine", readLineNative, 1, 0},
+    {"close", closeNative, 1, NATIVE_NO_ALLOC},
+};
+
+int findNative(const char *name, int len) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if (strncmp(nativeDefs[i].name, name, len) == 0 &&
+        nativeDefs[i].name[len] == '\0')
+      return i;
+  }
+
+  return -1;
+}
+
 static void defineNativeFuncs() {
-  defineNative("clock", clockNative);
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    vm.natives[i] = defineNative(&nativeDefs[i]);
+  }
+}
+
+// Compiles a function whose body compile() left until its first call.
+static bool compileBody(ObjFunc *func) {
+  flushOutput(); // Keep the output so far ahead of any compile errors
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bool compiled = compileLazyFunc(func);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  vm.lazyCompiles++;
+  vm.lazyTime += (end.tv_sec - start.tv_sec) +
+                 (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (compiled)
+    return true;
+
+  runtimeError("could not compile %.*s()", func->name->len,
+               func->name->chars);
+  return false;
 }
 
 static bool call(ObjClosure *closure, int argCount) {
-  ObjFunc *func = closure->func;
+  ObjFunc *func = CLOSURE_FUNC(closure);
 
   if (argCount != func->arity) {
     runtimeError("expected %d arguments, but got %d", func->arity, argCount);
@@ -100,6 +293,9 @@ static bool call(ObjClosure *closure, int argCount) {
     return false;
   }
 
+  if (func->lazyStart.start != NULL && !compileBody(func))
+    return false;
+
   CallFrame *frame = &vm.frames[vm.frameCount];
   vm.frameCount++;
 
@@ -119,9 +315,16 @@ static bool callValue(Value callee, int argCount) {
       // case OBJ_FUNC:   return call(AS_FUNC(callee), argCount);
       case OBJ_CLOSURE: return call(AS_CLOSURE(callee), argCount);
       case OBJ_NATIVE:  {
-        NativeFn native = AS_NATIVE(callee);
-        Value *args     = vm.stackTop - argCount;
-        Value result    = native(argCount, args);
+        ObjNative *native = AS_NATIVE(callee);
+
+        if (argCount != native->arity) {
+          runtimeError("expected %d arguments, but got %d", native->arity,
+                       argCount);
+          return false;
+        }
+
+        Value *args  = vm.stackTop - argCount;
+        Value result = native->func(argCount, args);
 
         // Remove args from stack and push the result
         vm.stackTop -= argCount + 1;
@@ -143,7 +346,7 @@ static ObjUpvalue *captureUpvalue(Value *local) {
   ObjUpvalue *prev = NULL, *cur = vm.openUpvalues;
   while (cur != NULL && cur->location > local) {
     prev = cur;
-    cur  = cur->next;
+    cur  = UPVALUE_NEXT(cur);
   }
 
   // Found an exising upvalue capturing the variable, reuse it.
@@ -154,17 +357,38 @@ static ObjUpvalue *captureUpvalue(Value *local) {
   // Otherwise, create a new upvalue for the local slot and insert it at the
   // right location within the sorted list.
   ObjUpvalue *createdUpvalue = newUpvalue(local);
-  createdUpvalue->next       = cur;
+  createdUpvalue->next       = ENCODE_REF(cur);
 
   if (prev == NULL) {
     vm.openUpvalues = createdUpvalue;
   } else {
-    prev->next = createdUpvalue;
+    prev->next = ENCODE_REF(createdUpvalue);
   }
 
   return createdUpvalue;
 }
 
+// The entry of a new closure for one variable it captures: an upvalue for a
+// local of the enclosing function, a copy of a local that is never assigned,
+// or the enclosing closure's own entry.
+static Value captureVar(uint8_t kind, Value *slots, ObjClosure *enclosing,
+                        uint8_t index) {
+  switch (kind) {
+    case UPVALUE_CAPTURES_LOCAL: return OBJ_VAL(captureUpvalue(slots + index));
+    case UPVALUE_CAPTURES_VALUE: return slots[index];
+    default:                     return enclosing->upvalues[index];
+  }
+}
+
+// A function that never escapes the frame creating it reads that frame's locals
+// directly, so all its closures are alike and one is shared between them.
+static ObjClosure *localClosure(ObjFunc *func) {
+  if (func->localClosure == NULL)
+    func->localClosure = newClosure(func);
+
+  return func->localClosure;
+}
+
 // Close every open upvalue pointing to the given stack slot or above it
 static void closeUpvalues(Value *lastSlot) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= lastSlot) {
@@ -178,29 +402,52 @@ static void closeUpvalues(Value *lastSlot) {
     upvalue->closed   = *upvalue->location;
     upvalue->location = &upvalue->closed;
 
-    vm.openUpvalues = upvalue->next;
+    vm.openUpvalues = UPVALUE_NEXT(upvalue);
   }
 }
 
 void initVM() {
   resetStack();
 
-  vm.objs           = NULL;
+  // Like stdio, interactive output is flushed every line.
+  vm.outputLen  = 0;
+  vm.outputMode = isatty(STDOUT_FILENO) ? OUTPUT_LINE : OUTPUT_FULL;
+  vm.backend    = BACKEND_STACK;
+
+  memset(vm.pools, 0, sizeof(vm.pools));
+  memset(vm.natives, 0, sizeof(vm.natives));
   vm.bytesAllocated = 0;
   vm.nextGC         = 1024 * 1024;
+  vm.objsAllocated  = 0;
+  vm.collections    = 0;
+  vm.traceTime      = 0;
+  vm.sweepTime      = 0;
+  vm.lazyCompiles   = 0;
+  vm.lazyTime       = 0;
   vm.grayCapacity   = 0;
   vm.grayCount      = 0;
   vm.grayStack      = NULL;
 
   initHashTable(&vm.globals);
+  initHashTable(&vm.constGlobals);
   initHashTable(&vm.strings);
+  initStringCache();
   defineNativeFuncs();
 }
 
 void freeVM() {
+  flushOutput();
+  freeCompiler();
+
   freeHashTable(&vm.strings);
   freeHashTable(&vm.globals);
+  freeHashTable(&vm.constGlobals);
   freeObjs();
+
+  vm.emptyString = NULL;
+  memset(vm.byteStrings, 0, sizeof(vm.byteStrings));
+  memset(vm.smallIntStrings, 0, sizeof(vm.smallIntStrings));
+  memset(vm.natives, 0, sizeof(vm.natives));
 }
 
 // Heartbeat of the VM
@@ -212,7 +459,7 @@ static InterpretResult run() {
 #define READ_SHORT() (frame->ip += 2, ((frame->ip[-2] << 8) | frame->ip[-1]))
 
 #define READ_CONSTANT() \
-  (frame->closure->func->chunk.constants.values[READ_BYTE()])
+  (CLOSURE_FUNC(frame->closure)->chunk.constants.values[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
@@ -312,17 +559,41 @@ static InterpretResult run() {
         ObjString *name = READ_STRING();
         Value value;
         if (!hashTableGet(&vm.globals, name, &value)) {
-          runtimeError("undefined variable '%s'", name->chars);
+          runtimeError("undefined variable '%.*s'", name->len, name->chars);
           return INTERPRET_RUNTIME_ERR;
         }
         push(value);
         continue;
       }
+      case OP_GET_HOISTED: {
+        // A hidden local caching a global a loop reads, named in the one below
+        Value *cached = &frame->slots[READ_BYTE()];
+        if (IS_NIL(*cached) &&
+            !hashTableGet(&vm.globals, AS_STRING(cached[-1]), cached)) {
+          ObjString *name = AS_STRING(cached[-1]);
+          runtimeError("undefined variable '%.*s'", name->len, name->chars);
+          return INTERPRET_RUNTIME_ERR;
+        }
+        push(*cached);
+        continue;
+      }
+      case OP_DEF_CONST: {
+        ObjString *name = READ_STRING();
+        hashTableSet(&vm.globals, name, peek(0));
+        hashTableSet(&vm.constGlobals, name, BOOL_VAL(true));
+        pop();
+        continue;
+      }
       case OP_SET_GLOBAL: {
         ObjString *name = READ_STRING();
+        if (isConstGlobal(name)) {
+          runtimeError("can't assign to a constant '%.*s'", name->len,
+                       name->chars);
+          return INTERPRET_RUNTIME_ERR;
+        }
         if (hashTableSet(&vm.globals, name, peek(0))) {
           hashTableRemove(&vm.globals, name);
-          runtimeError("undefined variable '%s'", name->chars);
+          runtimeError("undefined variable '%.*s'", name->len, name->chars);
           return INTERPRET_RUNTIME_ERR;
         }
         continue;
@@ -342,12 +613,18 @@ static InterpretResult run() {
       }
       case OP_GET_UPVALUE: {
         uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
+        push(*AS_UPVALUE(frame->closure->upvalues[slot])->location);
         continue;
       }
       case OP_SET_UPVALUE: {
-        uint8_t slot                              = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
+        uint8_t slot = READ_BYTE();
+        *AS_UPVALUE(frame->closure->upvalues[slot])->location = peek(0);
+        continue;
+      }
+      case OP_GET_CAPTURED: {
+        // Captured by value, the closure holds the value itself
+        uint8_t slot = READ_BYTE();
+        push(frame->closure->upvalues[slot]);
         continue;
       }
       case OP_CLOSE_UPVALUE: {
@@ -370,6 +647,25 @@ static InterpretResult run() {
         frame = TOP_CALLFRAME(vm);
         continue;
       }
+      case OP_CALL_NATIVE: {
+        uint8_t index = READ_BYTE();
+        int argCount  = nativeDefs[index].arity;
+        Value *callee = vm.stackTop - argCount - 1;
+
+        // The global the callee was read from may no longer hold the native
+        if (!IS_OBJ(*callee) || AS_OBJ(*callee) != (Obj *)vm.natives[index]) {
+          if (!callValue(*callee, argCount))
+            return INTERPRET_RUNTIME_ERR;
+
+          frame = TOP_CALLFRAME(vm);
+          continue;
+        }
+
+        // The result replaces the callee, which keeps the native rooted
+        *callee     = nativeDefs[index].func(argCount, callee + 1);
+        vm.stackTop = callee + 1;
+        continue;
+      }
       case OP_CLOSURE: {
         ObjFunc *func       = AS_FUNC(READ_CONSTANT());
         ObjClosure *closure = newClosure(func);
@@ -377,10 +673,10 @@ static InterpretResult run() {
 
         // Iterate over the pair of operands for each upvalue and capture it
         // from the enclosing function or a higher surrounding function
-        // depending on the isLocal operand byte of the upvalue.
+        // depending on the kind operand byte of the upvalue.
         for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index   = READ_BYTE();
+          uint8_t kind  = READ_BYTE();
+          uint8_t index = READ_BYTE();
 
           // Capturing upvalues from the enclosing function (isLocal = false):
           // An OP_CLOSURE is emitted at the end of a function declaration, so
@@ -388,15 +684,55 @@ static InterpretResult run() {
           // is the enclosing one - which is stored in the call frame at the
           // top of the callstack. So, to grab an upvalue from the enclosing
           // function we can directly read it from the the `frame` variable.
-          closure->upvalues[i] = isLocal ? captureUpvalue(frame->slots + index)
-                                         : frame->closure->upvalues[index];
+          closure->upvalues[i] = captureVar(kind, frame->slots, frame->closure,
+                                            index);
         }
 
         continue;
       }
+      case OP_LOCAL_CLOSURE: {
+        ObjFunc *func = AS_FUNC(READ_CONSTANT());
+        push(OBJ_VAL(localClosure(func)));
+        frame->ip += 2 * func->upvalueCount; // Its captures go unused
+        continue;
+      }
+      case OP_GET_PARENT: {
+        // The caller is always the frame that created the closure
+        uint8_t slot = READ_BYTE();
+        push(frame[-1].slots[slot]);
+        continue;
+      }
+      case OP_SET_PARENT: {
+        uint8_t slot          = READ_BYTE();
+        frame[-1].slots[slot] = peek(0);
+        continue;
+      }
       case OP_PRINT: {
         printValue(pop());
-        printf("\n");
+        endOutputLine();
+        continue;
+      }
+      case OP_SLIDE: {
+        uint8_t count = READ_BYTE();
+
+        // The top value replaces the lowest of the values it slides over
+        vm.stackTop[-count - 1] = peek(0);
+        vm.stackTop -= count;
+        continue;
+      }
+      case OP_IS_FUNC: {
+        // The callee is below the function's arguments
+        Value func   = READ_CONSTANT();
+        bool isFunc  = isClosureOf(peek(AS_FUNC(func)->arity), func);
+        push(BOOL_VAL(isFunc));
+
+        // The jump to the inlined body follows, so it can be taken right away
+        if (isFunc && *frame->ip == OP_JUMP_IF_TRUE) {
+          frame->ip++;
+          uint16_t toJump = READ_SHORT();
+          frame->ip += toJump;
+        }
+
         continue;
       }
       case OP_RETURN: {
@@ -434,12 +770,328 @@ static InterpretResult run() {
 #undef READ_BYTE
 }
 
+/*
+ * Calls the value in the register at base with the arguments in the registers
+ * above it. A closure's registers start at base, so its result ends up there
+ * without any copying, like a native's. Registers past the arguments may still
+ * hold values from finished calls which are cleared, as everything up to the
+ * stack top is seen by the collector.
+ */
+static bool callRegisters(Value *base, int argCount) {
+  Value callee = *base;
+
+  if (IS_NATIVE(callee)) {
+    ObjNative *native = AS_NATIVE(callee);
+
+    if (argCount != native->arity) {
+      runtimeError("expected %d arguments, but got %d", native->arity,
+                   argCount);
+      return false;
+    }
+
+    *base = native->func(argCount, base + 1);
+    return true;
+  }
+
+  if (!IS_CLOSURE(callee)) {
+    runtimeError("can only call functions");
+    return false;
+  }
+
+  ObjClosure *closure = AS_CLOSURE(callee);
+  ObjFunc *func       = CLOSURE_FUNC(closure);
+
+  if (argCount != func->arity) {
+    runtimeError("expected %d arguments, but got %d", func->arity, argCount);
+    return false;
+  }
+
+  if (vm.frameCount == FRAMES_MAX) {
+    runtimeError("stack overflow");
+    return false;
+  }
+
+  if (func->lazyStart.start != NULL && !compileBody(func))
+    return false;
+
+  if (func->regCode.code == NULL &&
+      !translateChunk(&func->chunk, func->arity, &func->regCode)) {
+    runtimeError("function is too large for the register backend");
+    return false;
+  }
+
+  Value *frameEnd = base + func->regCode.frameSize;
+  for (Value *slot = base + argCount + 1; slot < frameEnd; slot++) {
+    *slot = NIL_VAL;
+  }
+
+  CallFrame *frame = &vm.frames[vm.frameCount++];
+  frame->closure   = closure;
+  frame->pc        = func->regCode.code;
+  frame->slots     = base;
+  vm.stackTop      = frameEnd;
+
+  return true;
+}
+
+// The register backend's run loop. The current frame's pc, registers and
+// constants are kept in locals, the pc being written back to the frame before
+// anything that may call or report an error.
+static InterpretResult runRegisters() {
+  CallFrame *frame;
+  const RegInstr *pc;
+  Value *regs;
+  Value *constants;
+
+#define LOAD_FRAME()                                           \
+  do {                                                         \
+    frame     = TOP_CALLFRAME(vm);                             \
+    pc        = frame->pc;                                     \
+    regs      = frame->slots;                                  \
+    constants = CLOSURE_FUNC(frame->closure)->chunk.constants.values; \
+  } while (false)
+
+#define RK(operand) \
+  ((operand) & REG_CONST ? constants[(operand) & ~REG_CONST] : regs[operand])
+
+#define REG_ERROR(...)            \
+  do {                            \
+    frame->pc = pc;               \
+    runtimeError(__VA_ARGS__);    \
+    return INTERPRET_RUNTIME_ERR; \
+  } while (false)
+
+#define REG_BINARY_OP(valueType, op)                                     \
+  do {                                                                   \
+    Value b = RK(REG_B(instr)), c = RK(REG_C(instr));                    \
+    if (!IS_NUM(b) || !IS_NUM(c))                                        \
+      REG_ERROR("operands must be numbers");                             \
+    regs[REG_A(instr)] = valueType(AS_NUM(b) op AS_NUM(c));              \
+  } while (false)
+
+  LOAD_FRAME();
+
+  while (true) {
+    RegInstr instr = *pc++;
+
+    switch (REG_OP(instr)) {
+      case ROP_MOVE:  regs[REG_A(instr)] = RK(REG_B(instr)); continue;
+      case ROP_NIL:   regs[REG_A(instr)] = NIL_VAL; continue;
+      case ROP_TRUE:  regs[REG_A(instr)] = BOOL_VAL(true); continue;
+      case ROP_FALSE: regs[REG_A(instr)] = BOOL_VAL(false); continue;
+      case ROP_ADD:   {
+        Value b = RK(REG_B(instr)), c = RK(REG_C(instr));
+
+        if (IS_NUM(b) && IS_NUM(c)) {
+          regs[REG_A(instr)] = NUM_VAL(AS_NUM(b) + AS_NUM(c));
+        } else if (IS_STRING(b) && IS_STRING(c)) {
+          regs[REG_A(instr)] = OBJ_VAL(concatenate(AS_STRING(b), AS_STRING(c)));
+        } else {
+          REG_ERROR("operands must both be strings or both be numbers");
+        }
+
+        continue;
+      }
+      case ROP_SUBTRACT:   REG_BINARY_OP(NUM_VAL, -); continue;
+      case ROP_MULTIPLY:   REG_BINARY_OP(NUM_VAL, *); continue;
+      case ROP_DIVIDE:     REG_BINARY_OP(NUM_VAL, /); continue;
+      case ROP_LESS:       REG_BINARY_OP(BOOL_VAL, <); continue;
+      case ROP_LESS_EQ:    REG_BINARY_OP(BOOL_VAL, <=); continue;
+      case ROP_GREATER:    REG_BINARY_OP(BOOL_VAL, >); continue;
+      case ROP_GREATER_EQ: REG_BINARY_OP(BOOL_VAL, >=); continue;
+      case ROP_EQ:         {
+        bool isEqual       = valuesEq(RK(REG_B(instr)), RK(REG_C(instr)));
+        regs[REG_A(instr)] = BOOL_VAL(isEqual);
+        continue;
+      }
+      case ROP_NOT_EQ: {
+        bool isEqual       = valuesEq(RK(REG_B(instr)), RK(REG_C(instr)));
+        regs[REG_A(instr)] = BOOL_VAL(!isEqual);
+        continue;
+      }
+      case ROP_NOT: {
+        regs[REG_A(instr)] = BOOL_VAL(isFalsy(RK(REG_B(instr))));
+        continue;
+      }
+      case ROP_NEGATE: {
+        Value value = RK(REG_B(instr));
+        if (!IS_NUM(value))
+          REG_ERROR("negation operand must be a number");
+        regs[REG_A(instr)] = NUM_VAL(-AS_NUM(value));
+        continue;
+      }
+      case ROP_DEF_GLOBAL: {
+        ObjString *name = AS_STRING(constants[REG_A(instr)]);
+        hashTableSet(&vm.globals, name, RK(REG_B(instr)));
+        continue;
+      }
+      case ROP_GET_GLOBAL: {
+        ObjString *name = AS_STRING(constants[REG_BX(instr)]);
+        if (!hashTableGet(&vm.globals, name, &regs[REG_A(instr)]))
+          REG_ERROR("undefined variable '%.*s'", name->len, name->chars);
+        continue;
+      }
+      case ROP_GET_HOISTED: {
+        Value *cached = &regs[REG_B(instr)];
+        if (IS_NIL(*cached) &&
+            !hashTableGet(&vm.globals, AS_STRING(cached[-1]), cached)) {
+          ObjString *name = AS_STRING(cached[-1]);
+          REG_ERROR("undefined variable '%.*s'", name->len, name->chars);
+        }
+        regs[REG_A(instr)] = *cached;
+        continue;
+      }
+      case ROP_DEF_CONST: {
+        ObjString *name = AS_STRING(constants[REG_A(instr)]);
+        hashTableSet(&vm.globals, name, RK(REG_B(instr)));
+        hashTableSet(&vm.constGlobals, name, BOOL_VAL(true));
+        continue;
+      }
+      case ROP_SET_GLOBAL: {
+        ObjString *name = AS_STRING(constants[REG_A(instr)]);
+        if (isConstGlobal(name))
+          REG_ERROR("can't assign to a constant '%.*s'", name->len,
+                    name->chars);
+        if (hashTableSet(&vm.globals, name, RK(REG_B(instr)))) {
+          hashTableRemove(&vm.globals, name);
+          REG_ERROR("undefined variable '%.*s'", name->len, name->chars);
+        }
+        continue;
+      }
+      case ROP_GET_UPVALUE: {
+        Value upvalue      = frame->closure->upvalues[REG_B(instr)];
+        regs[REG_A(instr)] = *AS_UPVALUE(upvalue)->location;
+        continue;
+      }
+      case ROP_SET_UPVALUE: {
+        Value upvalue                  = frame->closure->upvalues[REG_A(instr)];
+        *AS_UPVALUE(upvalue)->location = RK(REG_B(instr));
+        continue;
+      }
+      case ROP_GET_CAPTURED: {
+        regs[REG_A(instr)] = frame->closure->upvalues[REG_B(instr)];
+        continue;
+      }
+      case ROP_GET_PARENT: {
+        regs[REG_A(instr)] = frame[-1].slots[REG_B(instr)];
+        continue;
+      }
+      case ROP_SET_PARENT: {
+        frame[-1].slots[REG_A(instr)] = RK(REG_B(instr));
+        continue;
+      }
+      case ROP_CLOSE:         closeUpvalues(&regs[REG_A(instr)]); continue;
+      case ROP_JUMP:          pc += REG_SBX(instr); continue;
+      case ROP_JUMP_IF_FALSE: {
+        if (isFalsy(regs[REG_A(instr)]))
+          pc += REG_SBX(instr);
+        continue;
+      }
+      case ROP_JUMP_IF_TRUE: {
+        if (!isFalsy(regs[REG_A(instr)]))
+          pc += REG_SBX(instr);
+        continue;
+      }
+      case ROP_CALL: {
+        frame->pc = pc;
+        if (!callRegisters(&regs[REG_A(instr)], REG_B(instr)))
+          return INTERPRET_RUNTIME_ERR;
+
+        LOAD_FRAME();
+        continue;
+      }
+      case ROP_CALL_NATIVE: {
+        Value *callee = &regs[REG_A(instr)];
+        int index     = REG_C(instr);
+
+        if (IS_OBJ(*callee) && AS_OBJ(*callee) == (Obj *)vm.natives[index]) {
+          *callee = nativeDefs[index].func(REG_B(instr), callee + 1);
+          continue;
+        }
+
+        frame->pc = pc;
+        if (!callRegisters(callee, REG_B(instr)))
+          return INTERPRET_RUNTIME_ERR;
+
+        LOAD_FRAME();
+        continue;
+      }
+      case ROP_CLOSURE: {
+        ObjFunc *func       = AS_FUNC(constants[REG_BX(instr)]);
+        ObjClosure *closure = newClosure(func);
+        regs[REG_A(instr)]  = OBJ_VAL(closure);
+
+        // Each captured upvalue follows as a word of its own
+        for (int i = 0; i < closure->upvalueCount; i++) {
+          RegInstr capture = *pc++;
+          uint8_t index    = REG_B(capture);
+
+          closure->upvalues[i] = captureVar(REG_A(capture), regs,
+                                            frame->closure, index);
+        }
+
+        continue;
+      }
+      case ROP_LOCAL_CLOSURE: {
+        ObjFunc *func      = AS_FUNC(constants[REG_BX(instr)]);
+        regs[REG_A(instr)] = OBJ_VAL(localClosure(func));
+        continue;
+      }
+      case ROP_PRINT: {
+        printValue(RK(REG_B(instr)));
+        endOutputLine();
+        continue;
+      }
+      case ROP_RETURN: {
+        Value result = RK(REG_B(instr));
+
+        closeUpvalues(regs);
+        vm.frameCount--;
+
+        if (vm.frameCount == 0) {
+          vm.stackTop = vm.stack;
+          return INTERPRET_OK;
+        }
+
+        // The callee's first register is the one the caller called it from
+        regs[0] = result;
+        LOAD_FRAME();
+        vm.stackTop = regs + CLOSURE_FUNC(frame->closure)->regCode.frameSize;
+        continue;
+      }
+      case ROP_IS_FUNC: {
+        Value func         = RK(REG_C(instr));
+        bool isFunc        = isClosureOf(RK(REG_B(instr)), func);
+        regs[REG_A(instr)] = BOOL_VAL(isFunc);
+
+        // As with the stack instructions, take the jump to the body right away
+        if (isFunc && REG_OP(*pc) == ROP_JUMP_IF_TRUE &&
+            REG_A(*pc) == REG_A(instr))
+          pc += 1 + REG_SBX(*pc);
+
+        continue;
+      }
+    }
+
+    REG_ERROR("unknown instruction");
+  }
+
+#undef REG_BINARY_OP
+#undef REG_ERROR
+#undef RK
+#undef LOAD_FRAME
+}
+
 InterpretResult interpret(const char *source) {
   // Compile and get the top level code - like a "main" function.
   ObjFunc *func = compile(source);
   if (func == NULL)
     return INTERPRET_COMPILER_ERR;
 
+  return interpretFunc(func);
+}
+
+InterpretResult interpretFunc(ObjFunc *func) {
   // Store main function closure on stack, it's stack window starts at the
   // bottom of the VM's stack. We push/pop the func before/after the closure
   // creation for the GC to be aware of the heap-allocated object ObjFunc.
@@ -447,6 +1099,14 @@ InterpretResult interpret(const char *source) {
   ObjClosure *closure = newClosure(func);
   pop();
   push(OBJ_VAL(closure));
+
+  if (vm.backend == BACKEND_REGISTER) {
+    if (!callRegisters(vm.stackTop - 1, 0))
+      return INTERPRET_RUNTIME_ERR;
+
+    return runRegisters();
+  }
+
   call(closure, 0);
 
   return run();
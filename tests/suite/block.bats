@@ -23,3 +23,9 @@ teardown() {
   assert_success
   assert_output "true"
 }
+
+@test "unmatched closing brace gives one error" {
+  _run_asbtl "print 1; } print 2;"
+  assert_failure
+  assert_output "[line 1, col 11] error at '}': expect expression"
+}
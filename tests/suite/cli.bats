@@ -0,0 +1,294 @@
+setup() {
+  load '../test-helpers/common'
+  _common_setup
+}
+
+teardown() {
+  _common_teardown
+}
+
+@test "unbuffered output mode" {
+  echo 'print 1; print "two";' >"$TMP_SOURCE_FILE"
+  run asbtl --buffer=none "$TMP_SOURCE_FILE"
+  assert_success
+  assert_line -n 0 '1'
+  assert_line -n 1 'two'
+}
+
+@test "line buffered output mode" {
+  echo 'print 1; print "two";' >"$TMP_SOURCE_FILE"
+  run asbtl --buffer=line "$TMP_SOURCE_FILE"
+  assert_success
+  assert_line -n 0 '1'
+  assert_line -n 1 'two'
+}
+
+@test "invalid output mode gives usage error" {
+  run asbtl --buffer=sometimes "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_output -p "usage:"
+}
+
+@test "buffered output is written before runtime error" {
+  _run_asbtl 'print "before"; print undefined;'
+  assert_failure
+  assert_line -n 0 'before'
+  assert_line -n 1 "undefined variable 'undefined'"
+}
+
+@test "script read from a pipe" {
+  run bash -c "echo 'print \"piped\";' | asbtl /dev/stdin"
+  assert_success
+  assert_output "piped"
+}
+
+@test "missing script gives io error" {
+  run asbtl "$TMP_SOURCE_FILE.missing"
+  assert_failure
+  assert_output -p "could not open file"
+}
+
+@test "compile to image then run image" {
+  echo 'func f(x) { return x * 2; } print f(21);' >"$TMP_SOURCE_FILE"
+  run asbtl --compile="$TMP_SOURCE_FILE.asbc" "$TMP_SOURCE_FILE"
+  assert_success
+  refute_output
+
+  run asbtl "$TMP_SOURCE_FILE.asbc"
+  rm -f "$TMP_SOURCE_FILE.asbc"
+  assert_success
+  assert_output "42"
+}
+
+@test "compile error writes no image" {
+  echo 'print ;' >"$TMP_SOURCE_FILE"
+  run asbtl --compile="$TMP_SOURCE_FILE.asbc" "$TMP_SOURCE_FILE"
+  assert_failure
+  assert [ ! -e "$TMP_SOURCE_FILE.asbc" ]
+}
+
+@test "error in uncalled function body is reported" {
+  _run_asbtl 'func f() { var x = ; } print 1;'
+  assert_failure
+  assert_output "[line 1, col 21] error at ';': expect expression"
+}
+
+@test "lazy error in function body is reported on its first call" {
+  echo 'func f() { print ; } print 1; f();' >"$TMP_SOURCE_FILE"
+  run asbtl --lazy "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_line -n 0 "1"
+  assert_line -n 1 "[line 1, col 19] error at ';': expect expression"
+  assert_line -n 2 "could not compile f()"
+}
+
+@test "compile to image reports errors in function bodies" {
+  echo 'func f() { print ; } print 1;' >"$TMP_SOURCE_FILE"
+  run asbtl --compile="$TMP_SOURCE_FILE.asbc" "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_output "[line 1, col 19] error at ';': expect expression"
+  assert [ ! -e "$TMP_SOURCE_FILE.asbc" ]
+}
+
+@test "cached image is reused" {
+  export ASBTL_CACHE_DIR="$(mktemp -d)"
+  echo 'var s = "cached"; print s;' >"$TMP_SOURCE_FILE"
+
+  run asbtl --cache "$TMP_SOURCE_FILE"
+  assert_success
+  assert_output "cached"
+
+  run asbtl --cache "$TMP_SOURCE_FILE"
+  local images=$(ls "$ASBTL_CACHE_DIR" | wc -l)
+  rm -rf "$ASBTL_CACHE_DIR"
+  assert_success
+  assert_output "cached"
+  assert [ "$images" -eq 1 ]
+}
+
+@test "optimization levels give the same output" {
+  echo 'var a = 2 * 3 + 1; if (a > 5) { print a; } else { print "no"; }' >"$TMP_SOURCE_FILE"
+
+  for level in -O0 -O1 -O2; do
+    run asbtl "$level" "$TMP_SOURCE_FILE"
+    assert_success
+    assert_output "7"
+  done
+}
+
+@test "invalid optimization level gives usage error" {
+  run asbtl -O3 "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_output -p "usage:"
+}
+
+@test "cached images are kept per optimization level" {
+  export ASBTL_CACHE_DIR="$(mktemp -d)"
+  echo 'print 1 + 2;' >"$TMP_SOURCE_FILE"
+
+  run asbtl --cache -O0 "$TMP_SOURCE_FILE"
+  assert_output "3"
+  run asbtl --cache -O2 "$TMP_SOURCE_FILE"
+  local images=$(ls "$ASBTL_CACHE_DIR" | wc -l)
+  rm -rf "$ASBTL_CACHE_DIR"
+  assert_success
+  assert_output "3"
+  assert [ "$images" -eq 2 ]
+}
+
+@test "inlined calls give the same output" {
+  echo 'func sq(x) { return x * x; } func add(a, b) { return a + b; } var t = 0; for (var i = 0; i < 4; i = i + 1) { t = add(t, sq(i)); } print t; sq = add; print sq(1, 2);' >"$TMP_SOURCE_FILE"
+
+  for flags in -O0 -O2 "-O2 --inline-limit=0" "-O2 --vm=register"; do
+    run asbtl $flags "$TMP_SOURCE_FILE"
+    assert_success
+    assert_line -n 0 "14"
+    assert_line -n 1 "3"
+  done
+}
+
+@test "hoisted loop globals give the same output" {
+  echo 'var n = 3; var step = 2; var none = nil; var t = 0; for (var i = 0; i < n; i = i + 1) { while (t < i * step) { t = t + step; } if (none == nil) print t; } var k = 0; while (k < 2) { if (k == 1) print missing; k = k + 1; }' >"$TMP_SOURCE_FILE"
+
+  for flags in -O0 -O2 "-O2 --vm=register"; do
+    run asbtl $flags "$TMP_SOURCE_FILE"
+    assert_failure
+    assert_line -n 0 "0"
+    assert_line -n 1 "2"
+    assert_line -n 2 "4"
+    assert_line -n 3 "undefined variable 'missing'"
+  done
+}
+
+@test "invalid inline limit gives usage error" {
+  run asbtl --inline-limit=256 "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_output -p "usage:"
+}
+
+@test "register backend gives the same output" {
+  echo 'func f(a, b) { a = a + b; return a; } var s = "x"; for (var i = 0; i < 3; i = i + 1) { s = s + str(f(i, 1)); } print s;' >"$TMP_SOURCE_FILE"
+
+  for backend in stack register; do
+    run asbtl --vm="$backend" "$TMP_SOURCE_FILE"
+    assert_success
+    assert_output "x123"
+  done
+}
+
+@test "register backend reports runtime error lines" {
+  printf 'func f(x) {\n  return -x;\n}\nprint f("a");\n' >"$TMP_SOURCE_FILE"
+  run asbtl --vm=register "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_line -n 0 "negation operand must be a number"
+  assert_line -n 1 "[line 2] in f()"
+  assert_line -n 2 "[line 4] in script"
+}
+
+@test "invalid backend gives usage error" {
+  run asbtl --vm=tree "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_output -p "usage:"
+}
+
+@test "several scripts run one after another" {
+  local dir="$(mktemp -d)"
+  echo 'print "one";' >"$dir/one.lox"
+  echo 'func f(n) { return n * 2; } print f(1);' >"$dir/two.lox"
+  echo 'print "three";' >"$dir/three.lox"
+
+  run asbtl --jobs=2 "$dir/one.lox" "$dir/two.lox" "$dir/three.lox"
+  rm -rf "$dir"
+  assert_success
+  assert_line -n 0 "one"
+  assert_line -n 1 "2"
+  assert_line -n 2 "three"
+}
+
+@test "error in one of several scripts still runs the others" {
+  local dir="$(mktemp -d)"
+  echo 'print ;' >"$dir/bad.lox"
+  echo 'print "good";' >"$dir/good.lox"
+
+  run asbtl "$dir/bad.lox" "$dir/good.lox"
+  rm -rf "$dir"
+  assert_failure
+  assert_line -n 0 "[line 1, col 8] error at ';': expect expression"
+  assert_line -n 1 "good"
+}
+
+@test "several scripts compile into a directory of images" {
+  local dir="$(mktemp -d)"
+  echo 'print "one";' >"$dir/one.lox"
+  echo 'print "two";' >"$dir/two.lox"
+
+  run asbtl --compile="$dir" "$dir/one.lox" "$dir/two.lox"
+  assert_success
+  refute_output
+
+  run asbtl "$dir/two.asbc"
+  rm -rf "$dir"
+  assert_success
+  assert_output "two"
+}
+
+@test "compile scripts with the same name into one directory fails" {
+  local dir="$(mktemp -d)"
+  mkdir "$dir/d1" "$dir/d2"
+  echo 'print "one";' >"$dir/d1/x.lox"
+  echo 'print "two";' >"$dir/d2/x.lox"
+
+  run asbtl --compile="$dir" "$dir/d1/x.lox" "$dir/d2/x.lox"
+  local images=$(ls "$dir"/*.asbc 2>/dev/null | wc -l)
+  rm -rf "$dir"
+  assert_failure
+  assert_output -p "would both compile to"
+  assert [ "$images" -eq 0 ]
+}
+
+@test "invalid job count gives usage error" {
+  run asbtl --jobs=0 "$TMP_SOURCE_FILE" "$TMP_SOURCE_FILE"
+  assert_failure
+  assert_output -p "usage:"
+}
+
+@test "stats report each phase and function after the output" {
+  echo 'func f(a) { return a + 1; } print f(2);' >"$TMP_SOURCE_FILE"
+  run asbtl --stats "$TMP_SOURCE_FILE"
+  assert_success
+  assert_line -n 0 "3"
+  assert_line -n 1 "stats for $TMP_SOURCE_FILE"
+  assert_line --regexp '^compile +[0-9]+\.[0-9]{6} +[0-9]+\.[0-9]{6}$'
+  assert_line "tokens: 18"
+  assert_line --regexp '^collections: [0-9]+, tracing [0-9.]+s, sweeping [0-9.]+s$'
+  assert_line --regexp '^compiled on first call: 0, taking [0-9.]+s$'
+  assert_line --regexp '^heap: [0-9]+ objects in [0-9]+ bytes, [0-9.]+ bytes each$'
+  assert_line --regexp '^<script> +[0-9]+ +4 +0$'
+  assert_line --regexp '^f +[0-9]+ +1 +0$'
+}
+
+@test "stats keep lazy compilation and time it" {
+  echo 'func f(a) { return a + 1; } func g() { print ; } print f(2);' >"$TMP_SOURCE_FILE"
+  run asbtl --lazy --stats "$TMP_SOURCE_FILE"
+  assert_success
+  assert_line -n 0 "3"
+  assert_line --regexp '^compiled on first call: 1, taking [0-9.]+s$'
+  assert_line --regexp '^f +[0-9]+ +1 +0$'
+  assert_line --regexp '^g +0 +0 +0$'
+}
+
+@test "stats as json are a line per script" {
+  echo 'print "one";' >"$TMP_SOURCE_FILE"
+  run asbtl --stats=json "$TMP_SOURCE_FILE" "$TMP_SOURCE_FILE"
+  assert_success
+  assert_line -n 0 "one"
+  assert_line -n 1 --regexp '^\{"path":".*","phases":\{"read":\{"wall":'
+  assert_line -n 1 --partial '"functions":[{"name":null,"bytes":'
+  assert_line -n 2 "one"
+}
+
+@test "stats without a script gives usage error" {
+  run asbtl --stats=json
+  assert_failure
+  assert_output -p "usage:"
+}
@@ -131,3 +131,108 @@ teardown() {
   assert_success
   assert_output "a"
 }
+
+@test "capture through two enclosing functions" {
+  _run_asbtl '
+  func outer() {
+    var x = "x";
+    var y = "y";
+
+    func middle() {
+      func inner() {
+        print x + y;
+      }
+
+      return inner;
+    }
+
+    return middle;
+  }
+
+  var middle = outer();
+  var inner = middle();
+  inner(); // expect "xy"'
+
+  assert_success
+  assert_output "xy"
+}
+
+@test "recursive local function" {
+  _run_asbtl '
+  {
+    func fact(n) {
+      if (n < 2) return 1;
+      return n * fact(n - 1);
+    }
+
+    print fact(5);
+  }'
+
+  assert_success
+  assert_output "120"
+}
+
+@test "assignment after capture is seen by the closure" {
+  _run_asbtl '
+  func make() {
+    var value = "before";
+
+    func get() {
+      return value;
+    }
+
+    func set() {
+      value = "after";
+    }
+
+    set();
+    return get;
+  }
+
+  var get = make();
+  print get(); // expect "after"'
+
+  assert_success
+  assert_output "after"
+}
+
+@test "local function assigns the enclosing function's variable" {
+  _run_asbtl '
+  func sum(n) {
+    var total = 0;
+
+    func add(x) {
+      total = total + x;
+    }
+
+    for (var i = 1; i <= n; i = i + 1) {
+      add(i);
+    }
+
+    return total;
+  }
+
+  print sum(10); // expect 55'
+
+  assert_success
+  assert_output "55"
+}
+
+@test "local function of a recursive function" {
+  _run_asbtl '
+  func depth(n) {
+    var label = "depth " + str(n);
+
+    func describe() {
+      if (n == 0) return label;
+      return depth(n - 1) + ", " + label;
+    }
+
+    return describe();
+  }
+
+  print depth(2);'
+
+  assert_success
+  assert_output "depth 0, depth 1, depth 2"
+}
@@ -166,3 +166,55 @@ teardown() {
   assert_failure
   assert_output -p "expect expression"
 }
+
+@test "if constant condition only runs taken branch" {
+  _run_asbtl "if (nil) print 1; else print 2; if (0) print 3; if (\"\") { var a = 4; print a; }"
+  assert_success
+  assert_line -n 0 '2'
+  assert_line -n 1 '3'
+  assert_line -n 2 '4'
+}
+
+@test "if constant condition still reports errors in dead branch" {
+  _run_asbtl "if (false) { print ; }"
+  assert_failure
+  assert_output -p "expect expression"
+}
+
+@test "while false loop never runs body" {
+  _run_asbtl "while (false) print 1; print 2;"
+  assert_success
+  assert_output "2"
+}
+
+@test "for loop false condition runs only initializer" {
+  _run_asbtl "var i = 0; for (i = 5; false; i = i + 1) print i; print i;"
+  assert_success
+  assert_output "5"
+}
+
+@test "code after return is not run" {
+  _run_asbtl "func f() { var a = 1; return a; print 2; } print f();"
+  assert_success
+  assert_output "1"
+}
+
+@test "if both branches return inside loop" {
+  _run_asbtl "func f(n) { while (true) { if (n > 2) return n; else { n = n + 1; } } } print f(0);"
+  assert_success
+  assert_output "3"
+}
+
+@test "dead closure does not affect live locals" {
+  _run_asbtl "func f() { var a = 1; if (false) { func g() { return a; } } a = a + 1; return a; } print f();"
+  assert_success
+  assert_output "2"
+}
+
+@test "nested if without else" {
+  _run_asbtl "for (var i = 0; i < 4; i = i + 1) { if (i > 0) { if (i < 3) print i; } } print 9;"
+  assert_success
+  assert_line -n 0 '1'
+  assert_line -n 1 '2'
+  assert_line -n 2 '9'
+}
@@ -142,3 +142,9 @@ teardown() {
   assert_failure
   assert_output -p "can only call functions"
 }
+
+@test "unterminated function body gives error" {
+  _run_asbtl "func f() { if (true) { print 1; }"
+  assert_failure
+  assert_output -p "expect '}' at end of block"
+}
@@ -0,0 +1,98 @@
+setup() {
+  load '../test-helpers/common'
+  _common_setup
+}
+
+teardown() {
+  _common_teardown
+}
+
+@test "str converts integer" {
+  _run_asbtl 'print str(42) + "!";'
+  assert_success
+  assert_output "42!"
+}
+
+@test "str converts fraction" {
+  _run_asbtl 'print str(0.1 + 0.2);'
+  assert_success
+  assert_output "0.30000000000000004"
+}
+
+@test "str converts negative number" {
+  _run_asbtl 'print str(-2.5) + "";'
+  assert_success
+  assert_output "-2.5"
+}
+
+@test "str passes through strings" {
+  _run_asbtl 'print str("foo");'
+  assert_success
+  assert_output "foo"
+}
+
+@test "str of non-number returns nil" {
+  _run_asbtl 'print str(true);'
+  assert_success
+  assert_output "nil"
+}
+
+@test "flush returns nil and keeps output order" {
+  _run_asbtl 'print "a"; print flush(); print "b";'
+  assert_success
+  assert_line -n 0 'a'
+  assert_line -n 1 'nil'
+  assert_line -n 2 'b'
+}
+
+@test "readLine iterates lines of a file" {
+  local input="$(mktemp)"
+  printf 'first\r\nsecond\n\nlast' >"$input"
+
+  _run_asbtl "
+  var file = open(\"$input\");
+  var line = readLine(file);
+  while (line != nil) {
+    print \"[\" + line + \"]\";
+    line = readLine(file);
+  }
+  close(file);"
+
+  rm -f "$input"
+  assert_success
+  assert_line -n 0 '[first]'
+  assert_line -n 1 '[second]'
+  assert_line -n 2 '[]'
+  assert_line -n 3 '[last]'
+}
+
+@test "readLine after close returns nil" {
+  _run_asbtl "var file = open(\"$TMP_SOURCE_FILE\"); close(file); print readLine(file);"
+  assert_success
+  assert_output "nil"
+}
+
+@test "open missing file returns nil" {
+  _run_asbtl 'print open("/nonexistent/asbtl/file");'
+  assert_success
+  assert_output "nil"
+}
+
+@test "native called with wrong argument count gives runtime error" {
+  _run_asbtl 'print str(1, 2);'
+  assert_failure
+  assert_output -p "expected 1 arguments, but got 2"
+}
+
+@test "native called through another variable" {
+  _run_asbtl 'var toString = str; print toString(7) + "!";'
+  assert_success
+  assert_output "7!"
+}
+
+@test "reassigned native global calls the new value" {
+  _run_asbtl 'func f(x) { return str(x); } print f(1); func mine(x) { return "mine"; } str = mine; print f(2);'
+  assert_success
+  assert_line -n 0 "1"
+  assert_line -n 1 "mine"
+}
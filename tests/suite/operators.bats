@@ -37,6 +37,24 @@ teardown() {
   assert_output "2"
 }
 
+@test "division prints shortest round-trip fraction" {
+  _run_asbtl "print 1 / 3;"
+  assert_success
+  assert_output "0.3333333333333333"
+}
+
+@test "large integer prints every digit" {
+  _run_asbtl "print 1234567890123;"
+  assert_success
+  assert_output "1234567890123"
+}
+
+@test "very large number prints with exponent" {
+  _run_asbtl "print 1000000 * 1000000 * 1000000 * 1000;"
+  assert_success
+  assert_output "1e+21"
+}
+
 @test "multiple operators follows precedence" {
   _run_asbtl "print 5 + 5 * 10;"
   assert_success
@@ -169,6 +187,12 @@ teardown() {
   assert_output "false"
 }
 
+@test "equal nil == nil returns true" {
+  _run_asbtl "print nil == nil;"
+  assert_success
+  assert_output "true"
+}
+
 @test "not equal a == b returns false" {
   _run_asbtl "print 2 != 2;"
   assert_success
@@ -126,3 +126,56 @@ teardown() {
   assert_line -n 1 "a b"
   assert_line -n 2 "a b c"
 }
+
+@test "shadowed local is visible again after the block" {
+  _run_asbtl '{ var a = "outer"; { var a = "inner"; var b = a; print b; } var b = a; print b; }'
+  assert_success
+  assert_line -n 0 "inner"
+  assert_line -n 1 "outer"
+}
+
+@test "constants fold their initializers" {
+  _run_asbtl 'const size = 4; const area = size * size; const big = area > 10 ? "big" : "small"; print area; print big;'
+  assert_success
+  assert_line -n 0 "16"
+  assert_line -n 1 "big"
+}
+
+@test "constant is visible in functions and shadowed by locals" {
+  _run_asbtl 'const n = 1; func f() { return n; } func g(n) { return n; } { const n = 2; print n; } print f(); print g(3);'
+  assert_success
+  assert_line -n 0 "2"
+  assert_line -n 1 "1"
+  assert_line -n 2 "3"
+}
+
+@test "top level constant is read by functions declared before it" {
+  _run_asbtl 'func f() { return LIMIT; } const LIMIT = 5; print f();'
+  assert_success
+  assert_output "5"
+}
+
+@test "assign to constant gives error" {
+  _run_asbtl "const a = 1; a = 2;"
+  assert_failure
+  assert_output -p "can't assign to a constant"
+}
+
+@test "assign to constant from function declared before it gives error" {
+  _run_asbtl 'func f() { X = 5; } func r() { return X; } const X = 1; f(); print X; print r();'
+  assert_failure
+  assert_line -n 0 "can't assign to a constant 'X'"
+  refute_output -p "5"
+}
+
+@test "redeclare constant as variable gives error" {
+  _run_asbtl "const a = 1; var a = 2;"
+  assert_failure
+  assert_output -p "constant with this name already declared in this scope"
+}
+
+@test "constant initialized from variable gives error" {
+  _run_asbtl "var a = 1; const b = a;"
+  assert_failure
+  assert_output -p "constant initializer must be known at compile time"
+}
@@ -13,8 +13,10 @@ _common_teardown() {
   rm -f "$TMP_SOURCE_FILE"
 }
 
+# Extra options for every run, e.g. ASBTL_FLAGS=-O2 runs the suites optimized.
 _run_asbtl() {
   local source="$1"
   echo "$source" >"$TMP_SOURCE_FILE"
-  run asbtl "$TMP_SOURCE_FILE"
+  # shellcheck disable=SC2086
+  run asbtl $ASBTL_FLAGS "$TMP_SOURCE_FILE"
 }
@@ -10,6 +10,8 @@
     ASSERT_EQ_INT(0, chunk.count);                       \
     ASSERT_EQ_INT(true, chunk.code == NULL);             \
     ASSERT_EQ_INT(true, chunk.lines == NULL);            \
+    ASSERT_EQ_INT(true, chunk.lineRuns == NULL);         \
+    ASSERT_EQ_INT(0, chunk.lineRunCount);                \
     ASSERT_EQ_INT(0, chunk.constants.count);             \
     ASSERT_EQ_INT(0, chunk.constants.capacity);          \
     ASSERT_EQ_INT(true, chunk.constants.values == NULL); \
@@ -68,6 +70,32 @@ MU_TEST(test_appendConstant) {
   ASSERT_EQ_INT(true, valuesEq(chunk.constants.values[0], constant));
 }
 
+MU_TEST(test_finalizeChunk) {
+  Chunk chunk;
+  initChunk(&chunk);
+
+  int lines[] = {1, 1, 2, 2, 2, 5};
+  for (int i = 0; i < 6; i++) {
+    appendChunk(&chunk, OP_NIL, lines[i]);
+  }
+
+  appendConstant(&chunk, NUM_VAL(1));
+
+  finalizeChunk(&chunk);
+
+  ASSERT_EQ_INT(6, chunk.capacity);
+  ASSERT_EQ_INT(1, chunk.constants.capacity);
+  ASSERT_EQ_INT(true, chunk.lines == NULL);
+  ASSERT_EQ_INT(3, chunk.lineRunCount);
+
+  for (int i = 0; i < 6; i++) {
+    ASSERT_EQ_INT(lines[i], chunkLine(&chunk, i));
+  }
+
+  freeChunk(&chunk);
+  ASSERT_CHUNK_INIT(chunk)
+}
+
 MU_TEST_SUITE(chunk_tests) {
   MU_SUITE_CONFIGURE(setup_chunk_tests, teardown_chunk_tests);
 
@@ -75,4 +103,5 @@ MU_TEST_SUITE(chunk_tests) {
   MU_RUN_TEST(test_appendChunk);
   MU_RUN_TEST(test_freeChunk);
   MU_RUN_TEST(test_appendConstant);
+  MU_RUN_TEST(test_finalizeChunk);
 }
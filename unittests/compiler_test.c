@@ -93,55 +93,137 @@ MU_TEST(test_compile_logicalOr) {
 }
 
 MU_TEST(test_compile_ifStmt) {
-  const char *source = "if (true) print true;";
+  const char *source = "if (x) print true;";
 
-  uint8_t bytecode[] = {OP_TRUE, OP_JUMP_IF_FALSE, 0x00,     0x06, OP_POP,
-                        OP_TRUE, OP_PRINT,         OP_JUMP,  0x00, 0x01,
-                        OP_POP,  OP_NIL,           OP_RETURN};
+  uint8_t bytecode[] = {OP_GET_GLOBAL, 0x00, OP_JUMP_IF_FALSE, 0x00,   0x06,
+                        OP_POP,        OP_TRUE, OP_PRINT,      OP_JUMP, 0x00,
+                        0x01,          OP_POP,  OP_NIL,        OP_RETURN};
 
   ObjFunc *func = compile(source);
 
   ASSERT_NOT_NULL(func);
-  ASSERT_BYTECODE(func->chunk, bytecode, 13);
+  ASSERT_BYTECODE(func->chunk, bytecode, 14);
 }
 
 MU_TEST(test_compile_ifElseStmt) {
-  const char *source = "if (true) print true; else print false;";
+  const char *source = "if (x) print true; else print false;";
 
-  uint8_t bytecode[] = {OP_TRUE, OP_JUMP_IF_FALSE, 0x00,     0x06,   OP_POP,
-                        OP_TRUE, OP_PRINT,         OP_JUMP,  0x00,   0x03,
-                        OP_POP,  OP_FALSE,         OP_PRINT, OP_NIL, OP_RETURN};
+  uint8_t bytecode[] = {OP_GET_GLOBAL, 0x00,     OP_JUMP_IF_FALSE, 0x00,
+                        0x06,          OP_POP,   OP_TRUE,          OP_PRINT,
+                        OP_JUMP,       0x00,     0x03,             OP_POP,
+                        OP_FALSE,      OP_PRINT, OP_NIL,           OP_RETURN};
 
   ObjFunc *func = compile(source);
 
   ASSERT_NOT_NULL(func);
-  ASSERT_BYTECODE(func->chunk, bytecode, 15);
+  ASSERT_BYTECODE(func->chunk, bytecode, 16);
+}
+
+MU_TEST(test_compile_ifStmt_nestedJumpThreaded) {
+  const char *source = "if (a) { if (b) print 1; }";
+
+  // The inner 'then' jump lands past the outer 'else', not on its jump.
+  uint8_t bytecode[] = {OP_GET_GLOBAL, 0x00,     OP_JUMP_IF_FALSE, 0x00,
+                        0x11,          OP_POP,   OP_GET_GLOBAL,    0x01,
+                        OP_JUMP_IF_FALSE, 0x00,  0x07,             OP_POP,
+                        OP_CONSTANT,   0x02,     OP_PRINT,         OP_JUMP,
+                        0x00,          0x05,     OP_POP,           OP_JUMP,
+                        0x00,          0x01,     OP_POP,           OP_NIL,
+                        OP_RETURN};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_BYTECODE(func->chunk, bytecode, 25);
+}
+
+MU_TEST(test_compile_ifStmt_constantCondition) {
+  const char *source = "if (false) print 1; else print true;"
+                       "if (nil) { print 2; }"
+                       "if (3) print false;";
+
+  // Only the taken branches are kept, without any condition or jumps.
+  uint8_t bytecode[] = {OP_TRUE,  OP_PRINT, OP_FALSE,
+                        OP_PRINT, OP_NIL,   OP_RETURN};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_BYTECODE(func->chunk, bytecode, 6);
+  ASSERT_EQ_INT(0, func->chunk.constants.count);
+}
+
+MU_TEST(test_compile_ifElseStmt_bothBranchesReturn) {
+  const char *source = "func f(x) { if (x) return 1; else return 2; print x; }";
+
+  // No jump over the else branch and nothing after the if is emitted.
+  uint8_t bytecode[] = {OP_GET_LOCAL, 0x01,        OP_JUMP_IF_FALSE,
+                        0x00,         0x04,        OP_POP,
+                        OP_CONSTANT,  0x00,        OP_RETURN,
+                        OP_POP,       OP_CONSTANT, 0x01,
+                        OP_RETURN};
+
+  ObjFunc *main = compile(source);
+
+  ASSERT_NOT_NULL(main);
+
+  ObjFunc *f = AS_FUNC(main->chunk.constants.values[1]);
+  ASSERT_BYTECODE(f->chunk, bytecode, 13);
 }
 
 MU_TEST(test_compile_conditional) {
-  const char *source = "print true ? true : false;";
+  const char *source = "print x ? true : false;";
 
-  uint8_t bytecode[] = {OP_TRUE,  OP_JUMP_IF_FALSE, 0x00,   0x05,     OP_POP,
-                        OP_TRUE,  OP_JUMP,          0x00,   0x02,     OP_POP,
-                        OP_FALSE, OP_PRINT,         OP_NIL, OP_RETURN};
+  uint8_t bytecode[] = {OP_GET_GLOBAL, 0x00,     OP_JUMP_IF_FALSE, 0x00,
+                        0x05,          OP_POP,   OP_TRUE,          OP_JUMP,
+                        0x00,          0x02,     OP_POP,           OP_FALSE,
+                        OP_PRINT,      OP_NIL,   OP_RETURN};
 
   ObjFunc *func = compile(source);
 
   ASSERT_NOT_NULL(func);
-  ASSERT_BYTECODE(func->chunk, bytecode, 14);
+  ASSERT_BYTECODE(func->chunk, bytecode, 15);
+}
+
+MU_TEST(test_compile_conditional_constantCondition) {
+  const char *source = "print true ? false : 1; print nil ? 2 : true;";
+
+  uint8_t bytecode[] = {OP_FALSE, OP_PRINT, OP_TRUE,
+                        OP_PRINT, OP_NIL,   OP_RETURN};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_BYTECODE(func->chunk, bytecode, 6);
+  ASSERT_EQ_INT(0, func->chunk.constants.count);
 }
 
 MU_TEST(test_compile_whileLoop) {
-  const char *source = "while (true) print true;";
+  const char *source = "while (x) print true;";
 
-  uint8_t bytecode[] = {OP_TRUE, OP_JUMP_IF_FALSE, 0x00,     0x06, OP_POP,
-                        OP_TRUE, OP_PRINT,         OP_LOOP,  0x00, 0x0A,
-                        OP_POP,  OP_NIL,           OP_RETURN};
+  uint8_t bytecode[] = {OP_GET_GLOBAL, 0x00,     OP_JUMP_IF_FALSE, 0x00,
+                        0x06,          OP_POP,   OP_TRUE,          OP_PRINT,
+                        OP_LOOP,       0x00,     0x0B,             OP_POP,
+                        OP_NIL,        OP_RETURN};
 
   ObjFunc *func = compile(source);
 
   ASSERT_NOT_NULL(func);
-  ASSERT_BYTECODE(func->chunk, bytecode, 13);
+  ASSERT_BYTECODE(func->chunk, bytecode, 14);
+}
+
+MU_TEST(test_compile_whileLoop_constantCondition) {
+  const char *source = "while (false) print 1; while (true) print true;";
+
+  // The false loop is dropped, the true loop has no exit test.
+  uint8_t bytecode[] = {OP_TRUE, OP_PRINT, OP_LOOP,  0x00,
+                        0x05,    OP_NIL,   OP_RETURN};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_BYTECODE(func->chunk, bytecode, 7);
+  ASSERT_EQ_INT(0, func->chunk.constants.count);
 }
 
 MU_TEST(test_compile_forLoop_noClauses) {
@@ -300,6 +382,48 @@ MU_TEST(test_compile_localVariable_initializer) {
   ASSERT_BYTECODE(func->chunk, bytecode, 4);
 }
 
+MU_TEST(test_compile_constant) {
+  const char *source = "const x = 2 * 3; { const y = !x; print x; print y; }";
+
+  // Only the top level declaration defines a global, the references are
+  // inlined
+  uint8_t bytecode[] = {OP_CONSTANT, 0x00,     OP_DEF_CONST, 0x01,
+                        OP_CONSTANT, 0x02,     OP_PRINT,     OP_FALSE,
+                        OP_PRINT,    OP_NIL,   OP_RETURN};
+  Value constants[]  = {NUM_VAL(6), OBJ_VAL(copyString("x", 1)), NUM_VAL(6)};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_BYTECODE(func->chunk, bytecode, 11);
+  ASSERT_CONSTS(func->chunk, constants, 3);
+}
+
+MU_TEST(test_compile_constant_shadowedByLocal) {
+  const char *source = "const x = 1; { var x = 2; print x; } print x;";
+
+  uint8_t bytecode[] = {OP_CONSTANT, 0x00,      OP_DEF_CONST, 0x01,
+                        OP_CONSTANT, 0x02,      OP_GET_LOCAL, 0x01,
+                        OP_PRINT,    OP_POP,    OP_CONSTANT,  0x03,
+                        OP_PRINT,    OP_NIL,    OP_RETURN};
+  Value constants[]  = {NUM_VAL(1), OBJ_VAL(copyString("x", 1)), NUM_VAL(2),
+                        NUM_VAL(1)};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_BYTECODE(func->chunk, bytecode, 15);
+  ASSERT_CONSTS(func->chunk, constants, 4);
+}
+
+MU_TEST(test_compile_constant_notConstantInitializer) {
+  ASSERT_EQ_INT(true, compile("var x = 1; const y = x;") == NULL);
+}
+
+MU_TEST(test_compile_constant_assigned) {
+  ASSERT_EQ_INT(true, compile("const x = 1; x = 2;") == NULL);
+}
+
 MU_TEST(test_compile_function_noParams) {
   const char *source = "func printTrue() { print true; }";
 
@@ -328,18 +452,31 @@ MU_TEST(test_compile_function_noParams) {
 MU_TEST(test_compile_function_returnValue) {
   const char *source = "func returnTrue() { return true; }";
 
-  // Compiler always emits OP_NIL, OP_RETURN at the end of each function
-  // as a fallback in case there is no explicit return value. This doesn't
-  // affect the VM's runtime execution because it is shortcutted by the
-  // first OP_RETURN if there was an explicit return statement compiled.
-  uint8_t funcBytecode[] = {OP_TRUE, OP_RETURN, OP_NIL, OP_RETURN};
+  // The fallback OP_NIL, OP_RETURN is only emitted at the end of a function
+  // when control can reach it, which it can't after the explicit return.
+  uint8_t funcBytecode[] = {OP_TRUE, OP_RETURN};
 
   ObjFunc *mainFunc = compile(source);
 
   ObjFunc *innerFunc = AS_FUNC(mainFunc->chunk.constants.values[1]);
   ASSERT_EQ_INT(0, innerFunc->arity);
   ASSERT_STREQ("returnTrue", innerFunc->name->chars);
-  ASSERT_BYTECODE(innerFunc->chunk, funcBytecode, 4);
+  ASSERT_BYTECODE(innerFunc->chunk, funcBytecode, 2);
+}
+
+MU_TEST(test_compile_function_codeAfterReturn) {
+  const char *source = "func f() { var a = 1; return a; print a; a = 2; }";
+
+  // Neither the code after the return, nor the pop of a, are emitted.
+  uint8_t funcBytecode[] = {OP_CONSTANT, 0x00, OP_GET_LOCAL, 0x01, OP_RETURN};
+
+  ObjFunc *main = compile(source);
+
+  ASSERT_NOT_NULL(main);
+
+  ObjFunc *f = AS_FUNC(main->chunk.constants.values[1]);
+  ASSERT_BYTECODE(f->chunk, funcBytecode, 5);
+  ASSERT_EQ_INT(1, f->chunk.constants.count);
 }
 
 MU_TEST(test_compile_function_simpleClosure) {
@@ -352,12 +489,14 @@ MU_TEST(test_compile_function_simpleClosure) {
 
   // locals = ["", "a", "f"]
   // constants = [3, <fn f>]
+  // f never escapes the block, so it reads a from the frame creating it and
+  // a needs no closing.
   uint8_t mainBytecode[] = {
-      OP_CONSTANT, 0x00,   OP_CLOSURE,       0x01,   UPVALUE_CAPTURES_LOCAL,
-      0x01,        OP_POP, OP_CLOSE_UPVALUE, OP_NIL, OP_RETURN};
+      OP_CONSTANT, 0x00,   OP_LOCAL_CLOSURE, 0x01,   UPVALUE_CAPTURES_LOCAL,
+      0x01,        OP_POP, OP_POP,           OP_NIL, OP_RETURN};
 
   // upvalues: [(local=true, i=1)]
-  uint8_t fBytecode[] = {OP_GET_UPVALUE, 0x00, OP_PRINT, OP_NIL, OP_RETURN};
+  uint8_t fBytecode[] = {OP_GET_PARENT, 0x01, OP_PRINT, OP_NIL, OP_RETURN};
 
   ObjFunc *main = compile(source);
 
@@ -390,8 +529,7 @@ MU_TEST(test_compile_function_counterClosure) {
   // constants: [0, <fn inc>]
   uint8_t makeCounterBytecode[] = {
       OP_CONSTANT,  0x00, OP_CLOSURE, 0x01,   UPVALUE_CAPTURES_LOCAL, 0x01,
-      OP_GET_LOCAL, 0x02, OP_RETURN,  OP_POP, OP_CLOSE_UPVALUE,       OP_NIL,
-      OP_RETURN};
+      OP_GET_LOCAL, 0x02, OP_RETURN};
 
   // constants: [1]
   // upvalues = [(local=true, i=1)]
@@ -414,7 +552,7 @@ MU_TEST(test_compile_function_counterClosure) {
   ASSERT_EQ_INT(0, makeCounter->arity);
 
   Chunk counterChunk = makeCounter->chunk;
-  ASSERT_BYTECODE(makeCounter->chunk, makeCounterBytecode, 13);
+  ASSERT_BYTECODE(makeCounter->chunk, makeCounterBytecode, 9);
   ASSERT_EQ_INT(2, counterChunk.constants.count);
   ASSERT_EQ_INT(true, valuesEq(NUM_VAL(0), counterChunk.constants.values[0]));
   ASSERT_EQ_INT(true, IS_FUNC(counterChunk.constants.values[1]));
@@ -430,6 +568,130 @@ MU_TEST(test_compile_function_counterClosure) {
   ASSERT_EQ_INT(true, valuesEq(NUM_VAL(1), incChunk.constants.values[0]));
 }
 
+MU_TEST(test_compile_function_capturedByValue) {
+  const char *source = "func make(n) {"
+                       "  func get() { return n; }"
+                       "  return get;"
+                       "}";
+
+  // locals = ["", "n", "get"]
+  // constants = [<fn get>]
+  // n is never assigned, so get copies it.
+  uint8_t makeBytecode[] = {OP_CLOSURE,   0x00, UPVALUE_CAPTURES_VALUE, 0x01,
+                            OP_GET_LOCAL, 0x02, OP_RETURN};
+
+  // upvalues: [(value, i=1)]
+  uint8_t getBytecode[] = {OP_GET_CAPTURED, 0x00, OP_RETURN};
+
+  ObjFunc *main = compile(source);
+
+  ASSERT_NOT_NULL(main);
+
+  ObjFunc *make = AS_FUNC(main->chunk.constants.values[1]);
+  ASSERT_BYTECODE(make->chunk, makeBytecode, 7);
+
+  ObjFunc *get = AS_FUNC(make->chunk.constants.values[0]);
+  ASSERT_BYTECODE(get->chunk, getBytecode, 3);
+}
+
+MU_TEST(test_compile_function_recursiveLocalClosure) {
+  const char *source = "{"
+                       "  func f() { f(); }"
+                       "}";
+
+  // locals = ["", "f"]
+  // constants = [<fn f>]
+  // f's closure is created before f is, so it captures f by reference.
+  uint8_t mainBytecode[] = {OP_CLOSURE, 0x00,      UPVALUE_CAPTURES_LOCAL,
+                            0x01,       OP_CLOSE_UPVALUE, OP_NIL,
+                            OP_RETURN};
+
+  // upvalues: [(local=true, i=1)]
+  uint8_t fBytecode[] = {OP_GET_UPVALUE, 0x00,   OP_CALL,  0x00,
+                         OP_POP,         OP_NIL, OP_RETURN};
+
+  ObjFunc *main = compile(source);
+
+  ASSERT_NOT_NULL(main);
+  ASSERT_BYTECODE(main->chunk, mainBytecode, 7);
+
+  ObjFunc *f = AS_FUNC(main->chunk.constants.values[0]);
+  ASSERT_BYTECODE(f->chunk, fBytecode, 7);
+}
+
+MU_TEST(test_compile_call_native) {
+  const char *source = "str(1);";
+
+  // constants = ["str", 1]
+  uint8_t expectedBytecode[] = {OP_GET_GLOBAL,  0x00, OP_CONSTANT, 0x01,
+                                OP_CALL_NATIVE, 0x02, OP_POP,      OP_NIL,
+                                OP_RETURN};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_EQ_INT(2, findNative("str", 3));
+  ASSERT_BYTECODE(func->chunk, expectedBytecode, 9);
+}
+
+MU_TEST(test_compile_call_nativeOtherArity) {
+  const char *source = "{ var clock = 1; clock(); } str(1, 2);";
+
+  // A local shadowing a native and the wrong number of arguments both call it
+  // as usual, the latter failing at runtime.
+  uint8_t expectedBytecode[] = {OP_CONSTANT,   0x00,   OP_GET_LOCAL, 0x01,
+                                OP_CALL,       0x00,   OP_POP,       OP_POP,
+                                OP_GET_GLOBAL, 0x01,   OP_CONSTANT,  0x02,
+                                OP_CONSTANT,   0x03,   OP_CALL,      0x02,
+                                OP_POP,        OP_NIL, OP_RETURN};
+
+  ObjFunc *func = compile(source);
+
+  ASSERT_NOT_NULL(func);
+  ASSERT_BYTECODE(func->chunk, expectedBytecode, 19);
+}
+
+MU_TEST(test_compile_function_lazyBody) {
+  const char *source = "func f(a, b) { return a + b; }";
+
+  uint8_t fBytecode[] = {OP_GET_LOCAL, 0x01, OP_GET_LOCAL, 0x02,
+                         OP_ADD,       OP_RETURN};
+
+  setLazyCompile(true);
+  ObjFunc *main = compile(source);
+  setLazyCompile(false);
+
+  ASSERT_NOT_NULL(main);
+
+  // Only the parameters are compiled up front
+  ObjFunc *f = AS_FUNC(main->chunk.constants.values[1]);
+  ASSERT_EQ_INT(2, f->arity);
+  ASSERT_EQ_INT(0, f->chunk.count);
+  ASSERT_NOT_NULL(f->lazyStart.start);
+
+  ASSERT_EQ_INT(true, compileLazyFunc(f));
+  ASSERT_EQ_INT(2, f->arity);
+  ASSERT_EQ_INT(true, f->lazyStart.start == NULL);
+  ASSERT_BYTECODE(f->chunk, fBytecode, 6);
+}
+
+MU_TEST(test_compile_retainedSource_borrowsStrings) {
+  const char *source = "var greeting = \"hello\"; print greeting;";
+
+  setRetainedSource(true);
+  ObjFunc *main = compile(source);
+  setRetainedSource(false);
+
+  ASSERT_NOT_NULL(main);
+
+  // The global's name and the literal both point into the source
+  ObjString *name = AS_STRING(main->chunk.constants.values[0]);
+  ObjString *str  = AS_STRING(main->chunk.constants.values[1]);
+  ASSERT_EQ_INT(true, name->chars == source + 4);
+  ASSERT_EQ_INT(true, str->chars == source + 16);
+  ASSERT_EQ_INT(false, str->ownsChars);
+}
+
 MU_TEST_SUITE(compiler_tests) {
   MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
@@ -440,8 +702,13 @@ MU_TEST_SUITE(compiler_tests) {
   MU_RUN_TEST(test_compile_logicalOr);
   MU_RUN_TEST(test_compile_ifStmt);
   MU_RUN_TEST(test_compile_ifElseStmt);
+  MU_RUN_TEST(test_compile_ifStmt_nestedJumpThreaded);
+  MU_RUN_TEST(test_compile_ifStmt_constantCondition);
+  MU_RUN_TEST(test_compile_ifElseStmt_bothBranchesReturn);
   MU_RUN_TEST(test_compile_conditional);
+  MU_RUN_TEST(test_compile_conditional_constantCondition);
   MU_RUN_TEST(test_compile_whileLoop);
+  MU_RUN_TEST(test_compile_whileLoop_constantCondition);
 
   // 'for' loops were tough! Had to take an `incremental` approach :)
   MU_RUN_TEST(test_compile_forLoop_noClauses);
@@ -454,9 +721,20 @@ MU_TEST_SUITE(compiler_tests) {
   MU_RUN_TEST(test_compile_setGlobalVariable);
   MU_RUN_TEST(test_compile_localVariable);
   MU_RUN_TEST(test_compile_localVariable_initializer);
+  MU_RUN_TEST(test_compile_constant);
+  MU_RUN_TEST(test_compile_constant_shadowedByLocal);
+  MU_RUN_TEST(test_compile_constant_notConstantInitializer);
+  MU_RUN_TEST(test_compile_constant_assigned);
 
   MU_RUN_TEST(test_compile_function_noParams);
   MU_RUN_TEST(test_compile_function_returnValue);
+  MU_RUN_TEST(test_compile_function_codeAfterReturn);
   MU_RUN_TEST(test_compile_function_simpleClosure);
   MU_RUN_TEST(test_compile_function_counterClosure);
+  MU_RUN_TEST(test_compile_function_capturedByValue);
+  MU_RUN_TEST(test_compile_function_recursiveLocalClosure);
+  MU_RUN_TEST(test_compile_call_native);
+  MU_RUN_TEST(test_compile_call_nativeOtherArity);
+  MU_RUN_TEST(test_compile_function_lazyBody);
+  MU_RUN_TEST(test_compile_retainedSource_borrowsStrings);
 }
@@ -0,0 +1,68 @@
+#include "dtoa.h"
+#include "minunit.h"
+#include "test_runners.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT_FORMATS(expected, value)      \
+  do {                                       \
+    char buf[NUMBER_FMT_MAX];                \
+    int n = formatNumber(value, buf);        \
+    ASSERT_STREQ(expected, buf);             \
+    ASSERT_EQ_INT((int)strlen(expected), n); \
+  } while (0)
+
+MU_TEST(test_formatNumber_integers) {
+  ASSERT_FORMATS("0", 0.0);
+  ASSERT_FORMATS("-0", -0.0);
+  ASSERT_FORMATS("7", 7.0);
+  ASSERT_FORMATS("-42", -42.0);
+  ASSERT_FORMATS("1000000", 1000000.0);
+  ASSERT_FORMATS("9007199254740991", 9007199254740991.0);
+}
+
+MU_TEST(test_formatNumber_fractions) {
+  ASSERT_FORMATS("0.1", 0.1);
+  ASSERT_FORMATS("0.30000000000000004", 0.1 + 0.2);
+  ASSERT_FORMATS("0.3333333333333333", 1.0 / 3.0);
+  ASSERT_FORMATS("123.456", 123.456);
+  ASSERT_FORMATS("0.000001", 0.000001);
+}
+
+MU_TEST(test_formatNumber_exponents) {
+  ASSERT_FORMATS("100000000000000000000", 1e20);
+  ASSERT_FORMATS("1e+21", 1e21);
+  ASSERT_FORMATS("1e-7", 1e-7);
+  ASSERT_FORMATS("1.5e+300", 1.5e300);
+  ASSERT_FORMATS("5e-324", 5e-324);
+  ASSERT_FORMATS("1.7976931348623157e+308", 1.7976931348623157e308);
+}
+
+MU_TEST(test_formatNumber_specials) {
+  ASSERT_FORMATS("nan", NAN);
+  ASSERT_FORMATS("inf", INFINITY);
+  ASSERT_FORMATS("-inf", -INFINITY);
+}
+
+MU_TEST(test_formatNumber_roundTrips) {
+  double values[] = {0.1, 2.0 / 3.0, 1e-300, 123456789.987654321,
+                     6.02214076e23};
+  int n           = sizeof(values) / sizeof(values[0]);
+
+  for (int i = 0; i < n; i++) {
+    char buf[NUMBER_FMT_MAX];
+    formatNumber(values[i], buf);
+    ASSERT_EQ_INT(true, strtod(buf, NULL) == values[i]);
+  }
+}
+
+MU_TEST_SUITE(dtoa_tests) {
+  MU_RUN_TEST(test_formatNumber_integers);
+  MU_RUN_TEST(test_formatNumber_fractions);
+  MU_RUN_TEST(test_formatNumber_exponents);
+  MU_RUN_TEST(test_formatNumber_specials);
+  MU_RUN_TEST(test_formatNumber_roundTrips);
+}
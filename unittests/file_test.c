@@ -0,0 +1,93 @@
+#include "file.h"
+
+#include "minunit.h"
+#include "object.h"
+#include "test_runners.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char filePath[] = "/tmp/asbtl_file_testXXXXXX";
+
+static void writeTestFile(const char *chars, size_t n) {
+  strcpy(filePath + strlen(filePath) - 6, "XXXXXX");
+  int fd = mkstemp(filePath);
+  write(fd, chars, n);
+  close(fd);
+}
+
+void file_test_setup() {
+  initVM();
+}
+
+void file_test_teardown() {
+  unlink(filePath);
+  freeVM();
+}
+
+MU_TEST(test_readLine_lineLongerThanBuffer) {
+  size_t n   = FILE_BUFFER_SIZE * 2 + 10;
+  char *text = malloc(n + 3);
+  memset(text, 'x', n);
+  memcpy(text + n, "\ny", 2);
+  writeTestFile(text, n + 2);
+
+  ObjFile *file = openFile(filePath);
+  push(OBJ_VAL(file)); // Keep the file reachable across collections
+
+  ObjString *line = readLine(file);
+
+  ASSERT_EQ_INT(true, line != NULL);
+  ASSERT_EQ_INT((int)n, line->len);
+  ASSERT_EQ_INT(true, readLine(file) == vm.byteStrings['y']);
+  ASSERT_EQ_INT(true, readLine(file) == NULL);
+
+  closeFile(file);
+  pop();
+  free(text);
+}
+
+MU_TEST(test_readLine_linesSpanRefills) {
+  // Lines of 9 chars + '\n' never line up with the buffer's end
+  size_t lines = FILE_BUFFER_SIZE / 10 * 3;
+  char *text   = malloc(lines * 10);
+  for (size_t i = 0; i < lines; i++) {
+    memcpy(text + i * 10, "abcdefghi\n", 10);
+  }
+  writeTestFile(text, lines * 10);
+
+  ObjFile *file = openFile(filePath);
+  push(OBJ_VAL(file));
+
+  size_t count  = 0;
+  bool allEqual = true;
+
+  ObjString *line;
+  while ((line = readLine(file)) != NULL) {
+    allEqual = allEqual && line->len == 9 && memcmp(line->chars, text, 9) == 0;
+    count++;
+  }
+
+  ASSERT_EQ_INT((int)lines, (int)count);
+  ASSERT_EQ_INT(true, allEqual);
+
+  closeFile(file);
+  pop();
+  free(text);
+}
+
+MU_TEST(test_openFile_missing) {
+  ASSERT_EQ_INT(true, openFile("/nonexistent/asbtl/file") == NULL);
+}
+
+MU_TEST_SUITE(file_tests) {
+  MU_SUITE_CONFIGURE(&file_test_setup, &file_test_teardown);
+
+  MU_RUN_TEST(test_readLine_lineLongerThanBuffer);
+  MU_RUN_TEST(test_readLine_linesSpanRefills);
+  MU_RUN_TEST(test_openFile_missing);
+}
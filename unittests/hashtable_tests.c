@@ -2,6 +2,8 @@
 #include "minunit.h"
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 
 HashTable table;
 
@@ -110,6 +112,31 @@ MU_TEST(test_hashTableRemove_notExist) {
   ASSERT_EQ_INT(false, success);
 }
 
+MU_TEST(test_hashTableSet_reusesTombstonedTable) {
+  char names[64][4];
+  ObjString keys[64];
+
+  // Fill the table with entries that are then all removed
+  for (int i = 0; i < 6; i++) {
+    snprintf(names[i], sizeof(names[i]), "k%d", i);
+    keys[i] = makeObjString(names[i], strlen(names[i]));
+    hashTableSet(&table, &keys[i], NUM_VAL(i));
+    hashTableRemove(&table, &keys[i]);
+  }
+
+  unsigned int capacity = table.capacity;
+
+  // Keep churning through new keys, the tombstones are dropped on rehash
+  for (int i = 6; i < 64; i++) {
+    snprintf(names[i], sizeof(names[i]), "k%d", i);
+    keys[i] = makeObjString(names[i], strlen(names[i]));
+    hashTableSet(&table, &keys[i], NUM_VAL(i));
+    hashTableRemove(&table, &keys[i]);
+  }
+
+  ASSERT_EQ_INT(capacity, table.capacity);
+}
+
 MU_TEST_SUITE(hashtable_tests) {
   MU_SUITE_CONFIGURE(&ht_test_setup, &ht_test_teardown);
 
@@ -121,4 +148,5 @@ MU_TEST_SUITE(hashtable_tests) {
   MU_RUN_TEST(test_hashTableGet_notExist);
   MU_RUN_TEST(test_hashTableRemove);
   MU_RUN_TEST(test_hashTableRemove_notExist);
+  MU_RUN_TEST(test_hashTableSet_reusesTombstonedTable);
 }
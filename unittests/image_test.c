@@ -0,0 +1,255 @@
+#include "image.h"
+
+#include "compiler.h"
+#include "minunit.h"
+#include "object.h"
+#include "source.h"
+#include "test_runners.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char imagePath[] = "/tmp/asbtl_image_testXXXXXX";
+
+static const ImageKey imageKey = {42, 0};
+
+static const char *imageSource = "var a = \"str\";"
+                                 "func outer(x) {"
+                                 "  func inner() { return x + 1.5; }"
+                                 "  return inner;"
+                                 "}"
+                                 "var f = outer(1);"
+                                 "print f();";
+
+void image_test_setup() {
+  initVM();
+
+  strcpy(imagePath + strlen(imagePath) - 6, "XXXXXX");
+  close(mkstemp(imagePath));
+}
+
+void image_test_teardown() {
+  unlink(imagePath);
+  freeVM();
+}
+
+// Compares everything the image stores, recursing into nested functions
+static bool funcsEqual(ObjFunc *a, ObjFunc *b) {
+  if (a->arity != b->arity || a->upvalueCount != b->upvalueCount ||
+      (a->name == NULL) != (b->name == NULL) ||
+      a->chunk.count != b->chunk.count ||
+      a->chunk.lineRunCount != b->chunk.lineRunCount ||
+      a->chunk.constants.count != b->chunk.constants.count)
+    return false;
+
+  // Interned, so the same name is the same object
+  if (a->name != b->name)
+    return false;
+
+  if (memcmp(a->chunk.code, b->chunk.code, a->chunk.count) != 0 ||
+      memcmp(a->chunk.lineRuns, b->chunk.lineRuns,
+             sizeof(LineRun) * a->chunk.lineRunCount) != 0)
+    return false;
+
+  for (unsigned int i = 0; i < a->chunk.constants.count; i++) {
+    Value x = a->chunk.constants.values[i], y = b->chunk.constants.values[i];
+
+    if (IS_FUNC(x) && IS_FUNC(y)) {
+      if (!funcsEqual(AS_FUNC(x), AS_FUNC(y)))
+        return false;
+    } else if (!valuesEq(x, y)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+MU_TEST(test_image_roundTrip) {
+  ObjFunc *compiled = compile(imageSource);
+  push(OBJ_VAL(compiled));
+
+  ASSERT_EQ_INT(true, writeImage(compiled, &imageKey, imagePath));
+
+  Source source;
+  readSource(&source, imagePath);
+
+  ASSERT_EQ_INT(true, isImage(source.chars, source.len));
+
+  ObjFunc *loaded = loadImage(source.chars, source.len, NULL);
+
+  ASSERT_EQ_INT(true, loaded != NULL && funcsEqual(compiled, loaded));
+
+  freeSource(&source);
+  pop();
+}
+
+MU_TEST(test_image_rejectsOtherSourceHash) {
+  ObjFunc *compiled = compile(imageSource);
+  writeImage(compiled, &imageKey, imagePath);
+
+  Source source;
+  readSource(&source, imagePath);
+
+  ImageKey key = {43, 0};
+  ASSERT_EQ_INT(true, loadImage(source.chars, source.len, &key) == NULL);
+
+  freeSource(&source);
+}
+
+MU_TEST(test_image_rejectsOtherFlags) {
+  ObjFunc *compiled = compile(imageSource);
+  writeImage(compiled, &imageKey, imagePath);
+
+  Source source;
+  readSource(&source, imagePath);
+
+  ImageKey key = {42, 2};
+  ASSERT_EQ_INT(true, loadImage(source.chars, source.len, &key) == NULL);
+  ASSERT_EQ_INT(true, loadImage(source.chars, source.len, &imageKey) != NULL);
+
+  freeSource(&source);
+}
+
+MU_TEST(test_image_rejectsTruncated) {
+  ObjFunc *compiled = compile(imageSource);
+  writeImage(compiled, &imageKey, imagePath);
+
+  Source source;
+  readSource(&source, imagePath);
+
+  ASSERT_EQ_INT(true, loadImage(source.chars, source.len / 2, NULL) == NULL);
+
+  freeSource(&source);
+}
+
+// A function of the given bytecode, with a number as its first constant and
+// the nested function, if any, as its second.
+static ObjFunc *codeFunc(const uint8_t *code, int len, ObjFunc *nested) {
+  ObjFunc *func = newFunc();
+  push(OBJ_VAL(func));
+
+  for (int i = 0; i < len; i++) {
+    appendChunk(&func->chunk, code[i], 1);
+  }
+  appendConstant(&func->chunk, NUM_VAL(1));
+  if (nested != NULL)
+    appendConstant(&func->chunk, OBJ_VAL(nested));
+  finalizeChunk(&func->chunk);
+
+  pop();
+  return func;
+}
+
+// Writes the script as an image, then loads it back.
+static ObjFunc *loadScript(ObjFunc *script) {
+  writeImage(script, &imageKey, imagePath);
+
+  Source source;
+  readSource(&source, imagePath);
+
+  ObjFunc *loaded = loadImage(source.chars, source.len, NULL);
+  freeSource(&source);
+  return loaded;
+}
+
+static ObjFunc *loadCode(const uint8_t *code, int len) {
+  return loadScript(codeFunc(code, len, NULL));
+}
+
+// Loads a script creating a function that reads a slot of its caller's frame.
+static ObjFunc *loadParentRead(OpCode closureOp, uint8_t slot) {
+  const uint8_t inner[] = {OP_GET_PARENT, slot, OP_RETURN};
+  ObjFunc *nested       = codeFunc(inner, sizeof(inner), NULL);
+  push(OBJ_VAL(nested));
+
+  const uint8_t code[] = {closureOp, 1, OP_POP, OP_NIL, OP_RETURN};
+  ObjFunc *script      = codeFunc(code, sizeof(code), nested);
+  pop();
+
+  return loadScript(script);
+}
+
+MU_TEST(test_image_checksCode) {
+  const uint8_t valid[] = {OP_CONSTANT, 0, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(valid, sizeof(valid)) != NULL);
+}
+
+MU_TEST(test_image_rejectsBadConstant) {
+  const uint8_t code[] = {OP_CONSTANT, 200, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(code, sizeof(code)) == NULL);
+}
+
+MU_TEST(test_image_rejectsBadOpCode) {
+  const uint8_t code[] = {OP_CODE_COUNT, OP_NIL, OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(code, sizeof(code)) == NULL);
+}
+
+MU_TEST(test_image_rejectsJumpIntoInstruction) {
+  const uint8_t code[] = {OP_JUMP, 0, 1, OP_CONSTANT, 0, OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(code, sizeof(code)) == NULL);
+}
+
+MU_TEST(test_image_rejectsRunningOffEnd) {
+  const uint8_t code[] = {OP_NIL, OP_PRINT};
+  ASSERT_EQ_INT(true, loadCode(code, sizeof(code)) == NULL);
+
+  const uint8_t operand[] = {OP_NIL, OP_RETURN, OP_CONSTANT};
+  ASSERT_EQ_INT(true, loadCode(operand, sizeof(operand)) == NULL);
+}
+
+MU_TEST(test_image_rejectsLocalOutsideFrame) {
+  const uint8_t valid[] = {OP_NIL, OP_GET_LOCAL, 1,      OP_PRINT,
+                           OP_POP, OP_NIL,       OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(valid, sizeof(valid)) != NULL);
+
+  const uint8_t code[] = {OP_GET_LOCAL, 250, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(code, sizeof(code)) == NULL);
+}
+
+MU_TEST(test_image_rejectsPoppingCallee) {
+  const uint8_t code[] = {OP_POP, OP_NIL, OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(code, sizeof(code)) == NULL);
+}
+
+MU_TEST(test_image_rejectsParentSlotInScript) {
+  const uint8_t code[] = {OP_GET_PARENT, 200, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_EQ_INT(true, loadCode(code, sizeof(code)) == NULL);
+}
+
+MU_TEST(test_image_checksParentSlots) {
+  ASSERT_EQ_INT(true, loadParentRead(OP_LOCAL_CLOSURE, 1) != NULL);
+  ASSERT_EQ_INT(true, loadParentRead(OP_LOCAL_CLOSURE, 5) == NULL);
+  ASSERT_EQ_INT(true, loadParentRead(OP_CLOSURE, 1) == NULL);
+}
+
+MU_TEST(test_isImage_source) {
+  ASSERT_EQ_INT(false, isImage(imageSource, strlen(imageSource)));
+}
+
+MU_TEST(test_hashSource_differs) {
+  ASSERT_EQ_INT(false, hashSource("print 1;", 8) == hashSource("print 2;", 8));
+}
+
+MU_TEST_SUITE(image_tests) {
+  MU_SUITE_CONFIGURE(&image_test_setup, &image_test_teardown);
+
+  MU_RUN_TEST(test_image_roundTrip);
+  MU_RUN_TEST(test_image_rejectsOtherSourceHash);
+  MU_RUN_TEST(test_image_rejectsOtherFlags);
+  MU_RUN_TEST(test_image_rejectsTruncated);
+  MU_RUN_TEST(test_image_checksCode);
+  MU_RUN_TEST(test_image_rejectsBadConstant);
+  MU_RUN_TEST(test_image_rejectsBadOpCode);
+  MU_RUN_TEST(test_image_rejectsJumpIntoInstruction);
+  MU_RUN_TEST(test_image_rejectsRunningOffEnd);
+  MU_RUN_TEST(test_image_rejectsLocalOutsideFrame);
+  MU_RUN_TEST(test_image_rejectsPoppingCallee);
+  MU_RUN_TEST(test_image_rejectsParentSlotInScript);
+  MU_RUN_TEST(test_image_checksParentSlots);
+  MU_RUN_TEST(test_isImage_source);
+  MU_RUN_TEST(test_hashSource_differs);
+}
@@ -0,0 +1,99 @@
+#include "ir.h"
+
+#include "chunk.h"
+#include "test_runners.h"
+
+#include "minunit.h"
+#include "vm.h"
+
+static Chunk chunk;
+static Chunk lowered;
+static IrFunc ir;
+
+static void appendCode(uint8_t *code, int n, int line) {
+  for (int i = 0; i < n; i++) {
+    appendChunk(&chunk, code[i], line);
+  }
+}
+
+void setup_ir_tests() {
+  initVM();
+  initChunk(&chunk);
+  initChunk(&lowered);
+}
+
+void teardown_ir_tests() {
+  freeIr(&ir);
+  freeChunk(&lowered);
+  freeChunk(&chunk);
+  freeVM();
+}
+
+MU_TEST(test_buildIr_splitsAtJumps) {
+  // if (x) { print x; } return;
+  uint8_t code[] = {OP_GET_LOCAL, 0x01, OP_JUMP_IF_FALSE, 0x00,      0x07,
+                    OP_POP,       OP_GET_LOCAL,     0x01, OP_PRINT, OP_JUMP,
+                    0x00,         0x01,             OP_POP,   OP_NIL,
+                    OP_RETURN};
+  appendCode(code, 15, 1);
+
+  buildIr(&ir, &chunk);
+
+  ASSERT_EQ_INT(4, ir.blockCount);
+  ASSERT_EQ_INT(EXIT_BRANCH, ir.blocks[0].exit);
+  ASSERT_EQ_INT(2, ir.blocks[0].target);
+  ASSERT_EQ_INT(1, ir.blocks[0].next);
+  ASSERT_EQ_INT(1, ir.blocks[0].count);
+  ASSERT_EQ_INT(OP_GET_LOCAL, ir.blocks[0].instrs[0].op);
+  ASSERT_EQ_INT(1, ir.blocks[0].instrs[0].operand);
+
+  ASSERT_EQ_INT(EXIT_JUMP, ir.blocks[1].exit);
+  ASSERT_EQ_INT(3, ir.blocks[1].target);
+  ASSERT_EQ_INT(3, ir.blocks[1].count);
+
+  ASSERT_EQ_INT(EXIT_NEXT, ir.blocks[2].exit);
+  ASSERT_EQ_INT(EXIT_RETURN, ir.blocks[3].exit);
+}
+
+MU_TEST(test_lowerIr_roundTrip) {
+  // while (x) { x = nil; }
+  uint8_t code[] = {OP_GET_LOCAL, 0x01,   OP_JUMP_IF_FALSE, 0x00, 0x08,
+                    OP_POP,       OP_NIL, OP_SET_LOCAL,     0x01, OP_POP,
+                    OP_LOOP,      0x00,   0x0D,             OP_POP, OP_NIL,
+                    OP_RETURN};
+  appendCode(code, 16, 1);
+
+  buildIr(&ir, &chunk);
+  ASSERT_EQ_INT(true, lowerIr(&ir, &lowered));
+
+  ASSERT_EQ_INT(chunk.count, lowered.count);
+  for (unsigned int i = 0; i < chunk.count; i++)
+    ASSERT_EQ_INT(chunk.code[i], lowered.code[i]);
+}
+
+MU_TEST(test_lowerIr_backwardsBranch) {
+  uint8_t code[] = {OP_NIL,  OP_POP, OP_TRUE, OP_JUMP_IF_FALSE,
+                    0x00,    0x01,   OP_NIL,  OP_RETURN};
+  appendCode(code, 8, 1);
+
+  buildIr(&ir, &chunk);
+
+  // Branch back to the start instead, which needs a loop
+  ir.blocks[0].target = 0;
+  ASSERT_EQ_INT(true, lowerIr(&ir, &lowered));
+
+  uint8_t expected[] = {OP_NIL,  OP_POP, OP_TRUE, OP_JUMP_IF_TRUE, 0x00,
+                        0x03,    OP_LOOP, 0x00,   0x09,            OP_NIL,
+                        OP_RETURN};
+  ASSERT_EQ_INT(11, lowered.count);
+  for (int i = 0; i < 11; i++)
+    ASSERT_EQ_INT(expected[i], lowered.code[i]);
+}
+
+MU_TEST_SUITE(ir_tests) {
+  MU_SUITE_CONFIGURE(&setup_ir_tests, &teardown_ir_tests);
+
+  MU_RUN_TEST(test_buildIr_splitsAtJumps);
+  MU_RUN_TEST(test_lowerIr_roundTrip);
+  MU_RUN_TEST(test_lowerIr_backwardsBranch);
+}
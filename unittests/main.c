@@ -5,9 +5,18 @@
 int main(void) {
   MU_RUN_SUITE(chunk_tests, "Chunk Tests");
   MU_RUN_SUITE(compiler_tests, "Compiler Tests");
+  MU_RUN_SUITE(dtoa_tests, "Dtoa Tests");
+  MU_RUN_SUITE(file_tests, "File Tests");
   MU_RUN_SUITE(hashtable_tests, "Hash Table Tests");
+  MU_RUN_SUITE(image_tests, "Image Tests");
+  MU_RUN_SUITE(ir_tests, "IR Tests");
   MU_RUN_SUITE(object_tests, "Object Tests");
+  MU_RUN_SUITE(optimizer_tests, "Optimizer Tests");
+  MU_RUN_SUITE(peephole_tests, "Peephole Tests");
+  MU_RUN_SUITE(regcode_tests, "Register Code Tests");
   MU_RUN_SUITE(scanner_tests, "Scanner Tests");
+  MU_RUN_SUITE(source_tests, "Source Tests");
+  MU_RUN_SUITE(stats_tests, "Stats Tests");
   MU_RUN_SUITE(value_tests, "Value Tests");
   MU_RUN_SUITE(vm_tests, "VM Tests");
 
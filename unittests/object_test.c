@@ -1,3 +1,4 @@
+#include "memory.h"
 #include "minunit.h"
 #include "object.h"
 #include "test_runners.h"
@@ -19,7 +20,7 @@ MU_TEST(test_makeObjString) {
   ASSERT_EQ_INT(3, s.len);
   ASSERT_STREQ("foo", s.chars);
   ASSERT_EQ_INT(OBJ_STRING, s.obj.type);
-  ASSERT_EQ_INT(true, s.obj.next == NULL);
+  ASSERT_EQ_INT(false, s.obj.isMarked);
 }
 
 MU_TEST(test_hashString_consistency) {
@@ -51,8 +52,8 @@ MU_TEST(test_copyString) {
   ASSERT_STREQ("test", result->chars);
   ASSERT_EQ_INT(4, result->len);
 
-  ASSERT_EQ_INT(true, vm.objs != NULL);
-  ASSERT_EQ_INT(OBJ_STRING, vm.objs->type);
+  ASSERT_EQ_INT(OBJ_STRING, result->obj.type);
+  ASSERT_EQ_INT(true, vm.pools[OBJ_STRING].live > 0);
 }
 
 MU_TEST(test_copyString_interns) {
@@ -62,6 +63,44 @@ MU_TEST(test_copyString_interns) {
   ASSERT_EQ_INT(true, a == b);
 }
 
+// Points into the given chars, which needn't be zero terminated
+MU_TEST(test_borrowString) {
+  const char *source = "print \"borrowed\";";
+  ObjString *result  = borrowString(source + 7, 8);
+
+  ASSERT_EQ_INT(true, result->chars == source + 7);
+  ASSERT_EQ_INT(8, result->len);
+  ASSERT_EQ_INT(false, result->ownsChars);
+  ASSERT_EQ_INT(true, copyString("borrowed", 8) == result);
+}
+
+MU_TEST(test_borrowString_findsInterned) {
+  ObjString *copied = copyString("interned", 8);
+
+  ASSERT_EQ_INT(true, borrowString("interned!", 8) == copied);
+  ASSERT_EQ_INT(true, copied->ownsChars);
+}
+
+MU_TEST(test_copyString_singleByteCached) {
+  ObjString *result = copyString("a", 1);
+
+  ASSERT_EQ_INT(true, result == vm.byteStrings['a']);
+  ASSERT_STREQ("a", result->chars);
+}
+
+MU_TEST(test_copyString_emptyCached) {
+  ObjString *result = copyString("", 0);
+
+  ASSERT_EQ_INT(true, result == vm.emptyString);
+  ASSERT_EQ_INT(0, result->len);
+}
+
+MU_TEST(test_copyString_smallIntInterned) {
+  ObjString *result = copyString("42", 2);
+
+  ASSERT_EQ_INT(true, result == vm.smallIntStrings[42]);
+}
+
 MU_TEST(test_concatenate) {
   ObjString *a = copyString("foo", 3);
   ObjString *b = copyString("bar", 3);
@@ -73,6 +112,55 @@ MU_TEST(test_concatenate) {
   ASSERT_EQ_INT(6, result->len);
 }
 
+MU_TEST(test_concatenate_emptyOperand) {
+  ObjString *a = copyString("foo", 3);
+
+  ASSERT_EQ_INT(true, concatenate(a, vm.emptyString) == a);
+  ASSERT_EQ_INT(true, concatenate(vm.emptyString, a) == a);
+}
+
+MU_TEST(test_collectGarbage_freesPooledObjs) {
+  ObjUpvalue *kept = newUpvalue(NULL);
+  push(OBJ_VAL(kept));
+  newUpvalue(NULL);
+
+  ASSERT_EQ_INT(2, vm.pools[OBJ_UPVALUE].live);
+  collectGarbage();
+
+  ASSERT_EQ_INT(1, vm.pools[OBJ_UPVALUE].live);
+  ASSERT_EQ_INT(OBJ_UPVALUE, kept->obj.type);
+
+  // The freed slot is reused before the page grows
+  ObjUpvalue *reused = newUpvalue(NULL);
+  ASSERT_EQ_INT(1, vm.pools[OBJ_UPVALUE].pageCount);
+  ASSERT_EQ_INT(true, reused != kept);
+
+  pop();
+  collectGarbage();
+
+  ASSERT_EQ_INT(0, vm.pools[OBJ_UPVALUE].live);
+  ASSERT_EQ_INT(true, vm.pools[OBJ_UPVALUE].pages == NULL);
+}
+
+MU_TEST(test_newClosure_refersToFunc) {
+  ObjFunc *func = newFunc();
+  push(OBJ_VAL(func));
+  ObjClosure *closure = newClosure(func);
+  push(OBJ_VAL(closure));
+  ObjUpvalue *upvalue = newUpvalue(NULL);
+  push(OBJ_VAL(upvalue));
+
+  ASSERT_EQ_INT(true, CLOSURE_FUNC(closure) == func);
+  ASSERT_EQ_INT(true, UPVALUE_NEXT(upvalue) == NULL);
+
+  upvalue->next = ENCODE_REF(newUpvalue(NULL));
+  ASSERT_EQ_INT(OBJ_UPVALUE, UPVALUE_NEXT(upvalue)->obj.type);
+
+  pop();
+  pop();
+  pop();
+}
+
 MU_TEST_SUITE(object_tests) {
   MU_SUITE_CONFIGURE(&object_test_setup, &object_test_teardown);
 
@@ -81,5 +169,13 @@ MU_TEST_SUITE(object_tests) {
   MU_RUN_TEST(test_hashString_difference);
   MU_RUN_TEST(test_copyString);
   MU_RUN_TEST(test_copyString_interns);
+  MU_RUN_TEST(test_borrowString);
+  MU_RUN_TEST(test_borrowString_findsInterned);
+  MU_RUN_TEST(test_copyString_singleByteCached);
+  MU_RUN_TEST(test_copyString_emptyCached);
+  MU_RUN_TEST(test_copyString_smallIntInterned);
   MU_RUN_TEST(test_concatenate);
+  MU_RUN_TEST(test_concatenate_emptyOperand);
+  MU_RUN_TEST(test_collectGarbage_freesPooledObjs);
+  MU_RUN_TEST(test_newClosure_refersToFunc);
 }
@@ -0,0 +1,176 @@
+#include "optimizer.h"
+
+#include "chunk.h"
+#include "compiler.h"
+#include "object.h"
+#include "test_runners.h"
+
+#include "minunit.h"
+#include "value.h"
+#include "vm.h"
+
+#define ASSERT_BYTECODE(chunk, bytecode, n) \
+  ASSERT_EQ_INT(n, chunk.count);            \
+  for (int i = 0; i < n; i++)               \
+    ASSERT_EQ_INT(bytecode[i], chunk.code[i]);
+
+void setup_optimizer_tests() {
+  initVM();
+}
+
+void teardown_optimizer_tests() {
+  setOptLevel(OPT_NONE);
+  setInlineLimit(INLINE_LIMIT_DEFAULT);
+  freeVM();
+}
+
+MU_TEST(test_optimize_local_foldsConstants) {
+  setOptLevel(OPT_LOCAL);
+  ObjFunc *func = compile("print 1 + 2 * 3;");
+
+  // The constants folded away are left in the pool
+  uint8_t expected[] = {OP_CONSTANT, 4, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 5);
+  ASSERT_EQ_INT(true, valuesEq(NUM_VAL(7), func->chunk.constants.values[4]));
+}
+
+MU_TEST(test_optimize_local_foldsConstantDecls) {
+  setOptLevel(OPT_LOCAL);
+  ObjFunc *func = compile("const n = 10; print n * n - 1;");
+
+  uint8_t expected[] = {OP_CONSTANT, 0,        OP_DEF_CONST, 1,     OP_CONSTANT,
+                        6,           OP_PRINT, OP_NIL,       OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 9);
+  ASSERT_EQ_INT(true, valuesEq(NUM_VAL(99), func->chunk.constants.values[6]));
+}
+
+MU_TEST(test_optimize_local_keepsBranches) {
+  setOptLevel(OPT_LOCAL);
+  ObjFunc *func = compile("if (1 < 2) { print nil; } else { print true; }");
+
+  uint8_t expected[] = {OP_TRUE,  OP_JUMP_IF_FALSE, 0x00,   0x06, OP_POP,
+                        OP_NIL,   OP_PRINT,         OP_JUMP, 0x00, 0x03,
+                        OP_POP,   OP_TRUE,          OP_PRINT, OP_NIL,
+                        OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 15);
+}
+
+MU_TEST(test_optimize_full_compactsConstants) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("print 1 + 2 * 3;");
+
+  uint8_t expected[] = {OP_CONSTANT, 0, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 5);
+  ASSERT_EQ_INT(1, func->chunk.constants.count);
+  ASSERT_EQ_INT(true, valuesEq(NUM_VAL(7), func->chunk.constants.values[0]));
+}
+
+MU_TEST(test_optimize_full_foldsBranch) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("if (1 < 2) { print nil; } else { print true; }");
+
+  uint8_t expected[] = {OP_NIL, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 4);
+}
+
+MU_TEST(test_optimize_full_hoistsLoopGlobals) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("while (x) { print y; x = false; }");
+
+  // y is read from a hidden local, loaded from the global named below it
+  uint8_t expected[] = {OP_CONSTANT,   0,                OP_NIL, OP_GET_GLOBAL,
+                        1,             OP_JUMP_IF_FALSE, 0x00,   0x0B,
+                        OP_POP,        OP_GET_HOISTED,   2,      OP_PRINT,
+                        OP_FALSE,      OP_SET_GLOBAL,    2,      OP_POP,
+                        OP_LOOP,       0x00,             0x10,   OP_POP,
+                        OP_POP,        OP_POP,           OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 24);
+}
+
+MU_TEST(test_optimize_full_callKeepsLoopGlobals) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("while (x) { f(); }");
+
+  uint8_t expected[] = {OP_GET_GLOBAL, 0,       OP_JUMP_IF_FALSE, 0x00,
+                        0x09,          OP_POP,  OP_GET_GLOBAL,    1,
+                        OP_CALL,       0,       OP_POP,           OP_LOOP,
+                        0x00,          0x0E,    OP_POP,           OP_NIL,
+                        OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 17);
+}
+
+MU_TEST(test_optimize_full_removesUnreachableLoop) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("while (!true) { print 1; } print nil;");
+
+  uint8_t expected[] = {OP_NIL, OP_PRINT, OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 4);
+  ASSERT_EQ_INT(0, func->chunk.constants.count);
+}
+
+MU_TEST(test_optimize_full_optimizesFunctions) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("func f() { return 4 * 2; }");
+  ObjFunc *f    = AS_FUNC(func->chunk.constants.values[0]);
+
+  uint8_t expected[] = {OP_CONSTANT, 0, OP_RETURN};
+  ASSERT_BYTECODE(f->chunk, expected, 3);
+  ASSERT_EQ_INT(true, valuesEq(NUM_VAL(8), f->chunk.constants.values[0]));
+}
+
+MU_TEST(test_optimize_full_inlinesCall) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("func sq(x) { return x * x; } print sq(3);");
+
+  // The body runs in place of the call while sq is still the same function
+  uint8_t expected[] = {OP_CLOSURE,    0,        OP_DEF_GLOBAL,   1,
+                        OP_GET_GLOBAL, 2,        OP_CONSTANT,     3,
+                        OP_IS_FUNC,    4,        OP_JUMP_IF_TRUE, 0x00,
+                        0x06,          OP_POP,   OP_CALL,         1,
+                        OP_JUMP,       0x00,     0x07,            OP_GET_LOCAL,
+                        2,             OP_GET_LOCAL,              2,
+                        OP_MULTIPLY,   OP_SLIDE, 3,               OP_PRINT,
+                        OP_NIL,        OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 29);
+  ASSERT_EQ_INT(true, valuesEq(func->chunk.constants.values[0],
+                               func->chunk.constants.values[4]));
+}
+
+MU_TEST(test_optimize_full_keepsRecursiveCall) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *func = compile("func f(n) { return f(n); } print f(1);");
+
+  uint8_t expected[] = {OP_CLOSURE,  0, OP_DEF_GLOBAL, 1,
+                        OP_GET_GLOBAL, 2, OP_CONSTANT,  3,
+                        OP_CALL,     1, OP_PRINT,      OP_NIL,
+                        OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 13);
+}
+
+MU_TEST(test_optimize_full_inlineLimitZero_keepsCall) {
+  setOptLevel(OPT_FULL);
+  setInlineLimit(0);
+  ObjFunc *func = compile("func one() { return 1; } print one();");
+
+  uint8_t expected[] = {OP_CLOSURE,  0, OP_DEF_GLOBAL, 1,
+                        OP_GET_GLOBAL, 2, OP_CALL,       0,
+                        OP_PRINT,    OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(func->chunk, expected, 11);
+}
+
+MU_TEST_SUITE(optimizer_tests) {
+  MU_SUITE_CONFIGURE(&setup_optimizer_tests, &teardown_optimizer_tests);
+
+  MU_RUN_TEST(test_optimize_local_foldsConstants);
+  MU_RUN_TEST(test_optimize_local_foldsConstantDecls);
+  MU_RUN_TEST(test_optimize_local_keepsBranches);
+  MU_RUN_TEST(test_optimize_full_compactsConstants);
+  MU_RUN_TEST(test_optimize_full_foldsBranch);
+  MU_RUN_TEST(test_optimize_full_hoistsLoopGlobals);
+  MU_RUN_TEST(test_optimize_full_callKeepsLoopGlobals);
+  MU_RUN_TEST(test_optimize_full_removesUnreachableLoop);
+  MU_RUN_TEST(test_optimize_full_optimizesFunctions);
+  MU_RUN_TEST(test_optimize_full_inlinesCall);
+  MU_RUN_TEST(test_optimize_full_keepsRecursiveCall);
+  MU_RUN_TEST(test_optimize_full_inlineLimitZero_keepsCall);
+}
@@ -0,0 +1,135 @@
+#include "peephole.h"
+
+#include "chunk.h"
+#include "test_runners.h"
+
+#include "minunit.h"
+#include "vm.h"
+
+#define ASSERT_BYTECODE(chunk, bytecode, n) \
+  ASSERT_EQ_INT(n, chunk.count);            \
+  for (int i = 0; i < n; i++)               \
+    ASSERT_EQ_INT(bytecode[i], chunk.code[i]);
+
+static Chunk chunk;
+
+static void appendCode(uint8_t *code, int n, int line) {
+  for (int i = 0; i < n; i++) {
+    appendChunk(&chunk, code[i], line);
+  }
+}
+
+void setup_peephole_tests() {
+  initVM();
+  initChunk(&chunk);
+}
+
+void teardown_peephole_tests() {
+  freeChunk(&chunk);
+  freeVM();
+}
+
+MU_TEST(test_threadJumps_jumpChain) {
+  uint8_t code[] = {OP_JUMP, 0x00,    0x01, OP_NIL,    OP_JUMP,
+                    0x00,    0x01,    OP_NIL, OP_RETURN};
+  appendCode(code, 9, 1);
+
+  threadJumps(&chunk);
+
+  uint8_t expected[] = {OP_JUMP, 0x00,    0x05, OP_NIL,    OP_JUMP,
+                        0x00,    0x01,    OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(chunk, expected, 9);
+}
+
+MU_TEST(test_threadJumps_sameConditionalJump) {
+  uint8_t code[] = {OP_JUMP_IF_FALSE, 0x00, 0x01,   OP_POP,   OP_JUMP_IF_FALSE,
+                    0x00,             0x01, OP_POP, OP_RETURN};
+  appendCode(code, 9, 1);
+
+  threadJumps(&chunk);
+
+  // Takes the second jump too, as the same condition is still on the stack
+  uint8_t expected[] = {OP_JUMP_IF_FALSE, 0x00,   0x05, OP_POP,
+                        OP_JUMP_IF_FALSE, 0x00,   0x01, OP_POP,
+                        OP_RETURN};
+  ASSERT_BYTECODE(chunk, expected, 9);
+}
+
+MU_TEST(test_threadJumps_oppositeConditionalJump) {
+  uint8_t code[] = {OP_JUMP_IF_FALSE, 0x00, 0x01,   OP_POP,   OP_JUMP_IF_TRUE,
+                    0x00,             0x01, OP_POP, OP_RETURN};
+  appendCode(code, 9, 1);
+
+  threadJumps(&chunk);
+
+  // Falls through the second jump, as the condition is the same
+  uint8_t expected[] = {OP_JUMP_IF_FALSE, 0x00,   0x04, OP_POP,
+                        OP_JUMP_IF_TRUE,  0x00,   0x01, OP_POP,
+                        OP_RETURN};
+  ASSERT_BYTECODE(chunk, expected, 9);
+}
+
+MU_TEST(test_threadJumps_backwardsBecomesLoop) {
+  uint8_t code[] = {OP_NIL, OP_JUMP, 0x00, 0x01, OP_POP, OP_LOOP, 0x00, 0x08};
+  appendCode(code, 8, 1);
+
+  threadJumps(&chunk);
+
+  uint8_t expected[] = {OP_NIL, OP_LOOP, 0x00, 0x04,
+                        OP_POP, OP_LOOP, 0x00, 0x08};
+  ASSERT_BYTECODE(chunk, expected, 8);
+}
+
+MU_TEST(test_threadJumps_infiniteLoop) {
+  uint8_t code[] = {OP_JUMP, 0x00, 0x00, OP_LOOP, 0x00, 0x03, OP_RETURN};
+  appendCode(code, 7, 1);
+
+  threadJumps(&chunk);
+
+  // The jump to the next instruction is removed, the loop to itself is kept
+  uint8_t expected[] = {OP_LOOP, 0x00, 0x03, OP_RETURN};
+  ASSERT_BYTECODE(chunk, expected, 4);
+}
+
+MU_TEST(test_threadJumps_removesJumpToNext) {
+  uint8_t first[]  = {OP_JUMP, 0x00, 0x04};
+  uint8_t second[] = {OP_JUMP, 0x00, 0x00};
+  uint8_t third[]  = {OP_NIL};
+  uint8_t fourth[] = {OP_RETURN};
+  appendCode(first, 3, 1);
+  appendCode(second, 3, 2);
+  appendCode(third, 1, 3);
+  appendCode(fourth, 1, 4);
+
+  threadJumps(&chunk);
+
+  // The first jump is fixed up to still land on OP_RETURN
+  uint8_t expected[] = {OP_JUMP, 0x00, 0x01, OP_NIL, OP_RETURN};
+  ASSERT_BYTECODE(chunk, expected, 5);
+
+  int lines[] = {1, 1, 1, 3, 4};
+  for (int i = 0; i < 5; i++)
+    ASSERT_EQ_INT(lines[i], chunk.lines[i]);
+}
+
+MU_TEST(test_threadJumps_removesJumpsLeftLandingOnNext) {
+  uint8_t code[] = {OP_JUMP, 0x00, 0x03, OP_JUMP, 0x00, 0x00, OP_RETURN};
+  appendCode(code, 7, 1);
+
+  threadJumps(&chunk);
+
+  uint8_t expected[] = {OP_RETURN};
+  ASSERT_BYTECODE(chunk, expected, 1);
+}
+
+MU_TEST_SUITE(peephole_tests) {
+  MU_SUITE_CONFIGURE(&setup_peephole_tests, &teardown_peephole_tests);
+
+  MU_RUN_TEST(test_threadJumps_jumpChain);
+  MU_RUN_TEST(test_threadJumps_sameConditionalJump);
+  MU_RUN_TEST(test_threadJumps_oppositeConditionalJump);
+  MU_RUN_TEST(test_threadJumps_backwardsBecomesLoop);
+  MU_RUN_TEST(test_threadJumps_infiniteLoop);
+  MU_RUN_TEST(test_threadJumps_removesJumpToNext);
+  MU_RUN_TEST(test_threadJumps_removesJumpsLeftLandingOnNext);
+}
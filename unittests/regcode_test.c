@@ -0,0 +1,117 @@
+#include "regcode.h"
+
+#include "compiler.h"
+#include "object.h"
+#include "test_runners.h"
+
+#include "minunit.h"
+#include "vm.h"
+
+#define ASSERT_REGCODE(regCode, instrs, n)  \
+  ASSERT_EQ_INT(n, regCode.count);          \
+  for (int i = 0; i < n; i++)               \
+    ASSERT_EQ_INT(instrs[i], regCode.code[i]);
+
+static RegCode regCode;
+
+void setup_regcode_tests() {
+  initVM();
+  initRegCode(&regCode);
+}
+
+void teardown_regcode_tests() {
+  freeRegCode(&regCode);
+  freeVM();
+}
+
+// Compiles the source and returns its first function, keeping the script on
+// the stack so translating can't free it.
+static ObjFunc *compileFunc(const char *source) {
+  ObjFunc *script = compile(source);
+  push(OBJ_VAL(script));
+  return AS_FUNC(script->chunk.constants.values[1]);
+}
+
+MU_TEST(test_translate_assignmentIsOneInstruction) {
+  ObjFunc *func = compileFunc("func f(a, b) { a = a + b; return a; }");
+
+  ASSERT_EQ_INT(true, translateChunk(&func->chunk, func->arity, &regCode));
+
+  RegInstr expected[] = {REG_ABC(ROP_ADD, 1, 1, 2),
+                         REG_ABC(ROP_RETURN, 0, 1, 0)};
+  ASSERT_REGCODE(regCode, expected, 2);
+}
+
+MU_TEST(test_translate_constantOperands) {
+  ObjFunc *func = compileFunc("func f(a) { return a * 2 - 1; }");
+
+  ASSERT_EQ_INT(true, translateChunk(&func->chunk, func->arity, &regCode));
+
+  RegInstr expected[] = {REG_ABC(ROP_MULTIPLY, 2, 1, 0 | REG_CONST),
+                         REG_ABC(ROP_SUBTRACT, 2, 2, 1 | REG_CONST),
+                         REG_ABC(ROP_RETURN, 0, 2, 0)};
+  ASSERT_REGCODE(regCode, expected, 3);
+}
+
+MU_TEST(test_translate_callArgumentsInRegisters) {
+  ObjFunc *func = compileFunc("func f(a) { return f(a - 1); }");
+
+  ASSERT_EQ_INT(true, translateChunk(&func->chunk, func->arity, &regCode));
+
+  // The callee and its argument are moved into consecutive registers
+  RegInstr expected[] = {REG_ABX(ROP_GET_GLOBAL, 2, 0),
+                         REG_ABC(ROP_SUBTRACT, 3, 1, 1 | REG_CONST),
+                         REG_ABC(ROP_CALL, 2, 1, 0),
+                         REG_ABC(ROP_RETURN, 0, 2, 0)};
+  ASSERT_REGCODE(regCode, expected, 4);
+}
+
+MU_TEST(test_translate_callNative) {
+  ObjFunc *func = compileFunc("func f(a) { return str(a); }");
+
+  ASSERT_EQ_INT(true, translateChunk(&func->chunk, func->arity, &regCode));
+
+  // The native's index goes in C, after the usual callee and argument count
+  RegInstr expected[] = {REG_ABX(ROP_GET_GLOBAL, 2, 0),
+                         REG_ABC(ROP_MOVE, 3, 1, 0),
+                         REG_ABC(ROP_CALL_NATIVE, 2, 1, findNative("str", 3)),
+                         REG_ABC(ROP_RETURN, 0, 2, 0)};
+  ASSERT_REGCODE(regCode, expected, 4);
+}
+
+MU_TEST(test_translate_loopJumps) {
+  ObjFunc *func = compileFunc("func f(n) { while (n > 0) n = n - 1; }");
+
+  ASSERT_EQ_INT(true, translateChunk(&func->chunk, func->arity, &regCode));
+
+  RegInstr expected[] = {REG_ABC(ROP_GREATER, 2, 1, 0 | REG_CONST),
+                         REG_ASBX(ROP_JUMP_IF_FALSE, 2, 2),
+                         REG_ABC(ROP_SUBTRACT, 1, 1, 1 | REG_CONST),
+                         REG_ASBX(ROP_JUMP, 0, -4),
+                         REG_ABC(ROP_NIL, 2, 0, 0),
+                         REG_ABC(ROP_RETURN, 0, 2, 0)};
+  ASSERT_REGCODE(regCode, expected, 6);
+}
+
+MU_TEST(test_translate_readBeforeAssignmentKeepsValue) {
+  ObjFunc *func = compileFunc("func f(a) { var b = a; a = 1; return b; }");
+
+  ASSERT_EQ_INT(true, translateChunk(&func->chunk, func->arity, &regCode));
+
+  // b is read from a, so is moved into its own register before a changes
+  RegInstr expected[] = {REG_ABC(ROP_MOVE, 2, 1, 0),
+                         REG_ABC(ROP_MOVE, 1, 0 | REG_CONST, 0),
+                         REG_ABC(ROP_RETURN, 0, 2, 0)};
+  ASSERT_REGCODE(regCode, expected, 3);
+}
+
+MU_TEST_SUITE(regcode_tests) {
+  MU_SUITE_CONFIGURE(&setup_regcode_tests, &teardown_regcode_tests);
+
+  MU_RUN_TEST(test_translate_assignmentIsOneInstruction);
+  MU_RUN_TEST(test_translate_constantOperands);
+  MU_RUN_TEST(test_translate_callArgumentsInRegisters);
+  MU_RUN_TEST(test_translate_callNative);
+  MU_RUN_TEST(test_translate_loopJumps);
+  MU_RUN_TEST(test_translate_readBeforeAssignmentKeepsValue);
+}
@@ -25,7 +25,7 @@ MU_TEST(test_scanNext) {
   Scanner scanner;
   initScanner(&scanner,
               "+ - * / ( ) { } ! ; : , ? = < <= == != >= > || && 123 false "
-              "true nil \"string\" var myVar if else while for func return");
+              "true nil \"string\" var const myVar if else while for func return");
 
   Token tok = scanNext(&scanner);
   ASSERT_TOK(tok, "+", 1, TOK_PLUS);
@@ -111,6 +111,9 @@ MU_TEST(test_scanNext) {
   tok = scanNext(&scanner);
   ASSERT_TOK(tok, "var", 3, TOK_VAR);
 
+  tok = scanNext(&scanner);
+  ASSERT_TOK(tok, "const", 5, TOK_CONST);
+
   tok = scanNext(&scanner);
   ASSERT_TOK(tok, "myVar", 5, TOK_IDENTIFIER);
 
@@ -138,7 +141,77 @@ MU_TEST(test_scanNext) {
 #undef ASSERT_TOK
 }
 
+// Runs longer than a word, which are skipped 8 bytes at a time
+MU_TEST(test_scanNext_longRuns) {
+  Scanner scanner;
+  initScanner(&scanner, "                  abcdefgh_0123456789z "
+                        "12345678901234567890.25 // a comment spanning words\n"
+                        "x");
+
+  Token tok = scanNext(&scanner);
+  ASSERT_EQ_INT(TOK_IDENTIFIER, tok.type);
+  ASSERT_EQ_INT(20, tok.len);
+  ASSERT_EQ_INT(39, tok.col);
+
+  tok = scanNext(&scanner);
+  ASSERT_EQ_INT(TOK_NUMBER, tok.type);
+  ASSERT_EQ_INT(23, tok.len);
+
+  tok = scanNext(&scanner);
+  ASSERT_EQ_INT(TOK_IDENTIFIER, tok.type);
+  ASSERT_EQ_INT('x', tok.start[0]);
+  ASSERT_EQ_INT(2, tok.line);
+  ASSERT_EQ_INT(2, tok.col);
+
+  ASSERT_EQ_INT(TOK_EOF, scanNext(&scanner).type);
+}
+
+MU_TEST(test_scanNext_keywordLookalikes) {
+  Scanner scanner;
+  initScanner(&scanner, "constant fo form iff vars whiles returns x if");
+
+  for (int i = 0; i < 8; i++) {
+    ASSERT_EQ_INT(TOK_IDENTIFIER, scanNext(&scanner).type);
+  }
+
+  ASSERT_EQ_INT(TOK_IF, scanNext(&scanner).type);
+}
+
+// A non-ASCII byte ends an identifier, even within a word
+MU_TEST(test_scanNext_nonAsciiEndsIdentifier) {
+  Scanner scanner;
+  initScanner(&scanner, "abc\xc3\xa9" "defghijk");
+
+  Token tok = scanNext(&scanner);
+  ASSERT_EQ_INT(TOK_IDENTIFIER, tok.type);
+  ASSERT_EQ_INT(3, tok.len);
+  ASSERT_EQ_INT(TOK_ERR, scanNext(&scanner).type);
+}
+
+MU_TEST(test_scanTokens) {
+  TokenList list;
+  initTokenList(&list);
+
+  scanTokens("var a = 1; @ print a;", &list);
+
+  ASSERT_EQ_INT(10, list.count);
+  ASSERT_EQ_INT(TOK_VAR, list.tokens[0].type);
+  ASSERT_EQ_INT(TOK_ERR, list.tokens[5].type);
+  ASSERT_EQ_INT(TOK_PRINT, list.tokens[6].type);
+  ASSERT_EQ_INT(TOK_EOF, list.tokens[9].type);
+
+  scanTokens("", &list);
+  ASSERT_EQ_INT(1, list.count);
+  ASSERT_EQ_INT(TOK_EOF, list.tokens[0].type);
+
+  freeTokenList(&list);
+}
+
 MU_TEST_SUITE(scanner_tests) {
   MU_RUN_TEST(test_initScanner);
   MU_RUN_TEST(test_scanNext);
+  MU_RUN_TEST(test_scanNext_longRuns);
+  MU_RUN_TEST(test_scanNext_keywordLookalikes);
+  MU_RUN_TEST(test_scanNext_nonAsciiEndsIdentifier);
+  MU_RUN_TEST(test_scanTokens);
 }
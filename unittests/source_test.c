@@ -0,0 +1,78 @@
+#include "source.h"
+
+#include "minunit.h"
+#include "test_runners.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char sourcePath[] = "/tmp/asbtl_source_testXXXXXX";
+
+// Writes n copies of the given char to a fresh temporary file
+static void writeSourceFile(char c, size_t n) {
+  strcpy(sourcePath + strlen(sourcePath) - 6, "XXXXXX");
+  int fd = mkstemp(sourcePath);
+
+  char *chars = malloc(n + 1);
+  memset(chars, c, n);
+  write(fd, chars, n);
+
+  free(chars);
+  close(fd);
+}
+
+void source_test_teardown() {
+  unlink(sourcePath);
+}
+
+MU_TEST(test_readSource_mapsRegularFile) {
+  writeSourceFile(';', 100);
+
+  Source source;
+  readSource(&source, sourcePath);
+
+  ASSERT_EQ_INT(100, source.len);
+  ASSERT_EQ_INT(true, source.mappedLen > 0);
+  ASSERT_EQ_INT(';', source.chars[99]);
+  ASSERT_EQ_INT('\0', source.chars[100]);
+
+  freeSource(&source);
+}
+
+MU_TEST(test_readSource_pageSizedFileHasSentinel) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  writeSourceFile(' ', pageSize);
+
+  Source source;
+  readSource(&source, sourcePath);
+
+  ASSERT_EQ_INT(pageSize, source.len);
+  ASSERT_EQ_INT(true, source.mappedLen > pageSize);
+  ASSERT_EQ_INT('\0', source.chars[pageSize]);
+
+  freeSource(&source);
+}
+
+MU_TEST(test_readSource_emptyFile) {
+  writeSourceFile(' ', 0);
+
+  Source source;
+  readSource(&source, sourcePath);
+
+  ASSERT_EQ_INT(0, source.len);
+  ASSERT_EQ_INT(0, source.mappedLen);
+  ASSERT_STREQ("", source.chars);
+
+  freeSource(&source);
+}
+
+MU_TEST_SUITE(source_tests) {
+  MU_SUITE_CONFIGURE(NULL, &source_test_teardown);
+
+  MU_RUN_TEST(test_readSource_mapsRegularFile);
+  MU_RUN_TEST(test_readSource_pageSizedFileHasSentinel);
+  MU_RUN_TEST(test_readSource_emptyFile);
+}
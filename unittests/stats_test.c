@@ -0,0 +1,109 @@
+#include "stats.h"
+
+#include "compiler.h"
+#include "memory.h"
+#include "minunit.h"
+#include "object.h"
+#include "test_runners.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void stats_test_setup() {
+  initVM();
+}
+
+void stats_test_teardown() {
+  setOptLevel(OPT_NONE);
+  freeVM();
+}
+
+MU_TEST(test_countTokens) {
+  ASSERT_EQ_INT(0, countTokens(""));
+  ASSERT_EQ_INT(5, countTokens("print 1 + 2;"));
+}
+
+MU_TEST(test_collectFuncStats_nested) {
+  ObjFunc *script = compile("func outer(x) {"
+                            "  func inner() { return x; }"
+                            "  return inner;"
+                            "}");
+
+  Stats stats;
+  initStats(&stats, "test.lox");
+  collectFuncStats(&stats, script);
+
+  ASSERT_EQ_INT(3, stats.funcCount);
+  ASSERT_EQ_INT(true, stats.funcs[0].name == NULL);
+  ASSERT_EQ_INT((int)script->chunk.count, stats.funcs[0].bytes);
+  ASSERT_STREQ("outer", stats.funcs[1].name);
+  ASSERT_STREQ("inner", stats.funcs[2].name);
+  ASSERT_EQ_INT(1, stats.funcs[2].upvalues);
+
+  freeStats(&stats);
+}
+
+// Inlining copies the function into its callers' constants as well
+MU_TEST(test_collectFuncStats_inlinedOnce) {
+  setOptLevel(OPT_FULL);
+  ObjFunc *script = compile("func twice(x) { return x * 2; }"
+                            "print twice(1) + twice(2);");
+
+  Stats stats;
+  initStats(&stats, "test.lox");
+  collectFuncStats(&stats, script);
+
+  ASSERT_EQ_INT(2, stats.funcCount);
+
+  freeStats(&stats);
+}
+
+MU_TEST(test_printStats_json) {
+  Stats stats;
+  initStats(&stats, "a \"b\".lox");
+  stats.tokens = 7;
+  collectFuncStats(&stats, compile("var x = 1;"));
+
+  char *json;
+  size_t len;
+  FILE *out = open_memstream(&json, &len);
+  printStats(&stats, STATS_JSON, out);
+  fclose(out);
+
+  ASSERT_EQ_INT(0, strncmp(json, "{\"path\":\"a \\\"b\\\".lox\"", 20));
+  ASSERT_EQ_INT(true, strstr(json, "\"tokens\":7,") != NULL);
+  ASSERT_EQ_INT(true, strstr(json, "\"lazy\":{\"compiles\":0,") != NULL);
+  ASSERT_EQ_INT(true, strstr(json, "\"functions\":[{\"name\":null,") != NULL);
+  ASSERT_EQ_INT('\n', json[len - 1]);
+
+  free(json);
+  freeStats(&stats);
+}
+
+MU_TEST(test_collectRunStats) {
+  copyString("heap", 4);
+  collectGarbage();
+
+  Stats stats;
+  initStats(&stats, "test.lox");
+  collectRunStats(&stats);
+
+  ASSERT_EQ_INT(true, stats.collections >= 1);
+  ASSERT_EQ_INT(true, stats.heapObjs > 0);
+  ASSERT_EQ_INT(0, (int)(stats.heapBytes % OBJ_PAGE_SIZE));
+  ASSERT_EQ_INT(true, stats.heapBytes > 0);
+
+  freeStats(&stats);
+}
+
+MU_TEST_SUITE(stats_tests) {
+  MU_SUITE_CONFIGURE(&stats_test_setup, &stats_test_teardown);
+
+  MU_RUN_TEST(test_countTokens);
+  MU_RUN_TEST(test_collectFuncStats_nested);
+  MU_RUN_TEST(test_collectFuncStats_inlinedOnce);
+  MU_RUN_TEST(test_printStats_json);
+  MU_RUN_TEST(test_collectRunStats);
+}
@@ -3,9 +3,18 @@
 
 void chunk_tests();
 void compiler_tests();
+void dtoa_tests();
+void file_tests();
 void hashtable_tests();
+void image_tests();
+void ir_tests();
 void object_tests();
+void optimizer_tests();
+void peephole_tests();
+void regcode_tests();
 void scanner_tests();
+void source_tests();
+void stats_tests();
 void value_tests();
 void vm_tests();
 
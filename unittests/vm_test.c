@@ -16,7 +16,8 @@ MU_TEST(test_freeVM) {
 
   freeVM();
 
-  ASSERT_EQ_INT(true, vm.objs == NULL);
+  ASSERT_EQ_INT(true, vm.pools[OBJ_STRING].pages == NULL);
+  ASSERT_EQ_INT(0, vm.pools[OBJ_STRING].live);
 }
 
 MU_TEST_SUITE(vm_tests) {